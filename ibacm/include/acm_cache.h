@@ -0,0 +1,82 @@
+/* GPLv2 or OpenIB.org BSD (MIT) See COPYING file */
+#ifndef ACM_CACHE_H
+#define ACM_CACHE_H
+
+#include <stdint.h>
+#include <linux/types.h>
+
+/*
+ * Binary preload cache for the acmp provider. ib_acme -B builds it from an
+ * OpenSM "full v1" path record dump and an ACM hosts file, and ibacm maps
+ * it read only at start up, so daemons on one host can share a copy. The
+ * header is followed by the node, path and host arrays, in that order.
+ * Fields are in host byte order, except GUIDs and GIDs which are kept in
+ * network order, ready to be copied into path records.
+ */
+#define ACM_CACHE_MAGIC		0x4143434d	/* "ACCM" */
+#define ACM_CACHE_VERSION	1
+
+struct acm_cache_hdr {
+	uint32_t	magic;
+	uint32_t	version;
+	uint32_t	node_cnt;
+	uint32_t	path_cnt;
+	uint32_t	host_cnt;
+	uint32_t	reserved;
+};
+
+/* A source port and the range of paths from it */
+struct acm_cache_node {
+	__be64		guid;
+	uint16_t	lid;
+	uint16_t	reserved;
+	uint32_t	path_index;
+	uint32_t	path_cnt;
+	uint32_t	reserved2;
+};
+
+struct acm_cache_path {
+	__be64		dguid;
+	uint16_t	dlid;
+	uint8_t		sl;
+	uint8_t		mtu;
+	uint8_t		rate;
+	uint8_t		reserved[3];
+};
+
+struct acm_cache_host {
+	uint8_t		addr[64];	/* ACM_MAX_ADDRESS */
+	uint8_t		gid[16];
+	uint8_t		addr_type;	/* ACM_ADDRESS_NAME, _IP or _IP6 */
+	uint8_t		reserved[7];
+};
+
+static inline const struct acm_cache_node *
+acm_cache_nodes(const struct acm_cache_hdr *hdr)
+{
+	return (const struct acm_cache_node *) (hdr + 1);
+}
+
+static inline const struct acm_cache_path *
+acm_cache_paths(const struct acm_cache_hdr *hdr)
+{
+	return (const struct acm_cache_path *)
+		(acm_cache_nodes(hdr) + hdr->node_cnt);
+}
+
+static inline const struct acm_cache_host *
+acm_cache_hosts(const struct acm_cache_hdr *hdr)
+{
+	return (const struct acm_cache_host *)
+		(acm_cache_paths(hdr) + hdr->path_cnt);
+}
+
+static inline uint64_t acm_cache_size(const struct acm_cache_hdr *hdr)
+{
+	return sizeof(*hdr) +
+	       (uint64_t) hdr->node_cnt * sizeof(struct acm_cache_node) +
+	       (uint64_t) hdr->path_cnt * sizeof(struct acm_cache_path) +
+	       (uint64_t) hdr->host_cnt * sizeof(struct acm_cache_host);
+}
+
+#endif /* ACM_CACHE_H */
@@ -106,6 +106,14 @@ struct acm_resolve_msg {
 	struct acm_ep_addr_data data[0];
 };
 
+/*
+ * Resolve latencies are counted in ACM_LAT_BUCKETS buckets per kind of
+ * request: answered from the cache, waited for address resolution, or
+ * waited for an SA route query only.  Bucket i counts requests answered
+ * in under 10^(i + 1) microseconds, and the last bucket all slower ones.
+ */
+#define ACM_LAT_BUCKETS 7
+
 enum {
 	ACM_CNTR_ERROR,
 	ACM_CNTR_RESOLVE,
@@ -114,7 +122,13 @@ enum {
 	ACM_CNTR_ADDR_CACHE,
 	ACM_CNTR_ROUTE_QUERY,
 	ACM_CNTR_ROUTE_CACHE,
-	ACM_MAX_COUNTER
+	ACM_CNTR_CACHE_ENTRIES,
+	ACM_CNTR_CACHE_EXPIRED,
+	ACM_CNTR_SA_WAIT_MS,
+	ACM_CNTR_LAT_HIT,
+	ACM_CNTR_LAT_ADDR = ACM_CNTR_LAT_HIT + ACM_LAT_BUCKETS,
+	ACM_CNTR_LAT_ROUTE = ACM_CNTR_LAT_ADDR + ACM_LAT_BUCKETS,
+	ACM_MAX_COUNTER = ACM_CNTR_LAT_ROUTE + ACM_LAT_BUCKETS
 };
 
 /*
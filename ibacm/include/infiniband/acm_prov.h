@@ -116,5 +116,6 @@ extern int acm_send_sa_mad(struct acm_sa_mad *mad);
 
 extern const char *acm_get_opts_file(void);
 extern void acm_increment_counter(int type);
+extern void acm_decrement_counter(int type);
 
 #endif /* ACM_PROV_H */
@@ -71,6 +71,15 @@ static inline int atomic_dec(atomic_t *atomic)
 	pthread_mutex_unlock(&atomic->mut);
 	return v;
 }
+static inline int atomic_add(atomic_t *atomic, int n)
+{
+	int v;
+
+	pthread_mutex_lock(&atomic->mut);
+	v = (atomic->val += n);
+	pthread_mutex_unlock(&atomic->mut);
+	return v;
+}
 static inline void atomic_init(atomic_t *atomic)
 {
 	pthread_mutex_init(&atomic->mut, NULL);
@@ -80,6 +89,7 @@ static inline void atomic_init(atomic_t *atomic)
 typedef struct { volatile int val; } atomic_t;
 #define atomic_inc(v) (__sync_add_and_fetch(&(v)->val, 1))
 #define atomic_dec(v) (__sync_sub_and_fetch(&(v)->val, 1))
+#define atomic_add(v, n) (__sync_add_and_fetch(&(v)->val, n))
 #define atomic_init(v) ((v)->val = 0)
 #endif
 #define atomic_get(v) ((v)->val)
@@ -39,6 +39,7 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/time.h>
+#include <sys/mman.h>
 #include <fcntl.h>
 #include <dirent.h>
 #include <infiniband/acm.h>
@@ -47,7 +48,6 @@
 #include <infiniband/verbs.h>
 #include <ifaddrs.h>
 #include <dlfcn.h>
-#include <search.h>
 #include <netdb.h>
 #include <net/if.h>
 #include <sys/ioctl.h>
@@ -59,6 +59,7 @@
 #include <ccan/list.h>
 #include "acm_util.h"
 #include "acm_mad.h"
+#include "acm_cache.h"
 
 #define src_out     data[0]
 #define src_index   data[1]
@@ -69,6 +70,15 @@
 #define MAX_EP_ADDR 4
 #define MAX_EP_MC   2
 
+#define ACMP_DEST_SHARDS	64
+#define ACMP_DEST_MIN_BUCKETS	16
+
+#define ACMP_WHEEL_SLOTS	256
+#define ACMP_WHEEL_TICK		8	/* ms */
+
+#define ACMP_SNAPSHOT_MAGIC	0x41434d53	/* "ACMS" */
+#define ACMP_SNAPSHOT_VERSION	1
+
 enum acmp_state {
 	ACMP_INIT,
 	ACMP_QUERY_ADDR,
@@ -93,22 +103,28 @@ enum acmp_loopback_prot {
 
 enum acmp_route_preload {
 	ACMP_ROUTE_PRELOAD_NONE,
-	ACMP_ROUTE_PRELOAD_OSM_FULL_V1
+	ACMP_ROUTE_PRELOAD_OSM_FULL_V1,
+	ACMP_ROUTE_PRELOAD_ACM_CACHE
 };
 
 enum acmp_addr_preload {
 	ACMP_ADDR_PRELOAD_NONE,
-	ACMP_ADDR_PRELOAD_HOSTS
+	ACMP_ADDR_PRELOAD_HOSTS,
+	ACMP_ADDR_PRELOAD_ACM_CACHE
 };
 
 /*
  * Nested locking order: dest -> ep, dest -> port
+ * The dest table shard locks are taken last.
  */
 struct acmp_ep;
 
 struct acmp_dest {
 	uint8_t                address[ACM_MAX_ADDRESS]; /* keep first */
 	char                   name[ACM_MAX_ADDRESS];
+	struct list_node       hash_entry;
+	uint64_t               hash;
+	int                    hashed;
 	struct ibv_ah          *ah;
 	struct ibv_ah_attr     av;
 	struct ibv_path_record path;
@@ -159,6 +175,21 @@ struct acmp_device {
 struct acmp_send_queue {
 	int                   credits;
 	struct list_head      pending;
+	int                   rate;	/* sends per second, 0 if unpaced */
+	uint64_t              tat;	/* time the next send is due, us */
+};
+
+/*
+ * Each endpoint indexes its destinations by a hash of the address type and
+ * address. The table is split into shards with their own lock and bucket
+ * array, so lookups of different destinations only share a read lock on
+ * the same shard. Shards grow when they average two entries per bucket.
+ */
+struct acmp_dest_shard {
+	pthread_rwlock_t      lock;
+	struct list_head      *buckets;
+	unsigned int          size;
+	unsigned int          count;
 };
 
 struct acmp_addr {
@@ -176,7 +207,7 @@ struct acmp_ep {
 	uint8_t               *recv_bufs;
 	struct list_node      entry;
 	char		      id_string[IBV_SYSFS_NAME_MAX + 11];
-	void                  *dest_map[ACM_ADDRESS_RESERVED - 1];
+	struct acmp_dest_shard dest_table[ACMP_DEST_SHARDS];
 	struct acmp_dest      mc_dest[MAX_EP_MC];
 	int                   mc_cnt;
 	uint16_t              pkey_index;
@@ -187,6 +218,9 @@ struct acmp_ep {
 	struct acmp_send_queue resp_queue;
 	struct list_head      active_queue;
 	struct list_head      wait_queue;
+	struct list_node      pace_entry;
+	int                   pace_armed;
+	uint64_t              pace_due;	/* us */
 	enum acmp_state       state;
 	struct acmp_addr      addr_info[MAX_EP_ADDR];
 	atomic_t              counters[ACM_MAX_COUNTER];
@@ -204,16 +238,44 @@ struct acmp_send_msg {
 	struct ibv_mr        *mr;
 	struct ibv_send_wr   wr;
 	struct ibv_sge       sge;
+	struct list_node     timer_entry;
+	int                  timer_armed;
 	uint64_t             expires;
 	int                  tries;
 	uint8_t              data[ACM_SEND_SIZE];
 };
 
+/*
+ * Resolved destinations are saved to the snapshot file in this host's
+ * format, keyed by the endpoint's port GID and pkey, so that a restarted
+ * daemon starts with a warm cache.
+ */
+struct acmp_snapshot_hdr {
+	uint32_t               magic;
+	uint32_t               version;
+	uint32_t               cnt;
+	uint32_t               reserved;
+};
+
+struct acmp_snapshot_rec {
+	union ibv_gid          port_gid;
+	struct ibv_path_record path;
+	uint8_t                address[ACM_MAX_ADDRESS];
+	uint64_t               addr_timeout;
+	uint64_t               route_timeout;
+	uint32_t               remote_qpn;
+	uint16_t               pkey;
+	uint8_t                addr_type;
+	uint8_t                reserved;
+};
+
 struct acmp_request {
 	uint64_t	id;
 	struct list_node entry;
 	struct acm_msg	msg;
 	struct acmp_ep	*ep;
+	uint64_t	start;		/* us */
+	int		lat_cntr;	/* ACM_CNTR_LAT_ADDR or _ROUTE */
 };
 
 static int acmp_open_dev(const struct acm_device *device, void **dev_context);
@@ -255,8 +317,20 @@ static pthread_mutex_t acmp_dev_lock;
 
 static atomic_t g_tid;
 static LIST_HEAD(timeout_list);
-static event_t timeout_event;
-static atomic_t wait_cnt;
+
+/*
+ * Sends waiting for a response sit on their endpoint's wait queue, for
+ * matching responses by TID, and on a timer wheel hashed by the tick they
+ * expire at, so the retry thread only looks at the slots of ticks that
+ * passed. An expired send belongs to the retry thread, and a response
+ * that matches it after that point is dropped.
+ */
+static struct list_head timer_wheel[ACMP_WHEEL_SLOTS];
+static pthread_mutex_t timer_lock;
+static pthread_cond_t timer_cond;
+static uint64_t timer_tick;	/* next tick to expire */
+static uint64_t timer_wake;	/* time the retry thread sleeps until, us */
+static LIST_HEAD(pace_list);	/* endpoints with paced sends, timer lock */
 static pthread_t retry_thread_id;
 static int retry_thread_started = 0;
 
@@ -267,6 +341,10 @@ static __thread char log_data[ACM_MAX_ADDRESS];
  */
 static char route_data_file[128] = ACM_CONF_DIR "/ibacm_route.data";
 static char addr_data_file[128] = ACM_CONF_DIR "/ibacm_hosts.data";
+static char cache_data_file[128] = ACM_CONF_DIR "/ibacm_cache.data";
+static char snapshot_file[128] = IBACM_SNAPSHOT_FILE;
+static int snapshot_interval = 0;
+static pthread_t snapshot_thread_id;
 static enum acmp_addr_prot addr_prot = ACMP_ADDR_PROT_ACM;
 static int addr_timeout = 1440;
 static enum acmp_route_prot route_prot = ACMP_ROUTE_PROT_SA;
@@ -275,6 +353,8 @@ static enum acmp_loopback_prot loopback_prot = ACMP_LOOPBACK_PROT_LOCAL;
 static int timeout = 2000;
 static int retries = 2;
 static int resolve_depth = 1;
+static int resolve_rate = 0;
+static int resolve_burst = 16;
 static int send_depth = 1;
 static int recv_depth = 1024;
 static uint8_t min_mtu = IBV_MTU_2048;
@@ -284,9 +364,75 @@ static enum acmp_addr_preload addr_preload;
 
 static int acmp_initialized = 0;
 
-static int acmp_compare_dest(const void *dest1, const void *dest2)
+static uint64_t acmp_dest_hash(uint8_t addr_type, const uint8_t *addr)
 {
-	return memcmp(dest1, dest2, ACM_MAX_ADDRESS);
+	uint64_t hash = addr_type, word;
+	int i;
+
+	for (i = 0; i < ACM_MAX_ADDRESS; i += sizeof(word)) {
+		memcpy(&word, addr + i, sizeof(word));
+		hash = (hash ^ word) * 0x9e3779b97f4a7c15ULL;
+		hash ^= hash >> 29;
+	}
+	return hash;
+}
+
+static struct acmp_dest_shard *
+acmp_dest_shard(struct acmp_ep *ep, uint64_t hash)
+{
+	return &ep->dest_table[hash & (ACMP_DEST_SHARDS - 1)];
+}
+
+static struct list_head *
+acmp_dest_bucket(struct acmp_dest_shard *shard, uint64_t hash)
+{
+	return &shard->buckets[(hash >> 32) & (shard->size - 1)];
+}
+
+/* Caller must hold the shard lock. */
+static struct acmp_dest *
+acmp_dest_lookup(struct acmp_dest_shard *shard, uint64_t hash,
+		 uint8_t addr_type, const uint8_t *addr)
+{
+	struct acmp_dest *dest;
+
+	if (!shard->count)
+		return NULL;
+
+	list_for_each(acmp_dest_bucket(shard, hash), dest, hash_entry) {
+		if (dest->hash == hash && dest->addr_type == addr_type &&
+		    !memcmp(dest->address, addr, ACM_MAX_ADDRESS))
+			return dest;
+	}
+	return NULL;
+}
+
+/* Caller must hold the shard lock for writing. */
+static int acmp_dest_grow(struct acmp_dest_shard *shard)
+{
+	struct list_head *buckets, *old = shard->buckets;
+	unsigned int i, size, old_size = shard->size;
+	struct acmp_dest *dest, *next;
+
+	size = old_size ? old_size * 2 : ACMP_DEST_MIN_BUCKETS;
+	buckets = malloc(size * sizeof(*buckets));
+	if (!buckets)
+		return -1;
+
+	for (i = 0; i < size; i++)
+		list_head_init(&buckets[i]);
+
+	shard->buckets = buckets;
+	shard->size = size;
+	for (i = 0; i < old_size; i++) {
+		list_for_each_safe(&old[i], dest, next, hash_entry) {
+			list_del(&dest->hash_entry);
+			list_add_tail(acmp_dest_bucket(shard, dest->hash),
+				      &dest->hash_entry);
+		}
+	}
+	free(old);
+	return 0;
 }
 
 static void
@@ -327,19 +473,22 @@ acmp_alloc_dest(uint8_t addr_type, const uint8_t *addr)
 	return dest;
 }
 
-/* Caller must hold ep lock. */
 static struct acmp_dest *
 acmp_get_dest(struct acmp_ep *ep, uint8_t addr_type, const uint8_t *addr)
 {
-	struct acmp_dest *dest, **tdest;
+	uint64_t hash = acmp_dest_hash(addr_type, addr);
+	struct acmp_dest_shard *shard = acmp_dest_shard(ep, hash);
+	struct acmp_dest *dest;
 
-	tdest = tfind(addr, &ep->dest_map[addr_type - 1], acmp_compare_dest);
-	if (tdest) {
-		dest = *tdest;
+	pthread_rwlock_rdlock(&shard->lock);
+	dest = acmp_dest_lookup(shard, hash, addr_type, addr);
+	if (dest)
 		(void) atomic_inc(&dest->refcnt);
+	pthread_rwlock_unlock(&shard->lock);
+
+	if (dest) {
 		acm_log(2, "%s\n", dest->name);
 	} else {
-		dest = NULL;
 		acm_format_name(2, log_data, sizeof log_data,
 				addr_type, addr, ACM_MAX_ADDRESS);
 		acm_log(2, "%s not found\n", log_data);
@@ -356,14 +505,67 @@ acmp_put_dest(struct acmp_dest *dest)
 	}
 }
 
-/* Caller must hold ep lock. */
+/* Drops the table's reference, if some other thread did not already. */
 static void
 acmp_remove_dest(struct acmp_ep *ep, struct acmp_dest *dest)
 {
+	struct acmp_dest_shard *shard = acmp_dest_shard(ep, dest->hash);
+	int hashed;
+
 	acm_log(2, "%s\n", dest->name);
-	tdelete(dest->address, &ep->dest_map[dest->addr_type - 1],
-		acmp_compare_dest);
-	acmp_put_dest(dest);
+	pthread_rwlock_wrlock(&shard->lock);
+	hashed = dest->hashed;
+	if (hashed) {
+		list_del(&dest->hash_entry);
+		dest->hashed = 0;
+		shard->count--;
+	}
+	pthread_rwlock_unlock(&shard->lock);
+
+	if (hashed) {
+		acm_decrement_counter(ACM_CNTR_CACHE_ENTRIES);
+		atomic_dec(&ep->counters[ACM_CNTR_CACHE_ENTRIES]);
+		acmp_put_dest(dest);
+	}
+}
+
+/*
+ * Insert @dest unless another thread added the same address first, and
+ * return a reference to whichever dest is in the table.
+ */
+static struct acmp_dest *
+acmp_insert_dest(struct acmp_ep *ep, struct acmp_dest *dest)
+{
+	struct acmp_dest_shard *shard = acmp_dest_shard(ep, dest->hash);
+	struct acmp_dest *cur;
+
+	pthread_rwlock_wrlock(&shard->lock);
+	cur = acmp_dest_lookup(shard, dest->hash, dest->addr_type,
+			       dest->address);
+	if (cur) {
+		(void) atomic_inc(&cur->refcnt);
+		pthread_rwlock_unlock(&shard->lock);
+		acmp_put_dest(dest);
+		return cur;
+	}
+
+	if (shard->count >= 2 * shard->size)
+		acmp_dest_grow(shard);
+	if (!shard->size) {
+		pthread_rwlock_unlock(&shard->lock);
+		acmp_put_dest(dest);
+		return NULL;
+	}
+
+	list_add_tail(acmp_dest_bucket(shard, dest->hash), &dest->hash_entry);
+	dest->hashed = 1;
+	shard->count++;
+	(void) atomic_inc(&dest->refcnt);
+	pthread_rwlock_unlock(&shard->lock);
+
+	acm_increment_counter(ACM_CNTR_CACHE_ENTRIES);
+	atomic_inc(&ep->counters[ACM_CNTR_CACHE_ENTRIES]);
+	return dest;
 }
 
 static struct acmp_dest *
@@ -375,14 +577,16 @@ acmp_acquire_dest(struct acmp_ep *ep, uint8_t addr_type, const uint8_t *addr)
 	acm_format_name(2, log_data, sizeof log_data,
 			addr_type, addr, ACM_MAX_ADDRESS);
 	acm_log(2, "%s\n", log_data);
-	pthread_mutex_lock(&ep->lock);
 	dest = acmp_get_dest(ep, addr_type, addr);
 	if (dest && dest->state == ACMP_READY &&
 	    dest->addr_timeout != (uint64_t)~0ULL) {
 		rec_expr_minutes = dest->addr_timeout - time_stamp_min();
 		if (rec_expr_minutes <= 0) {
 			acm_log(2, "Record expired\n");
+			acm_increment_counter(ACM_CNTR_CACHE_EXPIRED);
+			atomic_inc(&ep->counters[ACM_CNTR_CACHE_EXPIRED]);
 			acmp_remove_dest(ep, dest);
+			acmp_put_dest(dest);
 			dest = NULL;
 		} else {
 			acm_log(2, "Record valid for the next %" PRId64 " minute(s)\n",
@@ -393,11 +597,10 @@ acmp_acquire_dest(struct acmp_ep *ep, uint8_t addr_type, const uint8_t *addr)
 		dest = acmp_alloc_dest(addr_type, addr);
 		if (dest) {
 			dest->ep = ep;
-			tsearch(dest, &ep->dest_map[addr_type - 1], acmp_compare_dest);
-			(void) atomic_inc(&dest->refcnt);
+			dest->hash = acmp_dest_hash(addr_type, addr);
+			dest = acmp_insert_dest(ep, dest);
 		}
 	}
-	pthread_mutex_unlock(&ep->lock);
 	return dest;
 }
 
@@ -499,14 +702,72 @@ static void acmp_free_send(struct acmp_send_msg *msg)
 	free(msg);
 }
 
+/*
+ * A paced queue is a token bucket, kept as the time its next send is due.
+ * A send may go out while that time is less than resolve_burst intervals
+ * ahead of now.  Returns 0 and takes the token if a send may go out now,
+ * otherwise the number of microseconds to wait for one.
+ * Caller must hold ep lock.
+ */
+static uint64_t acmp_take_token(struct acmp_send_queue *queue)
+{
+	uint64_t now, interval, limit;
+
+	if (!queue->rate)
+		return 0;
+
+	now = time_stamp_us();
+	interval = 1000000 / queue->rate;
+	limit = now + (uint64_t) (resolve_burst - 1) * interval;
+	if (queue->tat > limit)
+		return queue->tat - limit;
+
+	queue->tat = max(queue->tat, now) + interval;
+	return 0;
+}
+
+static uint64_t acmp_timer_tick(uint64_t ms)
+{
+	return (ms + ACMP_WHEEL_TICK - 1) / ACMP_WHEEL_TICK;
+}
+
+static uint64_t acmp_tick_us(uint64_t tick)
+{
+	return tick == UINT64_MAX ? tick : tick * ACMP_WHEEL_TICK * 1000;
+}
+
+/*
+ * Have the retry thread send held back messages once @delay us passed.
+ * It sleeps until that exact time rather than to a timer wheel tick, so
+ * rates above one burst per tick are kept.  Caller must hold ep lock.
+ */
+static void acmp_arm_pacer(struct acmp_ep *ep, uint64_t delay)
+{
+	uint64_t due = time_stamp_us() + delay;
+
+	pthread_mutex_lock(&timer_lock);
+	if (!ep->pace_armed) {
+		list_add_tail(&pace_list, &ep->pace_entry);
+		ep->pace_armed = 1;
+		ep->pace_due = due;
+	} else if (due < ep->pace_due) {
+		ep->pace_due = due;
+	}
+	if (due < timer_wake)
+		pthread_cond_signal(&timer_cond);
+	pthread_mutex_unlock(&timer_lock);
+}
+
 static void acmp_post_send(struct acmp_send_queue *queue, struct acmp_send_msg *msg)
 {
 	struct acmp_ep *ep = msg->ep;
 	struct ibv_send_wr *bad_wr;
+	uint64_t delay = 0;
 
 	msg->req_queue = queue;
 	pthread_mutex_lock(&ep->lock);
-	if (queue->credits) {
+	if (queue->credits && list_empty(&queue->pending) &&
+	    !(delay = acmp_take_token(queue))) {
 		acm_log(2, "posting send to QP\n");
 		queue->credits--;
 		list_add_tail(&ep->active_queue, &msg->entry);
@@ -514,6 +775,8 @@ static void acmp_post_send(struct acmp_send_queue *queue, struct acmp_send_msg *
 	} else {
 		acm_log(2, "no sends available, queuing message\n");
 		list_add_tail(&queue->pending, &msg->entry);
+		if (delay)
+			acmp_arm_pacer(ep, delay);
 	}
 	pthread_mutex_unlock(&ep->lock);
 }
@@ -540,17 +803,53 @@ static void acmp_send_available(struct acmp_ep *ep, struct acmp_send_queue *queu
 {
 	struct acmp_send_msg *msg;
 	struct ibv_send_wr *bad_wr;
+	uint64_t delay = 0;
 
-	msg = list_pop(&queue->pending, struct acmp_send_msg, entry);
-	if (msg) {
+	if (!list_empty(&queue->pending) && !(delay = acmp_take_token(queue))) {
+		msg = list_pop(&queue->pending, struct acmp_send_msg, entry);
 		acm_log(2, "posting queued send message\n");
 		list_add_tail(&ep->active_queue, &msg->entry);
 		ibv_post_send(ep->qp, &msg->wr, &bad_wr);
 	} else {
 		queue->credits++;
+		if (delay)
+			acmp_arm_pacer(ep, delay);
 	}
 }
 
+/* Caller must hold ep lock */
+static void acmp_arm_timer(struct acmp_send_msg *msg)
+{
+	uint64_t tick = acmp_timer_tick(msg->expires);
+
+	pthread_mutex_lock(&timer_lock);
+	tick = max(tick, timer_tick);
+	list_add_tail(&timer_wheel[tick & (ACMP_WHEEL_SLOTS - 1)],
+		      &msg->timer_entry);
+	msg->timer_armed = 1;
+	if (acmp_tick_us(tick) < timer_wake)
+		pthread_cond_signal(&timer_cond);
+	pthread_mutex_unlock(&timer_lock);
+}
+
+/*
+ * Returns 0 if the retry thread already took @msg off the wheel.
+ * Caller must hold ep lock.
+ */
+static int acmp_cancel_timer(struct acmp_send_msg *msg)
+{
+	int armed;
+
+	pthread_mutex_lock(&timer_lock);
+	armed = msg->timer_armed;
+	if (armed) {
+		list_del(&msg->timer_entry);
+		msg->timer_armed = 0;
+	}
+	pthread_mutex_unlock(&timer_lock);
+	return armed;
+}
+
 static void acmp_complete_send(struct acmp_send_msg *msg)
 {
 	struct acmp_ep *ep = msg->ep;
@@ -561,8 +860,7 @@ static void acmp_complete_send(struct acmp_send_msg *msg)
 		acm_log(2, "waiting for response\n");
 		msg->expires = time_stamp_ms() + ep->port->subnet_timeout + timeout;
 		list_add_tail(&ep->wait_queue, &msg->entry);
-		if (atomic_inc(&wait_cnt) == 1)
-			event_signal(&timeout_event);
+		acmp_arm_timer(msg);
 	} else {
 		acm_log(2, "freeing\n");
 		acmp_send_available(ep, msg->req_queue);
@@ -581,10 +879,14 @@ static struct acmp_send_msg *acmp_get_request(struct acmp_ep *ep, __be64 tid, in
 	list_for_each_safe(&ep->wait_queue, msg, next, entry) {
 		mad = (struct acm_mad *) msg->data;
 		if (mad->tid == tid) {
+			if (!acmp_cancel_timer(msg)) {
+				acm_log(2, "match found in wait queue, "
+					"but the request timed out\n");
+				goto unlock;
+			}
 			acm_log(2, "match found in wait queue\n");
 			req = msg;
 			list_del(&msg->entry);
-			(void) atomic_dec(&wait_cnt);
 			acmp_send_available(ep, msg->req_queue);
 			*free = 1;
 			goto unlock;
@@ -924,6 +1226,18 @@ acmp_send_addr_resp(struct acmp_ep *ep, struct acmp_dest *dest)
 	acmp_post_send(&ep->resp_queue, msg);
 }
 
+static void acmp_record_latency(struct acmp_ep *ep, int cntr, uint64_t start)
+{
+	uint64_t now = time_stamp_us(), limit = 10;
+	int i;
+
+	for (i = 0; i < ACM_LAT_BUCKETS - 1 && now >= start + limit; i++)
+		limit *= 10;
+
+	acm_increment_counter(cntr + i);
+	atomic_inc(&ep->counters[cntr + i]);
+}
+
 static int
 acmp_resolve_response(uint64_t id, struct acm_msg *req_msg,
 		      struct acmp_dest *dest, uint8_t status)
@@ -974,6 +1288,7 @@ acmp_complete_queued_req(struct acmp_dest *dest, uint8_t status)
 
 		acm_log(2, "completing request, client %" PRIu64 "\n", req->id);
 		acmp_resolve_response(req->id, &req->msg, dest, status);
+		acmp_record_latency(req->ep, req->lat_cntr, req->start);
 		acmp_free_req(req);
 
 		pthread_mutex_lock(&dest->lock);
@@ -1501,42 +1816,165 @@ static void acmp_process_timeouts(void)
 	}
 }
 
-static void acmp_process_wait_queue(struct acmp_ep *ep, uint64_t *next_expire)
+/* Caller must hold timer lock */
+static void acmp_expire_timers(uint64_t now, struct list_head *expired)
 {
 	struct acmp_send_msg *msg, *next;
+	struct list_head *slot;
+
+	/* Every slot is visited at most once, at the latest tick it covers */
+	if (now >= timer_tick + ACMP_WHEEL_SLOTS)
+		timer_tick = now - ACMP_WHEEL_SLOTS + 1;
+
+	for (; timer_tick <= now; timer_tick++) {
+		slot = &timer_wheel[timer_tick & (ACMP_WHEEL_SLOTS - 1)];
+		list_for_each_safe(slot, msg, next, timer_entry) {
+			if (acmp_timer_tick(msg->expires) > timer_tick)
+				continue;
+			list_del(&msg->timer_entry);
+			msg->timer_armed = 0;
+			list_add_tail(expired, &msg->timer_entry);
+		}
+	}
+}
+
+/* Caller must hold timer lock */
+static uint64_t acmp_next_timer(void)
+{
+	int i;
+
+	for (i = 0; i < ACMP_WHEEL_SLOTS; i++) {
+		if (!list_empty(&timer_wheel[(timer_tick + i) &
+					     (ACMP_WHEEL_SLOTS - 1)]))
+			return timer_tick + i;
+	}
+	return UINT64_MAX;
+}
+
+/*
+ * Endpoints stay marked armed until acmp_pace_sends() runs, so they are
+ * not put back on the pace list while on @paced.
+ * Caller must hold timer lock.
+ */
+static void acmp_expire_pacers(uint64_t now, struct list_head *paced)
+{
+	struct acmp_ep *ep, *next;
+
+	list_for_each_safe(&pace_list, ep, next, pace_entry) {
+		if (ep->pace_due > now)
+			continue;
+		list_del(&ep->pace_entry);
+		list_add_tail(paced, &ep->pace_entry);
+	}
+}
+
+/* Caller must hold timer lock */
+static uint64_t acmp_next_pacer(void)
+{
+	struct acmp_ep *ep;
+	uint64_t due = UINT64_MAX;
+
+	list_for_each(&pace_list, ep, pace_entry)
+		due = min(due, ep->pace_due);
+	return due;
+}
+
+/* Caller must hold timer lock */
+static void acmp_timer_wait(uint64_t us)
+{
+	struct timespec wait;
+
+	timer_wake = us;
+	if (us == UINT64_MAX) {
+		pthread_cond_wait(&timer_cond, &timer_lock);
+	} else {
+		wait.tv_sec = us / 1000000;
+		wait.tv_nsec = (us % 1000000) * 1000;
+		pthread_cond_timedwait(&timer_cond, &timer_lock, &wait);
+	}
+	timer_wake = 0;
+}
+
+static void acmp_retry_sends(struct list_head *expired)
+{
+	struct acmp_send_msg *msg;
 	struct ibv_send_wr *bad_wr;
+	struct acmp_ep *ep;
 
-	list_for_each_safe(&ep->wait_queue, msg, next, entry) {
-		if (msg->expires < time_stamp_ms()) {
-			list_del(&msg->entry);
-			(void) atomic_dec(&wait_cnt);
-			if (--msg->tries) {
-				acm_log(1, "notice - retrying request\n");
-				list_add_tail(&ep->active_queue, &msg->entry);
-				ibv_post_send(ep->qp, &msg->wr, &bad_wr);
-			} else {
-				acm_log(0, "notice - failing request\n");
-				acmp_send_available(ep, msg->req_queue);
-				list_add_tail(&timeout_list, &msg->entry);
-			}
+	while ((msg = list_pop(expired, struct acmp_send_msg, timer_entry))) {
+		ep = msg->ep;
+		pthread_mutex_lock(&ep->lock);
+		list_del(&msg->entry);
+		if (--msg->tries) {
+			acm_log(1, "notice - retrying request\n");
+			list_add_tail(&ep->active_queue, &msg->entry);
+			ibv_post_send(ep->qp, &msg->wr, &bad_wr);
 		} else {
-			*next_expire = min(*next_expire, msg->expires);
-			break;
+			acm_log(0, "notice - failing request\n");
+			acmp_send_available(ep, msg->req_queue);
+			list_add_tail(&timeout_list, &msg->entry);
 		}
+		pthread_mutex_unlock(&ep->lock);
 	}
 }
 
-/* While the device/port/ep will not be freed, we need to be careful of
- * their addition while walking the link lists. Therefore, we need to acquire
- * the appropriate locks.
+/*
+ * Send the resolve requests an endpoint held back to stay under its rate.
+ * Requests whose destination was resolved in the meantime, by a request
+ * from it or a response to an earlier send, are dropped rather than sent.
  */
+static void acmp_pace_sends(struct acmp_ep *ep)
+{
+	struct acmp_send_queue *queue = &ep->resolve_queue;
+	struct acmp_send_msg *msg, *next;
+	struct ibv_send_wr *bad_wr;
+	struct acmp_dest *dest;
+	uint64_t delay = 0;
+	LIST_HEAD(stale);
+
+	pthread_mutex_lock(&timer_lock);
+	ep->pace_armed = 0;
+	pthread_mutex_unlock(&timer_lock);
+
+	pthread_mutex_lock(&ep->lock);
+	list_for_each_safe(&queue->pending, msg, next, entry) {
+		/*
+		 * The dest lock nests outside the ep lock, so the state is
+		 * read without it.  A response to a dest that is no longer
+		 * being queried is ignored, so a stale read is harmless.
+		 */
+		dest = (struct acmp_dest *) msg->context;
+		if (dest->state != ACMP_QUERY_ADDR) {
+			list_del(&msg->entry);
+			list_add_tail(&stale, &msg->entry);
+			continue;
+		}
+		if (!queue->credits || (delay = acmp_take_token(queue)))
+			break;
+
+		acm_log(2, "posting paced send message\n");
+		list_del(&msg->entry);
+		queue->credits--;
+		list_add_tail(&ep->active_queue, &msg->entry);
+		ibv_post_send(ep->qp, &msg->wr, &bad_wr);
+	}
+	if (delay)
+		acmp_arm_pacer(ep, delay);
+	pthread_mutex_unlock(&ep->lock);
+
+	while ((msg = list_pop(&stale, struct acmp_send_msg, entry))) {
+		acm_log(2, "dropping request for resolved dest\n");
+		acmp_put_dest((struct acmp_dest *) msg->context);
+		acmp_free_send(msg);
+	}
+}
+
 static void *acmp_retry_handler(void *context)
 {
-	struct acmp_device *dev;
-	struct acmp_port *port;
+	LIST_HEAD(expired);
+	LIST_HEAD(paced);
 	struct acmp_ep *ep;
-	uint64_t next_expire;
-	int i, wait;
+	uint64_t now;
 
 	acm_log(0, "started\n");
 	if (pthread_setcanceltype(PTHREAD_CANCEL_DEFERRED, NULL)) {
@@ -1550,40 +1988,20 @@ static void *acmp_retry_handler(void *context)
 	retry_thread_started = 1;
 
 	while (1) {
-		while (!atomic_get(&wait_cnt)) {
-			pthread_testcancel();
-			event_wait(&timeout_event, -1);
-		}
-
-		next_expire = -1;
-		pthread_mutex_lock(&acmp_dev_lock);
-		list_for_each(&acmp_dev_list, dev, entry) {
-			pthread_mutex_unlock(&acmp_dev_lock);
-
-			for (i = 0; i < dev->port_cnt; i++) {
-				port = &dev->port[i];
-
-				pthread_mutex_lock(&port->lock);
-				list_for_each(&port->ep_list, ep, entry) {
-					pthread_mutex_unlock(&port->lock);
-					pthread_mutex_lock(&ep->lock);
-					if (!list_empty(&ep->wait_queue))
-						acmp_process_wait_queue(ep, &next_expire);
-					pthread_mutex_unlock(&ep->lock);
-					pthread_mutex_lock(&port->lock);
-				}
-				pthread_mutex_unlock(&port->lock);
-			}
-			pthread_mutex_lock(&acmp_dev_lock);
-		}
-		pthread_mutex_unlock(&acmp_dev_lock);
-
+		pthread_testcancel();
+		pthread_mutex_lock(&timer_lock);
+		now = time_stamp_us();
+		acmp_expire_timers(now / 1000 / ACMP_WHEEL_TICK, &expired);
+		acmp_expire_pacers(now, &paced);
+		if (list_empty(&expired) && list_empty(&paced))
+			acmp_timer_wait(min(acmp_tick_us(acmp_next_timer()),
+					    acmp_next_pacer()));
+		pthread_mutex_unlock(&timer_lock);
+
+		acmp_retry_sends(&expired);
+		while ((ep = list_pop(&paced, struct acmp_ep, pace_entry)))
+			acmp_pace_sends(ep);
 		acmp_process_timeouts();
-		wait = (int) (next_expire - time_stamp_ms());
-		if (wait > 0 && atomic_get(&wait_cnt)) {
-			pthread_testcancel();
-			event_wait(&timeout_event, wait);
-		}
 	}
 
 	retry_thread_started = 0;
@@ -1695,7 +2113,8 @@ acmp_send_resolve(struct acmp_ep *ep, struct acmp_dest *dest,
 }
 
 /* Caller must hold dest lock */
-static uint8_t acmp_queue_req(struct acmp_dest *dest, uint64_t id, struct acm_msg *msg)
+static uint8_t acmp_queue_req(struct acmp_dest *dest, uint64_t id,
+			      struct acm_msg *msg, uint64_t start)
 {
 	struct acmp_request *req;
 
@@ -1705,6 +2124,9 @@ static uint8_t acmp_queue_req(struct acmp_dest *dest, uint64_t id, struct acm_ms
 		return ACM_STATUS_ENOMEM;
 	}
 	req->ep = dest->ep;
+	req->start = start;
+	req->lat_cntr = dest->state == ACMP_QUERY_ADDR ?
+			ACM_CNTR_LAT_ADDR : ACM_CNTR_LAT_ROUTE;
 
 	list_add_tail(&dest->req_queue, &req->entry);
 	return ACM_STATUS_SUCCESS;
@@ -1714,16 +2136,20 @@ static int acmp_dest_timeout(struct acmp_dest *dest)
 {
 	uint64_t timestamp = time_stamp_min();
 
+	/* Only an expired address counts, a route is just queried again */
 	if (timestamp > dest->addr_timeout) {
 		acm_log(2, "%s address timed out\n", dest->name);
 		dest->state = ACMP_INIT;
-		return 1;
+		acm_increment_counter(ACM_CNTR_CACHE_EXPIRED);
+		atomic_inc(&dest->ep->counters[ACM_CNTR_CACHE_EXPIRED]);
 	} else if (timestamp > dest->route_timeout) {
 		acm_log(2, "%s route timed out\n", dest->name);
 		dest->state = ACMP_ADDR_RESOLVED;
-		return 1;
+	} else {
+		return 0;
 	}
-	return 0;
+
+	return 1;
 }
 
 static int
@@ -1799,8 +2225,9 @@ acmp_resolve_dest(struct acmp_ep *ep, struct acm_msg *msg, uint64_t id)
 {
 	struct acmp_dest *dest;
 	struct acm_ep_addr_data *saddr, *daddr;
+	uint64_t start = time_stamp_us();
 	uint8_t status;
-	int ret;
+	int ret, hit = 0;
 
 	saddr = &msg->resolve_data[msg->hdr.src_index];
 	daddr = &msg->resolve_data[msg->hdr.dst_index];
@@ -1825,6 +2252,7 @@ test:
 		acm_increment_counter(ACM_CNTR_ROUTE_CACHE);
 		atomic_inc(&ep->counters[ACM_CNTR_ROUTE_CACHE]);
 		status = ACM_STATUS_SUCCESS;
+		hit = 1;
 		break;
 	case ACMP_ADDR_RESOLVED:
 		acm_log(2, "have address, resolving route\n");
@@ -1851,7 +2279,7 @@ queue:
 			status = ACM_STATUS_ENODATA;
 			break;
 		}
-		status = acmp_queue_req(dest, id, msg);
+		status = acmp_queue_req(dest, id, msg, start);
 		if (status) {
 			break;
 		}
@@ -1861,6 +2289,8 @@ queue:
 	}
 	pthread_mutex_unlock(&dest->lock);
 	ret = acmp_resolve_response(id, msg, dest, status);
+	if (hit)
+		acmp_record_latency(ep, ACM_CNTR_LAT_HIT, start);
 put:
 	acmp_put_dest(dest);
 	return ret;
@@ -1872,8 +2302,9 @@ acmp_resolve_path(struct acmp_ep *ep, struct acm_msg *msg, uint64_t id)
 	struct acmp_dest *dest;
 	struct ibv_path_record *path;
 	uint8_t *addr;
+	uint64_t start = time_stamp_us();
 	uint8_t status;
-	int ret;
+	int ret, hit = 0;
 
 	path = &msg->resolve_data[0].info.path;
 	addr = msg->resolve_data[1].info.addr;
@@ -1901,6 +2332,7 @@ test:
 		acm_increment_counter(ACM_CNTR_ROUTE_CACHE);
 		atomic_inc(&ep->counters[ACM_CNTR_ROUTE_CACHE]);
 		status = ACM_STATUS_SUCCESS;
+		hit = 1;
 		break;
 	case ACMP_INIT:
 		acm_log(2, "have path, bypassing address resolution\n");
@@ -1919,7 +2351,7 @@ test:
 			status = ACM_STATUS_ENODATA;
 			break;
 		}
-		status = acmp_queue_req(dest, id, msg);
+		status = acmp_queue_req(dest, id, msg, start);
 		if (status) {
 			break;
 		}
@@ -1929,6 +2361,8 @@ test:
 	}
 	pthread_mutex_unlock(&dest->lock);
 	ret = acmp_resolve_response(id, msg, dest, status);
+	if (hit)
+		acmp_record_latency(ep, ACM_CNTR_LAT_HIT, start);
 put:
 	acmp_put_dest(dest);
 	return ret;
@@ -1996,6 +2430,8 @@ static enum acmp_route_preload acmp_convert_route_preload(char *param)
 		return ACMP_ROUTE_PRELOAD_NONE;
 	else if (!strcasecmp("opensm_full_v1", param))
 		return ACMP_ROUTE_PRELOAD_OSM_FULL_V1;
+	else if (!strcasecmp("acm_cache", param))
+		return ACMP_ROUTE_PRELOAD_ACM_CACHE;
 
 	return route_preload;
 }
@@ -2006,10 +2442,25 @@ static enum acmp_addr_preload acmp_convert_addr_preload(char *param)
 		return ACMP_ADDR_PRELOAD_NONE;
 	else if (!strcasecmp("acm_hosts", param))
 		return ACMP_ADDR_PRELOAD_HOSTS;
+	else if (!strcasecmp("acm_cache", param))
+		return ACMP_ADDR_PRELOAD_ACM_CACHE;
 
 	return addr_preload;
 }
 
+/* Values below @min are ignored, leaving the option at @cur */
+static int acmp_convert_min(char *opt, char *param, int min, int cur)
+{
+	int val = atoi(param);
+
+	if (val >= min)
+		return val;
+
+	acm_log(0, "ERROR - ignoring %s %s, must be at least %d\n",
+		opt, param, min);
+	return cur;
+}
+
 static int acmp_post_recvs(struct acmp_ep *ep)
 {
 	int i, size;
@@ -2038,6 +2489,98 @@ err:
 	return -1;
 }
 
+/* Add the LID and GID destinations of a path from the endpoint's port */
+static void acmp_preload_path(struct acmp_ep *ep, union ibv_gid *sgid,
+			      uint8_t packetlifetime, uint16_t dlid,
+			      __be64 dguid, int sl, int mtu, int rate)
+{
+	struct acmp_dest *dest;
+	union ibv_gid dgid;
+	__be16 net_dlid = htobe16(dlid);
+	uint8_t addr[ACM_MAX_ADDRESS];
+	uint8_t addr_type;
+	int i;
+
+	dgid.global.subnet_prefix = sgid->global.subnet_prefix;
+	dgid.global.interface_id = dguid;
+
+	for (i = 0; i < 2; i++) {
+		memset(addr, 0, ACM_MAX_ADDRESS);
+		if (i == 0) {
+			addr_type = ACM_ADDRESS_LID;
+			memcpy(addr, &net_dlid, sizeof net_dlid);
+		} else {
+			addr_type = ACM_ADDRESS_GID;
+			memcpy(addr, &dgid, sizeof(dgid));
+		}
+		dest = acmp_acquire_dest(ep, addr_type, addr);
+		if (!dest) {
+			acm_log(0, "ERROR - unable to create dest\n");
+			break;
+		}
+
+		dest->path.sgid = *sgid;
+		dest->path.slid = htobe16(ep->port->lid);
+		dest->path.dgid = dgid;
+		dest->path.dlid = net_dlid;
+		dest->path.reversible_numpath = IBV_PATH_RECORD_REVERSIBLE;
+		dest->path.pkey = htobe16(ep->pkey);
+		dest->path.mtu = (uint8_t) mtu;
+		dest->path.rate = (uint8_t) rate;
+		dest->path.qosclass_sl = htobe16((uint16_t) sl & 0xF);
+		if (dlid == ep->port->lid) {
+			dest->path.packetlifetime = 0;
+			dest->addr_timeout = (uint64_t)~0ULL;
+			dest->route_timeout = (uint64_t)~0ULL;
+		} else {
+			dest->path.packetlifetime = packetlifetime;
+			dest->addr_timeout = time_stamp_min() + (unsigned) addr_timeout;
+			dest->route_timeout = time_stamp_min() + (unsigned) route_timeout;
+		}
+		dest->remote_qpn = 1;
+		dest->state = ACMP_READY;
+		acmp_put_dest(dest);
+		acm_log(1, "added cached dest %s\n", dest->name);
+	}
+}
+
+/* Add an address whose route may have been preloaded by its GID */
+static void acmp_preload_host(struct acmp_ep *ep, uint8_t addr_type,
+			      const uint8_t *name, const struct in6_addr *ib_addr)
+{
+	struct acmp_dest *dest, *gid_dest;
+	uint8_t gid[ACM_MAX_ADDRESS];
+
+	dest = acmp_acquire_dest(ep, addr_type, name);
+	if (!dest) {
+		acm_log(0, "ERROR - unable to create dest\n");
+		return;
+	}
+
+	memset(gid, 0, ACM_MAX_ADDRESS);
+	memcpy(gid, ib_addr, sizeof(*ib_addr));
+	gid_dest = acmp_get_dest(ep, ACM_ADDRESS_GID, gid);
+	if (gid_dest) {
+		dest->path = gid_dest->path;
+		dest->state = ACMP_READY;
+		acmp_put_dest(gid_dest);
+	} else {
+		memcpy(&dest->path.dgid, ib_addr, 16);
+		//ibv_query_gid(ep->port->dev->verbs, ep->port->port_num,
+		//		0, &dest->path.sgid);
+		dest->path.slid = htobe16(ep->port->lid);
+		dest->path.reversible_numpath = IBV_PATH_RECORD_REVERSIBLE;
+		dest->path.pkey = htobe16(ep->pkey);
+		dest->state = ACMP_ADDR_RESOLVED;
+	}
+
+	dest->remote_qpn = 1;
+	dest->addr_timeout = time_stamp_min() + (unsigned) addr_timeout;
+	dest->route_timeout = time_stamp_min() + (unsigned) route_timeout;
+	acm_log(1, "added host %s\n", dest->name);
+	acmp_put_dest(dest);
+}
+
 /* Parse "opensm full v1" file to build LID to GUID table */
 static void acmp_parse_osm_fullv1_lid2guid(FILE *f, __be64 *lid2guid)
 {
@@ -2090,18 +2633,14 @@ static void acmp_parse_osm_fullv1_lid2guid(FILE *f, __be64 *lid2guid)
 /* Parse 'opensm full v1' file to populate PR cache */
 static int acmp_parse_osm_fullv1_paths(FILE *f, __be64 *lid2guid, struct acmp_ep *ep)
 {
-	union ibv_gid sgid, dgid;
+	union ibv_gid sgid;
 	struct ibv_port_attr attr = {};
-	struct acmp_dest *dest;
 	char s[128];
 	char *p, *ptr, *p_guid, *p_lid;
 	uint64_t guid;
 	uint16_t lid, dlid;
-	__be16 net_dlid;
 	int sl, mtu, rate;
-	int ret = 1, i;
-	uint8_t addr[ACM_MAX_ADDRESS];
-	uint8_t addr_type;
+	int ret = 1;
 
 	acm_get_gid((struct acm_port *)ep->port->port, 0, &sgid);
 
@@ -2160,7 +2699,6 @@ static int acmp_parse_osm_fullv1_paths(FILE *f, __be64 *lid2guid, struct acmp_ep
 			break;
 
 		dlid = strtoul(p, NULL, 0);
-		net_dlid = htobe16(dlid);
 
 		p = strtok_r(NULL, ":", &ptr);
 		if (!p)
@@ -2184,47 +2722,8 @@ static int acmp_parse_osm_fullv1_paths(FILE *f, __be64 *lid2guid, struct acmp_ep
 			continue;
 		}
 
-		dgid.global.subnet_prefix = sgid.global.subnet_prefix;
-		dgid.global.interface_id = lid2guid[dlid];
-
-		for (i = 0; i < 2; i++) {
-			memset(addr, 0, ACM_MAX_ADDRESS);
-			if (i == 0) {
-				addr_type = ACM_ADDRESS_LID;
-				memcpy(addr, &net_dlid, sizeof net_dlid);
-			} else {
-				addr_type = ACM_ADDRESS_GID;
-				memcpy(addr, &dgid, sizeof(dgid));
-			}
-			dest = acmp_acquire_dest(ep, addr_type, addr);
-			if (!dest) {
-				acm_log(0, "ERROR - unable to create dest\n");
-				break;
-			}
-
-			dest->path.sgid = sgid;
-			dest->path.slid = htobe16(ep->port->lid);
-			dest->path.dgid = dgid;
-			dest->path.dlid = net_dlid;
-			dest->path.reversible_numpath = IBV_PATH_RECORD_REVERSIBLE;
-			dest->path.pkey = htobe16(ep->pkey);
-			dest->path.mtu = (uint8_t) mtu;
-			dest->path.rate = (uint8_t) rate;
-			dest->path.qosclass_sl = htobe16((uint16_t) sl & 0xF);
-			if (dlid == ep->port->lid) {
-				dest->path.packetlifetime = 0;
-				dest->addr_timeout = (uint64_t)~0ULL;
-				dest->route_timeout = (uint64_t)~0ULL;
-			} else {
-				dest->path.packetlifetime = attr.subnet_timeout;
-				dest->addr_timeout = time_stamp_min() + (unsigned) addr_timeout;
-				dest->route_timeout = time_stamp_min() + (unsigned) route_timeout;
-			}
-			dest->remote_qpn = 1;
-			dest->state = ACMP_READY;
-			acmp_put_dest(dest);
-			acm_log(1, "added cached dest %s\n", dest->name);
-		}
+		acmp_preload_path(ep, &sgid, attr.subnet_timeout, dlid,
+				  lid2guid[dlid], sl, mtu, rate);
 	}
 	return ret;
 }
@@ -2262,7 +2761,6 @@ static void acmp_parse_hosts_file(struct acmp_ep *ep)
 	char addr[INET6_ADDRSTRLEN], gid[INET6_ADDRSTRLEN];
 	uint8_t name[ACM_MAX_ADDRESS];
 	struct in6_addr ip_addr, ib_addr;
-	struct acmp_dest *dest, *gid_dest;
 	uint8_t addr_type;
 
 	if (!(f = fopen(addr_data_file, "r"))) {
@@ -2294,37 +2792,313 @@ static void acmp_parse_hosts_file(struct acmp_ep *ep)
 			strncpy((char *)name, addr, ACM_MAX_ADDRESS);
 		}
 
-		dest = acmp_acquire_dest(ep, addr_type, name);
-		if (!dest) {
-			acm_log(0, "ERROR - unable to create dest %s\n", addr);
+		acmp_preload_host(ep, addr_type, name, &ib_addr);
+	}
+
+	fclose(f);
+}
+
+/*
+ * The binary cache is mapped once and kept for the life of the daemon.
+ * Endpoints that are opened later preload from the same mapping.
+ */
+static const struct acm_cache_hdr *acmp_map_cache(void)
+{
+	static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+	static const struct acm_cache_hdr *cache;
+	static int mapped;
+	struct stat st;
+	void *map;
+	int fd;
+
+	pthread_mutex_lock(&lock);
+	if (mapped)
+		goto out;
+	mapped = 1;
+
+	fd = open(cache_data_file, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		acm_log(0, "ERROR - couldn't open %s\n", cache_data_file);
+		goto out;
+	}
+
+	if (fstat(fd, &st) || st.st_size < sizeof(*cache)) {
+		acm_log(0, "ERROR - %s is too short\n", cache_data_file);
+		goto close;
+	}
+
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	if (map == MAP_FAILED) {
+		acm_log(0, "ERROR - couldn't map %s\n", cache_data_file);
+		goto close;
+	}
+
+	cache = map;
+	if (cache->magic != ACM_CACHE_MAGIC ||
+	    cache->version != ACM_CACHE_VERSION ||
+	    acm_cache_size(cache) != st.st_size) {
+		acm_log(0, "ERROR - %s is not a valid cache file\n",
+			cache_data_file);
+		munmap(map, st.st_size);
+		cache = NULL;
+		goto close;
+	}
+	acm_log(1, "mapped %s, %u nodes, %u paths, %u hosts\n",
+		cache_data_file, cache->node_cnt, cache->path_cnt,
+		cache->host_cnt);
+close:
+	close(fd);
+out:
+	pthread_mutex_unlock(&lock);
+	return cache;
+}
+
+static int acmp_load_cache_paths(struct acmp_ep *ep)
+{
+	const struct acm_cache_hdr *cache;
+	const struct acm_cache_node *node;
+	const struct acm_cache_path *path;
+	struct ibv_port_attr attr = {};
+	union ibv_gid sgid;
+	uint32_t i;
+
+	cache = acmp_map_cache();
+	if (!cache)
+		return 1;
+
+	acm_get_gid((struct acm_port *)ep->port->port, 0, &sgid);
+	node = acm_cache_nodes(cache);
+	for (i = 0; i < cache->node_cnt; i++, node++) {
+		if (node->guid == sgid.global.interface_id &&
+		    node->lid == ep->port->lid)
+			break;
+	}
+	if (i == cache->node_cnt ||
+	    (uint64_t) node->path_index + node->path_cnt > cache->path_cnt)
+		return 1;
+
+	ibv_query_port(ep->port->dev->verbs, ep->port->port_num, &attr);
+	path = acm_cache_paths(cache) + node->path_index;
+	for (i = 0; i < node->path_cnt; i++, path++)
+		acmp_preload_path(ep, &sgid, attr.subnet_timeout, path->dlid,
+				  path->dguid, path->sl, path->mtu, path->rate);
+	return 0;
+}
+
+static void acmp_load_cache_hosts(struct acmp_ep *ep)
+{
+	const struct acm_cache_hdr *cache;
+	const struct acm_cache_host *host;
+	struct in6_addr ib_addr;
+	uint32_t i;
+
+	cache = acmp_map_cache();
+	if (!cache)
+		return;
+
+	host = acm_cache_hosts(cache);
+	for (i = 0; i < cache->host_cnt; i++, host++) {
+		if (host->addr_type != ACM_ADDRESS_NAME &&
+		    host->addr_type != ACM_ADDRESS_IP &&
+		    host->addr_type != ACM_ADDRESS_IP6)
 			continue;
-		}
 
-		memset(name, 0, ACM_MAX_ADDRESS);
-		memcpy(name, &ib_addr, sizeof(ib_addr));
-		gid_dest = acmp_get_dest(ep, ACM_ADDRESS_GID, name);
-		if (gid_dest) {
-			dest->path = gid_dest->path;
-			dest->state = ACMP_READY;
-			acmp_put_dest(gid_dest);
-		} else {
-			memcpy(&dest->path.dgid, &ib_addr, 16);
-			//ibv_query_gid(ep->port->dev->verbs, ep->port->port_num,
-			//		0, &dest->path.sgid);
-			dest->path.slid = htobe16(ep->port->lid);
-			dest->path.reversible_numpath = IBV_PATH_RECORD_REVERSIBLE;
-			dest->path.pkey = htobe16(ep->pkey);
-			dest->state = ACMP_ADDR_RESOLVED;
+		memcpy(&ib_addr, host->gid, sizeof(ib_addr));
+		acmp_preload_host(ep, host->addr_type, host->addr, &ib_addr);
+	}
+}
+
+/* Write out the resolved destinations of one endpoint */
+static int acmp_snapshot_ep(struct acmp_ep *ep, FILE *f)
+{
+	struct acmp_dest **dests = NULL, **tmp, *dest;
+	struct acmp_dest_shard *shard;
+	struct acmp_snapshot_rec rec;
+	union ibv_gid gid;
+	uint64_t now = time_stamp_min();
+	int i, saved, cnt = 0, size = 0, new_size, written = 0;
+	unsigned int b;
+
+	/* Take references under the shard locks, read the dests outside */
+	for (i = 0; i < ACMP_DEST_SHARDS; i++) {
+		shard = &ep->dest_table[i];
+		pthread_rwlock_rdlock(&shard->lock);
+		for (b = 0; b < shard->size; b++) {
+			list_for_each(&shard->buckets[b], dest, hash_entry) {
+				if (cnt == size) {
+					new_size = size ? size * 2 : 256;
+					tmp = realloc(dests,
+						      new_size * sizeof(*dests));
+					if (!tmp) {
+						pthread_rwlock_unlock(&shard->lock);
+						acm_log(0, "ERROR - snapshot of %s "
+							"is incomplete\n",
+							ep->id_string);
+						goto write;
+					}
+					dests = tmp;
+					size = new_size;
+				}
+				(void) atomic_inc(&dest->refcnt);
+				dests[cnt++] = dest;
+			}
 		}
+		pthread_rwlock_unlock(&shard->lock);
+	}
 
-		dest->remote_qpn = 1;
-		dest->addr_timeout = time_stamp_min() + (unsigned) addr_timeout;
-		dest->route_timeout = time_stamp_min() + (unsigned) route_timeout;
+write:
+	acm_get_gid((struct acm_port *) ep->port->port, 0, &gid);
+	for (i = 0; i < cnt; i++) {
+		dest = dests[i];
+		pthread_mutex_lock(&dest->lock);
+		saved = dest->state == ACMP_READY && dest->addr_timeout > now &&
+			dest->route_timeout > now;
+		if (saved) {
+			memset(&rec, 0, sizeof rec);
+			rec.port_gid = gid;
+			rec.path = dest->path;
+			memcpy(rec.address, dest->address, ACM_MAX_ADDRESS);
+			rec.addr_timeout = dest->addr_timeout;
+			rec.route_timeout = dest->route_timeout;
+			rec.remote_qpn = dest->remote_qpn;
+			rec.pkey = ep->pkey;
+			rec.addr_type = dest->addr_type;
+		}
+		pthread_mutex_unlock(&dest->lock);
 		acmp_put_dest(dest);
-		acm_log(1, "added host %s address type %d IB GID %s\n",
-			addr, addr_type, gid);
+
+		if (saved && fwrite(&rec, sizeof rec, 1, f) == 1)
+			written++;
+	}
+
+	free(dests);
+	return written;
+}
+
+static void acmp_write_snapshot(void)
+{
+	struct acmp_snapshot_hdr hdr = {
+		.magic = ACMP_SNAPSHOT_MAGIC,
+		.version = ACMP_SNAPSHOT_VERSION,
+	};
+	struct acmp_device *dev;
+	struct acmp_port *port;
+	struct acmp_ep *ep;
+	char tmp_file[sizeof(snapshot_file) + 4];
+	FILE *f;
+	int i;
+
+	snprintf(tmp_file, sizeof tmp_file, "%s.tmp", snapshot_file);
+	if (!(f = fopen(tmp_file, "w"))) {
+		acm_log(0, "ERROR - couldn't open %s\n", tmp_file);
+		return;
+	}
+
+	if (fwrite(&hdr, sizeof hdr, 1, f) != 1)
+		goto err;
+
+	pthread_mutex_lock(&acmp_dev_lock);
+	list_for_each(&acmp_dev_list, dev, entry) {
+		pthread_mutex_unlock(&acmp_dev_lock);
+
+		for (i = 0; i < dev->port_cnt; i++) {
+			port = &dev->port[i];
+
+			pthread_mutex_lock(&port->lock);
+			list_for_each(&port->ep_list, ep, entry) {
+				pthread_mutex_unlock(&port->lock);
+				hdr.cnt += acmp_snapshot_ep(ep, f);
+				pthread_mutex_lock(&port->lock);
+			}
+			pthread_mutex_unlock(&port->lock);
+		}
+		pthread_mutex_lock(&acmp_dev_lock);
+	}
+	pthread_mutex_unlock(&acmp_dev_lock);
+
+	rewind(f);
+	if (fwrite(&hdr, sizeof hdr, 1, f) != 1)
+		goto err;
+	if (fclose(f) || rename(tmp_file, snapshot_file)) {
+		acm_log(0, "ERROR - couldn't write %s\n", snapshot_file);
+		unlink(tmp_file);
+		return;
+	}
+	acm_log(1, "saved %u destinations\n", hdr.cnt);
+	return;
+
+err:
+	acm_log(0, "ERROR - couldn't write %s\n", tmp_file);
+	fclose(f);
+	unlink(tmp_file);
+}
+
+static void *acmp_snapshot_handler(void *context)
+{
+	acm_log(0, "started\n");
+	while (1) {
+		sleep(snapshot_interval);
+		acmp_write_snapshot();
+	}
+	return NULL;
+}
+
+/*
+ * Reload the destinations this endpoint had resolved before a restart.
+ * They keep their original timeouts, and are resolved again once those
+ * pass. Records from a port whose LID changed since are dropped.
+ */
+static void acmp_ep_restore(struct acmp_ep *ep)
+{
+	struct acmp_snapshot_hdr hdr;
+	struct acmp_snapshot_rec rec;
+	struct acmp_dest *dest;
+	union ibv_gid gid;
+	uint64_t now = time_stamp_min();
+	int cnt = 0;
+	FILE *f;
+
+	if (!(f = fopen(snapshot_file, "r"))) {
+		acm_log(1, "no snapshot in %s\n", snapshot_file);
+		return;
+	}
+
+	if (fread(&hdr, sizeof hdr, 1, f) != 1 ||
+	    hdr.magic != ACMP_SNAPSHOT_MAGIC ||
+	    hdr.version != ACMP_SNAPSHOT_VERSION) {
+		acm_log(0, "ERROR - %s is not a valid snapshot\n", snapshot_file);
+		goto out;
 	}
 
+	acm_get_gid((struct acm_port *) ep->port->port, 0, &gid);
+	while (hdr.cnt-- && fread(&rec, sizeof rec, 1, f) == 1) {
+		if (memcmp(&rec.port_gid, &gid, sizeof gid) ||
+		    rec.pkey != ep->pkey ||
+		    rec.path.slid != htobe16(ep->port->lid) ||
+		    rec.addr_timeout <= now || rec.route_timeout <= now ||
+		    rec.addr_type == ACM_ADDRESS_INVALID ||
+		    rec.addr_type >= ACM_ADDRESS_RESERVED)
+			continue;
+
+		dest = acmp_acquire_dest(ep, rec.addr_type, rec.address);
+		if (!dest)
+			continue;
+
+		pthread_mutex_lock(&dest->lock);
+		if (dest->state != ACMP_READY) {
+			dest->path = rec.path;
+			dest->remote_qpn = rec.remote_qpn;
+			dest->addr_timeout = rec.addr_timeout;
+			dest->route_timeout = rec.route_timeout;
+			acmp_init_path_av(ep->port, dest);
+			dest->state = ACMP_READY;
+			cnt++;
+		}
+		pthread_mutex_unlock(&dest->lock);
+		acmp_put_dest(dest);
+	}
+	acm_log(1, "%s restored %d destinations\n", ep->id_string, cnt);
+out:
 	fclose(f);
 }
 
@@ -2340,6 +3114,10 @@ static void acmp_ep_preload(struct acmp_ep *ep)
 		if (acmp_parse_osm_fullv1(ep))
 			acm_log(0, "ERROR - failed to preload EP\n");
 		break;
+	case ACMP_ROUTE_PRELOAD_ACM_CACHE:
+		if (acmp_load_cache_paths(ep))
+			acm_log(0, "ERROR - failed to preload EP\n");
+		break;
 	default:
 		break;
 	}
@@ -2348,6 +3126,9 @@ static void acmp_ep_preload(struct acmp_ep *ep)
 	case ACMP_ADDR_PRELOAD_HOSTS:
 		acmp_parse_hosts_file(ep);
 		break;
+	case ACMP_ADDR_PRELOAD_ACM_CACHE:
+		acmp_load_cache_hosts(ep);
+		break;
 	default:
 		break;
 	}
@@ -2494,12 +3275,15 @@ acmp_alloc_ep(struct acmp_port *port, struct acm_endpoint *endpoint)
 	ep->endpoint = endpoint;
 	ep->pkey = endpoint->pkey;
 	ep->resolve_queue.credits = resolve_depth;
+	ep->resolve_queue.rate = resolve_rate;
 	ep->resp_queue.credits = send_depth;
 	list_head_init(&ep->resolve_queue.pending);
 	list_head_init(&ep->resp_queue.pending);
 	list_head_init(&ep->active_queue);
 	list_head_init(&ep->wait_queue);
 	pthread_mutex_init(&ep->lock, NULL);
+	for (i = 0; i < ACMP_DEST_SHARDS; i++)
+		pthread_rwlock_init(&ep->dest_table[i].lock, NULL);
 	sprintf(ep->id_string, "%s-%d-0x%x", port->dev->verbs->device->name,
 		port->port_num, endpoint->pkey);
 	for (i = 0; i < ACM_MAX_COUNTER; i++)
@@ -2600,6 +3384,8 @@ static int acmp_open_endpoint(const struct acm_endpoint *endpoint,
 	list_add(&port->ep_list, &ep->entry);
 	pthread_mutex_unlock(&port->lock);
 	acmp_ep_preload(ep);
+	if (snapshot_interval)
+		acmp_ep_restore(ep);
 	acmp_ep_join(ep);
 	*ep_context = (void *) ep;
 	return 0;
@@ -2865,6 +3651,12 @@ static void acmp_set_options(void)
 			retries = atoi(value);
 		else if (!strcasecmp("resolve_depth", opt))
 			resolve_depth = atoi(value);
+		else if (!strcasecmp("resolve_rate", opt))
+			resolve_rate = acmp_convert_min(opt, value, 0,
+							resolve_rate);
+		else if (!strcasecmp("resolve_burst", opt))
+			resolve_burst = acmp_convert_min(opt, value, 1,
+							 resolve_burst);
 		else if (!strcasecmp("send_depth", opt))
 			send_depth = atoi(value);
 		else if (!strcasecmp("recv_depth", opt))
@@ -2881,6 +3673,12 @@ static void acmp_set_options(void)
 			addr_preload = acmp_convert_addr_preload(value);
 		else if (!strcasecmp("addr_data_file", opt))
 			strcpy(addr_data_file, value);
+		else if (!strcasecmp("cache_data_file", opt))
+			strcpy(cache_data_file, value);
+		else if (!strcasecmp("snapshot_file", opt))
+			strcpy(snapshot_file, value);
+		else if (!strcasecmp("snapshot_interval", opt))
+			snapshot_interval = atoi(value);
 	}
 
 	fclose(f);
@@ -2896,6 +3694,8 @@ static void acmp_log_options(void)
 	acm_log(0, "timeout %d ms\n", timeout);
 	acm_log(0, "retries %d\n", retries);
 	acm_log(0, "resolve depth %d\n", resolve_depth);
+	acm_log(0, "resolve rate %d\n", resolve_rate);
+	acm_log(0, "resolve burst %d\n", resolve_burst);
 	acm_log(0, "send depth %d\n", send_depth);
 	acm_log(0, "receive depth %d\n", recv_depth);
 	acm_log(0, "minimum mtu %d\n", min_mtu);
@@ -2904,18 +3704,26 @@ static void acmp_log_options(void)
 	acm_log(0, "route data file %s\n", route_data_file);
 	acm_log(0, "address preload %d\n", addr_preload);
 	acm_log(0, "address data file %s\n", addr_data_file);
+	acm_log(0, "cache data file %s\n", cache_data_file);
+	acm_log(0, "snapshot file %s\n", snapshot_file);
+	acm_log(0, "snapshot interval %d\n", snapshot_interval);
 }
 
 static void __attribute__((constructor)) acmp_init(void)
 {
+	int i;
+
 	acmp_set_options();
 
 	acmp_log_options();
 
 	atomic_init(&g_tid);
-	atomic_init(&wait_cnt);
 	pthread_mutex_init(&acmp_dev_lock, NULL);
-	event_init(&timeout_event);
+	pthread_mutex_init(&timer_lock, NULL);
+	pthread_cond_init(&timer_cond, NULL);
+	for (i = 0; i < ACMP_WHEEL_SLOTS; i++)
+		list_head_init(&timer_wheel[i]);
+	timer_tick = time_stamp_ms() / ACMP_WHEEL_TICK;
 
 	umad_init();
 
@@ -2926,6 +3734,11 @@ static void __attribute__((constructor)) acmp_init(void)
 		return;
 	}
 
+	if (snapshot_interval > 0 &&
+	    pthread_create(&snapshot_thread_id, NULL, acmp_snapshot_handler,
+			   NULL))
+		acm_log(0, "Error: failed to create the snapshot thread\n");
+
 	acmp_initialized = 1;
 }
 
@@ -0,0 +1,738 @@
+/* GPLv2 or OpenIB.org BSD (MIT) See COPYING file */
+
+/*
+ * ibacmsim answers resolve requests and path record queries from a
+ * synthetic fabric, so the ibacm service can be tested and benchmarked on
+ * any verbs device, without an SA or peers running ibacm.
+ *
+ * Destinations are looked up in a hosts file in the ibacm_hosts.data
+ * format. Other addresses get a GID derived from a hash of the address,
+ * unless sim_unknown is set to reject. The first request for a destination
+ * completes after the configured address and route resolution delays, and
+ * requests for a destination that is being resolved wait for it. Later
+ * requests are answered from the cache, unless sim_cache is 0.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <osd.h>
+#include <arpa/inet.h>
+#include <infiniband/acm.h>
+#include <infiniband/acm_prov.h>
+#include <infiniband/verbs.h>
+#include <inttypes.h>
+#include <ccan/list.h>
+#include "acm_mad.h"
+
+#define src_out     data[0]
+#define src_index   data[1]
+#define dst_index   data[2]
+
+#define ACMSIM_HASH_SIZE	4096
+
+enum acmsim_state {
+	ACMSIM_INIT,
+	ACMSIM_QUERY,
+	ACMSIM_READY
+};
+
+struct acmsim_host {
+	struct list_node	entry;
+	union ibv_gid		gid;
+	uint8_t			addr_type;
+	uint8_t			address[ACM_MAX_ADDRESS];
+};
+
+struct acmsim_port {
+	const struct acm_port	*port;
+	union ibv_gid		gid;
+	__be16			lid;
+};
+
+struct acmsim_ep {
+	struct acmsim_port	*port;
+	uint16_t		pkey;
+	pthread_mutex_t		lock;
+	struct list_head	dest_table[ACMSIM_HASH_SIZE];
+	atomic_t		counters[ACM_MAX_COUNTER];
+};
+
+/*
+ * A destination waiting for its resolution delay sits on addr_timers or
+ * route_timers. Each list only holds one delay, and due is set under the
+ * timer lock, so each list stays sorted by the time its entries are due.
+ */
+struct acmsim_dest {
+	struct list_node	entry;
+	struct list_node	timer_entry;
+	struct acmsim_ep	*ep;
+	struct list_head	req_queue;
+	struct ibv_path_record	path;
+	uint64_t		due;		/* us */
+	enum acmsim_state	state;
+	uint8_t			status;
+	uint8_t			addr_type;
+	uint8_t			address[ACM_MAX_ADDRESS];
+};
+
+struct acmsim_request {
+	struct list_node	entry;
+	uint64_t		id;
+	uint64_t		start;		/* us */
+	int			query;
+	int			lat_cntr;
+	struct acm_msg		msg;
+};
+
+static int acmsim_open_dev(const struct acm_device *device, void **dev_context);
+static void acmsim_close_dev(void *dev_context);
+static int acmsim_open_port(const struct acm_port *port, void *dev_context,
+			    void **port_context);
+static void acmsim_close_port(void *port_context);
+static int acmsim_open_endpoint(const struct acm_endpoint *endpoint,
+				void *port_context, void **ep_context);
+static void acmsim_close_endpoint(void *ep_context);
+static int acmsim_add_addr(const struct acm_address *addr, void *ep_context,
+			   void **addr_context);
+static void acmsim_remove_addr(void *addr_context);
+static int acmsim_resolve(void *addr_context, struct acm_msg *msg, uint64_t id);
+static int acmsim_query(void *addr_context, struct acm_msg *msg, uint64_t id);
+static int acmsim_handle_event(void *port_context, enum ibv_event_type type);
+static void acmsim_query_perf(void *ep_context, uint64_t *values, uint8_t *cnt);
+
+static struct acm_provider sim_prov = {
+	.size = sizeof(struct acm_provider),
+	.version = ACM_PROV_VERSION,
+	.name = "ibacmsim",
+	.open_device = acmsim_open_dev,
+	.close_device = acmsim_close_dev,
+	.open_port = acmsim_open_port,
+	.close_port = acmsim_close_port,
+	.open_endpoint = acmsim_open_endpoint,
+	.close_endpoint = acmsim_close_endpoint,
+	.add_address = acmsim_add_addr,
+	.remove_address = acmsim_remove_addr,
+	.resolve = acmsim_resolve,
+	.query = acmsim_query,
+	.handle_event = acmsim_handle_event,
+	.query_perf = acmsim_query_perf,
+};
+
+static struct list_head host_table[ACMSIM_HASH_SIZE];
+static int hosts_loaded;
+
+static LIST_HEAD(addr_timers);
+static LIST_HEAD(route_timers);
+static pthread_mutex_t timer_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t timer_cond = PTHREAD_COND_INITIALIZER;
+static pthread_t timer_thread_id;
+static int timer_thread_started;
+
+/*
+ * Service options - may be set through ibacm_opts.cfg file.
+ */
+static char sim_hosts_file[256] = ACM_CONF_DIR "/ibacm_hosts.data";
+static int sim_addr_delay = 100;	/* us */
+static int sim_route_delay = 100;	/* us */
+static int sim_cache = 1;
+static int sim_reject_unknown = 0;
+
+static uint64_t acmsim_hash(uint8_t addr_type, const uint8_t *addr)
+{
+	uint64_t hash = addr_type, word;
+	int i;
+
+	for (i = 0; i < ACM_MAX_ADDRESS; i += sizeof(word)) {
+		memcpy(&word, addr + i, sizeof(word));
+		hash = (hash ^ word) * 0x9e3779b97f4a7c15ULL;
+		hash ^= hash >> 29;
+	}
+	return hash;
+}
+
+static struct list_head *
+acmsim_bucket(struct list_head *table, uint8_t addr_type, const uint8_t *addr)
+{
+	return &table[acmsim_hash(addr_type, addr) & (ACMSIM_HASH_SIZE - 1)];
+}
+
+static void acmsim_load_hosts(void)
+{
+	struct acmsim_host *host;
+	char s[120], addr[46], gid[46];
+	int i, cnt = 0;
+	FILE *f;
+
+	for (i = 0; i < ACMSIM_HASH_SIZE; i++)
+		list_head_init(&host_table[i]);
+	hosts_loaded = 1;
+
+	if (!(f = fopen(sim_hosts_file, "r"))) {
+		acm_log(1, "no hosts file %s\n", sim_hosts_file);
+		return;
+	}
+
+	while (fgets(s, sizeof s, f)) {
+		if (s[0] == '#')
+			continue;
+
+		if (sscanf(s, "%45s%45s", addr, gid) != 2)
+			continue;
+
+		host = calloc(1, sizeof *host);
+		if (!host)
+			break;
+
+		if (inet_pton(AF_INET6, gid, &host->gid) <= 0) {
+			acm_log(0, "ERROR - %s is not IB GID\n", gid);
+			free(host);
+			continue;
+		}
+
+		if (inet_pton(AF_INET, addr, host->address) > 0) {
+			host->addr_type = ACM_ADDRESS_IP;
+		} else if (inet_pton(AF_INET6, addr, host->address) > 0) {
+			host->addr_type = ACM_ADDRESS_IP6;
+		} else {
+			host->addr_type = ACM_ADDRESS_NAME;
+			strncpy((char *) host->address, addr, ACM_MAX_ADDRESS);
+		}
+
+		list_add_tail(acmsim_bucket(host_table, host->addr_type,
+					    host->address), &host->entry);
+		cnt++;
+	}
+	fclose(f);
+	acm_log(1, "loaded %d hosts from %s\n", cnt, sim_hosts_file);
+}
+
+static struct acmsim_host *
+acmsim_lookup_host(uint8_t addr_type, const uint8_t *addr)
+{
+	struct acmsim_host *host;
+
+	list_for_each(acmsim_bucket(host_table, addr_type, addr), host, entry) {
+		if (host->addr_type == addr_type &&
+		    !memcmp(host->address, addr, ACM_MAX_ADDRESS))
+			return host;
+	}
+	return NULL;
+}
+
+/* Build the path to @dest, as the SA would return it */
+static uint8_t acmsim_resolve_path(struct acmsim_dest *dest)
+{
+	struct acmsim_port *port = dest->ep->port;
+	struct ibv_path_record *path = &dest->path;
+	struct acmsim_host *host;
+	uint16_t dlid;
+
+	memset(path, 0, sizeof *path);
+	switch (dest->addr_type) {
+	case ACM_ADDRESS_GID:
+		memcpy(&path->dgid, dest->address, sizeof path->dgid);
+		break;
+	case ACM_ADDRESS_LID:
+		memcpy(&path->dlid, dest->address, sizeof path->dlid);
+		path->dgid.global.subnet_prefix = port->gid.global.subnet_prefix;
+		path->dgid.global.interface_id =
+			htobe64(be16toh(path->dlid));
+		break;
+	default:
+		host = acmsim_lookup_host(dest->addr_type, dest->address);
+		if (host) {
+			path->dgid = host->gid;
+		} else if (sim_reject_unknown) {
+			return ACM_STATUS_ENODATA;
+		} else {
+			path->dgid.global.subnet_prefix =
+				port->gid.global.subnet_prefix;
+			path->dgid.global.interface_id =
+				htobe64(acmsim_hash(dest->addr_type,
+						    dest->address) | 1);
+		}
+		break;
+	}
+
+	if (!path->dlid) {
+		dlid = be64toh(path->dgid.global.interface_id) % 0xbfff + 1;
+		path->dlid = htobe16(dlid);
+	}
+	path->sgid = port->gid;
+	path->slid = port->lid;
+	path->reversible_numpath = IBV_PATH_RECORD_REVERSIBLE | 1;
+	path->pkey = htobe16(dest->ep->pkey);
+	path->mtu = (2 << 6) | IBV_MTU_2048;
+	path->rate = (2 << 6) | IBV_RATE_100_GBPS;
+	path->packetlifetime = (2 << 6) | 0x12;
+	return ACM_STATUS_SUCCESS;
+}
+
+static void acmsim_record_latency(struct acmsim_ep *ep, int cntr, uint64_t start)
+{
+	uint64_t now = time_stamp_us(), limit = 10;
+	int i;
+
+	for (i = 0; i < ACM_LAT_BUCKETS - 1 && now >= start + limit; i++)
+		limit *= 10;
+
+	acm_increment_counter(cntr + i);
+	atomic_inc(&ep->counters[cntr + i]);
+}
+
+static int acmsim_resolve_response(struct acmsim_ep *ep, uint64_t id,
+				   struct acm_msg *req_msg,
+				   struct ibv_path_record *path, uint8_t status)
+{
+	struct acm_msg msg;
+
+	acm_log(2, "client %" PRIu64 ", status 0x%x\n", id, status);
+	if (status == ACM_STATUS_ENODATA)
+		atomic_inc(&ep->counters[ACM_CNTR_NODATA]);
+	else if (status)
+		atomic_inc(&ep->counters[ACM_CNTR_ERROR]);
+
+	memset(&msg, 0, sizeof msg);
+	msg.hdr = req_msg->hdr;
+	msg.hdr.status = status;
+	msg.hdr.length = ACM_MSG_HDR_LENGTH;
+	memset(msg.hdr.data, 0, sizeof(msg.hdr.data));
+
+	if (status == ACM_STATUS_SUCCESS) {
+		msg.hdr.length += ACM_MSG_EP_LENGTH;
+		msg.resolve_data[0].flags = IBV_PATH_FLAG_GMP |
+			IBV_PATH_FLAG_PRIMARY | IBV_PATH_FLAG_BIDIRECTIONAL;
+		msg.resolve_data[0].type = ACM_EP_INFO_PATH;
+		msg.resolve_data[0].info.path = *path;
+
+		if (req_msg->hdr.src_out) {
+			msg.hdr.length += ACM_MSG_EP_LENGTH;
+			memcpy(&msg.resolve_data[1],
+			       &req_msg->resolve_data[req_msg->hdr.src_index],
+			       ACM_MSG_EP_LENGTH);
+		}
+	}
+
+	return acm_resolve_response(id, &msg);
+}
+
+static int acmsim_query_response(struct acmsim_ep *ep, uint64_t id,
+				 struct acm_msg *msg,
+				 struct ibv_path_record *path, uint8_t status)
+{
+	acm_log(2, "client %" PRIu64 ", status 0x%x\n", id, status);
+	msg->hdr.opcode |= ACM_OP_ACK;
+	msg->hdr.status = status;
+	if (status == ACM_STATUS_SUCCESS)
+		msg->resolve_data[0].info.path = *path;
+	else if (status == ACM_STATUS_ENODATA)
+		atomic_inc(&ep->counters[ACM_CNTR_NODATA]);
+	else
+		atomic_inc(&ep->counters[ACM_CNTR_ERROR]);
+
+	return acm_query_response(id, msg);
+}
+
+static int acmsim_respond(struct acmsim_ep *ep, uint64_t id, int query,
+			  struct acm_msg *msg, struct ibv_path_record *path,
+			  uint8_t status)
+{
+	return query ? acmsim_query_response(ep, id, msg, path, status) :
+		       acmsim_resolve_response(ep, id, msg, path, status);
+}
+
+/* Caller must hold the ep lock */
+static struct acmsim_dest *
+acmsim_acquire_dest(struct acmsim_ep *ep, uint8_t addr_type, const uint8_t *addr)
+{
+	struct list_head *bucket = acmsim_bucket(ep->dest_table, addr_type, addr);
+	struct acmsim_dest *dest;
+
+	list_for_each(bucket, dest, entry) {
+		if (dest->addr_type == addr_type &&
+		    !memcmp(dest->address, addr, ACM_MAX_ADDRESS))
+			return dest;
+	}
+
+	dest = calloc(1, sizeof *dest);
+	if (!dest)
+		return NULL;
+
+	dest->ep = ep;
+	dest->addr_type = addr_type;
+	memcpy(dest->address, addr, ACM_MAX_ADDRESS);
+	list_head_init(&dest->req_queue);
+	dest->state = ACMSIM_INIT;
+	list_add_tail(bucket, &dest->entry);
+	acm_increment_counter(ACM_CNTR_CACHE_ENTRIES);
+	atomic_inc(&ep->counters[ACM_CNTR_CACHE_ENTRIES]);
+	return dest;
+}
+
+/* Caller must hold the ep lock */
+static void acmsim_start_timer(struct acmsim_dest *dest, int route_only)
+{
+	int delay = route_only ? sim_route_delay :
+				 sim_addr_delay + sim_route_delay;
+
+	/* Read the time under the lock, so each list is added to in order */
+	pthread_mutex_lock(&timer_lock);
+	dest->due = time_stamp_us() + delay;
+	list_add_tail(route_only ? &route_timers : &addr_timers,
+		      &dest->timer_entry);
+	pthread_cond_signal(&timer_cond);
+	pthread_mutex_unlock(&timer_lock);
+}
+
+static void acmsim_complete_dest(struct acmsim_dest *dest)
+{
+	struct acmsim_ep *ep = dest->ep;
+	struct acmsim_request *req;
+	struct list_head reqs;
+	uint8_t status;
+
+	status = acmsim_resolve_path(dest);
+
+	list_head_init(&reqs);
+	pthread_mutex_lock(&ep->lock);
+	dest->status = status;
+	dest->state = ACMSIM_READY;
+	list_append_list(&reqs, &dest->req_queue);
+	if (!sim_cache || status) {
+		list_del(&dest->entry);
+		acm_decrement_counter(ACM_CNTR_CACHE_ENTRIES);
+		atomic_dec(&ep->counters[ACM_CNTR_CACHE_ENTRIES]);
+	}
+	pthread_mutex_unlock(&ep->lock);
+
+	while ((req = list_pop(&reqs, struct acmsim_request, entry))) {
+		acmsim_respond(ep, req->id, req->query, &req->msg,
+			       &dest->path, status);
+		acmsim_record_latency(ep, req->lat_cntr, req->start);
+		free(req);
+	}
+
+	if (!sim_cache || status)
+		free(dest);
+}
+
+/* Caller must hold the timer lock */
+static struct acmsim_dest *acmsim_next_timer(void)
+{
+	struct acmsim_dest *addr, *route;
+
+	addr = list_top(&addr_timers, struct acmsim_dest, timer_entry);
+	route = list_top(&route_timers, struct acmsim_dest, timer_entry);
+	if (!addr || (route && route->due < addr->due))
+		return route;
+	return addr;
+}
+
+static void *acmsim_timer_handler(void *context)
+{
+	struct acmsim_dest *dest;
+	struct timespec wait;
+	uint64_t now;
+
+	acm_log(0, "started\n");
+	pthread_mutex_lock(&timer_lock);
+	for (;;) {
+		dest = acmsim_next_timer();
+		if (!dest) {
+			pthread_cond_wait(&timer_cond, &timer_lock);
+			continue;
+		}
+
+		now = time_stamp_us();
+		if (dest->due > now) {
+			wait.tv_sec = dest->due / 1000000;
+			wait.tv_nsec = (dest->due % 1000000) * 1000;
+			pthread_cond_timedwait(&timer_cond, &timer_lock, &wait);
+			continue;
+		}
+
+		list_del(&dest->timer_entry);
+		pthread_mutex_unlock(&timer_lock);
+		acmsim_complete_dest(dest);
+		pthread_mutex_lock(&timer_lock);
+	}
+	return NULL;
+}
+
+static int acmsim_lookup(struct acmsim_ep *ep, struct acm_msg *msg, uint64_t id,
+			 uint8_t addr_type, const uint8_t *addr, int route_only,
+			 int nodelay, int query)
+{
+	uint64_t start = time_stamp_us();
+	struct acmsim_request *req;
+	struct acmsim_dest *dest;
+	struct ibv_path_record path;
+	uint8_t status;
+	int ret;
+
+	pthread_mutex_lock(&ep->lock);
+	dest = acmsim_acquire_dest(ep, addr_type, addr);
+	if (!dest) {
+		pthread_mutex_unlock(&ep->lock);
+		return acmsim_respond(ep, id, query, msg, NULL,
+				      ACM_STATUS_ENOMEM);
+	}
+
+	switch (dest->state) {
+	case ACMSIM_READY:
+		acm_log(2, "request satisfied from local cache\n");
+		acm_increment_counter(ACM_CNTR_ROUTE_CACHE);
+		atomic_inc(&ep->counters[ACM_CNTR_ROUTE_CACHE]);
+		path = dest->path;
+		status = dest->status;
+		pthread_mutex_unlock(&ep->lock);
+		ret = acmsim_respond(ep, id, query, msg, &path, status);
+		acmsim_record_latency(ep, ACM_CNTR_LAT_HIT, start);
+		return ret;
+	case ACMSIM_INIT:
+		if (route_only) {
+			acm_increment_counter(ACM_CNTR_ROUTE_QUERY);
+			atomic_inc(&ep->counters[ACM_CNTR_ROUTE_QUERY]);
+		} else {
+			acm_increment_counter(ACM_CNTR_ADDR_QUERY);
+			atomic_inc(&ep->counters[ACM_CNTR_ADDR_QUERY]);
+		}
+		dest->state = ACMSIM_QUERY;
+		acmsim_start_timer(dest, route_only);
+		/* fall through */
+	default:
+		break;
+	}
+
+	if (nodelay) {
+		pthread_mutex_unlock(&ep->lock);
+		acm_log(2, "lookup initiated, but client wants no delay\n");
+		return acmsim_respond(ep, id, query, msg, NULL,
+				      ACM_STATUS_ENODATA);
+	}
+
+	req = calloc(1, sizeof *req);
+	if (!req) {
+		pthread_mutex_unlock(&ep->lock);
+		return acmsim_respond(ep, id, query, msg, NULL,
+				      ACM_STATUS_ENOMEM);
+	}
+
+	req->id = id;
+	req->start = start;
+	req->query = query;
+	req->lat_cntr = route_only ? ACM_CNTR_LAT_ROUTE : ACM_CNTR_LAT_ADDR;
+	memcpy(&req->msg, msg, sizeof(req->msg));
+	list_add_tail(&dest->req_queue, &req->entry);
+	pthread_mutex_unlock(&ep->lock);
+	return 0;
+}
+
+/* Key path requests on the destination LID, or the GID without one */
+static int acmsim_lookup_path(struct acmsim_ep *ep, struct acm_msg *msg,
+			      uint64_t id, int nodelay, int query)
+{
+	struct ibv_path_record *path = &msg->resolve_data[0].info.path;
+	uint8_t addr[ACM_MAX_ADDRESS];
+
+	memset(addr, 0, sizeof addr);
+	if (path->dlid) {
+		memcpy(addr, &path->dlid, sizeof path->dlid);
+		return acmsim_lookup(ep, msg, id, ACM_ADDRESS_LID, addr, 1,
+				     nodelay, query);
+	}
+
+	memcpy(addr, &path->dgid, sizeof path->dgid);
+	return acmsim_lookup(ep, msg, id, ACM_ADDRESS_GID, addr, 1,
+			     nodelay, query);
+}
+
+static int acmsim_resolve(void *addr_context, struct acm_msg *msg, uint64_t id)
+{
+	struct acmsim_ep *ep = addr_context;
+	struct acm_ep_addr_data *daddr;
+
+	atomic_inc(&ep->counters[ACM_CNTR_RESOLVE]);
+	if (msg->resolve_data[0].type == ACM_EP_INFO_PATH)
+		return acmsim_lookup_path(ep, msg, id,
+			msg->resolve_data[0].flags & ACM_FLAGS_NODELAY, 0);
+
+	daddr = &msg->resolve_data[msg->hdr.dst_index];
+	return acmsim_lookup(ep, msg, id, daddr->type, daddr->info.addr, 0,
+			     daddr->flags & ACM_FLAGS_NODELAY, 0);
+}
+
+static int acmsim_query(void *addr_context, struct acm_msg *msg, uint64_t id)
+{
+	return acmsim_lookup_path(addr_context, msg, id, 0, 1);
+}
+
+static int acmsim_add_addr(const struct acm_address *addr, void *ep_context,
+			   void **addr_context)
+{
+	acm_log(2, "%s\n", addr->id_string);
+	*addr_context = ep_context;
+	return 0;
+}
+
+static void acmsim_remove_addr(void *addr_context)
+{
+}
+
+static int acmsim_open_endpoint(const struct acm_endpoint *endpoint,
+				void *port_context, void **ep_context)
+{
+	struct acmsim_ep *ep;
+	int i;
+
+	acm_log(1, "pkey 0x%04x\n", endpoint->pkey);
+	ep = calloc(1, sizeof *ep);
+	if (!ep)
+		return -1;
+
+	ep->port = port_context;
+	ep->pkey = endpoint->pkey;
+	pthread_mutex_init(&ep->lock, NULL);
+	for (i = 0; i < ACMSIM_HASH_SIZE; i++)
+		list_head_init(&ep->dest_table[i]);
+	for (i = 0; i < ACM_MAX_COUNTER; i++)
+		atomic_init(&ep->counters[i]);
+
+	*ep_context = ep;
+	return 0;
+}
+
+/*
+ * As with ibacmp, endpoints are not freed, since requests that are
+ * waiting for their delay may still reference them.
+ */
+static void acmsim_close_endpoint(void *ep_context)
+{
+	struct acmsim_ep *ep = ep_context;
+
+	acm_log(1, "pkey 0x%04x\n", ep->pkey);
+}
+
+static int acmsim_open_port(const struct acm_port *cport, void *dev_context,
+			    void **port_context)
+{
+	struct acmsim_port *port;
+	struct ibv_port_attr attr;
+
+	acm_log(1, "port %d\n", cport->port_num);
+	port = calloc(1, sizeof *port);
+	if (!port)
+		return -1;
+
+	port->port = cport;
+	acm_get_gid((struct acm_port *) cport, 0, &port->gid);
+	if (!ibv_query_port(cport->dev->verbs, cport->port_num, &attr))
+		port->lid = htobe16(attr.lid);
+
+	*port_context = port;
+	return 0;
+}
+
+static void acmsim_close_port(void *port_context)
+{
+}
+
+static int acmsim_open_dev(const struct acm_device *device, void **dev_context)
+{
+	acm_log(1, "%s\n", device->verbs->device->name);
+
+	pthread_mutex_lock(&timer_lock);
+	if (!hosts_loaded)
+		acmsim_load_hosts();
+	if (!timer_thread_started &&
+	    !pthread_create(&timer_thread_id, NULL, acmsim_timer_handler, NULL))
+		timer_thread_started = 1;
+	pthread_mutex_unlock(&timer_lock);
+
+	if (!timer_thread_started) {
+		acm_log(0, "Error: failed to create the timer thread\n");
+		return -1;
+	}
+
+	*dev_context = (void *) device;
+	return 0;
+}
+
+static void acmsim_close_dev(void *dev_context)
+{
+}
+
+static int acmsim_handle_event(void *port_context, enum ibv_event_type type)
+{
+	return 0;
+}
+
+static void acmsim_query_perf(void *ep_context, uint64_t *values, uint8_t *cnt)
+{
+	struct acmsim_ep *ep = ep_context;
+	int i;
+
+	for (i = 0; i < ACM_MAX_COUNTER; i++)
+		values[i] = htobe64((uint64_t) atomic_get(&ep->counters[i]));
+	*cnt = ACM_MAX_COUNTER;
+}
+
+static void acmsim_set_options(void)
+{
+	FILE *f;
+	char s[120];
+	char opt[32], value[256];
+	const char *opts_file = acm_get_opts_file();
+
+	if (!(f = fopen(opts_file, "r")))
+		return;
+
+	while (fgets(s, sizeof s, f)) {
+		if (s[0] == '#')
+			continue;
+
+		if (sscanf(s, "%31s%255s", opt, value) != 2)
+			continue;
+
+		if (!strcasecmp("sim_hosts_file", opt))
+			strcpy(sim_hosts_file, value);
+		else if (!strcasecmp("sim_addr_delay", opt))
+			sim_addr_delay = atoi(value);
+		else if (!strcasecmp("sim_route_delay", opt))
+			sim_route_delay = atoi(value);
+		else if (!strcasecmp("sim_cache", opt))
+			sim_cache = atoi(value);
+		else if (!strcasecmp("sim_unknown", opt))
+			sim_reject_unknown = !strcasecmp("reject", value);
+	}
+
+	fclose(f);
+}
+
+static void acmsim_log_options(void)
+{
+	acm_log(0, "sim hosts file %s\n", sim_hosts_file);
+	acm_log(0, "sim address delay %d us\n", sim_addr_delay);
+	acm_log(0, "sim route delay %d us\n", sim_route_delay);
+	acm_log(0, "sim cache %d\n", sim_cache);
+	acm_log(0, "sim unknown addresses %s\n",
+		sim_reject_unknown ? "reject" : "synthesize");
+}
+
+int provider_query(struct acm_provider **provider, uint32_t *version)
+{
+	acm_log(1, "\n");
+
+	acmsim_set_options();
+	acmsim_log_options();
+
+	if (provider)
+		*provider = &sim_prov;
+	if (version)
+		*version = ACM_PROV_VERSION;
+
+	return 0;
+}
@@ -40,6 +40,8 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/time.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
 #include <fcntl.h>
 #include <dirent.h>
 #include <infiniband/acm.h>
@@ -74,6 +76,8 @@
 #define NL_MSG_BUF_SIZE 4096
 #define ACM_PROV_NAME_SIZE 64
 #define NL_CLIENT_INDEX 0
+#define ACM_MAX_EVENTS 64
+#define ACMC_SA_HASH_SIZE 64
 
 struct acmc_subnet {
 	struct list_node       entry;
@@ -104,7 +108,8 @@ struct acmc_port {
 	int		    mad_portid;
 	int		    mad_agentid;
 	struct ib_mad_addr  sa_addr;
-	struct list_head    sa_pending;
+	struct list_head    sa_pending[ACMC_SA_HASH_SIZE];	/* by TID */
+	struct list_head    sa_query[ACMC_SA_HASH_SIZE];	/* by path */
 	struct list_head    sa_wait;
 	int		    sa_credits;
 	pthread_mutex_t     lock;
@@ -140,11 +145,29 @@ struct acmc_ep {
 	struct list_node      entry;
 };
 
+/*
+ * Client sockets are read without blocking.  A request that arrives in
+ * pieces is gathered in msg by the client's server thread, which never
+ * waits for the rest of it.  Responses are sent blocking, so they are
+ * never left half written on the stream.
+ */
 struct acmc_client {
 	pthread_mutex_t lock;   /* acquire ep lock first */
 	int      sock;
 	int      index;
 	atomic_t refcnt;
+	int      msg_len;	/* bytes of msg received */
+	struct acm_msg msg;
+};
+
+/*
+ * Client connections are spread over the server threads, each of which
+ * waits on its own epoll set and only ever reads from its own clients.
+ */
+struct acmc_worker {
+	pthread_t thread;
+	int       epfd;
+	int       index;
 };
 
 union socket_addr {
@@ -153,8 +176,18 @@ union socket_addr {
 	struct sockaddr_in6 sin6;
 };
 
+/*
+ * Path record queries that match one already sent or queued on the port
+ * are not sent, but are added to the dups list of the first one, and get
+ * a copy of its response.
+ */
 struct acmc_sa_req {
 	struct list_node	entry;
+	struct list_node	query_entry;
+	struct list_head	dups;
+	uint32_t		query_hash;
+	int			coalesce;
+	uint64_t		queued;		/* when added to sa_wait, in us */
 	struct acmc_ep		*ep;
 	void			(*resp_handler)(struct acm_sa_mad *);
 	struct acm_sa_mad	mad;
@@ -183,7 +216,18 @@ static LIST_HEAD(dev_list);
 
 static int listen_socket;
 static int ip_mon_socket;
-static struct acmc_client client_array[FD_SETSIZE - 1];
+static struct acmc_client *client_array;
+static int *client_free;
+static int client_free_cnt;
+static pthread_mutex_t client_free_lock;
+static struct acmc_worker *worker_array;
+static int next_worker;
+/*
+ * Held shared by the server threads while they process a request, and
+ * exclusively by the main thread while it changes devices, endpoints or
+ * addresses.
+ */
+static pthread_rwlock_t ep_rwlock;
 
 static FILE *flog;
 static pthread_mutex_t log_lock;
@@ -218,6 +262,8 @@ static char log_file[128] = IBACM_LOG_FILE;
 static int log_level = 0;
 static char lock_file[128] = IBACM_PID_FILE;
 static short server_port = 6125;
+static int server_threads = 4;
+static int max_clients = 4096;
 static int support_ips_in_addr_cfg = 0;
 static char prov_lib_path[256] = IBACM_LIB_PATH;
 
@@ -293,6 +339,12 @@ void acm_increment_counter(int type)
 		atomic_inc(&counter[type]);
 }
 
+void acm_decrement_counter(int type)
+{
+	if (type >= 0 && type < ACM_MAX_COUNTER)
+		atomic_dec(&counter[type]);
+}
+
 static struct acmc_prov_context *
 acm_alloc_prov_context(struct acm_provider *prov)
 {
@@ -470,6 +522,27 @@ __be64 acm_path_comp_mask(struct ibv_path_record *path)
 	return comp_mask;
 }
 
+/*
+ * A response that could not be sent whole must not be followed by others
+ * on the same stream.  Shutting the socket down makes the client's server
+ * thread see the end of the stream and disconnect it.
+ * Caller must hold the client lock.
+ */
+static void acm_shutdown_client(struct acmc_client *client)
+{
+	shutdown(client->sock, SHUT_RDWR);
+}
+
+static void acm_put_client(struct acmc_client *client)
+{
+	if (atomic_dec(&client->refcnt) || client->index == NL_CLIENT_INDEX)
+		return;
+
+	pthread_mutex_lock(&client_free_lock);
+	client_free[client_free_cnt++] = client->index;
+	pthread_mutex_unlock(&client_free_lock);
+}
+
 int acm_resolve_response(uint64_t id, struct acm_msg *msg)
 {
 	struct acmc_client *client = &client_array[id];
@@ -489,10 +562,14 @@ int acm_resolve_response(uint64_t id, struct acm_msg *msg)
 		goto release;
 	}
 
-	if (id == NL_CLIENT_INDEX)
+	if (id == NL_CLIENT_INDEX) {
 		ret = acm_nl_send(client->sock, msg);
-	else
-		ret = send(client->sock, (char *) msg, msg->hdr.length, 0);
+	} else {
+		ret = send(client->sock, (char *) msg, msg->hdr.length,
+			   MSG_NOSIGNAL);
+		if (ret != msg->hdr.length)
+			acm_shutdown_client(client);
+	}
 
 	if (ret != msg->hdr.length)
 		acm_log(0, "ERROR - failed to send response\n");
@@ -501,7 +578,7 @@ int acm_resolve_response(uint64_t id, struct acm_msg *msg)
 
 release:
 	pthread_mutex_unlock(&client->lock);
-	(void) atomic_dec(&client->refcnt);
+	acm_put_client(client);
 	return ret;
 }
 
@@ -530,15 +607,17 @@ int acm_query_response(uint64_t id, struct acm_msg *msg)
 		goto release;
 	}
 
-	ret = send(client->sock, (char *) msg, msg->hdr.length, 0);
-	if (ret != msg->hdr.length)
+	ret = send(client->sock, (char *) msg, msg->hdr.length, MSG_NOSIGNAL);
+	if (ret != msg->hdr.length) {
 		acm_log(0, "ERROR - failed to send response\n");
-	else
+		acm_shutdown_client(client);
+	} else {
 		ret = 0;
+	}
 
 release:
 	pthread_mutex_unlock(&client->lock);
-	(void) atomic_dec(&client->refcnt);
+	acm_put_client(client);
 	return ret;
 }
 
@@ -550,24 +629,65 @@ static int acmc_query_response(uint64_t id, struct acm_msg *msg, uint8_t status)
 	return acm_query_response(id, msg);
 }
 
-static void acm_init_server(void)
+/* Each client holds a socket, make sure the fd limit is not hit first */
+static void acm_raise_fd_limit(void)
 {
+	struct rlimit rlim;
+	rlim_t want = max_clients + 64;
+
+	if (getrlimit(RLIMIT_NOFILE, &rlim) || rlim.rlim_cur >= want)
+		return;
+
+	rlim.rlim_cur = min_t(rlim_t, want, rlim.rlim_max);
+	if (setrlimit(RLIMIT_NOFILE, &rlim))
+		acm_log(0, "notice - unable to raise open file limit\n");
+	if (rlim.rlim_cur < want)
+		acm_log(0, "notice - open file limit %llu is below max_clients\n",
+			(unsigned long long) rlim.rlim_cur);
+}
+
+static int acm_init_server(void)
+{
+	pthread_rwlockattr_t attr;
 	FILE *f;
 	int i;
 
-	for (i = 0; i < FD_SETSIZE - 1; i++) {
+	client_array = calloc(max_clients, sizeof(*client_array));
+	client_free = calloc(max_clients, sizeof(*client_free));
+	worker_array = calloc(server_threads, sizeof(*worker_array));
+	if (!client_array || !client_free || !worker_array) {
+		acm_log(0, "ERROR - unable to allocate client table\n");
+		return ENOMEM;
+	}
+
+	pthread_mutex_init(&client_free_lock, NULL);
+	for (i = 0; i < max_clients; i++) {
 		pthread_mutex_init(&client_array[i].lock, NULL);
 		client_array[i].index = i;
 		client_array[i].sock = -1;
 		atomic_init(&client_array[i].refcnt);
 	}
 
+	/* Hand out the lowest free index first */
+	for (i = max_clients - 1; i > NL_CLIENT_INDEX; i--)
+		client_free[client_free_cnt++] = i;
+
+	/* Keep a stream of requests from starving address updates */
+	pthread_rwlockattr_init(&attr);
+	pthread_rwlockattr_setkind_np(&attr,
+				      PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+	pthread_rwlock_init(&ep_rwlock, &attr);
+	pthread_rwlockattr_destroy(&attr);
+
+	acm_raise_fd_limit();
+
 	if (!(f = fopen(IBACM_PORT_FILE, "w"))) {
 		acm_log(0, "notice - cannot publish ibacm port number\n");
-		return;
+		return 0;
 	}
 	fprintf(f, "%hu\n", server_port);
 	fclose(f);
+	return 0;
 }
 
 static int acm_listen(void)
@@ -657,6 +777,7 @@ static int acm_listen_systemd(void)
 	return 0;
 }
 
+/* Closing the socket also removes it from its server thread's epoll set */
 static void acm_disconnect_client(struct acmc_client *client)
 {
 	pthread_mutex_lock(&client->lock);
@@ -664,13 +785,15 @@ static void acm_disconnect_client(struct acmc_client *client)
 	close(client->sock);
 	client->sock = -1;
 	pthread_mutex_unlock(&client->lock);
-	(void) atomic_dec(&client->refcnt);
+	acm_put_client(client);
 }
 
 static void acm_svr_accept(void)
 {
+	struct acmc_worker *worker;
+	struct epoll_event event;
 	int s;
-	int i;
+	int i = -1;
 
 	acm_log(2, "\n");
 	s = accept(listen_socket, NULL, NULL);
@@ -679,22 +802,33 @@ static void acm_svr_accept(void)
 		return;
 	}
 
-	for (i = 0; i < FD_SETSIZE - 1; i++) {
-		if (i == NL_CLIENT_INDEX)
-			continue;
-		if (!atomic_get(&client_array[i].refcnt))
-			break;
-	}
+	pthread_mutex_lock(&client_free_lock);
+	if (client_free_cnt)
+		i = client_free[--client_free_cnt];
+	pthread_mutex_unlock(&client_free_lock);
 
-	if (i == FD_SETSIZE - 1) {
+	if (i == -1) {
 		acm_log(0, "ERROR - all connections busy - rejecting\n");
 		close(s);
 		return;
 	}
 
 	client_array[i].sock = s;
+	client_array[i].msg_len = 0;
 	atomic_set(&client_array[i].refcnt, 1);
-	acm_log(2, "assigned client %d\n", i);
+
+	worker = &worker_array[next_worker];
+	next_worker = (next_worker + 1) % server_threads;
+
+	memset(&event, 0, sizeof event);
+	event.events = EPOLLIN;
+	event.data.u32 = i;
+	if (epoll_ctl(worker->epfd, EPOLL_CTL_ADD, s, &event)) {
+		acm_log(0, "ERROR - unable to add client %d: %d\n", i, errno);
+		acm_disconnect_client(&client_array[i]);
+		return;
+	}
+	acm_log(2, "assigned client %d to thread %d\n", i, worker->index);
 }
 
 static int
@@ -1040,9 +1174,28 @@ static int acm_svr_resolve(struct acmc_client *client, struct acm_msg *msg)
 	}
 }
 
+/* Responses from the providers may be sent on the same socket at any time */
+static int acm_client_send(struct acmc_client *client, struct acm_msg *msg,
+			   uint16_t len)
+{
+	int ret;
+
+	pthread_mutex_lock(&client->lock);
+	ret = send(client->sock, (char *) msg, len, MSG_NOSIGNAL);
+	if (ret != len)
+		acm_shutdown_client(client);
+	pthread_mutex_unlock(&client->lock);
+
+	if (ret != len) {
+		acm_log(0, "ERROR - failed to send response\n");
+		return ret ? ret : -1;
+	}
+	return 0;
+}
+
 static int acm_svr_perf_query(struct acmc_client *client, struct acm_msg *msg)
 {
-	int ret, i;
+	int i;
 	uint16_t len;
 	struct acmc_addr *addr;
 	struct acmc_ep *ep = NULL;
@@ -1084,18 +1237,12 @@ static int acm_svr_perf_query(struct acmc_client *client, struct acm_msg *msg)
 	}
 	msg->hdr.length = htobe16(len);
 
-	ret = send(client->sock, (char *) msg, len, 0);
-	if (ret != len)
-		acm_log(0, "ERROR - failed to send response\n");
-	else
-		ret = 0;
-
-	return ret;
+	return acm_client_send(client, msg, len);
 }
 
 static int acm_svr_ep_query(struct acmc_client *client, struct acm_msg *msg)
 {
-	int ret, i;
+	int i;
 	uint16_t len;
 	struct acmc_ep *ep;
 	int index, cnt = 0;
@@ -1130,13 +1277,7 @@ static int acm_svr_ep_query(struct acmc_client *client, struct acm_msg *msg)
 	msg->hdr.data[2] = 0;
 	msg->hdr.length = htobe16(len);
 
-	ret = send(client->sock, (char *) msg, len, 0);
-	if (ret != len)
-		acm_log(0, "ERROR - failed to send response\n");
-	else
-		ret = 0;
-
-	return ret;
+	return acm_client_send(client, msg, len);
 }
 
 static int acm_msg_length(struct acm_msg *msg)
@@ -1145,43 +1286,83 @@ static int acm_msg_length(struct acm_msg *msg)
 		msg->hdr.length : be16toh(msg->hdr.length);
 }
 
+/*
+ * Clients may pipeline requests, so read at most up to the end of the
+ * current message and leave the rest for the next wakeup.  Returns 1 once
+ * a whole message is in client->msg, 0 if more of it is needed, and -1 if
+ * the client disconnected or sent an invalid header.
+ */
+static int acm_client_recv(struct acmc_client *client)
+{
+	int ret, len;
+
+	if (client->msg_len < ACM_MSG_HDR_LENGTH)
+		len = ACM_MSG_HDR_LENGTH;
+	else
+		len = acm_msg_length(&client->msg);
+
+	ret = recv(client->sock, (char *) &client->msg + client->msg_len,
+		   len - client->msg_len, MSG_DONTWAIT);
+	if (ret == -1 && (errno == EAGAIN || errno == EWOULDBLOCK ||
+			  errno == EINTR))
+		return 0;
+	if (ret <= 0)
+		return -1;
+
+	client->msg_len += ret;
+	if (client->msg_len < ACM_MSG_HDR_LENGTH)
+		return 0;
+
+	len = acm_msg_length(&client->msg);
+	if (len < ACM_MSG_HDR_LENGTH || len > sizeof(client->msg))
+		return -1;
+	return client->msg_len == len;
+}
+
 static void acm_svr_receive(struct acmc_client *client)
 {
-	struct acm_msg msg;
+	struct acm_msg *msg = &client->msg;
 	int ret;
 
 	acm_log(2, "client %d\n", client->index);
-	ret = recv(client->sock, (char *) &msg, sizeof msg, 0);
-	if (ret <= 0 || ret != acm_msg_length(&msg)) {
-		acm_log(2, "client disconnected\n");
-		ret = ACM_STATUS_ENOTCONN;
-		goto out;
-	}
+	ret = acm_client_recv(client);
+	if (ret < 0)
+		goto disconnect;
+	if (!ret)
+		return;
 
-	if (msg.hdr.version != ACM_VERSION) {
-		acm_log(0, "ERROR - unsupported version %d\n", msg.hdr.version);
-		goto out;
+	client->msg_len = 0;
+	if (msg->hdr.version != ACM_VERSION) {
+		acm_log(0, "ERROR - unsupported version %d\n", msg->hdr.version);
+		goto disconnect;
 	}
 
-	switch (msg.hdr.opcode & ACM_OP_MASK) {
+	pthread_rwlock_rdlock(&ep_rwlock);
+	switch (msg->hdr.opcode & ACM_OP_MASK) {
 	case ACM_OP_RESOLVE:
 		atomic_inc(&counter[ACM_CNTR_RESOLVE]);
-		ret = acm_svr_resolve(client, &msg);
+		ret = acm_svr_resolve(client, msg);
 		break;
 	case ACM_OP_PERF_QUERY:
-		ret = acm_svr_perf_query(client, &msg);
+		ret = acm_svr_perf_query(client, msg);
 		break;
 	case ACM_OP_EP_QUERY:
-		ret = acm_svr_ep_query(client, &msg);
+		ret = acm_svr_ep_query(client, msg);
 		break;
 	default:
-		acm_log(0, "ERROR - unknown opcode 0x%x\n", msg.hdr.opcode);
+		acm_log(0, "ERROR - unknown opcode 0x%x\n", msg->hdr.opcode);
+		ret = 0;
 		break;
 	}
+	pthread_rwlock_unlock(&ep_rwlock);
 
-out:
 	if (ret)
 		acm_disconnect_client(client);
+	return;
+
+disconnect:
+	acm_log(2, "client disconnected\n");
+	acm_disconnect_client(client);
 }
 
 static int acm_nl_to_addr_data(struct acm_ep_addr_data *ad,
@@ -1727,14 +1908,80 @@ static int acm_init_nl(void)
 	return 0;
 }
 
+static void *acm_worker(void *context)
+{
+	struct acmc_worker *worker = context;
+	struct epoll_event events[ACM_MAX_EVENTS];
+	int i, n;
+
+	acm_log(1, "server thread %d started\n", worker->index);
+	for (;;) {
+		n = epoll_wait(worker->epfd, events, ACM_MAX_EVENTS, -1);
+		if (n == -1) {
+			if (errno != EINTR)
+				acm_log(0, "ERROR - server thread %d epoll error %d\n",
+					worker->index, errno);
+			continue;
+		}
+
+		for (i = 0; i < n; i++) {
+			acm_log(2, "receiving from client %d\n",
+				events[i].data.u32);
+			acm_svr_receive(&client_array[events[i].data.u32]);
+		}
+	}
+	return NULL;
+}
+
+static int acm_start_workers(void)
+{
+	int i;
+
+	for (i = 0; i < server_threads; i++) {
+		worker_array[i].index = i;
+		worker_array[i].epfd = epoll_create1(EPOLL_CLOEXEC);
+		if (worker_array[i].epfd == -1) {
+			acm_log(0, "ERROR - unable to create epoll set\n");
+			return errno;
+		}
+
+		if (pthread_create(&worker_array[i].thread, NULL, acm_worker,
+				   &worker_array[i])) {
+			acm_log(0, "ERROR - unable to start server thread\n");
+			return ENOMEM;
+		}
+	}
+
+	return 0;
+}
+
+static int acm_server_add_fd(int epfd, int fd)
+{
+	struct epoll_event event;
+
+	memset(&event, 0, sizeof event);
+	event.events = EPOLLIN;
+	event.data.fd = fd;
+	if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &event)) {
+		acm_log(0, "ERROR - unable to watch fd %d: %d\n", fd, errno);
+		return errno;
+	}
+	return 0;
+}
+
+/*
+ * The main thread accepts connections, which the server threads then
+ * serve, and handles netlink and device events itself.
+ */
 static void acm_server(bool systemd)
 {
-	fd_set readfds;
-	int i, n, ret;
+	struct epoll_event events[ACM_MAX_EVENTS];
+	int i, n, fd, epfd, ret;
 	struct acmc_device *dev;
 
 	acm_log(0, "started\n");
-	acm_init_server();
+	if (acm_init_server())
+		return;
 
 	client_array[NL_CLIENT_INDEX].sock = -1;
 	listen_socket = -1;
@@ -1760,56 +2007,59 @@ static void acm_server(bool systemd)
 			acm_log(1, "Warn - Netlink init failed\n");
 	}
 
+	epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (epfd == -1) {
+		acm_log(0, "ERROR - unable to create epoll set\n");
+		return;
+	}
+
+	if (acm_server_add_fd(epfd, listen_socket))
+		return;
+	if (ip_mon_socket != -1 && acm_server_add_fd(epfd, ip_mon_socket))
+		return;
+	if (client_array[NL_CLIENT_INDEX].sock != -1 &&
+	    acm_server_add_fd(epfd, client_array[NL_CLIENT_INDEX].sock))
+		return;
+	list_for_each(&dev_list, dev, entry) {
+		if (acm_server_add_fd(epfd, dev->device.verbs->async_fd))
+			return;
+	}
+
+	if (acm_start_workers())
+		return;
+
 	if (systemd)
 		sd_notify(0, "READY=1");
 
 	while (1) {
-		n = (int) listen_socket;
-		FD_ZERO(&readfds);
-		FD_SET(listen_socket, &readfds);
-		n = max(n, (int) ip_mon_socket);
-		FD_SET(ip_mon_socket, &readfds);
-
-		for (i = 0; i < FD_SETSIZE - 1; i++) {
-			if (client_array[i].sock != -1) {
-				FD_SET(client_array[i].sock, &readfds);
-				n = max(n, (int) client_array[i].sock);
-			}
-		}
-
-		list_for_each(&dev_list, dev, entry) {
-			FD_SET(dev->device.verbs->async_fd, &readfds);
-			n = max(n, (int) dev->device.verbs->async_fd);
-		}
-
-		ret = select(n + 1, &readfds, NULL, NULL, NULL);
-		if (ret == -1) {
-			acm_log(0, "ERROR - server select error\n");
+		n = epoll_wait(epfd, events, ACM_MAX_EVENTS, -1);
+		if (n == -1) {
+			if (errno != EINTR)
+				acm_log(0, "ERROR - server epoll error\n");
 			continue;
 		}
 
-		if (FD_ISSET(listen_socket, &readfds))
-			acm_svr_accept();
-
-		if (FD_ISSET(ip_mon_socket, &readfds))
-			acm_ipnl_handler();
-
-		for (i = 0; i < FD_SETSIZE - 1; i++) {
-			if (client_array[i].sock != -1 &&
-				FD_ISSET(client_array[i].sock, &readfds)) {
-				acm_log(2, "receiving from client %d\n", i);
-				if (i == NL_CLIENT_INDEX)
-					acm_nl_receive(&client_array[i]);
-				else
-					acm_svr_receive(&client_array[i]);
-			}
-		}
-
-		list_for_each(&dev_list, dev, entry) {
-			if (FD_ISSET(dev->device.verbs->async_fd, &readfds)) {
-				acm_log(2, "handling event from %s\n",
-					dev->device.verbs->device->name);
-				acm_event_handler(dev);
+		for (i = 0; i < n; i++) {
+			fd = events[i].data.fd;
+			if (fd == listen_socket) {
+				acm_svr_accept();
+			} else if (fd == ip_mon_socket) {
+				pthread_rwlock_wrlock(&ep_rwlock);
+				acm_ipnl_handler();
+				pthread_rwlock_unlock(&ep_rwlock);
+			} else if (fd == client_array[NL_CLIENT_INDEX].sock) {
+				acm_log(2, "receiving from netlink\n");
+				acm_nl_receive(&client_array[NL_CLIENT_INDEX]);
+			} else {
+				list_for_each(&dev_list, dev, entry) {
+					if (dev->device.verbs->async_fd != fd)
+						continue;
+					acm_log(2, "handling event from %s\n",
+						dev->device.verbs->device->name);
+					pthread_rwlock_wrlock(&ep_rwlock);
+					acm_event_handler(dev);
+					pthread_rwlock_unlock(&ep_rwlock);
+				}
 			}
 		}
 	}
@@ -2439,13 +2689,18 @@ static void acm_activate_devices(void)
 static void
 acm_open_port(struct acmc_port *port, struct acmc_device *dev, uint8_t port_num)
 {
+	int i;
+
 	acm_log(1, "%s %d\n", dev->device.verbs->device->name, port_num);
 	port->dev = dev;
 	port->port.dev = &dev->device;
 	port->port.port_num = port_num;
 	pthread_mutex_init(&port->lock, NULL);
 	list_head_init(&port->ep_list);
-	list_head_init(&port->sa_pending);
+	for (i = 0; i < ACMC_SA_HASH_SIZE; i++) {
+		list_head_init(&port->sa_pending[i]);
+		list_head_init(&port->sa_query[i]);
+	}
 	list_head_init(&port->sa_wait);
 	port->sa_credits = sa.depth;
 	port->sa_addr.qpn = htobe32(1);
@@ -2768,10 +3023,79 @@ void acm_free_sa_mad(struct acm_sa_mad *mad)
 	free(req);
 }
 
+static struct list_head *
+acmc_sa_pending(struct acmc_port *port, __be64 tid)
+{
+	return &port->sa_pending[be64toh(tid) & (ACMC_SA_HASH_SIZE - 1)];
+}
+
+static int acmc_sa_path_query(const struct umad_sa_packet *mad)
+{
+	return mad->mad_hdr.mgmt_class == UMAD_CLASS_SUBN_ADM &&
+	       mad->mad_hdr.method == UMAD_METHOD_GET &&
+	       mad->mad_hdr.attr_id == htobe16(UMAD_SA_ATTR_PATH_REC);
+}
+
+static uint32_t acmc_sa_query_hash(const struct umad_sa_packet *mad)
+{
+	const struct ibv_path_record *path = (const void *) mad->data;
+	uint64_t hash = mad->comp_mask;
+
+	hash = (hash ^ path->sgid.global.interface_id) * 0x9e3779b97f4a7c15ULL;
+	hash = (hash ^ path->dgid.global.subnet_prefix) * 0x9e3779b97f4a7c15ULL;
+	hash = (hash ^ path->dgid.global.interface_id) * 0x9e3779b97f4a7c15ULL;
+	hash = (hash ^ path->pkey ^ ((uint64_t) path->tclass << 16)) *
+	       0x9e3779b97f4a7c15ULL;
+	return hash >> 32;
+}
+
+/* Caller must hold the port lock */
+static struct acmc_sa_req *
+acmc_find_sa_query(struct acmc_port *port, struct acmc_sa_req *req)
+{
+	struct list_head *head;
+	struct acmc_sa_req *query;
+
+	head = &port->sa_query[req->query_hash & (ACMC_SA_HASH_SIZE - 1)];
+	list_for_each(head, query, query_entry) {
+		if (query->query_hash == req->query_hash &&
+		    query->mad.sa_mad.comp_mask == req->mad.sa_mad.comp_mask &&
+		    !memcmp(query->mad.sa_mad.data, req->mad.sa_mad.data,
+			    sizeof(struct ibv_path_record)))
+			return query;
+	}
+	return NULL;
+}
+
+/*
+ * Caller must hold the port lock. Once a request is no longer in flight,
+ * later queries for the same path start a new one.
+ */
+static void acmc_finish_sa_query(struct acmc_sa_req *req, struct list_head *dups)
+{
+	list_head_init(dups);
+	if (req->coalesce) {
+		list_del(&req->query_entry);
+		list_append_list(dups, &req->dups);
+	}
+}
+
+static void acmc_complete_sa_req(struct acmc_sa_req *req, struct list_head *dups)
+{
+	struct acmc_sa_req *dup;
+
+	while ((dup = list_pop(dups, struct acmc_sa_req, entry))) {
+		memcpy(&dup->mad.umad, &req->mad.umad,
+		       sizeof(req->mad.umad) + sizeof(req->mad.sa_mad));
+		dup->resp_handler(&dup->mad);
+	}
+	req->resp_handler(&req->mad);
+}
+
 int acm_send_sa_mad(struct acm_sa_mad *mad)
 {
 	struct acmc_port *port;
-	struct acmc_sa_req *req;
+	struct acmc_sa_req *req, *query;
 	int ret;
 
 	req = container_of(mad, struct acmc_sa_req, mad);
@@ -2784,16 +3108,39 @@ int acm_send_sa_mad(struct acm_sa_mad *mad)
 	mad->umad.addr.sl = port->sa_addr.sl;
 	mad->umad.addr.pkey_index = req->ep->port->sa_pkey_index;
 
+	list_head_init(&req->dups);
+	req->coalesce = acmc_sa_path_query(&mad->sa_mad);
+	if (req->coalesce)
+		req->query_hash = acmc_sa_query_hash(&mad->sa_mad);
+
 	pthread_mutex_lock(&port->lock);
+	if (req->coalesce) {
+		query = acmc_find_sa_query(port, req);
+		if (query) {
+			acm_log(2, "%p coalesced with %p\n", req, query);
+			req->coalesce = 0;
+			list_add_tail(&query->dups, &req->entry);
+			pthread_mutex_unlock(&port->lock);
+			return 0;
+		}
+		list_add_tail(&port->sa_query[req->query_hash &
+					      (ACMC_SA_HASH_SIZE - 1)],
+			      &req->query_entry);
+	}
+
 	if (port->sa_credits && list_empty(&port->sa_wait)) {
 		ret = umad_send(port->mad_portid, port->mad_agentid, &mad->umad,
 				sizeof mad->sa_mad, sa.timeout, sa.retries);
 		if (!ret) {
 			port->sa_credits--;
-			list_add_tail(&port->sa_pending, &req->entry);
+			list_add_tail(acmc_sa_pending(port, mad->sa_mad.mad_hdr.tid),
+				      &req->entry);
+		} else if (req->coalesce) {
+			list_del(&req->query_entry);
 		}
 	} else {
 		ret = 0;
+		req->queued = time_stamp_us();
 		list_add_tail(&port->sa_wait, &req->entry);
 	}
 	pthread_mutex_unlock(&port->lock);
@@ -2803,6 +3150,8 @@ int acm_send_sa_mad(struct acm_sa_mad *mad)
 static void acmc_send_queued_req(struct acmc_port *port)
 {
 	struct acmc_sa_req *req;
+	struct list_head dups;
+	uint64_t now;
 	int ret;
 
 	pthread_mutex_lock(&port->lock);
@@ -2812,18 +3161,25 @@ static void acmc_send_queued_req(struct acmc_port *port)
 	}
 
 	req = list_pop(&port->sa_wait, struct acmc_sa_req, entry);
+	now = time_stamp_us();
+	if (now > req->queued)
+		atomic_add(&counter[ACM_CNTR_SA_WAIT_MS],
+			   (now - req->queued) / 1000);
 
 	ret = umad_send(port->mad_portid, port->mad_agentid, &req->mad.umad,
 			sizeof req->mad.sa_mad, sa.timeout, sa.retries);
 	if (!ret) {
 		port->sa_credits--;
-		list_add_tail(&port->sa_pending, &req->entry);
+		list_add_tail(acmc_sa_pending(port, req->mad.sa_mad.mad_hdr.tid),
+			      &req->entry);
+	} else {
+		acmc_finish_sa_query(req, &dups);
 	}
 	pthread_mutex_unlock(&port->lock);
 
 	if (ret) {
 		req->mad.umad.status = -ret;
-		req->resp_handler(&req->mad);
+		acmc_complete_sa_req(req, &dups);
 	}
 }
 
@@ -2831,6 +3187,7 @@ static void acmc_recv_mad(struct acmc_port *port)
 {
 	struct acmc_sa_req *req;
 	struct acm_sa_mad resp;
+	struct list_head *head, dups;
 	int ret, len, found;
 	struct umad_hdr *hdr;
 
@@ -2847,12 +3204,14 @@ static void acmc_recv_mad(struct acmc_port *port)
 		hdr->base_version, hdr->mgmt_class, hdr->class_version,
 		hdr->method, hdr->status, be64toh(hdr->tid), hdr->attr_id, hdr->attr_mod);
 	found = 0;
+	head = acmc_sa_pending(port, hdr->tid);
 	pthread_mutex_lock(&port->lock);
-	list_for_each(&port->sa_pending, req, entry) {
+	list_for_each(head, req, entry) {
 		/* The upper 32-bit of the tid is used for agentid in umad */
 		if (req->mad.sa_mad.mad_hdr.tid == (hdr->tid & htobe64(0xFFFFFFFF))) {
 			found = 1;
 			list_del(&req->entry);
+			acmc_finish_sa_query(req, &dups);
 			port->sa_credits++;
 			break;
 		}
@@ -2861,7 +3220,7 @@ static void acmc_recv_mad(struct acmc_port *port)
 
 	if (found) {
 		memcpy(&req->mad.umad, &resp.umad, sizeof(resp.umad) + len);
-		req->resp_handler(&req->mad);
+		acmc_complete_sa_req(req, &dups);
 	}
 }
 
@@ -2945,6 +3304,10 @@ static void acm_set_options(void)
 			strcpy(lock_file, value);
 		else if (!strcasecmp("server_port", opt))
 			server_port = (short) atoi(value);
+		else if (!strcasecmp("server_threads", opt))
+			server_threads = max(atoi(value), 1);
+		else if (!strcasecmp("max_clients", opt))
+			max_clients = max(atoi(value), 2);
 		else if (!strcasecmp("provider_lib_path", opt))
 			strcpy(prov_lib_path, value);
 		else if (!strcasecmp("support_ips_in_addr_cfg", opt))
@@ -2966,6 +3329,8 @@ static void acm_log_options(void)
 	acm_log(0, "log level %d\n", log_level);
 	acm_log(0, "lock file %s\n", lock_file);
 	acm_log(0, "server_port %d\n", server_port);
+	acm_log(0, "server threads %d\n", server_threads);
+	acm_log(0, "max clients %d\n", max_clients);
 	acm_log(0, "timeout %d ms\n", sa.timeout);
 	acm_log(0, "retries %d\n", sa.retries);
 	acm_log(0, "sa depth %d\n", sa.depth);
@@ -43,10 +43,17 @@
 #include <infiniband/acm.h>
 #include "libacm.h"
 #include "acm_util.h"
+#include "acm_mad.h"
+#include "acm_cache.h"
+
+#define IB_LID_MCAST_START 0xc000
 
 static const char *dest_dir = ACM_CONF_DIR;
 static const char *addr_file = ACM_ADDR_FILE;
 static const char *opts_file = ACM_OPTS_FILE;
+static const char *route_file = "ibacm_route.data";
+static const char *hosts_file = "ibacm_hosts.data";
+static const char *cache_file = "ibacm_cache.data";
 
 static char *dest_addr;
 static char *src_addr;
@@ -104,6 +111,9 @@ static void show_usage(char *program)
 	printf("                      (default is %s)\n", ACM_ADDR_FILE);
 	printf("   -O [opt_file]    - generate local ibacm_opts.cfg options file\n");
 	printf("                      (default is %s)\n", ACM_OPTS_FILE);
+	printf("   -B [cache_file]  - generate a binary ibacm preload cache from the\n");
+	printf("                      %s and %s files\n", route_file, hosts_file);
+	printf("                      (default is %s/%s)\n", ACM_CONF_DIR, cache_file);
 	printf("   -D dest_dir      - specify destination directory for output files\n");
 	printf("                      (default is %s)\n", ACM_CONF_DIR);
 	printf("   -V               - enable verbose output\n");
@@ -192,6 +202,19 @@ static void gen_opts_temp(FILE *f)
 	fprintf(f, "\n");
 	fprintf(f, "server_port 6125\n");
 	fprintf(f, "\n");
+	fprintf(f, "# server_threads:\n");
+	fprintf(f, "# Number of threads that receive and process client requests.  Client\n");
+	fprintf(f, "# connections are spread evenly over the threads.\n");
+	fprintf(f, "\n");
+	fprintf(f, "server_threads 4\n");
+	fprintf(f, "\n");
+	fprintf(f, "# max_clients:\n");
+	fprintf(f, "# Maximum number of client connections that the ACM service accepts at\n");
+	fprintf(f, "# the same time.  Additional connections are rejected.  The open file\n");
+	fprintf(f, "# limit of the service is raised to fit if possible.\n");
+	fprintf(f, "\n");
+	fprintf(f, "max_clients 4096\n");
+	fprintf(f, "\n");
 	fprintf(f, "# timeout:\n");
 	fprintf(f, "# Additional time, in milliseconds, that the ACM service will wait for a\n");
 	fprintf(f, "# response from a remote ACM service or the IB SA.  The actual request\n");
@@ -215,6 +238,22 @@ static void gen_opts_temp(FILE *f)
 	fprintf(f, "\n");
 	fprintf(f, "resolve_depth 1\n");
 	fprintf(f, "\n");
+	fprintf(f, "# resolve_rate:\n");
+	fprintf(f, "# Limits the rate at which each endpoint multicasts address resolution\n");
+	fprintf(f, "# requests, in requests per second.  Requests over the rate are queued\n");
+	fprintf(f, "# and sent as the rate allows, which keeps a burst of connection set up\n");
+	fprintf(f, "# from flooding the subnet.  Queued requests for destinations that are\n");
+	fprintf(f, "# resolved in the meantime are dropped.  0 disables the limit, and\n");
+	fprintf(f, "# negative values are ignored.\n");
+	fprintf(f, "\n");
+	fprintf(f, "resolve_rate 0\n");
+	fprintf(f, "\n");
+	fprintf(f, "# resolve_burst:\n");
+	fprintf(f, "# Number of address resolution requests that may be sent back to back\n");
+	fprintf(f, "# before resolve_rate applies.  Must be at least 1.\n");
+	fprintf(f, "\n");
+	fprintf(f, "resolve_burst 16\n");
+	fprintf(f, "\n");
 	fprintf(f, "# sa_depth:\n");
 	fprintf(f, "# Specifies the maximum number of outstanding requests to the SA that\n");
 	fprintf(f, "# can be in progress simultaneously.  A larger SA depth allows for greater\n");
@@ -264,6 +303,7 @@ static void gen_opts_temp(FILE *f)
 	fprintf(f, "# Supported preload values are:\n");
 	fprintf(f, "# none - The routing cache is not pre-built (default)\n");
 	fprintf(f, "# opensm_full_v1 - OpenSM 'full' path records dump file format (version 1)\n");
+	fprintf(f, "# acm_cache - binary cache file generated by ib_acme -B\n");
 	fprintf(f, "\n");
 	fprintf(f, "route_preload none\n");
 	fprintf(f, "\n");
@@ -280,6 +320,7 @@ static void gen_opts_temp(FILE *f)
 	fprintf(f, "# Supported preload values are:\n");
 	fprintf(f, "# none - The address cache is not pre-built (default)\n");
 	fprintf(f, "# acm_hosts - ACM address to GID file format\n");
+	fprintf(f, "# acm_cache - binary cache file generated by ib_acme -B\n");
 	fprintf(f, "\n");
 	fprintf(f, "addr_preload none\n");
 	fprintf(f, "\n");
@@ -290,6 +331,27 @@ static void gen_opts_temp(FILE *f)
 	fprintf(f, "# Default is %s/ibacm_hosts.data\n", ACM_CONF_DIR);
 	fprintf(f, "# addr_data_file %s/ibacm_hosts.data\n", ACM_CONF_DIR);
 	fprintf(f, "\n");
+	fprintf(f, "# cache_data_file:\n");
+	fprintf(f, "# Specifies the location of the binary cache file to use when preloading\n");
+	fprintf(f, "# the ACM cache.  This option is only valid if route_preload or\n");
+	fprintf(f, "# addr_preload is set to acm_cache.  The file is mapped read only and\n");
+	fprintf(f, "# may be shared by several ibacm instances.\n");
+	fprintf(f, "# Default is %s/ibacm_cache.data\n", ACM_CONF_DIR);
+	fprintf(f, "# cache_data_file %s/ibacm_cache.data\n", ACM_CONF_DIR);
+	fprintf(f, "\n");
+	fprintf(f, "# snapshot_interval:\n");
+	fprintf(f, "# Number of seconds between saves of the resolved address and route\n");
+	fprintf(f, "# cache to snapshot_file.  The saved entries are reloaded when ibacm\n");
+	fprintf(f, "# restarts, until their original timeouts expire.  0 disables saving\n");
+	fprintf(f, "# and reloading the cache.\n");
+	fprintf(f, "# Default is 0\n");
+	fprintf(f, "# snapshot_interval 0\n");
+	fprintf(f, "\n");
+	fprintf(f, "# snapshot_file:\n");
+	fprintf(f, "# Specifies the location of the cache snapshot file.\n");
+	fprintf(f, "# Default is %s\n", IBACM_SNAPSHOT_FILE);
+	fprintf(f, "# snapshot_file %s\n", IBACM_SNAPSHOT_FILE);
+	fprintf(f, "\n");
 	fprintf(f, "# support_ips_in_addr_cfg:\n");
 	fprintf(f, "# If 1 continue to read IP addresses from ibacm_addr.cfg\n");
 	fprintf(f, "# Default is 0 \"no\"\n");
@@ -485,6 +547,253 @@ out1:
 	return ret;
 }
 
+struct cache_data {
+	struct acm_cache_hdr hdr;
+	struct acm_cache_node *nodes;
+	struct acm_cache_path *paths;
+	struct acm_cache_host *hosts;
+	int node_size, path_size, host_size;
+};
+
+/* On failure the array is freed, so callers may overwrite their pointer */
+static void *grow_array(void *array, int cnt, int *size, size_t elem)
+{
+	void *new;
+
+	if (cnt < *size)
+		return array;
+
+	new = realloc(array, (*size ? *size * 2 : 1024) * elem);
+	if (!new) {
+		free(array);
+		*size = 0;
+		return NULL;
+	}
+	*size = *size ? *size * 2 : 1024;
+	return new;
+}
+
+/* Returns 1 for a "Switch", "Channel Adapter" or "Router" port line */
+static int parse_osm_node(char *s, uint64_t *guid, uint16_t *lid)
+{
+	char *p, *ptr;
+
+	if (!(p = strtok_r(s, " \n", &ptr)))
+		return 0;
+
+	if (strncmp(p, "Switch", sizeof("Switch") - 1) &&
+	    strncmp(p, "Channel", sizeof("Channel") - 1) &&
+	    strncmp(p, "Router", sizeof("Router") - 1))
+		return 0;
+
+	if (!strncmp(p, "Channel", sizeof("Channel") - 1) &&
+	    !strtok_r(NULL, " ", &ptr)) /* skip 'Adapter' */
+		return 0;
+
+	if (!(p = strtok_r(NULL, ",", &ptr)))
+		return 0;
+	*guid = strtoull(p, NULL, 16);
+
+	if (!(ptr = strstr(ptr, "base LID")))
+		return 0;
+	ptr += sizeof("base LID");
+	if (!(p = strtok_r(NULL, ",", &ptr)))
+		return 0;
+	*lid = (uint16_t) strtoul(p, NULL, 0);
+	return 1;
+}
+
+/*
+ * The paths of an OpenSM "full v1" dump name their destination by LID, so
+ * read the whole file and map LIDs to GUIDs at the end.
+ */
+static int gen_cache_paths(FILE *f, struct cache_data *cd)
+{
+	struct acm_cache_node *node = NULL;
+	struct acm_cache_path *path;
+	uint64_t guid, *lid2guid;
+	unsigned int dlid, sl, mtu, rate;
+	char s[128], line[128];
+	uint16_t lid;
+	uint32_t i, j, k, first;
+
+	lid2guid = calloc(IB_LID_MCAST_START, sizeof(*lid2guid));
+	if (!lid2guid) {
+		printf("Unable to allocate LID table\n");
+		return -1;
+	}
+
+	while (fgets(s, sizeof s, f)) {
+		if (s[0] == '#')
+			continue;
+
+		strcpy(line, s);
+		if (parse_osm_node(line, &guid, &lid)) {
+			if (lid < IB_LID_MCAST_START && !lid2guid[lid])
+				lid2guid[lid] = guid;
+
+			cd->nodes = grow_array(cd->nodes, cd->hdr.node_cnt,
+					       &cd->node_size, sizeof(*node));
+			if (!cd->nodes)
+				goto err;
+			node = &cd->nodes[cd->hdr.node_cnt++];
+			memset(node, 0, sizeof(*node));
+			node->guid = htobe64(guid);
+			node->lid = lid;
+			node->path_index = cd->hdr.path_cnt;
+			continue;
+		}
+
+		if (!node || sscanf(s, "%i : %u : %u : %u", &dlid, &sl, &mtu,
+				    &rate) != 4 || dlid >= IB_LID_MCAST_START)
+			continue;
+
+		cd->paths = grow_array(cd->paths, cd->hdr.path_cnt,
+				       &cd->path_size, sizeof(*path));
+		if (!cd->paths)
+			goto err;
+		path = &cd->paths[cd->hdr.path_cnt++];
+		memset(path, 0, sizeof(*path));
+		path->dlid = dlid;
+		path->sl = sl;
+		path->mtu = mtu;
+		path->rate = rate;
+		node->path_cnt++;
+	}
+
+	/* Drop paths to unknown LIDs, as the route data file parser does */
+	for (i = 0, j = 0; i < cd->hdr.node_cnt; i++) {
+		node = &cd->nodes[i];
+		first = j;
+		for (k = node->path_index;
+		     k < node->path_index + node->path_cnt; k++) {
+			path = &cd->paths[k];
+			if (!lid2guid[path->dlid]) {
+				printf("dlid %u not found in LID table\n",
+				       path->dlid);
+				continue;
+			}
+			path->dguid = htobe64(lid2guid[path->dlid]);
+			cd->paths[j++] = *path;
+		}
+		node->path_index = first;
+		node->path_cnt = j - first;
+	}
+	cd->hdr.path_cnt = j;
+	free(lid2guid);
+	return 0;
+
+err:
+	printf("Unable to allocate cache entries\n");
+	free(lid2guid);
+	return -1;
+}
+
+static int gen_cache_hosts(FILE *f, struct cache_data *cd)
+{
+	char s[120], addr[INET6_ADDRSTRLEN], gid[INET6_ADDRSTRLEN];
+	struct acm_cache_host *host;
+	struct in6_addr ib_addr;
+
+	while (fgets(s, sizeof s, f)) {
+		if (s[0] == '#' || sscanf(s, "%46s%46s", addr, gid) != 2)
+			continue;
+
+		if (inet_pton(AF_INET6, gid, &ib_addr) <= 0) {
+			printf("%s is not an IB GID\n", gid);
+			continue;
+		}
+
+		cd->hosts = grow_array(cd->hosts, cd->hdr.host_cnt,
+				       &cd->host_size, sizeof(*host));
+		if (!cd->hosts) {
+			printf("Unable to allocate cache entries\n");
+			return -1;
+		}
+		host = &cd->hosts[cd->hdr.host_cnt++];
+		memset(host, 0, sizeof(*host));
+		memcpy(host->gid, &ib_addr, sizeof(host->gid));
+		if (inet_pton(AF_INET, addr, host->addr) > 0) {
+			host->addr_type = ACM_ADDRESS_IP;
+		} else if (inet_pton(AF_INET6, addr, host->addr) > 0) {
+			host->addr_type = ACM_ADDRESS_IP6;
+		} else {
+			host->addr_type = ACM_ADDRESS_NAME;
+			strncpy((char *) host->addr, addr, sizeof(host->addr));
+		}
+	}
+	return 0;
+}
+
+/* Replace the cache file atomically, as running daemons may have it mapped */
+static int write_cache(struct cache_data *cd)
+{
+	char tmp_file[256];
+	FILE *f;
+	int ret = 0;
+
+	snprintf(tmp_file, sizeof tmp_file, "%s.tmp", cache_file);
+	if (!(f = fopen(tmp_file, "w"))) {
+		printf("Failed to open cache file: %s\n", strerror(errno));
+		return -1;
+	}
+
+	if (fwrite(&cd->hdr, sizeof(cd->hdr), 1, f) != 1 ||
+	    fwrite(cd->nodes, sizeof(*cd->nodes), cd->hdr.node_cnt, f) !=
+	    cd->hdr.node_cnt ||
+	    fwrite(cd->paths, sizeof(*cd->paths), cd->hdr.path_cnt, f) !=
+	    cd->hdr.path_cnt ||
+	    fwrite(cd->hosts, sizeof(*cd->hosts), cd->hdr.host_cnt, f) !=
+	    cd->hdr.host_cnt)
+		ret = -1;
+
+	if (fclose(f) || ret || rename(tmp_file, cache_file)) {
+		printf("Failed to write cache file: %s\n", strerror(errno));
+		unlink(tmp_file);
+		return -1;
+	}
+	return 0;
+}
+
+static int gen_cache(void)
+{
+	struct cache_data cd = {};
+	FILE *route_f, *hosts_f;
+	int ret = -1;
+
+	VPRINT("Generating %s/%s\n", dest_dir, cache_file);
+	if (open_dir())
+		return -1;
+
+	route_f = fopen(route_file, "r");
+	hosts_f = fopen(hosts_file, "r");
+	if (!route_f && !hosts_f) {
+		printf("Failed to open %s or %s: %s\n", route_file, hosts_file,
+		       strerror(errno));
+		return -1;
+	}
+
+	cd.hdr.magic = ACM_CACHE_MAGIC;
+	cd.hdr.version = ACM_CACHE_VERSION;
+	if (route_f && gen_cache_paths(route_f, &cd))
+		goto out;
+	if (hosts_f && gen_cache_hosts(hosts_f, &cd))
+		goto out;
+
+	VPRINT("%u nodes, %u paths, %u hosts\n", cd.hdr.node_cnt,
+	       cd.hdr.path_cnt, cd.hdr.host_cnt);
+	ret = write_cache(&cd);
+out:
+	free(cd.nodes);
+	free(cd.paths);
+	free(cd.hosts);
+	if (route_f)
+		fclose(route_f);
+	if (hosts_f)
+		fclose(hosts_f);
+	return ret;
+}
+
 static void show_path(struct ibv_path_record *path)
 {
 	char gid[sizeof "ffff:ffff:ffff:ffff:ffff:ffff:ffff:ffff"];
@@ -537,6 +846,42 @@ static int inet_any_pton(char *addr, struct sockaddr *sa)
 	return ret;
 }
 
+/* Keep the repetitions in flight together */
+static int resolve_ip_batch(struct sockaddr *src, struct sockaddr *dest,
+			    struct ibv_path_record *path)
+{
+	struct ib_acm_resolve_req *reqs;
+	int i, ret;
+
+	reqs = calloc(repetitions, sizeof *reqs);
+	if (!reqs) {
+		printf("unable to allocate %d requests\n", repetitions);
+		return -1;
+	}
+
+	for (i = 0; i < repetitions; i++) {
+		reqs[i].src = src;
+		reqs[i].dest = dest;
+		reqs[i].flags = get_resolve_flags();
+	}
+
+	ret = ib_acm_resolve_ip_batch(reqs, repetitions);
+	if (ret < 0)
+		printf("ib_acm_resolve_ip_batch failed: %s\n", strerror(errno));
+	else if (ret)
+		printf("ib_acm_resolve_ip_batch: %d of %d failed: %s\n", ret,
+		       repetitions, strerror(reqs[0].status ? reqs[0].status :
+					     reqs[repetitions - 1].status));
+
+	for (i = 0; i < repetitions; i++) {
+		if (!reqs[i].status && reqs[i].paths)
+			*path = reqs[i].paths[0].path;
+		ib_acm_free_paths(reqs[i].paths);
+	}
+	free(reqs);
+	return ret ? -1 : 0;
+}
+
 static int resolve_ip(struct ibv_path_record *path)
 {
 	struct ibv_path_data *paths;
@@ -566,6 +911,9 @@ static int resolve_ip(struct ibv_path_record *path)
 		return -1;
 	}
 
+	if (repetitions > 1)
+		return resolve_ip_batch(saddr, (struct sockaddr *) &dest, path);
+
 	ret = ib_acm_resolve_ip(saddr, (struct sockaddr *) &dest,
 		&paths, &count, get_resolve_flags(), (repetitions == 1));
 	if (ret) {
@@ -720,7 +1068,9 @@ static void resolve(char *svc)
 			for (i = 0; i < repetitions; i++) {
 				switch (dest_type) {
 				case 'i':
+					/* resolve_ip() sends all repetitions at once */
 					ret = resolve_ip(&path);
+					i = repetitions;
 					break;
 				case 'n':
 					ret = resolve_name(&path);
@@ -988,8 +1338,9 @@ int main(int argc, char **argv)
 	int op, ret = 0;
 	int make_addr = 0;
 	int make_opts = 0;
+	int make_cache = 0;
 
-	while ((op = getopt(argc, argv, "e::f:s:d:vcA::O::D:P::S:C:V")) != -1) {
+	while ((op = getopt(argc, argv, "e::f:s:d:vcA::O::B::D:P::S:C:V")) != -1) {
 		switch (op) {
 		case 'e':
 			enum_ep = 1;
@@ -1024,6 +1375,11 @@ int main(int argc, char **argv)
 			if (opt_arg(argc, argv))
 				opts_file = opt_arg(argc, argv);
 			break;
+		case 'B':
+			make_cache = 1;
+			if (opt_arg(argc, argv))
+				cache_file = opt_arg(argc, argv);
+			break;
 		case 'D':
 			dest_dir = optarg;
 			break;
@@ -1052,7 +1408,7 @@ int main(int argc, char **argv)
 	if ((src_arg && (!dest_arg && perf_query != PERF_QUERY_EP_ADDR)) ||
 	    (perf_query == PERF_QUERY_EP_ADDR && !src_arg) || 
 	    (!src_arg && !dest_arg && !perf_query && !make_addr && !make_opts &&
-	     !enum_ep))
+	     !make_cache && !enum_ep))
 		goto show_use;
 
 	if (dest_arg || perf_query || enum_ep)
@@ -1064,7 +1420,10 @@ int main(int argc, char **argv)
 	if (!ret && make_opts)
 		ret = gen_opts();
 
-	if (verbose || !(make_addr || make_opts) || ret)
+	if (!ret && make_cache)
+		ret = gen_cache();
+
+	if (verbose || !(make_addr || make_opts || make_cache) || ret)
 		printf("return status 0x%x\n", ret);
 	return ret;
 
@@ -0,0 +1,472 @@
+/* GPLv2 or OpenIB.org BSD (MIT) See COPYING file */
+
+/*
+ * Load generator for the ibacm service. Each thread opens its own client
+ * connections and keeps a fixed number of resolve requests outstanding on
+ * each, matching responses to requests by transaction ID, and the run
+ * reports throughput and the latency distribution seen by the clients.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <getopt.h>
+#include <netdb.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <osd.h>
+#include <infiniband/acm.h>
+
+#define LAT_MAX_US	100000	/* latencies above are only counted */
+
+struct load_conn {
+	int		sock;
+	int		outstanding;
+	uint64_t	*start;		/* per tid, in us */
+	int		buf_len;
+	uint8_t		buf[sizeof(struct acm_msg) * 4];
+};
+
+struct load_thread {
+	pthread_t	thread;
+	int		index;
+	int		epfd;
+	struct load_conn *conns;
+	uint64_t	completed;
+	uint64_t	errors;		/* responses with an error status */
+	int		failed;
+	uint64_t	lat_max;
+	uint64_t	lat_over;
+	uint32_t	*lat;		/* LAT_MAX_US buckets of 1 us */
+};
+
+static const char *svc_arg = "localhost";
+static unsigned short svc_port;
+static char *src_arg;
+static char *dest_arg;
+static int dest_cnt = 1;
+static int thread_cnt = 1;
+static int conn_cnt = 8;
+static int depth = 128;
+static long long total = 100000;
+static int duration;
+
+static struct addrinfo *svc_addr;
+static int addr_type;
+static uint8_t src_addr[ACM_MAX_ADDRESS];
+static uint8_t dest_base[ACM_MAX_ADDRESS];
+static long long issued;
+static volatile int stop;
+
+static void show_usage(char *program)
+{
+	printf("usage: %s -s src_addr -d dest_addr [options]\n", program);
+	printf("Generate resolve requests against an ibacm service\n");
+	printf("   -s src_addr      - local source address, IP or name\n");
+	printf("   -d dest_addr     - destination address, IP or name; a name\n");
+	printf("                      containing %%d is formatted with the\n");
+	printf("                      destination number\n");
+	printf("   [-N dest_count]  - number of destinations to cycle through,\n");
+	printf("                      consecutive IPs from dest_addr (default 1)\n");
+	printf("   [-S svc_addr]    - address of ACM service (default localhost)\n");
+	printf("   [-p port]        - port of ACM service (default from %s)\n",
+	       IBACM_PORT_FILE);
+	printf("   [-t threads]     - number of client threads (default 1)\n");
+	printf("   [-c conns]       - connections per thread (default 8)\n");
+	printf("   [-q depth]       - requests outstanding per connection\n");
+	printf("                      (default 128)\n");
+	printf("   [-n requests]    - total number of requests (default 100000)\n");
+	printf("   [-T seconds]     - run for a time instead of a request count\n");
+}
+
+static void set_server_port(void)
+{
+	FILE *f;
+
+	svc_port = 6125;
+	if ((f = fopen(IBACM_PORT_FILE, "r"))) {
+		if (fscanf(f, "%hu", &svc_port) != 1)
+			printf("Failed to read server port\n");
+		fclose(f);
+	}
+}
+
+static int parse_addrs(void)
+{
+	struct addrinfo hint;
+	int ret;
+
+	if (inet_pton(AF_INET, src_arg, src_addr) > 0) {
+		addr_type = ACM_EP_INFO_ADDRESS_IP;
+		ret = inet_pton(AF_INET, dest_arg, dest_base) > 0;
+	} else if (inet_pton(AF_INET6, src_arg, src_addr) > 0) {
+		addr_type = ACM_EP_INFO_ADDRESS_IP6;
+		ret = inet_pton(AF_INET6, dest_arg, dest_base) > 0;
+	} else {
+		addr_type = ACM_EP_INFO_NAME;
+		strncpy((char *) src_addr, src_arg, ACM_MAX_ADDRESS - 1);
+		ret = 1;
+	}
+	if (!ret) {
+		printf("destination %s is not the same type as the source\n",
+		       dest_arg);
+		return -1;
+	}
+
+	memset(&hint, 0, sizeof hint);
+	hint.ai_family = AF_INET;
+	hint.ai_socktype = SOCK_STREAM;
+	ret = getaddrinfo(svc_arg, NULL, &hint, &svc_addr);
+	if (ret) {
+		printf("unable to resolve %s: %s\n", svc_arg, gai_strerror(ret));
+		return -1;
+	}
+	((struct sockaddr_in *) svc_addr->ai_addr)->sin_port = htobe16(svc_port);
+	return 0;
+}
+
+static void format_dest(uint8_t *addr, long long n)
+{
+	const char *num;
+	uint32_t ip;
+	int i;
+
+	memset(addr, 0, ACM_MAX_ADDRESS);
+	n %= dest_cnt;
+	switch (addr_type) {
+	case ACM_EP_INFO_ADDRESS_IP:
+		memcpy(&ip, dest_base, sizeof ip);
+		ip = htobe32(be32toh(ip) + (uint32_t) n);
+		memcpy(addr, &ip, sizeof ip);
+		break;
+	case ACM_EP_INFO_ADDRESS_IP6:
+		memcpy(addr, dest_base, 16);
+		for (i = 15; i >= 0 && n; i--, n >>= 8) {
+			n += addr[i];
+			addr[i] = (uint8_t) n;
+		}
+		break;
+	default:
+		num = strstr(dest_arg, "%d");
+		if (num)
+			snprintf((char *) addr, ACM_MAX_ADDRESS, "%.*s%lld%s",
+				 (int) (num - dest_arg), dest_arg, n, num + 2);
+		else
+			strncpy((char *) addr, dest_arg, ACM_MAX_ADDRESS - 1);
+		break;
+	}
+}
+
+/* Claim the next request, unless the run is over */
+static int next_request(long long *n)
+{
+	if (stop)
+		return 0;
+
+	*n = __sync_fetch_and_add(&issued, 1);
+	return duration || *n < total;
+}
+
+static int send_request(struct load_conn *conn, int tid, long long n)
+{
+	struct acm_msg msg;
+
+	memset(&msg, 0, ACM_MSG_HDR_LENGTH + 2 * ACM_MSG_EP_LENGTH);
+	msg.hdr.version = ACM_VERSION;
+	msg.hdr.opcode = ACM_OP_RESOLVE;
+	msg.hdr.length = ACM_MSG_HDR_LENGTH + 2 * ACM_MSG_EP_LENGTH;
+	msg.hdr.tid = tid;
+
+	msg.resolve_data[0].flags = ACM_EP_FLAG_SOURCE;
+	msg.resolve_data[0].type = addr_type;
+	memcpy(msg.resolve_data[0].info.addr, src_addr, ACM_MAX_ADDRESS);
+	msg.resolve_data[1].flags = ACM_EP_FLAG_DEST;
+	msg.resolve_data[1].type = addr_type;
+	format_dest(msg.resolve_data[1].info.addr, n);
+
+	conn->start[tid] = time_stamp_us();
+	if (send(conn->sock, &msg, msg.hdr.length, 0) != msg.hdr.length) {
+		printf("failed to send request: %s\n", strerror(errno));
+		return -1;
+	}
+	conn->outstanding++;
+	return 0;
+}
+
+static void record_latency(struct load_thread *thread, uint64_t start)
+{
+	uint64_t now = time_stamp_us(), us;
+
+	us = now > start ? now - start : 0;
+	if (us > thread->lat_max)
+		thread->lat_max = us;
+	if (us < LAT_MAX_US)
+		thread->lat[us]++;
+	else
+		thread->lat_over++;
+}
+
+/* Complete every whole response in the buffer and reuse its tid */
+static int process_responses(struct load_thread *thread, struct load_conn *conn)
+{
+	struct acm_msg *msg;
+	long long n;
+	int off = 0, len, tid;
+
+	while (conn->buf_len - off >= ACM_MSG_HDR_LENGTH) {
+		msg = (struct acm_msg *) (conn->buf + off);
+		len = msg->hdr.length;
+		if (len < ACM_MSG_HDR_LENGTH || len > sizeof(struct acm_msg)) {
+			printf("invalid response length %d\n", len);
+			return -1;
+		}
+		if (conn->buf_len - off < len)
+			break;
+
+		tid = (int) msg->hdr.tid;
+		if (tid < 0 || tid >= depth) {
+			printf("unexpected response tid %d\n", tid);
+			return -1;
+		}
+
+		record_latency(thread, conn->start[tid]);
+		thread->completed++;
+		if (msg->hdr.status)
+			thread->errors++;
+		conn->outstanding--;
+		off += len;
+
+		if (next_request(&n) && send_request(conn, tid, n))
+			return -1;
+	}
+
+	conn->buf_len -= off;
+	memmove(conn->buf, conn->buf + off, conn->buf_len);
+	return 0;
+}
+
+static int open_conn(struct load_thread *thread, struct load_conn *conn)
+{
+	struct epoll_event event;
+	int val = 1;
+
+	conn->start = calloc(depth, sizeof(*conn->start));
+	if (!conn->start)
+		return -1;
+
+	conn->sock = socket(svc_addr->ai_family, SOCK_STREAM, IPPROTO_TCP);
+	if (conn->sock < 0)
+		return -1;
+
+	setsockopt(conn->sock, IPPROTO_TCP, TCP_NODELAY, &val, sizeof val);
+	if (connect(conn->sock, svc_addr->ai_addr, svc_addr->ai_addrlen)) {
+		printf("failed to connect to %s: %s\n", svc_arg, strerror(errno));
+		return -1;
+	}
+
+	event.events = EPOLLIN;
+	event.data.ptr = conn;
+	return epoll_ctl(thread->epfd, EPOLL_CTL_ADD, conn->sock, &event);
+}
+
+static void *run_thread(void *context)
+{
+	struct load_thread *thread = context;
+	struct epoll_event events[64];
+	struct load_conn *conn;
+	long long n;
+	int i, j, ret, outstanding;
+
+	for (i = 0; i < conn_cnt; i++) {
+		if (open_conn(thread, &thread->conns[i]))
+			goto err;
+	}
+
+	for (i = 0; i < conn_cnt; i++) {
+		for (j = 0; j < depth && next_request(&n); j++) {
+			if (send_request(&thread->conns[i], j, n))
+				goto err;
+		}
+	}
+
+	for (;;) {
+		for (i = 0, outstanding = 0; i < conn_cnt; i++)
+			outstanding += thread->conns[i].outstanding;
+		if (!outstanding)
+			break;
+
+		ret = epoll_wait(thread->epfd, events, 64, -1);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			goto err;
+		}
+
+		for (i = 0; i < ret; i++) {
+			conn = events[i].data.ptr;
+			n = recv(conn->sock, conn->buf + conn->buf_len,
+				 sizeof(conn->buf) - conn->buf_len, 0);
+			if (n <= 0) {
+				printf("connection closed by ibacm\n");
+				goto err;
+			}
+			conn->buf_len += n;
+			if (process_responses(thread, conn))
+				goto err;
+		}
+	}
+	return NULL;
+
+err:
+	stop = 1;
+	thread->failed = 1;
+	return NULL;
+}
+
+static uint64_t percentile(struct load_thread *threads, uint64_t completed,
+			   double pct)
+{
+	uint64_t want, seen = 0;
+	int us, i;
+
+	want = (uint64_t) (completed * pct / 100.0);
+	for (us = 0; us < LAT_MAX_US; us++) {
+		for (i = 0; i < thread_cnt; i++)
+			seen += threads[i].lat[us];
+		if (seen > want)
+			return us;
+	}
+	return LAT_MAX_US;
+}
+
+static void report(struct load_thread *threads, uint64_t elapsed)
+{
+	uint64_t completed = 0, errors = 0, lat_max = 0;
+	int i;
+
+	for (i = 0; i < thread_cnt; i++) {
+		completed += threads[i].completed;
+		errors += threads[i].errors;
+		if (threads[i].lat_max > lat_max)
+			lat_max = threads[i].lat_max;
+	}
+
+	printf("requests %" PRIu64 " errors %" PRIu64 " time %.3f s"
+	       " rate %.0f req/s\n", completed, errors, elapsed / 1000000.0,
+	       elapsed ? completed * 1000000.0 / elapsed : 0.0);
+	if (!completed)
+		return;
+
+	printf("latency us: p50 %" PRIu64 " p90 %" PRIu64 " p99 %" PRIu64
+	       " p99.9 %" PRIu64 " max %" PRIu64 "\n",
+	       percentile(threads, completed, 50),
+	       percentile(threads, completed, 90),
+	       percentile(threads, completed, 99),
+	       percentile(threads, completed, 99.9), lat_max);
+}
+
+int main(int argc, char **argv)
+{
+	struct load_thread *threads;
+	uint64_t start;
+	int op, i, ret = 0;
+
+	set_server_port();
+	while ((op = getopt(argc, argv, "s:d:N:S:p:t:c:q:n:T:")) != -1) {
+		switch (op) {
+		case 's':
+			src_arg = optarg;
+			break;
+		case 'd':
+			dest_arg = optarg;
+			break;
+		case 'N':
+			dest_cnt = atoi(optarg);
+			break;
+		case 'S':
+			svc_arg = optarg;
+			break;
+		case 'p':
+			svc_port = (unsigned short) atoi(optarg);
+			break;
+		case 't':
+			thread_cnt = atoi(optarg);
+			break;
+		case 'c':
+			conn_cnt = atoi(optarg);
+			break;
+		case 'q':
+			depth = atoi(optarg);
+			break;
+		case 'n':
+			total = atoll(optarg);
+			break;
+		case 'T':
+			duration = atoi(optarg);
+			break;
+		default:
+			show_usage(argv[0]);
+			exit(1);
+		}
+	}
+
+	if (!src_arg || !dest_arg || dest_cnt < 1 || thread_cnt < 1 ||
+	    conn_cnt < 1 || depth < 1 || total < 1 || duration < 0) {
+		show_usage(argv[0]);
+		exit(1);
+	}
+
+	if (parse_addrs())
+		exit(1);
+
+	threads = calloc(thread_cnt, sizeof(*threads));
+	if (!threads)
+		exit(1);
+
+	for (i = 0; i < thread_cnt; i++) {
+		threads[i].index = i;
+		threads[i].epfd = epoll_create1(0);
+		threads[i].conns = calloc(conn_cnt, sizeof(*threads[i].conns));
+		threads[i].lat = calloc(LAT_MAX_US, sizeof(*threads[i].lat));
+		if (threads[i].epfd < 0 || !threads[i].conns || !threads[i].lat) {
+			printf("failed to allocate thread resources\n");
+			exit(1);
+		}
+	}
+
+	printf("%d threads, %d connections each, %d requests outstanding per"
+	       " connection, %d destinations\n", thread_cnt, conn_cnt, depth,
+	       dest_cnt);
+	start = time_stamp_us();
+	for (i = 0; i < thread_cnt; i++) {
+		if (pthread_create(&threads[i].thread, NULL, run_thread,
+				   &threads[i])) {
+			printf("failed to create thread\n");
+			exit(1);
+		}
+	}
+
+	if (duration) {
+		sleep(duration);
+		stop = 1;
+	}
+
+	for (i = 0; i < thread_cnt; i++) {
+		pthread_join(threads[i].thread, NULL);
+		if (threads[i].failed)
+			ret = 1;
+	}
+
+	report(threads, time_stamp_us() - start);
+	freeaddrinfo(svc_addr);
+	return ret;
+}
@@ -37,8 +37,39 @@
 #include <errno.h>
 #include <netdb.h>
 #include <arpa/inet.h>
+#include <ccan/list.h>
+
+/*
+ * Requests carry a transaction ID, so any number of them can be in flight
+ * on the socket and ibacm may answer them in any order. Senders only hold
+ * acm_lock across send(). Threads waiting for a response take turns
+ * reading the socket: a waiter that finds no reader reads one response
+ * without the lock, hands it to the request with the matching ID and wakes
+ * the other waiters.
+ */
+#define ACM_BATCH_DEPTH 64
+
+struct acm_request {
+	struct list_node entry;
+	uint64_t tid;
+	struct acm_msg *msg;
+	int done;
+	int err;
+	void (*complete)(struct acm_request *req);
+};
+
+struct acm_async_req {
+	struct acm_request req;
+	struct acm_msg msg;
+	ib_acm_resolve_cb_t callback;
+	void *context;
+};
 
 static pthread_mutex_t acm_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t acm_cond = PTHREAD_COND_INITIALIZER;
+static LIST_HEAD(acm_pending);
+static uint64_t acm_tid;
+static int acm_reading;
 static int sock = -1;
 static short server_port = 6125;
 
@@ -149,6 +180,7 @@ static int acm_format_resp(struct acm_msg *msg,
 	return 0;
 err:
 	free(path_data);
+	errno = EINVAL;
 	return -1;
 }
 
@@ -206,50 +238,181 @@ static int acm_error(uint8_t status)
 	}
 }
 
-static int acm_resolve(uint8_t *src, uint8_t *dest, uint8_t type,
-	struct ibv_path_data **paths, int *count, uint32_t flags, int print)
+static int acm_msg_length(struct acm_msg *msg)
+{
+	return ((msg->hdr.opcode & ACM_OP_MASK) == ACM_OP_RESOLVE) ?
+		msg->hdr.length : be16toh(msg->hdr.length);
+}
+
+static int acm_recv_msg(struct acm_msg *msg)
+{
+	int ret, len;
+
+	ret = recv(sock, (char *) msg, ACM_MSG_HDR_LENGTH, MSG_WAITALL);
+	if (ret != ACM_MSG_HDR_LENGTH)
+		return ENOTCONN;
+
+	len = acm_msg_length(msg);
+	if (len < ACM_MSG_HDR_LENGTH || len > sizeof(*msg))
+		return EINVAL;
+
+	len -= ACM_MSG_HDR_LENGTH;
+	if (len) {
+		ret = recv(sock, (char *) msg->data, len, MSG_WAITALL);
+		if (ret != len)
+			return ENOTCONN;
+	}
+	return 0;
+}
+
+/* Called with acm_lock held */
+static int acm_send_req(struct acm_request *req, struct acm_msg *msg, int len)
+{
+	int ret;
+
+	req->tid = msg->hdr.tid = ++acm_tid;
+	req->msg = msg;
+	req->done = 0;
+	req->err = 0;
+	list_add_tail(&acm_pending, &req->entry);
+
+	ret = send(sock, (char *) msg, len, MSG_NOSIGNAL);
+	if (ret != len) {
+		list_del(&req->entry);
+		return ret < 0 ? -1 : ERR(EIO);
+	}
+	return 0;
+}
+
+/*
+ * Read one response and complete its request. Called with acm_lock held,
+ * which is dropped while blocked in recv() and while running completion
+ * callbacks. A broken stream fails every pending request.
+ */
+static void acm_read_resp(void)
 {
+	struct acm_request *req, *next;
 	struct acm_msg msg;
-	int ret, cnt = 0;
+	LIST_HEAD(done);
+	int err;
 
+	acm_reading = 1;
+	pthread_mutex_unlock(&acm_lock);
+	err = acm_recv_msg(&msg);
 	pthread_mutex_lock(&acm_lock);
-	memset(&msg, 0, sizeof msg);
-	msg.hdr.version = ACM_VERSION;
-	msg.hdr.opcode = ACM_OP_RESOLVE;
+	acm_reading = 0;
 
-	if (src) {
-		ret = acm_format_ep_addr(&msg.resolve_data[cnt++], src, type,
-			ACM_EP_FLAG_SOURCE);
-		if (ret)
-			goto out;
+	if (err && sock >= 0) {
+		shutdown(sock, SHUT_RDWR);
+		close(sock);
+		sock = -1;
 	}
 
-	ret = acm_format_ep_addr(&msg.resolve_data[cnt++], dest, type,
-		ACM_EP_FLAG_DEST | flags);
-	if (ret)
-		goto out;
-
-	msg.hdr.length = ACM_MSG_HDR_LENGTH + (cnt * ACM_MSG_EP_LENGTH);
+	list_for_each_safe(&acm_pending, req, next, entry) {
+		if (!err && req->tid != msg.hdr.tid)
+			continue;
+
+		list_del(&req->entry);
+		if (!err)
+			memcpy(req->msg, &msg, acm_msg_length(&msg));
+		req->err = err;
+		req->done = 1;
+		if (req->complete)
+			list_add_tail(&done, &req->entry);
+		if (!err)
+			break;
+	}
+	pthread_cond_broadcast(&acm_cond);
 
-	ret = send(sock, (char *) &msg, msg.hdr.length, 0);
-	if (ret != msg.hdr.length)
-		goto out;
+	if (list_empty(&done))
+		return;
 
-	ret = recv(sock, (char *) &msg, sizeof msg, 0);
-	if (ret < ACM_MSG_HDR_LENGTH || ret != msg.hdr.length)
-		goto out;
+	pthread_mutex_unlock(&acm_lock);
+	list_for_each_safe(&done, req, next, entry)
+		req->complete(req);
+	pthread_mutex_lock(&acm_lock);
+}
 
-	if (msg.hdr.status) {
-		ret = acm_error(msg.hdr.status);
-		goto out;
+/* Called with acm_lock held */
+static int acm_wait(struct acm_request *req)
+{
+	while (!req->done) {
+		if (acm_reading)
+			pthread_cond_wait(&acm_cond, &acm_lock);
+		else
+			acm_read_resp();
 	}
 
-	ret = acm_format_resp(&msg, paths, count, print);
-out:
+	return req->err ? ERR(req->err) : 0;
+}
+
+/* Send @msg and wait for the response, which overwrites it */
+static int acm_query(struct acm_msg *msg, int len)
+{
+	struct acm_request req = {};
+	int ret;
+
+	pthread_mutex_lock(&acm_lock);
+	ret = acm_send_req(&req, msg, len);
+	if (!ret)
+		ret = acm_wait(&req);
 	pthread_mutex_unlock(&acm_lock);
 	return ret;
 }
 
+static int acm_format_resolve(struct acm_msg *msg, uint8_t *src,
+	uint8_t *dest, uint8_t type, uint32_t flags)
+{
+	int cnt = 0;
+
+	memset(msg, 0, sizeof *msg);
+	msg->hdr.version = ACM_VERSION;
+	msg->hdr.opcode = ACM_OP_RESOLVE;
+
+	if (src && acm_format_ep_addr(&msg->resolve_data[cnt++], src, type,
+				      ACM_EP_FLAG_SOURCE))
+		return ERR(EINVAL);
+
+	if (acm_format_ep_addr(&msg->resolve_data[cnt++], dest, type,
+			       ACM_EP_FLAG_DEST | flags))
+		return ERR(EINVAL);
+
+	msg->hdr.length = ACM_MSG_HDR_LENGTH + (cnt * ACM_MSG_EP_LENGTH);
+	return 0;
+}
+
+static int acm_resolve_resp(struct acm_msg *msg,
+	struct ibv_path_data **paths, int *count, int print)
+{
+	if (msg->hdr.status)
+		return acm_error(msg->hdr.status);
+
+	return acm_format_resp(msg, paths, count, print);
+}
+
+static int acm_resolve(uint8_t *src, uint8_t *dest, uint8_t type,
+	struct ibv_path_data **paths, int *count, uint32_t flags, int print)
+{
+	struct acm_msg msg;
+	int ret;
+
+	ret = acm_format_resolve(&msg, src, dest, type, flags);
+	if (ret)
+		return ret;
+
+	ret = acm_query(&msg, msg.hdr.length);
+	if (ret)
+		return ret;
+
+	return acm_resolve_resp(&msg, paths, count, print);
+}
+
+static uint8_t acm_ip_type(struct sockaddr *addr)
+{
+	return addr->sa_family == AF_INET ?
+		ACM_EP_INFO_ADDRESS_IP : ACM_EP_INFO_ADDRESS_IP6;
+}
+
 int ib_acm_resolve_name(char *src, char *dest,
 	struct ibv_path_data **paths, int *count, uint32_t flags, int print)
 {
@@ -260,13 +423,128 @@ int ib_acm_resolve_name(char *src, char *dest,
 int ib_acm_resolve_ip(struct sockaddr *src, struct sockaddr *dest,
 	struct ibv_path_data **paths, int *count, uint32_t flags, int print)
 {
-	if (((struct sockaddr *) dest)->sa_family == AF_INET) {
-		return acm_resolve((uint8_t *) src, (uint8_t *) dest,
-			ACM_EP_INFO_ADDRESS_IP, paths, count, flags, print);
-	} else {
-		return acm_resolve((uint8_t *) src, (uint8_t *) dest,
-			ACM_EP_INFO_ADDRESS_IP6, paths, count, flags, print);
+	return acm_resolve((uint8_t *) src, (uint8_t *) dest,
+		acm_ip_type(dest), paths, count, flags, print);
+}
+
+static void acm_async_complete(struct acm_request *req)
+{
+	struct acm_async_req *areq = container_of(req, struct acm_async_req, req);
+	struct ibv_path_data *paths = NULL;
+	int ret, count = 0;
+
+	ret = req->err ? ERR(req->err) :
+		acm_resolve_resp(&areq->msg, &paths, &count, 0);
+	areq->callback(areq->context, ret ? errno : 0, paths, count);
+	free(areq);
+}
+
+int ib_acm_resolve_ip_async(struct sockaddr *src, struct sockaddr *dest,
+	uint32_t flags, ib_acm_resolve_cb_t callback, void *context)
+{
+	struct acm_async_req *areq;
+	int ret;
+
+	areq = malloc(sizeof *areq);
+	if (!areq)
+		return ERR(ENOMEM);
+
+	ret = acm_format_resolve(&areq->msg, (uint8_t *) src, (uint8_t *) dest,
+				 acm_ip_type(dest), flags);
+	if (ret)
+		goto err;
+
+	areq->req.complete = acm_async_complete;
+	areq->callback = callback;
+	areq->context = context;
+
+	pthread_mutex_lock(&acm_lock);
+	ret = acm_send_req(&areq->req, &areq->msg, areq->msg.hdr.length);
+	pthread_mutex_unlock(&acm_lock);
+	if (ret)
+		goto err;
+	return 0;
+
+err:
+	free(areq);
+	return ret;
+}
+
+int ib_acm_get_fd(void)
+{
+	return sock;
+}
+
+int ib_acm_process(void)
+{
+	pthread_mutex_lock(&acm_lock);
+	if (!acm_reading && !list_empty(&acm_pending))
+		acm_read_resp();
+	pthread_mutex_unlock(&acm_lock);
+	return 0;
+}
+
+struct acm_batch_slot {
+	struct acm_request req;
+	struct acm_msg msg;
+	int sent;
+};
+
+/* Called with acm_lock held, returns 1 if @req failed */
+static int acm_batch_complete(struct ib_acm_resolve_req *req,
+	struct acm_batch_slot *slot)
+{
+	int ret;
+
+	if (!slot->sent)
+		return 1;
+
+	ret = acm_wait(&slot->req);
+	if (!ret)
+		ret = acm_resolve_resp(&slot->msg, &req->paths, &req->count, 0);
+	req->status = ret ? errno : 0;
+	return ret ? 1 : 0;
+}
+
+/*
+ * Keep up to ACM_BATCH_DEPTH of the requests in flight. Waiting for the
+ * oldest one before sending more bounds what ibacm has to queue towards us
+ * while we are not reading.
+ */
+int ib_acm_resolve_ip_batch(struct ib_acm_resolve_req *reqs, int cnt)
+{
+	struct acm_batch_slot *slots, *slot;
+	int i, failed = 0;
+
+	slots = calloc(ACM_BATCH_DEPTH, sizeof *slots);
+	if (!slots)
+		return ERR(ENOMEM);
+
+	pthread_mutex_lock(&acm_lock);
+	for (i = 0; i < cnt; i++) {
+		slot = &slots[i % ACM_BATCH_DEPTH];
+		if (i >= ACM_BATCH_DEPTH)
+			failed += acm_batch_complete(&reqs[i - ACM_BATCH_DEPTH],
+						     slot);
+
+		reqs[i].paths = NULL;
+		reqs[i].count = 0;
+		slot->sent = !acm_format_resolve(&slot->msg,
+				(uint8_t *) reqs[i].src, (uint8_t *) reqs[i].dest,
+				acm_ip_type(reqs[i].dest), reqs[i].flags) &&
+			!acm_send_req(&slot->req, &slot->msg,
+				      slot->msg.hdr.length);
+		if (!slot->sent)
+			reqs[i].status = errno;
 	}
+
+	for (i = max(cnt - ACM_BATCH_DEPTH, 0); i < cnt; i++)
+		failed += acm_batch_complete(&reqs[i],
+					     &slots[i % ACM_BATCH_DEPTH]);
+	pthread_mutex_unlock(&acm_lock);
+
+	free(slots);
+	return failed;
 }
 
 int ib_acm_resolve_path(struct ibv_path_record *path, uint32_t flags)
@@ -275,7 +553,6 @@ int ib_acm_resolve_path(struct ibv_path_record *path, uint32_t flags)
 	struct acm_ep_addr_data *data;
 	int ret;
 
-	pthread_mutex_lock(&acm_lock);
 	memset(&msg, 0, sizeof msg);
 	msg.hdr.version = ACM_VERSION;
 	msg.hdr.opcode = ACM_OP_RESOLVE;
@@ -286,20 +563,13 @@ int ib_acm_resolve_path(struct ibv_path_record *path, uint32_t flags)
 	data->type = ACM_EP_INFO_PATH;
 	data->info.path = *path;
 
-	ret = send(sock, (char *) &msg, msg.hdr.length, 0);
-	if (ret != msg.hdr.length)
-		goto out;
-
-	ret = recv(sock, (char *) &msg, sizeof msg, 0);
-	if (ret < ACM_MSG_HDR_LENGTH || ret != msg.hdr.length)
-		goto out;
+	ret = acm_query(&msg, msg.hdr.length);
+	if (ret)
+		return ret;
 
 	ret = acm_error(msg.hdr.status);
 	if (!ret)
 		*path = data->info.path;
-
-out:
-	pthread_mutex_unlock(&acm_lock);
 	return ret;
 }
 
@@ -308,41 +578,27 @@ int ib_acm_query_perf(int index, uint64_t **counters, int *count)
 	struct acm_msg msg;
 	int ret, i;
 
-	pthread_mutex_lock(&acm_lock);
 	memset(&msg, 0, sizeof msg);
 	msg.hdr.version = ACM_VERSION;
 	msg.hdr.opcode = ACM_OP_PERF_QUERY;
 	msg.hdr.data[1] = index;
 	msg.hdr.length = htobe16(ACM_MSG_HDR_LENGTH);
 
-	ret = send(sock, (char *) &msg, ACM_MSG_HDR_LENGTH, 0);
-	if (ret != ACM_MSG_HDR_LENGTH)
-		goto out;
-
-	ret = recv(sock, (char *) &msg, sizeof msg, 0);
-	if (ret < ACM_MSG_HDR_LENGTH || ret != be16toh(msg.hdr.length)) {
-		ret = ACM_STATUS_EINVAL;
-		goto out;
-	}
+	ret = acm_query(&msg, ACM_MSG_HDR_LENGTH);
+	if (ret)
+		return ret;
 
-	if (msg.hdr.status) {
-		ret = acm_error(msg.hdr.status);
-		goto out;
-	}
+	if (msg.hdr.status)
+		return acm_error(msg.hdr.status);
 
 	*counters = malloc(sizeof(uint64_t) * msg.hdr.data[0]);
-	if (!*counters) {
-		ret = ACM_STATUS_ENOMEM;
-		goto out;
-	}
+	if (!*counters)
+		return ACM_STATUS_ENOMEM;
 
 	*count = msg.hdr.data[0];
 	for (i = 0; i < *count; i++)
 		(*counters)[i] = be64toh(msg.perf_data[i]);
-	ret = 0;
-out:
-	pthread_mutex_unlock(&acm_lock);
-	return ret;
+	return 0;
 }
 
 int ib_acm_enum_ep(int index, struct acm_ep_config_data **data)
@@ -353,46 +609,32 @@ int ib_acm_enum_ep(int index, struct acm_ep_config_data **data)
 	int cnt;
 	struct acm_ep_config_data *edata;
 
-	pthread_mutex_lock(&acm_lock);
 	memset(&msg, 0, sizeof msg);
 	msg.hdr.version = ACM_VERSION;
 	msg.hdr.opcode = ACM_OP_EP_QUERY;
 	msg.hdr.data[0] = index;
 	msg.hdr.length = htobe16(ACM_MSG_HDR_LENGTH);
 
-	ret = send(sock, (char *) &msg, ACM_MSG_HDR_LENGTH, 0);
-	if (ret != ACM_MSG_HDR_LENGTH)
-		goto out;
-
-	ret = recv(sock, (char *) &msg, sizeof msg, 0);
-	if (ret < ACM_MSG_HDR_LENGTH || ret != be16toh(msg.hdr.length)) {
-		ret = ACM_STATUS_EINVAL;
-		goto out;
-	}
+	ret = acm_query(&msg, ACM_MSG_HDR_LENGTH);
+	if (ret)
+		return ret;
 
-	if (msg.hdr.status) {
-		ret = acm_error(msg.hdr.status);
-		goto out;
-	}
+	if (msg.hdr.status)
+		return acm_error(msg.hdr.status);
 
 	cnt = be16toh(msg.ep_data[0].addr_cnt);
 	len = sizeof(struct acm_ep_config_data) +
 		ACM_MAX_ADDRESS * cnt;
 	edata = malloc(len);
-	if (!edata) {
-		ret = ACM_STATUS_ENOMEM;
-		goto out;
-	}
+	if (!edata)
+		return ACM_STATUS_ENOMEM;
 
 	memcpy(edata, &msg.ep_data[0], len);
 	edata->dev_guid = be64toh(msg.ep_data[0].dev_guid);
 	edata->pkey = be16toh(msg.ep_data[0].pkey);
 	edata->addr_cnt = cnt;
 	*data = edata;
-	ret = 0;
-out:
-	pthread_mutex_unlock(&acm_lock);
-	return ret;
+	return 0;
 }
 
 int ib_acm_query_perf_ep_addr(uint8_t *src, uint8_t type,
@@ -404,7 +646,6 @@ int ib_acm_query_perf_ep_addr(uint8_t *src, uint8_t type,
 	if (!src)
 		return -1;
 
-	pthread_mutex_lock(&acm_lock);
 	memset(&msg, 0, sizeof msg);
 	msg.hdr.version = ACM_VERSION;
 	msg.hdr.opcode = ACM_OP_PERF_QUERY;
@@ -412,40 +653,26 @@ int ib_acm_query_perf_ep_addr(uint8_t *src, uint8_t type,
 	ret = acm_format_ep_addr(&msg.resolve_data[0], src, type,
 		ACM_EP_FLAG_SOURCE);
 	if (ret)
-		goto out;
+		return ret;
 
 	len = ACM_MSG_HDR_LENGTH + ACM_MSG_EP_LENGTH;
 	msg.hdr.length = htobe16(len);
 
-	ret = send(sock, (char *) &msg, len, 0);
-	if (ret != len)
-		goto out;
-
-	ret = recv(sock, (char *) &msg, sizeof msg, 0);
-	if (ret < ACM_MSG_HDR_LENGTH || ret != be16toh(msg.hdr.length)) {
-		ret = ACM_STATUS_EINVAL;
-		goto out;
-	}
+	ret = acm_query(&msg, len);
+	if (ret)
+		return ret;
 
-	if (msg.hdr.status) {
-		ret = acm_error(msg.hdr.status);
-		goto out;
-	}
+	if (msg.hdr.status)
+		return acm_error(msg.hdr.status);
 
 	*counters = malloc(sizeof(uint64_t) * msg.hdr.data[0]);
-	if (!*counters) {
-		ret = ACM_STATUS_ENOMEM;
-		goto out;
-	}
+	if (!*counters)
+		return ACM_STATUS_ENOMEM;
 
 	*count = msg.hdr.data[0];
 	for (i = 0; i < *count; i++)
 		(*counters)[i] = be64toh(msg.perf_data[i]);
-
-	ret = 0;
-out:
-	pthread_mutex_unlock(&acm_lock);
-	return ret;
+	return 0;
 }
 
 
@@ -459,9 +686,33 @@ const char *ib_acm_cntr_name(int index)
 		[ACM_CNTR_ADDR_CACHE]	= "Addr Cache Count",
 		[ACM_CNTR_ROUTE_QUERY]	= "Route Query Count",
 		[ACM_CNTR_ROUTE_CACHE]	= "Route Cache Count",
+		[ACM_CNTR_CACHE_ENTRIES] = "Cache Entries",
+		[ACM_CNTR_CACHE_EXPIRED] = "Cache Expired Count",
+		[ACM_CNTR_SA_WAIT_MS]	= "SA Credit Wait (ms)",
+		[ACM_CNTR_LAT_HIT + 0]	= "Cache Hit <10us",
+		[ACM_CNTR_LAT_HIT + 1]	= "Cache Hit <100us",
+		[ACM_CNTR_LAT_HIT + 2]	= "Cache Hit <1ms",
+		[ACM_CNTR_LAT_HIT + 3]	= "Cache Hit <10ms",
+		[ACM_CNTR_LAT_HIT + 4]	= "Cache Hit <100ms",
+		[ACM_CNTR_LAT_HIT + 5]	= "Cache Hit <1s",
+		[ACM_CNTR_LAT_HIT + 6]	= "Cache Hit >=1s",
+		[ACM_CNTR_LAT_ADDR + 0]	= "Addr Resolve <10us",
+		[ACM_CNTR_LAT_ADDR + 1]	= "Addr Resolve <100us",
+		[ACM_CNTR_LAT_ADDR + 2]	= "Addr Resolve <1ms",
+		[ACM_CNTR_LAT_ADDR + 3]	= "Addr Resolve <10ms",
+		[ACM_CNTR_LAT_ADDR + 4]	= "Addr Resolve <100ms",
+		[ACM_CNTR_LAT_ADDR + 5]	= "Addr Resolve <1s",
+		[ACM_CNTR_LAT_ADDR + 6]	= "Addr Resolve >=1s",
+		[ACM_CNTR_LAT_ROUTE + 0] = "Route Resolve <10us",
+		[ACM_CNTR_LAT_ROUTE + 1] = "Route Resolve <100us",
+		[ACM_CNTR_LAT_ROUTE + 2] = "Route Resolve <1ms",
+		[ACM_CNTR_LAT_ROUTE + 3] = "Route Resolve <10ms",
+		[ACM_CNTR_LAT_ROUTE + 4] = "Route Resolve <100ms",
+		[ACM_CNTR_LAT_ROUTE + 5] = "Route Resolve <1s",
+		[ACM_CNTR_LAT_ROUTE + 6] = "Route Resolve >=1s",
 	};
 
-	if (index < ACM_CNTR_ERROR || index > ACM_MAX_COUNTER)
+	if (index < ACM_CNTR_ERROR || index >= ACM_MAX_COUNTER)
 		return "Unknown";
 
 	return cntr_name[index];
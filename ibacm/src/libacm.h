@@ -47,6 +47,34 @@ int ib_acm_resolve_ip(struct sockaddr *src, struct sockaddr *dest,
 int ib_acm_resolve_path(struct ibv_path_record *path, uint32_t flags);
 #define ib_acm_free_paths(paths) free(paths)
 
+/*
+ * Asynchronous resolution. The callback gets 0 or an errno value, and owns
+ * the returned paths. It runs in whichever thread reads the response: a
+ * caller of ib_acm_process(), which should be called when ib_acm_get_fd()
+ * is readable, or a thread waiting in a synchronous call.
+ */
+typedef void (*ib_acm_resolve_cb_t)(void *context, int status,
+	struct ibv_path_data *paths, int count);
+int ib_acm_resolve_ip_async(struct sockaddr *src, struct sockaddr *dest,
+	uint32_t flags, ib_acm_resolve_cb_t callback, void *context);
+int ib_acm_get_fd(void);
+int ib_acm_process(void);
+
+/*
+ * Resolve @cnt requests with many of them in flight at once. Returns the
+ * number of requests that failed, each with status set to an errno value,
+ * or -1 if the batch could not be started.
+ */
+struct ib_acm_resolve_req {
+	struct sockaddr *src;
+	struct sockaddr *dest;
+	uint32_t flags;
+	struct ibv_path_data *paths;
+	int count;
+	int status;
+};
+int ib_acm_resolve_ip_batch(struct ib_acm_resolve_req *reqs, int cnt);
+
 int ib_acm_query_perf(int index, uint64_t **counters, int *count);
 int ib_acm_query_perf_ep_addr(uint8_t *src, uint8_t type,
 			      uint64_t **counters, int *count);
@@ -0,0 +1,321 @@
+/* GPLv2 or OpenIB.org BSD (MIT) See COPYING file */
+#define _GNU_SOURCE
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "ibverbs.h"
+
+/*
+ * Per context cache of port attributes and of the GID table, which
+ * otherwise cost a system call or a sysfs read per lookup. Entries are
+ * dropped when ibv_get_async_event() returns a port or GID change event.
+ * Applications that never read async events would not see those changes,
+ * so entries also expire after RDMAV_PORT_CACHE_TTL milliseconds. A TTL of
+ * 0 turns the cache off.
+ *
+ * Lookups take the lock shared. A miss returns the cache generation, and
+ * the value read from the kernel is only stored if no invalidation
+ * happened in between.
+ */
+#define CACHE_DEFAULT_TTL_MS	1000
+#define CACHE_MAX_PORTS		256
+#define CACHE_MAX_GIDS		4096
+
+enum {
+	GID_ENTRY_GID		= 1 << 0,
+	GID_ENTRY_TYPE		= 1 << 1,
+};
+
+struct gid_entry {
+	union ibv_gid gid;
+	enum ibv_gid_type type;
+	unsigned int flags;
+};
+
+struct port_cache {
+	uint64_t expires;
+	bool attr_valid;
+	struct ibv_port_attr attr;
+	unsigned int num_gids;
+	struct gid_entry *gids;
+};
+
+struct ibverbs_cache {
+	pthread_rwlock_t lock;
+	uint64_t ttl;
+	unsigned int gen;
+	struct port_cache *ports[CACHE_MAX_PORTS];
+};
+
+static uint64_t cache_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+struct ibverbs_cache *ibverbs_cache_alloc(void)
+{
+	struct ibverbs_cache *cache;
+	const char *env;
+	uint64_t ttl = CACHE_DEFAULT_TTL_MS;
+
+	env = getenv("RDMAV_PORT_CACHE_TTL");
+	if (env)
+		ttl = strtoull(env, NULL, 0);
+	if (!ttl)
+		return NULL;
+
+	cache = calloc(1, sizeof(*cache));
+	if (!cache)
+		return NULL;
+
+	pthread_rwlock_init(&cache->lock, NULL);
+	cache->ttl = ttl * 1000000;
+	return cache;
+}
+
+void ibverbs_cache_free(struct ibverbs_cache *cache)
+{
+	int i;
+
+	if (!cache)
+		return;
+
+	for (i = 0; i != CACHE_MAX_PORTS; i++) {
+		if (!cache->ports[i])
+			continue;
+		free(cache->ports[i]->gids);
+		free(cache->ports[i]);
+	}
+
+	pthread_rwlock_destroy(&cache->lock);
+	free(cache);
+}
+
+static inline struct ibverbs_cache *get_cache(struct ibv_context *context)
+{
+	struct verbs_context *vctx = verbs_get_ctx(context);
+
+	return vctx ? vctx->priv->cache : NULL;
+}
+
+static void port_reset(struct port_cache *port)
+{
+	port->attr_valid = false;
+	if (port->gids)
+		memset(port->gids, 0, port->num_gids * sizeof(*port->gids));
+}
+
+void ibverbs_cache_invalidate(struct ibv_context *context)
+{
+	struct ibverbs_cache *cache = get_cache(context);
+	int i;
+
+	if (!cache)
+		return;
+
+	pthread_rwlock_wrlock(&cache->lock);
+	cache->gen++;
+	for (i = 0; i != CACHE_MAX_PORTS; i++)
+		if (cache->ports[i])
+			port_reset(cache->ports[i]);
+	pthread_rwlock_unlock(&cache->lock);
+}
+
+/* Called with the lock held shared, NULL if the port has nothing valid */
+static struct port_cache *port_lookup(struct ibverbs_cache *cache,
+				      uint8_t port_num)
+{
+	struct port_cache *port = cache->ports[port_num];
+
+	if (!port || cache_now() >= port->expires)
+		return NULL;
+	return port;
+}
+
+/* Called with the lock held exclusive */
+static struct port_cache *port_store(struct ibverbs_cache *cache,
+				     uint8_t port_num)
+{
+	struct port_cache *port = cache->ports[port_num];
+	uint64_t now = cache_now();
+
+	if (!port) {
+		port = calloc(1, sizeof(*port));
+		if (!port)
+			return NULL;
+		cache->ports[port_num] = port;
+	}
+
+	if (now >= port->expires) {
+		port_reset(port);
+		port->expires = now + cache->ttl;
+	}
+
+	return port;
+}
+
+bool ibverbs_cache_get_port(struct ibv_context *context, uint8_t port_num,
+			    struct ibv_port_attr *attr, unsigned int *gen)
+{
+	struct ibverbs_cache *cache = get_cache(context);
+	struct port_cache *port;
+	bool hit = false;
+
+	if (!cache)
+		return false;
+
+	pthread_rwlock_rdlock(&cache->lock);
+	port = port_lookup(cache, port_num);
+	if (port && port->attr_valid) {
+		*attr = port->attr;
+		hit = true;
+	}
+	*gen = cache->gen;
+	pthread_rwlock_unlock(&cache->lock);
+
+	return hit;
+}
+
+void ibverbs_cache_put_port(struct ibv_context *context, uint8_t port_num,
+			    const struct ibv_port_attr *attr, unsigned int gen)
+{
+	struct ibverbs_cache *cache = get_cache(context);
+	struct port_cache *port;
+
+	if (!cache)
+		return;
+
+	pthread_rwlock_wrlock(&cache->lock);
+	if (cache->gen == gen) {
+		port = port_store(cache, port_num);
+		if (port) {
+			port->attr = *attr;
+			port->attr_valid = true;
+		}
+	}
+	pthread_rwlock_unlock(&cache->lock);
+}
+
+/*
+ * Fill in whichever of @gid and @type is not NULL. Either both come from
+ * the cache or the call is a miss.
+ */
+bool ibverbs_cache_get_gid(struct ibv_context *context, uint8_t port_num,
+			   unsigned int index, union ibv_gid *gid,
+			   enum ibv_gid_type *type, unsigned int *gen)
+{
+	struct ibverbs_cache *cache = get_cache(context);
+	unsigned int want = (gid ? GID_ENTRY_GID : 0) |
+			    (type ? GID_ENTRY_TYPE : 0);
+	struct port_cache *port;
+	struct gid_entry *ent;
+	bool hit = false;
+
+	if (!cache)
+		return false;
+
+	pthread_rwlock_rdlock(&cache->lock);
+	port = port_lookup(cache, port_num);
+	if (port && index < port->num_gids) {
+		ent = &port->gids[index];
+		if ((ent->flags & want) == want) {
+			if (gid)
+				*gid = ent->gid;
+			if (type)
+				*type = ent->type;
+			hit = true;
+		}
+	}
+	*gen = cache->gen;
+	pthread_rwlock_unlock(&cache->lock);
+
+	return hit;
+}
+
+void ibverbs_cache_put_gid(struct ibv_context *context, uint8_t port_num,
+			   unsigned int index, const union ibv_gid *gid,
+			   const enum ibv_gid_type *type, unsigned int gen)
+{
+	struct ibverbs_cache *cache = get_cache(context);
+	struct port_cache *port;
+	struct gid_entry *gids;
+	unsigned int num;
+
+	if (!cache || index >= CACHE_MAX_GIDS)
+		return;
+
+	pthread_rwlock_wrlock(&cache->lock);
+	if (cache->gen != gen)
+		goto out;
+
+	port = port_store(cache, port_num);
+	if (!port)
+		goto out;
+
+	if (index >= port->num_gids) {
+		num = index < 64 ? 64 : index * 2;
+		if (num > CACHE_MAX_GIDS)
+			num = CACHE_MAX_GIDS;
+		gids = realloc(port->gids, num * sizeof(*gids));
+		if (!gids)
+			goto out;
+		memset(gids + port->num_gids, 0,
+		       (num - port->num_gids) * sizeof(*gids));
+		port->gids = gids;
+		port->num_gids = num;
+	}
+
+	if (gid) {
+		port->gids[index].gid = *gid;
+		port->gids[index].flags |= GID_ENTRY_GID;
+	}
+	if (type) {
+		port->gids[index].type = *type;
+		port->gids[index].flags |= GID_ENTRY_TYPE;
+	}
+out:
+	pthread_rwlock_unlock(&cache->lock);
+}
+
+/*
+ * Search the cached GID table the way ibv_find_gid_index() searches the
+ * real one. Returns -1 if an entry the search needs is not cached.
+ */
+int ibverbs_cache_find_gid(struct ibv_context *context, uint8_t port_num,
+			   const union ibv_gid *gid, enum ibv_gid_type type)
+{
+	struct ibverbs_cache *cache = get_cache(context);
+	struct port_cache *port;
+	struct gid_entry *ent;
+	unsigned int i;
+	int ret = -1;
+
+	if (!cache)
+		return -1;
+
+	pthread_rwlock_rdlock(&cache->lock);
+	port = port_lookup(cache, port_num);
+	if (!port)
+		goto out;
+
+	for (i = 0; i != port->num_gids; i++) {
+		ent = &port->gids[i];
+		if ((ent->flags & (GID_ENTRY_GID | GID_ENTRY_TYPE)) !=
+		    (GID_ENTRY_GID | GID_ENTRY_TYPE))
+			break;
+		if (ent->type == type && !memcmp(&ent->gid, gid, sizeof(*gid))) {
+			ret = i;
+			break;
+		}
+	}
+out:
+	pthread_rwlock_unlock(&cache->lock);
+	return ret;
+}
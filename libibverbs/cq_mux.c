@@ -0,0 +1,336 @@
+/* GPLv2 or OpenIB.org BSD (MIT) See COPYING file */
+#define _GNU_SOURCE
+#include <config.h>
+
+#include <stdlib.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+
+#include <util/util.h>
+#include <ccan/list.h>
+#include <ccan/minmax.h>
+#include "ibverbs.h"
+
+#define MUX_DEFAULT_ACK_BATCH	32
+#define MUX_HASH_SIZE		256
+#define MUX_MAX_WAIT		64
+
+enum mux_source_type {
+	MUX_SOURCE_CHANNEL,
+	MUX_SOURCE_ASYNC,
+};
+
+struct mux_source {
+	struct list_node entry;
+	enum mux_source_type type;
+	union {
+		struct ibv_comp_channel *channel;
+		struct ibv_context *context;
+	};
+};
+
+/* Completion events read for a CQ but not yet acknowledged */
+struct mux_cq {
+	struct list_node entry;
+	struct ibv_cq *cq;
+	unsigned int unacked;
+	/* Position in the caller's array if seen during poll number gen */
+	unsigned int gen;
+	int slot;
+};
+
+struct ibv_cq_mux {
+	int epfd;
+	unsigned int ack_batch;
+	unsigned int gen;
+	struct list_head sources;
+	struct list_head cqs[MUX_HASH_SIZE];
+};
+
+static inline struct list_head *mux_bucket(struct ibv_cq_mux *mux,
+					   struct ibv_cq *cq)
+{
+	uint64_t key = (uintptr_t)cq;
+
+	return &mux->cqs[(key * 0x9E3779B97F4A7C15ULL) >> 56];
+}
+
+static struct mux_cq *mux_get_cq(struct ibv_cq_mux *mux, struct ibv_cq *cq)
+{
+	struct list_head *bucket = mux_bucket(mux, cq);
+	struct mux_cq *mcq;
+
+	list_for_each(bucket, mcq, entry)
+		if (mcq->cq == cq)
+			return mcq;
+
+	mcq = calloc(1, sizeof(*mcq));
+	if (!mcq)
+		return NULL;
+	mcq->cq = cq;
+	mcq->gen = mux->gen - 1;
+	list_add(bucket, &mcq->entry);
+	return mcq;
+}
+
+static void mux_ack_cq(struct mux_cq *mcq)
+{
+	if (mcq->unacked)
+		ibv_ack_cq_events(mcq->cq, mcq->unacked);
+	list_del(&mcq->entry);
+	free(mcq);
+}
+
+struct ibv_cq_mux *ibv_create_cq_mux(struct ibv_cq_mux_init_attr *attr)
+{
+	struct ibv_cq_mux *mux;
+	int i;
+
+	if (attr && attr->comp_mask & ~(IBV_CQ_MUX_INIT_ATTR_RESERVED - 1)) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	mux = calloc(1, sizeof(*mux));
+	if (!mux)
+		return NULL;
+
+	mux->epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (mux->epfd < 0) {
+		free(mux);
+		return NULL;
+	}
+
+	mux->ack_batch = MUX_DEFAULT_ACK_BATCH;
+	if (attr && attr->comp_mask & IBV_CQ_MUX_INIT_ATTR_ACK_BATCH &&
+	    attr->ack_batch)
+		mux->ack_batch = attr->ack_batch;
+
+	list_head_init(&mux->sources);
+	for (i = 0; i != MUX_HASH_SIZE; i++)
+		list_head_init(&mux->cqs[i]);
+
+	return mux;
+}
+
+int ibv_destroy_cq_mux(struct ibv_cq_mux *mux)
+{
+	struct mux_source *src, *tmp;
+
+	ibv_cq_mux_flush_acks(mux, NULL);
+
+	list_for_each_safe(&mux->sources, src, tmp, entry) {
+		list_del(&src->entry);
+		free(src);
+	}
+
+	close(mux->epfd);
+	free(mux);
+	return 0;
+}
+
+static int mux_add_source(struct ibv_cq_mux *mux, struct mux_source *src,
+			  int fd)
+{
+	struct epoll_event ev = {};
+
+	ev.events = EPOLLIN;
+	ev.data.ptr = src;
+	if (epoll_ctl(mux->epfd, EPOLL_CTL_ADD, fd, &ev))
+		return errno;
+
+	list_add_tail(&mux->sources, &src->entry);
+	return 0;
+}
+
+static void mux_del_source(struct ibv_cq_mux *mux, struct mux_source *src,
+			   int fd)
+{
+	epoll_ctl(mux->epfd, EPOLL_CTL_DEL, fd, NULL);
+	list_del(&src->entry);
+	free(src);
+}
+
+int ibv_cq_mux_add_channel(struct ibv_cq_mux *mux,
+			   struct ibv_comp_channel *channel)
+{
+	struct mux_source *src;
+	int ret;
+
+	if (set_fd_nonblock(channel->fd, true))
+		return errno;
+
+	src = calloc(1, sizeof(*src));
+	if (!src)
+		return ENOMEM;
+	src->type = MUX_SOURCE_CHANNEL;
+	src->channel = channel;
+
+	ret = mux_add_source(mux, src, channel->fd);
+	if (ret)
+		free(src);
+	return ret;
+}
+
+int ibv_cq_mux_del_channel(struct ibv_cq_mux *mux,
+			   struct ibv_comp_channel *channel)
+{
+	struct mux_source *src;
+	struct mux_cq *mcq, *tmp;
+	int i;
+
+	list_for_each(&mux->sources, src, entry) {
+		if (src->type != MUX_SOURCE_CHANNEL || src->channel != channel)
+			continue;
+
+		mux_del_source(mux, src, channel->fd);
+
+		for (i = 0; i != MUX_HASH_SIZE; i++)
+			list_for_each_safe(&mux->cqs[i], mcq, tmp, entry)
+				if (mcq->cq->channel == channel)
+					mux_ack_cq(mcq);
+		return 0;
+	}
+
+	return ENOENT;
+}
+
+int ibv_cq_mux_add_async(struct ibv_cq_mux *mux, struct ibv_context *context)
+{
+	struct mux_source *src;
+	int ret;
+
+	src = calloc(1, sizeof(*src));
+	if (!src)
+		return ENOMEM;
+	src->type = MUX_SOURCE_ASYNC;
+	src->context = context;
+
+	ret = mux_add_source(mux, src, context->async_fd);
+	if (ret)
+		free(src);
+	return ret;
+}
+
+int ibv_cq_mux_del_async(struct ibv_cq_mux *mux, struct ibv_context *context)
+{
+	struct mux_source *src;
+
+	list_for_each(&mux->sources, src, entry) {
+		if (src->type == MUX_SOURCE_ASYNC && src->context == context) {
+			mux_del_source(mux, src, context->async_fd);
+			return 0;
+		}
+	}
+
+	return ENOENT;
+}
+
+int ibv_cq_mux_get_fd(struct ibv_cq_mux *mux)
+{
+	return mux->epfd;
+}
+
+/* Drain a non-blocking channel until it is empty or @events is full */
+static int mux_read_channel(struct ibv_cq_mux *mux,
+			    struct ibv_comp_channel *channel,
+			    struct ibv_cq_mux_event *events, int filled,
+			    int num_events)
+{
+	struct ibv_comp_event ev;
+	struct mux_cq *mcq;
+	struct ibv_cq *cq;
+
+	while (filled < num_events) {
+		if (read(channel->fd, &ev, sizeof(ev)) != sizeof(ev))
+			break;
+
+		cq = (struct ibv_cq *)(uintptr_t)ev.cq_handle;
+		if (cq->context->ops.cq_event)
+			cq->context->ops.cq_event(cq);
+
+		mcq = mux_get_cq(mux, cq);
+		if (!mcq) {
+			/* No memory to defer the ack, so do it now */
+			ibv_ack_cq_events(cq, 1);
+			events[filled].type = IBV_CQ_MUX_EVENT_CQ;
+			events[filled].element.cq = cq;
+			events[filled].nevents = 1;
+			filled++;
+			continue;
+		}
+
+		if (mcq->gen == mux->gen) {
+			events[mcq->slot].nevents++;
+		} else {
+			mcq->gen = mux->gen;
+			mcq->slot = filled;
+			events[filled].type = IBV_CQ_MUX_EVENT_CQ;
+			events[filled].element.cq = cq;
+			events[filled].nevents = 1;
+			filled++;
+		}
+
+		if (++mcq->unacked >= mux->ack_batch) {
+			ibv_ack_cq_events(cq, mcq->unacked);
+			mcq->unacked = 0;
+		}
+	}
+
+	return filled;
+}
+
+int ibv_cq_mux_poll(struct ibv_cq_mux *mux, struct ibv_cq_mux_event *events,
+		    int num_events, int timeout)
+{
+	struct epoll_event evs[MUX_MAX_WAIT];
+	struct mux_source *src;
+	int filled = 0;
+	int i, n;
+
+	if (num_events <= 0) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	n = epoll_wait(mux->epfd, evs, min(num_events, MUX_MAX_WAIT), timeout);
+	if (n < 0)
+		return -1;
+
+	mux->gen++;
+	for (i = 0; i != n && filled < num_events; i++) {
+		src = evs[i].data.ptr;
+
+		if (src->type == MUX_SOURCE_ASYNC) {
+			events[filled].type = IBV_CQ_MUX_EVENT_ASYNC;
+			events[filled].element.context = src->context;
+			events[filled].nevents = 0;
+			filled++;
+			continue;
+		}
+
+		/* Anything left unread is reported again by the next poll */
+		filled = mux_read_channel(mux, src->channel, events, filled,
+					  num_events);
+	}
+
+	return filled;
+}
+
+void ibv_cq_mux_flush_acks(struct ibv_cq_mux *mux, struct ibv_cq *cq)
+{
+	struct mux_cq *mcq, *tmp;
+	int i;
+
+	if (cq) {
+		list_for_each_safe(mux_bucket(mux, cq), mcq, tmp, entry)
+			if (mcq->cq == cq)
+				mux_ack_cq(mcq);
+		return;
+	}
+
+	for (i = 0; i != MUX_HASH_SIZE; i++)
+		list_for_each_safe(&mux->cqs[i], mcq, tmp, entry)
+			mux_ack_cq(mcq);
+}
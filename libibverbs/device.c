@@ -202,18 +202,24 @@ LATEST_SYMVER_FUNC(ibv_open_device, 1_1, "IBVERBS_1.1",
 	struct ibv_context *context;
 	struct verbs_context *context_ex;
 
-	if (asprintf(&devpath, "/dev/infiniband/%s", device->dev_name) < 0)
-		return NULL;
+	if (verbs_device->sysfs->loopback) {
+		/* The provider implements the device, there is no kernel one */
+		cmd_fd = -1;
+	} else {
+		if (asprintf(&devpath, "/dev/infiniband/%s",
+			     device->dev_name) < 0)
+			return NULL;
 
-	/*
-	 * We'll only be doing writes, but we need O_RDWR in case the
-	 * provider needs to mmap() the file.
-	 */
-	cmd_fd = open(devpath, O_RDWR | O_CLOEXEC);
-	free(devpath);
+		/*
+		 * We'll only be doing writes, but we need O_RDWR in case the
+		 * provider needs to mmap() the file.
+		 */
+		cmd_fd = open(devpath, O_RDWR | O_CLOEXEC);
+		free(devpath);
 
-	if (cmd_fd < 0)
-		return NULL;
+		if (cmd_fd < 0)
+			return NULL;
+	}
 
 	if (!verbs_device->ops->init_context) {
 		context = verbs_device->ops->alloc_context(device, cmd_fd);
@@ -237,6 +243,8 @@ LATEST_SYMVER_FUNC(ibv_open_device, 1_1, "IBVERBS_1.1",
 			goto err;
 		}
 
+		priv->numa_node = ibverbs_default_numa_node(device);
+		priv->cache = ibverbs_cache_alloc();
 		context_ex->priv = priv;
 		context_ex->context.abi_compat  = __VERBS_ABI_IS_EXTENDED;
 		context_ex->sz = sizeof(*context_ex);
@@ -270,15 +278,18 @@ LATEST_SYMVER_FUNC(ibv_open_device, 1_1, "IBVERBS_1.1",
 	context->cmd_fd = cmd_fd;
 	pthread_mutex_init(&context->mutex, NULL);
 
+	ibverbs_trace_context(context);
 	ibverbs_device_hold(device);
 
 	return context;
 
 verbs_err:
+	ibverbs_cache_free(context_ex->priv->cache);
 	free(context_ex->priv);
 	free(context_ex);
 err:
-	close(cmd_fd);
+	if (cmd_fd >= 0)
+		close(cmd_fd);
 	return NULL;
 }
 
@@ -296,14 +307,20 @@ LATEST_SYMVER_FUNC(ibv_close_device, 1_1, "IBVERBS_1.1",
 	context_ex = verbs_get_ctx(context);
 	if (context_ex) {
 		verbs_device->ops->uninit_context(verbs_device, context);
+		ibverbs_cache_free(context_ex->priv->cache);
 		free(context_ex->priv);
 		free(context_ex);
 	} else {
 		verbs_device->ops->free_context(context);
 	}
 
-	close(async_fd);
-	close(cmd_fd);
+	ibverbs_untrace_context(context);
+
+	/* Loopback devices have no kernel file descriptors */
+	if (async_fd >= 0)
+		close(async_fd);
+	if (cmd_fd >= 0)
+		close(cmd_fd);
 	if (abi_ver <= 2)
 		close(cq_fd);
 	ibverbs_device_put(device);
@@ -347,6 +364,17 @@ LATEST_SYMVER_FUNC(ibv_get_async_event, 1_1, "IBVERBS_1.1",
 	case IBV_EVENT_WQ_FATAL:
 		event->element.wq = (void *) (uintptr_t) ev.element;
 		break;
+	case IBV_EVENT_PORT_ACTIVE:
+	case IBV_EVENT_PORT_ERR:
+	case IBV_EVENT_LID_CHANGE:
+	case IBV_EVENT_PKEY_CHANGE:
+	case IBV_EVENT_SM_CHANGE:
+	case IBV_EVENT_CLIENT_REREGISTER:
+	case IBV_EVENT_GID_CHANGE:
+		event->element.port_num = ev.element;
+		ibverbs_cache_invalidate(context);
+		break;
+
 	default:
 		event->element.port_num = ev.element;
 		break;
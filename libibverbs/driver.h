@@ -147,7 +147,11 @@ struct verbs_sysfs_dev {
 	char ibdev_path[IBV_SYSFS_PATH_MAX];
 	char modalias[512];
 	int abi_ver;
+	/* -1 if the device is not attached to a NUMA node */
+	int numa_node;
 	struct timespec time_created;
+	/* Listed in RDMAV_LOOPBACK_DEVICES, there is no kernel device */
+	bool loopback;
 };
 
 /* Must change the PRIVATE IBVERBS_PRIVATE_ symbol if this is changed */
@@ -226,6 +230,15 @@ void verbs_init_cq(struct ibv_cq *cq, struct ibv_context *context,
 int verbs_get_action_xfrm_size(const struct ibv_action_xfrm_attr *attr,
 			       size_t *cmd, size_t *resp);
 
+/*
+ * Place page aligned memory on the context's NUMA node, see
+ * ibv_set_numa_node(). Best effort, the memory is left alone when the node
+ * is unknown or the kernel refuses.
+ */
+void verbs_numa_bind(struct ibv_context *context, void *addr, size_t length);
+/* Zeroed, page aligned and placed memory for provider tables, free() it */
+void *verbs_numa_zalloc(struct ibv_context *context, size_t size);
+
 int ibv_cmd_get_context(struct ibv_context *context, struct ibv_get_context *cmd,
 			size_t cmd_size, struct ibv_get_context_resp *resp,
 			size_t resp_size);
@@ -56,9 +56,34 @@ int ibverbs_init(void);
 void ibverbs_device_put(struct ibv_device *dev);
 void ibverbs_device_hold(struct ibv_device *dev);
 
+void ibverbs_trace_init(void);
+void ibverbs_trace_context(struct ibv_context *context);
+void ibverbs_untrace_context(struct ibv_context *context);
+
+int ibverbs_default_numa_node(struct ibv_device *device);
+
+struct ibverbs_cache;
+struct ibverbs_cache *ibverbs_cache_alloc(void);
+void ibverbs_cache_free(struct ibverbs_cache *cache);
+void ibverbs_cache_invalidate(struct ibv_context *context);
+bool ibverbs_cache_get_port(struct ibv_context *context, uint8_t port_num,
+			    struct ibv_port_attr *attr, unsigned int *gen);
+void ibverbs_cache_put_port(struct ibv_context *context, uint8_t port_num,
+			    const struct ibv_port_attr *attr, unsigned int gen);
+bool ibverbs_cache_get_gid(struct ibv_context *context, uint8_t port_num,
+			   unsigned int index, union ibv_gid *gid,
+			   enum ibv_gid_type *type, unsigned int *gen);
+void ibverbs_cache_put_gid(struct ibv_context *context, uint8_t port_num,
+			   unsigned int index, const union ibv_gid *gid,
+			   const enum ibv_gid_type *type, unsigned int gen);
+int ibverbs_cache_find_gid(struct ibv_context *context, uint8_t port_num,
+			   const union ibv_gid *gid, enum ibv_gid_type type);
+
 struct verbs_ex_private {
 	struct ibv_cq_ex *(*create_cq_ex)(struct ibv_context *context,
 					  struct ibv_cq_init_attr_ex *init_attr);
+	int numa_node;
+	struct ibverbs_cache *cache;
 };
 
 #define IBV_INIT_CMD(cmd, size, opcode)					\
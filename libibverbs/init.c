@@ -144,6 +144,12 @@ static int find_sysfs_devs(struct list_head *tmp_sysfs_dev_list)
 					sizeof(sysfs_dev->modalias)) <= 0)
 			sysfs_dev->modalias[0] = 0;
 
+		sysfs_dev->numa_node = -1;
+		if (ibv_read_sysfs_file(sysfs_dev->sysfs_path,
+					"device/numa_node", value,
+					sizeof(value)) > 0)
+			sysfs_dev->numa_node = strtol(value, NULL, 10);
+
 		list_add(tmp_sysfs_dev_list, &sysfs_dev->entry);
 		sysfs_dev      = NULL;
 	}
@@ -156,6 +162,49 @@ static int find_sysfs_devs(struct list_head *tmp_sysfs_dev_list)
 	return ret;
 }
 
+/*
+ * RDMAV_LOOPBACK_DEVICES is a comma separated list of device names that
+ * have no kernel device behind them. They are matched to a provider by
+ * name like any other device, and that provider has to implement the
+ * device entirely in user space.
+ */
+static int find_loopback_devs(struct list_head *tmp_sysfs_dev_list)
+{
+	const char *env = getenv("RDMAV_LOOPBACK_DEVICES");
+	struct verbs_sysfs_dev *sysfs_dev;
+	char *names, *name, *save;
+	int i = 0;
+
+	if (!env)
+		return 0;
+
+	names = strdup(env);
+	if (!names)
+		return ENOMEM;
+
+	for (name = strtok_r(names, ",", &save); name;
+	     name = strtok_r(NULL, ",", &save), i++) {
+		sysfs_dev = calloc(1, sizeof(*sysfs_dev));
+		if (!sysfs_dev)
+			break;
+
+		if (!check_snprintf(sysfs_dev->sysfs_name,
+				    sizeof(sysfs_dev->sysfs_name), "loop%d", i) ||
+		    !check_snprintf(sysfs_dev->ibdev_name,
+				    sizeof(sysfs_dev->ibdev_name), "%s", name)) {
+			free(sysfs_dev);
+			continue;
+		}
+
+		sysfs_dev->numa_node = -1;
+		sysfs_dev->loopback = true;
+		list_add_tail(tmp_sysfs_dev_list, &sysfs_dev->entry);
+	}
+
+	free(names);
+	return 0;
+}
+
 void verbs_register_driver(const struct verbs_device_ops *ops)
 {
 	struct ibv_driver *driver;
@@ -464,7 +513,10 @@ static struct verbs_device *try_driver(const struct verbs_device_ops *ops,
 	assert(dev->_ops._dummy1 == NULL);
 	assert(dev->_ops._dummy2 == NULL);
 
-	if (ibv_read_sysfs_file(sysfs_dev->ibdev_path, "node_type", value, sizeof value) < 0) {
+	if (sysfs_dev->loopback) {
+		dev->node_type = IBV_NODE_CA;
+	} else if (ibv_read_sysfs_file(sysfs_dev->ibdev_path, "node_type",
+				       value, sizeof value) < 0) {
 		fprintf(stderr, PFX "Warning: no node_type attr under %s.\n",
 			sysfs_dev->ibdev_path);
 			dev->node_type = IBV_NODE_UNKNOWN;
@@ -601,6 +653,10 @@ int ibverbs_get_device_list(struct list_head *device_list)
 	int ret;
 
 	ret = find_sysfs_devs(&sysfs_list);
+	if (ret && !(ret == ENOSYS && getenv("RDMAV_LOOPBACK_DEVICES")))
+		return -ret;
+
+	ret = find_loopback_devs(&sysfs_list);
 	if (ret)
 		return -ret;
 
@@ -692,13 +748,19 @@ int ibverbs_init(void)
 		return -ENOSYS;
 
 	ret = check_abi_version(sysfs_path);
-	if (ret)
-		return -ret;
+	if (ret) {
+		/* Without ib_uverbs only loopback devices can be used */
+		if (!getenv("RDMAV_LOOPBACK_DEVICES"))
+			return -ret;
+		abi_ver = IB_USER_VERBS_MAX_ABI_VERSION;
+	}
 
 	check_memlock_limit();
 
 	read_config();
 
+	ibverbs_trace_init();
+
 	return 0;
 }
 
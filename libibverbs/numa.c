@@ -0,0 +1,106 @@
+/* GPLv2 or OpenIB.org BSD (MIT) See COPYING file */
+#define _GNU_SOURCE
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+#include "ibverbs.h"
+
+/*
+ * Queue buffers, doorbell records and provider tables are placed on the
+ * NUMA node of the device, as read from sysfs when the device list is
+ * built. RDMAV_NUMA_NODE overrides this for every context, -1 turns
+ * placement off, and ibv_set_numa_node() overrides it per context.
+ *
+ * mbind() is called directly so libibverbs does not need libnuma.
+ */
+#define NUMA_MAX_NODES		1024
+#define NUMA_MASK_BITS		(8 * sizeof(unsigned long))
+
+#ifndef MPOL_PREFERRED
+#define MPOL_PREFERRED		1
+#endif
+#ifndef MPOL_MF_MOVE
+#define MPOL_MF_MOVE		(1 << 1)
+#endif
+
+int ibverbs_default_numa_node(struct ibv_device *device)
+{
+	const char *env = getenv("RDMAV_NUMA_NODE");
+	int node;
+
+	if (env) {
+		node = strtol(env, NULL, 0);
+		if (node >= -1 && node < NUMA_MAX_NODES)
+			return node;
+		fprintf(stderr, PFX "Warning: ignoring RDMAV_NUMA_NODE=%s\n",
+			env);
+	}
+
+	node = verbs_get_device(device)->sysfs->numa_node;
+	return node < NUMA_MAX_NODES ? node : -1;
+}
+
+int ibv_get_numa_node(struct ibv_context *context)
+{
+	struct verbs_context *vctx = verbs_get_ctx(context);
+
+	if (!vctx)
+		return ibverbs_default_numa_node(context->device);
+
+	return vctx->priv->numa_node;
+}
+
+int ibv_set_numa_node(struct ibv_context *context, int node)
+{
+	struct verbs_context *vctx = verbs_get_ctx(context);
+
+	if (!vctx)
+		return EOPNOTSUPP;
+
+	if (node < -1 || node >= NUMA_MAX_NODES)
+		return EINVAL;
+
+	vctx->priv->numa_node = node;
+	return 0;
+}
+
+void verbs_numa_bind(struct ibv_context *context, void *addr, size_t length)
+{
+#ifdef SYS_mbind
+	unsigned long mask[NUMA_MAX_NODES / NUMA_MASK_BITS] = {};
+	int node = ibv_get_numa_node(context);
+
+	if (node < 0 || !length)
+		return;
+
+	mask[node / NUMA_MASK_BITS] = 1UL << (node % NUMA_MASK_BITS);
+
+	/* Pages that were already touched are moved over */
+	syscall(SYS_mbind, addr, length, MPOL_PREFERRED, mask,
+		NUMA_MAX_NODES + 1, MPOL_MF_MOVE);
+#endif
+}
+
+void *verbs_numa_zalloc(struct ibv_context *context, size_t size)
+{
+	size_t page_size = sysconf(_SC_PAGESIZE);
+	void *ptr;
+	int ret;
+
+	size = (size + page_size - 1) & ~(page_size - 1);
+	ret = posix_memalign(&ptr, page_size, size);
+	if (ret) {
+		errno = ret;
+		return NULL;
+	}
+
+	verbs_numa_bind(context, ptr, size);
+	memset(ptr, 0, size);
+	return ptr;
+}
@@ -0,0 +1,380 @@
+/* GPLv2 or OpenIB.org BSD (MIT) See COPYING file */
+#define _GNU_SOURCE
+#include <config.h>
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "ibverbs.h"
+
+/*
+ * Generic work request builder for providers without init_qp_ex. The
+ * requests are accumulated in growable arrays and handed to the provider's
+ * post_send as one list by wr_complete. The sg_list pointers are only
+ * resolved at that point, since the arrays may move while growing.
+ */
+
+struct sw_wr {
+	struct ibv_send_wr wr;
+	/* First entry of this WR in sges */
+	unsigned int sge_idx;
+	/* The SGEs are offsets into inl_buf, not addresses */
+	bool inl;
+};
+
+struct sw_qp_ex {
+	struct ibv_qp_ex qpx;
+	int err;
+
+	struct sw_wr *wrs;
+	unsigned int num_wr;
+	unsigned int max_wr;
+
+	struct ibv_sge *sges;
+	unsigned int num_sge;
+	unsigned int max_sge;
+
+	uint8_t *inl_buf;
+	size_t inl_len;
+	size_t max_inl;
+};
+
+static inline struct sw_qp_ex *to_sw_qp_ex(struct ibv_qp_ex *qpx)
+{
+	return container_of(qpx, struct sw_qp_ex, qpx);
+}
+
+static int sw_grow(void **arr, unsigned int *max, size_t elem,
+		   unsigned int need)
+{
+	unsigned int new_max = *max ? *max : 16;
+	void *tmp;
+
+	if (need <= *max)
+		return 0;
+
+	while (new_max < need)
+		new_max *= 2;
+
+	tmp = realloc(*arr, new_max * elem);
+	if (!tmp)
+		return ENOMEM;
+
+	*arr = tmp;
+	*max = new_max;
+	return 0;
+}
+
+static void sw_reset(struct sw_qp_ex *sqx)
+{
+	sqx->err = 0;
+	sqx->num_wr = 0;
+	sqx->num_sge = 0;
+	sqx->inl_len = 0;
+}
+
+static struct sw_wr *sw_cur_wr(struct sw_qp_ex *sqx)
+{
+	if (sqx->err)
+		return NULL;
+
+	if (!sqx->num_wr) {
+		sqx->err = EINVAL;
+		return NULL;
+	}
+
+	return &sqx->wrs[sqx->num_wr - 1];
+}
+
+static struct ibv_send_wr *sw_new_wr(struct ibv_qp_ex *qpx,
+				     enum ibv_wr_opcode opcode)
+{
+	struct sw_qp_ex *sqx = to_sw_qp_ex(qpx);
+	struct sw_wr *swr;
+
+	if (sqx->err)
+		return NULL;
+
+	sqx->err = sw_grow((void **)&sqx->wrs, &sqx->max_wr, sizeof(*swr),
+			   sqx->num_wr + 1);
+	if (sqx->err)
+		return NULL;
+
+	swr = &sqx->wrs[sqx->num_wr++];
+	memset(swr, 0, sizeof(*swr));
+	swr->sge_idx = sqx->num_sge;
+	swr->wr.wr_id = qpx->wr_id;
+	swr->wr.send_flags = qpx->wr_flags;
+	swr->wr.opcode = opcode;
+
+	return &swr->wr;
+}
+
+/* A WR carries either SGEs or inline data, never both */
+static struct ibv_sge *sw_add_sges(struct sw_qp_ex *sqx, unsigned int num,
+				   bool inl)
+{
+	struct sw_wr *swr = sw_cur_wr(sqx);
+	struct ibv_sge *sge;
+
+	if (!swr)
+		return NULL;
+
+	if (swr->wr.num_sge && swr->inl != inl) {
+		sqx->err = EINVAL;
+		return NULL;
+	}
+	swr->inl = inl;
+
+	sqx->err = sw_grow((void **)&sqx->sges, &sqx->max_sge,
+			   sizeof(*sge), sqx->num_sge + num);
+	if (sqx->err)
+		return NULL;
+
+	sge = &sqx->sges[sqx->num_sge];
+	sqx->num_sge += num;
+	swr->wr.num_sge += num;
+	return sge;
+}
+
+static void sw_wr_start(struct ibv_qp_ex *qpx)
+{
+	sw_reset(to_sw_qp_ex(qpx));
+}
+
+static int sw_wr_complete(struct ibv_qp_ex *qpx)
+{
+	struct sw_qp_ex *sqx = to_sw_qp_ex(qpx);
+	struct ibv_send_wr *bad_wr;
+	struct sw_wr *swr;
+	unsigned int i, j;
+	int ret;
+
+	if (sqx->err || !sqx->num_wr) {
+		ret = sqx->err;
+		goto out;
+	}
+
+	for (i = 0; i != sqx->num_wr; i++) {
+		swr = &sqx->wrs[i];
+		swr->wr.next = i + 1 == sqx->num_wr ? NULL : &sqx->wrs[i + 1].wr;
+		swr->wr.sg_list = swr->wr.num_sge ?
+				  &sqx->sges[swr->sge_idx] : NULL;
+
+		if (!swr->inl)
+			continue;
+		for (j = 0; j != swr->wr.num_sge; j++)
+			swr->wr.sg_list[j].addr +=
+				(uintptr_t)sqx->inl_buf;
+	}
+
+	ret = qpx->qp->context->ops.post_send(qpx->qp, &sqx->wrs[0].wr,
+					      &bad_wr);
+out:
+	sw_reset(sqx);
+	return ret;
+}
+
+static void sw_wr_abort(struct ibv_qp_ex *qpx)
+{
+	sw_reset(to_sw_qp_ex(qpx));
+}
+
+static void sw_wr_send(struct ibv_qp_ex *qpx)
+{
+	sw_new_wr(qpx, IBV_WR_SEND);
+}
+
+static void sw_wr_send_imm(struct ibv_qp_ex *qpx, __be32 imm_data)
+{
+	struct ibv_send_wr *wr = sw_new_wr(qpx, IBV_WR_SEND_WITH_IMM);
+
+	if (wr)
+		wr->imm_data = imm_data;
+}
+
+static void sw_wr_rdma_write(struct ibv_qp_ex *qpx, uint32_t rkey,
+			     uint64_t remote_addr)
+{
+	struct ibv_send_wr *wr = sw_new_wr(qpx, IBV_WR_RDMA_WRITE);
+
+	if (wr) {
+		wr->wr.rdma.rkey = rkey;
+		wr->wr.rdma.remote_addr = remote_addr;
+	}
+}
+
+static void sw_wr_rdma_write_imm(struct ibv_qp_ex *qpx, uint32_t rkey,
+				 uint64_t remote_addr, __be32 imm_data)
+{
+	struct ibv_send_wr *wr = sw_new_wr(qpx, IBV_WR_RDMA_WRITE_WITH_IMM);
+
+	if (wr) {
+		wr->wr.rdma.rkey = rkey;
+		wr->wr.rdma.remote_addr = remote_addr;
+		wr->imm_data = imm_data;
+	}
+}
+
+static void sw_wr_rdma_read(struct ibv_qp_ex *qpx, uint32_t rkey,
+			    uint64_t remote_addr)
+{
+	struct ibv_send_wr *wr = sw_new_wr(qpx, IBV_WR_RDMA_READ);
+
+	if (wr) {
+		wr->wr.rdma.rkey = rkey;
+		wr->wr.rdma.remote_addr = remote_addr;
+	}
+}
+
+static void sw_wr_atomic_cmp_swp(struct ibv_qp_ex *qpx, uint32_t rkey,
+				 uint64_t remote_addr, uint64_t compare,
+				 uint64_t swap)
+{
+	struct ibv_send_wr *wr = sw_new_wr(qpx, IBV_WR_ATOMIC_CMP_AND_SWP);
+
+	if (wr) {
+		wr->wr.atomic.rkey = rkey;
+		wr->wr.atomic.remote_addr = remote_addr;
+		wr->wr.atomic.compare_add = compare;
+		wr->wr.atomic.swap = swap;
+	}
+}
+
+static void sw_wr_atomic_fetch_add(struct ibv_qp_ex *qpx, uint32_t rkey,
+				   uint64_t remote_addr, uint64_t add)
+{
+	struct ibv_send_wr *wr = sw_new_wr(qpx, IBV_WR_ATOMIC_FETCH_AND_ADD);
+
+	if (wr) {
+		wr->wr.atomic.rkey = rkey;
+		wr->wr.atomic.remote_addr = remote_addr;
+		wr->wr.atomic.compare_add = add;
+	}
+}
+
+static void sw_wr_set_ud_addr(struct ibv_qp_ex *qpx, struct ibv_ah *ah,
+			      uint32_t remote_qpn, uint32_t remote_qkey)
+{
+	struct sw_wr *swr = sw_cur_wr(to_sw_qp_ex(qpx));
+
+	if (swr) {
+		swr->wr.wr.ud.ah = ah;
+		swr->wr.wr.ud.remote_qpn = remote_qpn;
+		swr->wr.wr.ud.remote_qkey = remote_qkey;
+	}
+}
+
+static void sw_wr_set_xrc_srqn(struct ibv_qp_ex *qpx, uint32_t remote_srqn)
+{
+	struct sw_wr *swr = sw_cur_wr(to_sw_qp_ex(qpx));
+
+	if (swr)
+		swr->wr.qp_type.xrc.remote_srqn = remote_srqn;
+}
+
+static void sw_wr_set_sge(struct ibv_qp_ex *qpx, uint32_t lkey,
+			  uint64_t addr, uint32_t length)
+{
+	struct ibv_sge *sge = sw_add_sges(to_sw_qp_ex(qpx), 1, false);
+
+	if (sge) {
+		sge->lkey = lkey;
+		sge->addr = addr;
+		sge->length = length;
+	}
+}
+
+static void sw_wr_set_sge_list(struct ibv_qp_ex *qpx, size_t num_sge,
+			       const struct ibv_sge *sg_list)
+{
+	struct ibv_sge *sge = sw_add_sges(to_sw_qp_ex(qpx), num_sge, false);
+
+	if (sge)
+		memcpy(sge, sg_list, num_sge * sizeof(*sge));
+}
+
+static void sw_wr_set_inline_data(struct ibv_qp_ex *qpx, void *addr,
+				  size_t length)
+{
+	struct sw_qp_ex *sqx = to_sw_qp_ex(qpx);
+	struct ibv_sge *sge;
+	size_t new_max;
+	void *tmp;
+
+	if (sqx->inl_len + length > sqx->max_inl) {
+		new_max = sqx->max_inl ? sqx->max_inl : 256;
+		while (new_max < sqx->inl_len + length)
+			new_max *= 2;
+
+		tmp = realloc(sqx->inl_buf, new_max);
+		if (!tmp) {
+			if (!sqx->err)
+				sqx->err = ENOMEM;
+			return;
+		}
+		sqx->inl_buf = tmp;
+		sqx->max_inl = new_max;
+	}
+
+	sge = sw_add_sges(sqx, 1, true);
+	if (!sge)
+		return;
+
+	memcpy(sqx->inl_buf + sqx->inl_len, addr, length);
+	sge->addr = sqx->inl_len;
+	sge->length = length;
+	sge->lkey = 0;
+	sqx->inl_len += length;
+
+	sqx->wrs[sqx->num_wr - 1].wr.send_flags |= IBV_SEND_INLINE;
+}
+
+struct ibv_qp_ex *ibv_alloc_qp_ex(struct ibv_qp *qp)
+{
+	struct verbs_context *vctx;
+	struct ibv_qp_ex *qpx;
+	struct sw_qp_ex *sqx;
+
+	sqx = calloc(1, sizeof(*sqx));
+	if (!sqx) {
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	qpx = &sqx->qpx;
+	qpx->qp = qp;
+
+	vctx = verbs_get_ctx_op(qp->context, init_qp_ex);
+	if (vctx && !vctx->init_qp_ex(qp, qpx))
+		return qpx;
+
+	qpx->wr_start = sw_wr_start;
+	qpx->wr_complete = sw_wr_complete;
+	qpx->wr_abort = sw_wr_abort;
+	qpx->wr_send = sw_wr_send;
+	qpx->wr_send_imm = sw_wr_send_imm;
+	qpx->wr_rdma_write = sw_wr_rdma_write;
+	qpx->wr_rdma_write_imm = sw_wr_rdma_write_imm;
+	qpx->wr_rdma_read = sw_wr_rdma_read;
+	qpx->wr_atomic_cmp_swp = sw_wr_atomic_cmp_swp;
+	qpx->wr_atomic_fetch_add = sw_wr_atomic_fetch_add;
+	qpx->wr_set_ud_addr = sw_wr_set_ud_addr;
+	qpx->wr_set_xrc_srqn = sw_wr_set_xrc_srqn;
+	qpx->wr_set_sge = sw_wr_set_sge;
+	qpx->wr_set_sge_list = sw_wr_set_sge_list;
+	qpx->wr_set_inline_data = sw_wr_set_inline_data;
+
+	return qpx;
+}
+
+void ibv_free_qp_ex(struct ibv_qp_ex *qpx)
+{
+	struct sw_qp_ex *sqx = to_sw_qp_ex(qpx);
+
+	free(sqx->wrs);
+	free(sqx->sges);
+	free(sqx->inl_buf);
+	free(sqx);
+}
@@ -0,0 +1,646 @@
+/* GPLv2 or OpenIB.org BSD (MIT) See COPYING file */
+#define _GNU_SOURCE
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <string.h>
+#include <signal.h>
+#include <time.h>
+#include <pthread.h>
+
+#include <util/compiler.h>
+#include "ibverbs.h"
+
+/*
+ * Opt-in verbs tracing. When RDMAV_TRACE is set in the environment every
+ * context returned by ibv_open_device() has its ibv_context_ops replaced by
+ * wrappers that count each call and record its latency in a log2 histogram
+ * before forwarding to the provider. Counters live in per-thread buffers so
+ * the data path never takes a lock, and are summed when dumped.
+ *
+ * Variables:
+ *   RDMAV_TRACE         enable tracing
+ *   RDMAV_TRACE_FILE    write the report here instead of stderr
+ *   RDMAV_TRACE_SIGNAL  signal number that requests a report; the report is
+ *                       written by the next traced call made by any thread
+ */
+
+enum trace_op {
+	TRACE_QUERY_DEVICE,
+	TRACE_QUERY_PORT,
+	TRACE_ALLOC_PD,
+	TRACE_DEALLOC_PD,
+	TRACE_REG_MR,
+	TRACE_REREG_MR,
+	TRACE_DEREG_MR,
+	TRACE_CREATE_CQ,
+	TRACE_POLL_CQ,
+	TRACE_REQ_NOTIFY_CQ,
+	TRACE_RESIZE_CQ,
+	TRACE_DESTROY_CQ,
+	TRACE_CREATE_SRQ,
+	TRACE_MODIFY_SRQ,
+	TRACE_DESTROY_SRQ,
+	TRACE_POST_SRQ_RECV,
+	TRACE_CREATE_QP,
+	TRACE_QUERY_QP,
+	TRACE_MODIFY_QP,
+	TRACE_DESTROY_QP,
+	TRACE_POST_SEND,
+	TRACE_POST_RECV,
+	TRACE_CREATE_AH,
+	TRACE_DESTROY_AH,
+	TRACE_NUM_OPS
+};
+
+static const char *const trace_op_names[TRACE_NUM_OPS] = {
+	[TRACE_QUERY_DEVICE]	= "query_device",
+	[TRACE_QUERY_PORT]	= "query_port",
+	[TRACE_ALLOC_PD]	= "alloc_pd",
+	[TRACE_DEALLOC_PD]	= "dealloc_pd",
+	[TRACE_REG_MR]		= "reg_mr",
+	[TRACE_REREG_MR]	= "rereg_mr",
+	[TRACE_DEREG_MR]	= "dereg_mr",
+	[TRACE_CREATE_CQ]	= "create_cq",
+	[TRACE_POLL_CQ]		= "poll_cq",
+	[TRACE_REQ_NOTIFY_CQ]	= "req_notify_cq",
+	[TRACE_RESIZE_CQ]	= "resize_cq",
+	[TRACE_DESTROY_CQ]	= "destroy_cq",
+	[TRACE_CREATE_SRQ]	= "create_srq",
+	[TRACE_MODIFY_SRQ]	= "modify_srq",
+	[TRACE_DESTROY_SRQ]	= "destroy_srq",
+	[TRACE_POST_SRQ_RECV]	= "post_srq_recv",
+	[TRACE_CREATE_QP]	= "create_qp",
+	[TRACE_QUERY_QP]	= "query_qp",
+	[TRACE_MODIFY_QP]	= "modify_qp",
+	[TRACE_DESTROY_QP]	= "destroy_qp",
+	[TRACE_POST_SEND]	= "post_send",
+	[TRACE_POST_RECV]	= "post_recv",
+	[TRACE_CREATE_AH]	= "create_ah",
+	[TRACE_DESTROY_AH]	= "destroy_ah",
+};
+
+/* Bucket i holds calls that took [2^i, 2^(i+1)) nanoseconds */
+#define TRACE_BUCKETS 32
+
+struct trace_op_stats {
+	uint64_t calls;
+	uint64_t errors;
+	/* WRs posted or WCs polled, only for the data path ops */
+	uint64_t items;
+	uint64_t total_ns;
+	uint64_t hist[TRACE_BUCKETS];
+};
+
+struct trace_thread {
+	struct trace_thread *next;
+	struct trace_op_stats ops[TRACE_NUM_OPS];
+};
+
+/*
+ * The provider's original ops for every traced context. Entries are only
+ * ever added at the head, and are never freed since a racing data path call
+ * may still be walking the list; a closed context just clears its pointer.
+ */
+struct trace_ctx {
+	struct trace_ctx *next;
+	struct ibv_context *context;
+	struct ibv_context_ops ops;
+};
+
+static int trace_enabled;
+static FILE *trace_file;
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct trace_ctx *trace_ctxs;
+static struct trace_thread *trace_threads;
+static volatile sig_atomic_t trace_dump_requested;
+
+static __thread struct trace_thread *trace_self;
+static __thread struct trace_ctx *trace_last_ctx;
+
+static void trace_dump(void);
+
+static struct trace_thread *trace_get_thread(void)
+{
+	struct trace_thread *thr = trace_self;
+
+	if (likely(thr))
+		return thr;
+
+	/* Threads are never unregistered, so their counts survive exit */
+	thr = calloc(1, sizeof(*thr));
+	if (!thr)
+		return NULL;
+
+	pthread_mutex_lock(&trace_lock);
+	thr->next = trace_threads;
+	trace_threads = thr;
+	pthread_mutex_unlock(&trace_lock);
+
+	trace_self = thr;
+	return thr;
+}
+
+static const struct ibv_context_ops *trace_get_ops(struct ibv_context *context)
+{
+	struct trace_ctx *tctx = trace_last_ctx;
+
+	if (likely(tctx && tctx->context == context))
+		return &tctx->ops;
+
+	for (tctx = __atomic_load_n(&trace_ctxs, __ATOMIC_ACQUIRE); tctx;
+	     tctx = tctx->next) {
+		if (tctx->context == context) {
+			trace_last_ctx = tctx;
+			return &tctx->ops;
+		}
+	}
+
+	/* Only reachable if the application uses a closed context */
+	abort();
+}
+
+static inline uint64_t trace_start(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void trace_end(enum trace_op op, uint64_t start, bool err,
+		      uint64_t items)
+{
+	struct trace_thread *thr;
+	struct trace_op_stats *stats;
+	uint64_t ns = trace_start() - start;
+	unsigned int bucket;
+
+	if (unlikely(trace_dump_requested)) {
+		trace_dump_requested = 0;
+		trace_dump();
+	}
+
+	thr = trace_get_thread();
+	if (unlikely(!thr))
+		return;
+
+	bucket = ns ? 63 - __builtin_clzll(ns) : 0;
+	if (bucket >= TRACE_BUCKETS)
+		bucket = TRACE_BUCKETS - 1;
+
+	stats = &thr->ops[op];
+	stats->calls++;
+	stats->errors += err;
+	stats->items += items;
+	stats->total_ns += ns;
+	stats->hist[bucket]++;
+}
+
+static unsigned int trace_count_send_wr(struct ibv_send_wr *wr,
+					struct ibv_send_wr *stop)
+{
+	unsigned int n = 0;
+
+	for (; wr && wr != stop; wr = wr->next)
+		n++;
+	return n;
+}
+
+static unsigned int trace_count_recv_wr(struct ibv_recv_wr *wr,
+					struct ibv_recv_wr *stop)
+{
+	unsigned int n = 0;
+
+	for (; wr && wr != stop; wr = wr->next)
+		n++;
+	return n;
+}
+
+static int trace_query_device(struct ibv_context *context,
+			      struct ibv_device_attr *device_attr)
+{
+	uint64_t start = trace_start();
+	int ret;
+
+	ret = trace_get_ops(context)->query_device(context, device_attr);
+	trace_end(TRACE_QUERY_DEVICE, start, ret, 0);
+	return ret;
+}
+
+static int trace_query_port(struct ibv_context *context, uint8_t port_num,
+			    struct ibv_port_attr *port_attr)
+{
+	uint64_t start = trace_start();
+	int ret;
+
+	ret = trace_get_ops(context)->query_port(context, port_num, port_attr);
+	trace_end(TRACE_QUERY_PORT, start, ret, 0);
+	return ret;
+}
+
+static struct ibv_pd *trace_alloc_pd(struct ibv_context *context)
+{
+	uint64_t start = trace_start();
+	struct ibv_pd *pd;
+
+	pd = trace_get_ops(context)->alloc_pd(context);
+	trace_end(TRACE_ALLOC_PD, start, !pd, 0);
+	return pd;
+}
+
+static int trace_dealloc_pd(struct ibv_pd *pd)
+{
+	const struct ibv_context_ops *ops = trace_get_ops(pd->context);
+	uint64_t start = trace_start();
+	int ret;
+
+	ret = ops->dealloc_pd(pd);
+	trace_end(TRACE_DEALLOC_PD, start, ret, 0);
+	return ret;
+}
+
+static struct ibv_mr *trace_reg_mr(struct ibv_pd *pd, void *addr,
+				   size_t length, int access)
+{
+	uint64_t start = trace_start();
+	struct ibv_mr *mr;
+
+	mr = trace_get_ops(pd->context)->reg_mr(pd, addr, length, access);
+	trace_end(TRACE_REG_MR, start, !mr, 0);
+	return mr;
+}
+
+static int trace_rereg_mr(struct ibv_mr *mr, int flags, struct ibv_pd *pd,
+			  void *addr, size_t length, int access)
+{
+	uint64_t start = trace_start();
+	int ret;
+
+	ret = trace_get_ops(mr->context)->rereg_mr(mr, flags, pd, addr, length,
+						   access);
+	trace_end(TRACE_REREG_MR, start, ret, 0);
+	return ret;
+}
+
+static int trace_dereg_mr(struct ibv_mr *mr)
+{
+	const struct ibv_context_ops *ops = trace_get_ops(mr->context);
+	uint64_t start = trace_start();
+	int ret;
+
+	ret = ops->dereg_mr(mr);
+	trace_end(TRACE_DEREG_MR, start, ret, 0);
+	return ret;
+}
+
+static struct ibv_cq *trace_create_cq(struct ibv_context *context, int cqe,
+				      struct ibv_comp_channel *channel,
+				      int comp_vector)
+{
+	uint64_t start = trace_start();
+	struct ibv_cq *cq;
+
+	cq = trace_get_ops(context)->create_cq(context, cqe, channel,
+					       comp_vector);
+	trace_end(TRACE_CREATE_CQ, start, !cq, 0);
+	return cq;
+}
+
+static int trace_poll_cq(struct ibv_cq *cq, int num_entries, struct ibv_wc *wc)
+{
+	uint64_t start = trace_start();
+	int ret;
+
+	ret = trace_get_ops(cq->context)->poll_cq(cq, num_entries, wc);
+	trace_end(TRACE_POLL_CQ, start, ret < 0, ret > 0 ? ret : 0);
+	return ret;
+}
+
+static int trace_req_notify_cq(struct ibv_cq *cq, int solicited_only)
+{
+	uint64_t start = trace_start();
+	int ret;
+
+	ret = trace_get_ops(cq->context)->req_notify_cq(cq, solicited_only);
+	trace_end(TRACE_REQ_NOTIFY_CQ, start, ret, 0);
+	return ret;
+}
+
+static int trace_resize_cq(struct ibv_cq *cq, int cqe)
+{
+	uint64_t start = trace_start();
+	int ret;
+
+	ret = trace_get_ops(cq->context)->resize_cq(cq, cqe);
+	trace_end(TRACE_RESIZE_CQ, start, ret, 0);
+	return ret;
+}
+
+static int trace_destroy_cq(struct ibv_cq *cq)
+{
+	const struct ibv_context_ops *ops = trace_get_ops(cq->context);
+	uint64_t start = trace_start();
+	int ret;
+
+	ret = ops->destroy_cq(cq);
+	trace_end(TRACE_DESTROY_CQ, start, ret, 0);
+	return ret;
+}
+
+static struct ibv_srq *trace_create_srq(struct ibv_pd *pd,
+					struct ibv_srq_init_attr *srq_init_attr)
+{
+	uint64_t start = trace_start();
+	struct ibv_srq *srq;
+
+	srq = trace_get_ops(pd->context)->create_srq(pd, srq_init_attr);
+	trace_end(TRACE_CREATE_SRQ, start, !srq, 0);
+	return srq;
+}
+
+static int trace_modify_srq(struct ibv_srq *srq, struct ibv_srq_attr *srq_attr,
+			    int srq_attr_mask)
+{
+	uint64_t start = trace_start();
+	int ret;
+
+	ret = trace_get_ops(srq->context)->modify_srq(srq, srq_attr,
+						      srq_attr_mask);
+	trace_end(TRACE_MODIFY_SRQ, start, ret, 0);
+	return ret;
+}
+
+static int trace_destroy_srq(struct ibv_srq *srq)
+{
+	const struct ibv_context_ops *ops = trace_get_ops(srq->context);
+	uint64_t start = trace_start();
+	int ret;
+
+	ret = ops->destroy_srq(srq);
+	trace_end(TRACE_DESTROY_SRQ, start, ret, 0);
+	return ret;
+}
+
+static int trace_post_srq_recv(struct ibv_srq *srq,
+			       struct ibv_recv_wr *recv_wr,
+			       struct ibv_recv_wr **bad_recv_wr)
+{
+	uint64_t start = trace_start();
+	int ret;
+
+	ret = trace_get_ops(srq->context)->post_srq_recv(srq, recv_wr,
+							 bad_recv_wr);
+	trace_end(TRACE_POST_SRQ_RECV, start, ret,
+		  trace_count_recv_wr(recv_wr, ret ? *bad_recv_wr : NULL));
+	return ret;
+}
+
+static struct ibv_qp *trace_create_qp(struct ibv_pd *pd,
+				      struct ibv_qp_init_attr *attr)
+{
+	uint64_t start = trace_start();
+	struct ibv_qp *qp;
+
+	qp = trace_get_ops(pd->context)->create_qp(pd, attr);
+	trace_end(TRACE_CREATE_QP, start, !qp, 0);
+	return qp;
+}
+
+static int trace_query_qp(struct ibv_qp *qp, struct ibv_qp_attr *attr,
+			  int attr_mask, struct ibv_qp_init_attr *init_attr)
+{
+	uint64_t start = trace_start();
+	int ret;
+
+	ret = trace_get_ops(qp->context)->query_qp(qp, attr, attr_mask,
+						   init_attr);
+	trace_end(TRACE_QUERY_QP, start, ret, 0);
+	return ret;
+}
+
+static int trace_modify_qp(struct ibv_qp *qp, struct ibv_qp_attr *attr,
+			   int attr_mask)
+{
+	uint64_t start = trace_start();
+	int ret;
+
+	ret = trace_get_ops(qp->context)->modify_qp(qp, attr, attr_mask);
+	trace_end(TRACE_MODIFY_QP, start, ret, 0);
+	return ret;
+}
+
+static int trace_destroy_qp(struct ibv_qp *qp)
+{
+	const struct ibv_context_ops *ops = trace_get_ops(qp->context);
+	uint64_t start = trace_start();
+	int ret;
+
+	ret = ops->destroy_qp(qp);
+	trace_end(TRACE_DESTROY_QP, start, ret, 0);
+	return ret;
+}
+
+static int trace_post_send(struct ibv_qp *qp, struct ibv_send_wr *wr,
+			   struct ibv_send_wr **bad_wr)
+{
+	uint64_t start = trace_start();
+	int ret;
+
+	ret = trace_get_ops(qp->context)->post_send(qp, wr, bad_wr);
+	trace_end(TRACE_POST_SEND, start, ret,
+		  trace_count_send_wr(wr, ret ? *bad_wr : NULL));
+	return ret;
+}
+
+static int trace_post_recv(struct ibv_qp *qp, struct ibv_recv_wr *wr,
+			   struct ibv_recv_wr **bad_wr)
+{
+	uint64_t start = trace_start();
+	int ret;
+
+	ret = trace_get_ops(qp->context)->post_recv(qp, wr, bad_wr);
+	trace_end(TRACE_POST_RECV, start, ret,
+		  trace_count_recv_wr(wr, ret ? *bad_wr : NULL));
+	return ret;
+}
+
+static struct ibv_ah *trace_create_ah(struct ibv_pd *pd,
+				      struct ibv_ah_attr *attr)
+{
+	uint64_t start = trace_start();
+	struct ibv_ah *ah;
+
+	ah = trace_get_ops(pd->context)->create_ah(pd, attr);
+	trace_end(TRACE_CREATE_AH, start, !ah, 0);
+	return ah;
+}
+
+static int trace_destroy_ah(struct ibv_ah *ah)
+{
+	const struct ibv_context_ops *ops = trace_get_ops(ah->context);
+	uint64_t start = trace_start();
+	int ret;
+
+	ret = ops->destroy_ah(ah);
+	trace_end(TRACE_DESTROY_AH, start, ret, 0);
+	return ret;
+}
+
+static void trace_dump(void)
+{
+	struct trace_op_stats total;
+	struct trace_thread *thr;
+	unsigned int op, i;
+
+	pthread_mutex_lock(&trace_lock);
+
+	fprintf(trace_file, PFX "verbs trace for pid %d\n", getpid());
+	fprintf(trace_file, "%-14s %12s %8s %12s %10s\n",
+		"op", "calls", "errors", "wr/wc", "avg_ns");
+
+	for (op = 0; op != TRACE_NUM_OPS; op++) {
+		memset(&total, 0, sizeof(total));
+
+		/* Racy against running threads, but each counter is a
+		 * naturally aligned word so a torn total is impossible. */
+		for (thr = trace_threads; thr; thr = thr->next) {
+			total.calls += thr->ops[op].calls;
+			total.errors += thr->ops[op].errors;
+			total.items += thr->ops[op].items;
+			total.total_ns += thr->ops[op].total_ns;
+			for (i = 0; i != TRACE_BUCKETS; i++)
+				total.hist[i] += thr->ops[op].hist[i];
+		}
+
+		if (!total.calls)
+			continue;
+
+		fprintf(trace_file, "%-14s %12" PRIu64 " %8" PRIu64
+			" %12" PRIu64 " %10" PRIu64 "\n",
+			trace_op_names[op], total.calls, total.errors,
+			total.items, total.total_ns / total.calls);
+
+		for (i = 0; i != TRACE_BUCKETS; i++) {
+			if (!total.hist[i])
+				continue;
+			fprintf(trace_file, "    < %-12llu %12" PRIu64 "\n",
+				2ULL << i, total.hist[i]);
+		}
+	}
+
+	fflush(trace_file);
+	pthread_mutex_unlock(&trace_lock);
+}
+
+static void trace_signal_handler(int sig)
+{
+	trace_dump_requested = 1;
+}
+
+void ibverbs_trace_init(void)
+{
+	const char *env;
+
+	if (!getenv("RDMAV_TRACE"))
+		return;
+
+	trace_file = stderr;
+	env = getenv("RDMAV_TRACE_FILE");
+	if (env && getuid() == geteuid()) {
+		trace_file = fopen(env, "a" STREAM_CLOEXEC);
+		if (!trace_file) {
+			fprintf(stderr, PFX "Warning: couldn't open trace file %s.\n",
+				env);
+			trace_file = stderr;
+		}
+	}
+
+	env = getenv("RDMAV_TRACE_SIGNAL");
+	if (env) {
+		struct sigaction act = {};
+		int sig = strtol(env, NULL, 0);
+
+		act.sa_handler = trace_signal_handler;
+		act.sa_flags = SA_RESTART;
+		if (sigaction(sig, &act, NULL))
+			fprintf(stderr, PFX "Warning: couldn't install trace signal %d.\n",
+				sig);
+	}
+
+	if (atexit(trace_dump))
+		fprintf(stderr, PFX "Warning: couldn't register trace report.\n");
+
+	trace_enabled = 1;
+}
+
+#define TRACE_HOOK(ops, name)                                                  \
+	do {                                                                   \
+		if ((ops)->name)                                               \
+			(ops)->name = trace_##name;                            \
+	} while (0)
+
+void ibverbs_trace_context(struct ibv_context *context)
+{
+	struct ibv_context_ops *ops = &context->ops;
+	struct trace_ctx *tctx;
+
+	if (!trace_enabled)
+		return;
+
+	tctx = calloc(1, sizeof(*tctx));
+	if (!tctx) {
+		fprintf(stderr, PFX "Warning: couldn't trace context of %s.\n",
+			context->device->name);
+		return;
+	}
+	tctx->context = context;
+	tctx->ops = *ops;
+
+	pthread_mutex_lock(&trace_lock);
+	tctx->next = trace_ctxs;
+	__atomic_store_n(&trace_ctxs, tctx, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&trace_lock);
+
+	TRACE_HOOK(ops, query_device);
+	TRACE_HOOK(ops, query_port);
+	TRACE_HOOK(ops, alloc_pd);
+	TRACE_HOOK(ops, dealloc_pd);
+	TRACE_HOOK(ops, reg_mr);
+	TRACE_HOOK(ops, rereg_mr);
+	TRACE_HOOK(ops, dereg_mr);
+	TRACE_HOOK(ops, create_cq);
+	TRACE_HOOK(ops, poll_cq);
+	TRACE_HOOK(ops, req_notify_cq);
+	TRACE_HOOK(ops, resize_cq);
+	TRACE_HOOK(ops, destroy_cq);
+	TRACE_HOOK(ops, create_srq);
+	TRACE_HOOK(ops, modify_srq);
+	TRACE_HOOK(ops, destroy_srq);
+	TRACE_HOOK(ops, post_srq_recv);
+	TRACE_HOOK(ops, create_qp);
+	TRACE_HOOK(ops, query_qp);
+	TRACE_HOOK(ops, modify_qp);
+	TRACE_HOOK(ops, destroy_qp);
+	TRACE_HOOK(ops, post_send);
+	TRACE_HOOK(ops, post_recv);
+	TRACE_HOOK(ops, create_ah);
+	TRACE_HOOK(ops, destroy_ah);
+}
+
+void ibverbs_untrace_context(struct ibv_context *context)
+{
+	struct trace_ctx *tctx;
+
+	if (!trace_enabled)
+		return;
+
+	pthread_mutex_lock(&trace_lock);
+	for (tctx = trace_ctxs; tctx; tctx = tctx->next)
+		if (tctx->context == context)
+			tctx->context = NULL;
+	pthread_mutex_unlock(&trace_lock);
+}
@@ -149,13 +149,21 @@ LATEST_SYMVER_FUNC(ibv_query_port, 1_1, "IBVERBS_1.1",
 		   struct ibv_context *context, uint8_t port_num,
 		   struct ibv_port_attr *port_attr)
 {
-	return context->ops.query_port(context, port_num, port_attr);
+	unsigned int gen;
+	int ret;
+
+	if (ibverbs_cache_get_port(context, port_num, port_attr, &gen))
+		return 0;
+
+	ret = context->ops.query_port(context, port_num, port_attr);
+	if (!ret)
+		ibverbs_cache_put_port(context, port_num, port_attr, gen);
+
+	return ret;
 }
 
-LATEST_SYMVER_FUNC(ibv_query_gid, 1_1, "IBVERBS_1.1",
-		   int,
-		   struct ibv_context *context, uint8_t port_num,
-		   int index, union ibv_gid *gid)
+static int query_gid_sysfs(struct ibv_context *context, uint8_t port_num,
+			   int index, union ibv_gid *gid)
 {
 	char name[24];
 	char attr[41];
@@ -178,6 +186,27 @@ LATEST_SYMVER_FUNC(ibv_query_gid, 1_1, "IBVERBS_1.1",
 	return 0;
 }
 
+LATEST_SYMVER_FUNC(ibv_query_gid, 1_1, "IBVERBS_1.1",
+		   int,
+		   struct ibv_context *context, uint8_t port_num,
+		   int index, union ibv_gid *gid)
+{
+	unsigned int gen;
+	int ret;
+
+	if (index < 0)
+		return query_gid_sysfs(context, port_num, index, gid);
+
+	if (ibverbs_cache_get_gid(context, port_num, index, gid, NULL, &gen))
+		return 0;
+
+	ret = query_gid_sysfs(context, port_num, index, gid);
+	if (!ret)
+		ibverbs_cache_put_gid(context, port_num, index, gid, NULL, gen);
+
+	return ret;
+}
+
 LATEST_SYMVER_FUNC(ibv_query_pkey, 1_1, "IBVERBS_1.1",
 		   int,
 		   struct ibv_context *context, uint8_t port_num,
@@ -606,8 +635,8 @@ LATEST_SYMVER_FUNC(ibv_create_ah, 1_1, "IBVERBS_1.1",
  */
 #define V1_TYPE "IB/RoCE v1"
 #define V2_TYPE "RoCE v2"
-int ibv_query_gid_type(struct ibv_context *context, uint8_t port_num,
-		       unsigned int index, enum ibv_gid_type *type)
+static int query_gid_type_sysfs(struct ibv_context *context, uint8_t port_num,
+				unsigned int index, enum ibv_gid_type *type)
 {
 	char name[32];
 	char buff[11];
@@ -665,6 +694,22 @@ int ibv_query_gid_type(struct ibv_context *context, uint8_t port_num,
 	return 0;
 }
 
+int ibv_query_gid_type(struct ibv_context *context, uint8_t port_num,
+		       unsigned int index, enum ibv_gid_type *type)
+{
+	unsigned int gen;
+	int ret;
+
+	if (ibverbs_cache_get_gid(context, port_num, index, NULL, type, &gen))
+		return 0;
+
+	ret = query_gid_type_sysfs(context, port_num, index, type);
+	if (!ret)
+		ibverbs_cache_put_gid(context, port_num, index, NULL, type, gen);
+
+	return ret;
+}
+
 static int ibv_find_gid_index(struct ibv_context *context, uint8_t port_num,
 			      union ibv_gid *gid, enum ibv_gid_type gid_type)
 {
@@ -672,6 +717,10 @@ static int ibv_find_gid_index(struct ibv_context *context, uint8_t port_num,
 	union ibv_gid sgid;
 	int i = 0, ret;
 
+	ret = ibverbs_cache_find_gid(context, port_num, gid, gid_type);
+	if (ret >= 0)
+		return ret;
+
 	do {
 		ret = ibv_query_gid(context, port_num, i, &sgid);
 		if (!ret) {
@@ -1623,8 +1623,11 @@ enum verbs_context_mask {
 	VERBS_CONTEXT_RESERVED	= 1 << 5
 };
 
+struct ibv_qp_ex;
+
 struct verbs_context {
 	/*  "grows up" - new fields go here */
+	int (*init_qp_ex)(struct ibv_qp *qp, struct ibv_qp_ex *qpx);
 	int (*modify_action_xfrm)(struct _ibv_action_xfrm *action,
 				  const struct ibv_action_xfrm_attr *attr);
 	int (*destroy_action_xfrm)(struct _ibv_action_xfrm *action);
@@ -1722,6 +1725,19 @@ struct ibv_context *ibv_open_device(struct ibv_device *device);
  */
 int ibv_close_device(struct ibv_context *context);
 
+/**
+ * ibv_get_numa_node - Get the NUMA node resources of a context are placed on
+ *
+ * Returns -1 if the memory is not placed on a particular node.
+ */
+int ibv_get_numa_node(struct ibv_context *context);
+
+/**
+ * ibv_set_numa_node - Place resources created from now on on another node
+ * @node: NUMA node number, or -1 to leave placement to the kernel
+ */
+int ibv_set_numa_node(struct ibv_context *context, int node);
+
 /**
  * ibv_get_async_event - Get next async event
  * @event: Pointer to use to return async event
@@ -2043,6 +2059,104 @@ int ibv_get_cq_event(struct ibv_comp_channel *channel,
  */
 void ibv_ack_cq_events(struct ibv_cq *cq, unsigned int nevents);
 
+enum ibv_cq_mux_event_type {
+	IBV_CQ_MUX_EVENT_CQ,
+	IBV_CQ_MUX_EVENT_ASYNC,
+};
+
+struct ibv_cq_mux_event {
+	enum ibv_cq_mux_event_type	type;
+	union {
+		/* IBV_CQ_MUX_EVENT_CQ */
+		struct ibv_cq	       *cq;
+		/* IBV_CQ_MUX_EVENT_ASYNC, ibv_get_async_event() won't block */
+		struct ibv_context     *context;
+	} element;
+	/* Completion events coalesced into this entry */
+	uint32_t			nevents;
+};
+
+enum ibv_cq_mux_init_attr_mask {
+	IBV_CQ_MUX_INIT_ATTR_ACK_BATCH	= 1 << 0,
+	IBV_CQ_MUX_INIT_ATTR_RESERVED	= 1 << 1,
+};
+
+struct ibv_cq_mux_init_attr {
+	uint32_t	comp_mask;
+	/* Completion events per CQ accumulated before they are acked */
+	uint32_t	ack_batch;
+};
+
+struct ibv_cq_mux;
+
+/**
+ * ibv_create_cq_mux - Create an event multiplexer for completion channels
+ * @attr: Optional attributes, may be NULL
+ *
+ * The multiplexer waits on many completion channels and device async
+ * event fds at once, returns the CQs that got events in batches, and
+ * acknowledges the completion events on behalf of the caller.
+ */
+struct ibv_cq_mux *ibv_create_cq_mux(struct ibv_cq_mux_init_attr *attr);
+
+/**
+ * ibv_destroy_cq_mux - Acknowledge all pending events and free the mux
+ */
+int ibv_destroy_cq_mux(struct ibv_cq_mux *mux);
+
+/**
+ * ibv_cq_mux_add_channel - Start waiting for events on @channel
+ *
+ * The channel's fd is switched to non-blocking mode.
+ */
+int ibv_cq_mux_add_channel(struct ibv_cq_mux *mux,
+			   struct ibv_comp_channel *channel);
+
+/**
+ * ibv_cq_mux_del_channel - Stop waiting on @channel and ack its CQs' events
+ */
+int ibv_cq_mux_del_channel(struct ibv_cq_mux *mux,
+			   struct ibv_comp_channel *channel);
+
+/**
+ * ibv_cq_mux_add_async - Report when @context has an async event pending
+ */
+int ibv_cq_mux_add_async(struct ibv_cq_mux *mux, struct ibv_context *context);
+
+/**
+ * ibv_cq_mux_del_async - Stop reporting async events for @context
+ */
+int ibv_cq_mux_del_async(struct ibv_cq_mux *mux, struct ibv_context *context);
+
+/**
+ * ibv_cq_mux_get_fd - Return an fd that is readable when events are pending
+ */
+int ibv_cq_mux_get_fd(struct ibv_cq_mux *mux);
+
+/**
+ * ibv_cq_mux_poll - Wait for events on the multiplexer
+ * @mux: Multiplexer to wait on
+ * @events: Array of at least @num_events entries to fill
+ * @num_events: Maximum number of entries to return
+ * @timeout: Milliseconds to wait, -1 to wait forever, 0 to not wait
+ *
+ * Each CQ appears at most once per call, all completion events read for it
+ * are counted in nevents. The events are acknowledged internally, the
+ * caller must not call ibv_ack_cq_events() for them. Returns the number of
+ * entries filled, or -1 and sets errno.
+ */
+int ibv_cq_mux_poll(struct ibv_cq_mux *mux, struct ibv_cq_mux_event *events,
+		    int num_events, int timeout);
+
+/**
+ * ibv_cq_mux_flush_acks - Acknowledge pending events now
+ * @cq: CQ to acknowledge, or NULL for every CQ seen by @mux
+ *
+ * Must be called before destroying a CQ whose events were delivered by the
+ * multiplexer, since ibv_destroy_cq() waits for all events to be acked.
+ */
+void ibv_cq_mux_flush_acks(struct ibv_cq_mux *mux, struct ibv_cq *cq);
+
 /**
  * ibv_poll_cq - Poll a CQ for work completions
  * @cq:the CQ being polled
@@ -2410,6 +2524,154 @@ static inline int ibv_post_send(struct ibv_qp *qp, struct ibv_send_wr *wr,
 	return qp->context->ops.post_send(qp, wr, bad_wr);
 }
 
+/*
+ * Work request builder. Instead of building a list of ibv_send_wr for
+ * ibv_post_send(), the caller opens a batch with ibv_wr_start(), and for
+ * each work request sets wr_id and wr_flags, calls one opcode function
+ * and then the setters its opcode and QP type need. ibv_wr_complete()
+ * posts the whole batch, ibv_wr_abort() discards it. Providers that
+ * support this write the WQEs directly, others get a generic
+ * implementation on top of post_send.
+ *
+ * Inline data is copied by ibv_wr_set_inline_data(), the buffer may be
+ * reused as soon as it returns.
+ */
+struct ibv_qp_ex {
+	struct ibv_qp *qp;
+	uint64_t comp_mask;
+
+	uint64_t wr_id;
+	/* Or'ed value of enum ibv_send_flags */
+	unsigned int wr_flags;
+
+	void (*wr_start)(struct ibv_qp_ex *qpx);
+	int (*wr_complete)(struct ibv_qp_ex *qpx);
+	void (*wr_abort)(struct ibv_qp_ex *qpx);
+
+	void (*wr_send)(struct ibv_qp_ex *qpx);
+	void (*wr_send_imm)(struct ibv_qp_ex *qpx, __be32 imm_data);
+	void (*wr_rdma_write)(struct ibv_qp_ex *qpx, uint32_t rkey,
+			      uint64_t remote_addr);
+	void (*wr_rdma_write_imm)(struct ibv_qp_ex *qpx, uint32_t rkey,
+				  uint64_t remote_addr, __be32 imm_data);
+	void (*wr_rdma_read)(struct ibv_qp_ex *qpx, uint32_t rkey,
+			     uint64_t remote_addr);
+	void (*wr_atomic_cmp_swp)(struct ibv_qp_ex *qpx, uint32_t rkey,
+				  uint64_t remote_addr, uint64_t compare,
+				  uint64_t swap);
+	void (*wr_atomic_fetch_add)(struct ibv_qp_ex *qpx, uint32_t rkey,
+				    uint64_t remote_addr, uint64_t add);
+
+	void (*wr_set_ud_addr)(struct ibv_qp_ex *qpx, struct ibv_ah *ah,
+			       uint32_t remote_qpn, uint32_t remote_qkey);
+	void (*wr_set_xrc_srqn)(struct ibv_qp_ex *qpx, uint32_t remote_srqn);
+	void (*wr_set_sge)(struct ibv_qp_ex *qpx, uint32_t lkey,
+			   uint64_t addr, uint32_t length);
+	void (*wr_set_sge_list)(struct ibv_qp_ex *qpx, size_t num_sge,
+				const struct ibv_sge *sg_list);
+	void (*wr_set_inline_data)(struct ibv_qp_ex *qpx, void *addr,
+				   size_t length);
+};
+
+/**
+ * ibv_alloc_qp_ex - Get a work request builder for a QP
+ *
+ * Only one builder may be used on a QP at any time. It must be freed with
+ * ibv_free_qp_ex() before the QP is destroyed.
+ */
+struct ibv_qp_ex *ibv_alloc_qp_ex(struct ibv_qp *qp);
+
+/**
+ * ibv_free_qp_ex - Free a work request builder
+ */
+void ibv_free_qp_ex(struct ibv_qp_ex *qpx);
+
+static inline void ibv_wr_start(struct ibv_qp_ex *qpx)
+{
+	qpx->wr_start(qpx);
+}
+
+static inline int ibv_wr_complete(struct ibv_qp_ex *qpx)
+{
+	return qpx->wr_complete(qpx);
+}
+
+static inline void ibv_wr_abort(struct ibv_qp_ex *qpx)
+{
+	qpx->wr_abort(qpx);
+}
+
+static inline void ibv_wr_send(struct ibv_qp_ex *qpx)
+{
+	qpx->wr_send(qpx);
+}
+
+static inline void ibv_wr_send_imm(struct ibv_qp_ex *qpx, __be32 imm_data)
+{
+	qpx->wr_send_imm(qpx, imm_data);
+}
+
+static inline void ibv_wr_rdma_write(struct ibv_qp_ex *qpx, uint32_t rkey,
+				     uint64_t remote_addr)
+{
+	qpx->wr_rdma_write(qpx, rkey, remote_addr);
+}
+
+static inline void ibv_wr_rdma_write_imm(struct ibv_qp_ex *qpx, uint32_t rkey,
+					 uint64_t remote_addr, __be32 imm_data)
+{
+	qpx->wr_rdma_write_imm(qpx, rkey, remote_addr, imm_data);
+}
+
+static inline void ibv_wr_rdma_read(struct ibv_qp_ex *qpx, uint32_t rkey,
+				    uint64_t remote_addr)
+{
+	qpx->wr_rdma_read(qpx, rkey, remote_addr);
+}
+
+static inline void ibv_wr_atomic_cmp_swp(struct ibv_qp_ex *qpx, uint32_t rkey,
+					 uint64_t remote_addr, uint64_t compare,
+					 uint64_t swap)
+{
+	qpx->wr_atomic_cmp_swp(qpx, rkey, remote_addr, compare, swap);
+}
+
+static inline void ibv_wr_atomic_fetch_add(struct ibv_qp_ex *qpx, uint32_t rkey,
+					   uint64_t remote_addr, uint64_t add)
+{
+	qpx->wr_atomic_fetch_add(qpx, rkey, remote_addr, add);
+}
+
+static inline void ibv_wr_set_ud_addr(struct ibv_qp_ex *qpx, struct ibv_ah *ah,
+				      uint32_t remote_qpn, uint32_t remote_qkey)
+{
+	qpx->wr_set_ud_addr(qpx, ah, remote_qpn, remote_qkey);
+}
+
+static inline void ibv_wr_set_xrc_srqn(struct ibv_qp_ex *qpx,
+				       uint32_t remote_srqn)
+{
+	qpx->wr_set_xrc_srqn(qpx, remote_srqn);
+}
+
+static inline void ibv_wr_set_sge(struct ibv_qp_ex *qpx, uint32_t lkey,
+				  uint64_t addr, uint32_t length)
+{
+	qpx->wr_set_sge(qpx, lkey, addr, length);
+}
+
+static inline void ibv_wr_set_sge_list(struct ibv_qp_ex *qpx, size_t num_sge,
+				       const struct ibv_sge *sg_list)
+{
+	qpx->wr_set_sge_list(qpx, num_sge, sg_list);
+}
+
+static inline void ibv_wr_set_inline_data(struct ibv_qp_ex *qpx, void *addr,
+					  size_t length)
+{
+	qpx->wr_set_inline_data(qpx, addr, length);
+}
+
 /**
  * ibv_post_recv - Post a list of work requests to a receive queue.
  */
@@ -43,9 +43,11 @@
 #include <rdma/rdma_cma.h>
 #include <infiniband/ib.h>
 #include <infiniband/sa.h>
+#include <ccan/list.h>
 
 #define ACM_VERSION             1
 
+#define ACM_OP_MASK             0x0F
 #define ACM_OP_RESOLVE          0x01
 #define ACM_OP_ACK              0x80
 
@@ -110,7 +112,25 @@ struct acm_msg {
 	};
 };
 
+/*
+ * Requests are tagged with a transaction ID so that threads resolving in
+ * parallel can all have a request in flight. acm_lock is only held across
+ * send(). Waiting threads take turns reading the socket, and the reader
+ * hands each response to the request with the matching ID.
+ */
+struct acm_request {
+	struct list_node entry;
+	uint64_t tid;
+	struct acm_msg *msg;
+	int done;
+	int err;
+};
+
 static pthread_mutex_t acm_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t acm_cond = PTHREAD_COND_INITIALIZER;
+static LIST_HEAD(acm_pending);
+static uint64_t acm_tid;
+static int acm_reading;
 static int sock = -1;
 static uint16_t server_port;
 
@@ -169,6 +189,94 @@ void ucma_ib_cleanup(void)
 	}
 }
 
+static int ucma_ib_recv_msg(struct acm_msg *msg)
+{
+	int ret, len;
+
+	ret = recv(sock, (char *) msg, ACM_MSG_HDR_LENGTH, MSG_WAITALL);
+	if (ret != ACM_MSG_HDR_LENGTH)
+		return ENOTCONN;
+
+	len = ((msg->hdr.opcode & ACM_OP_MASK) == ACM_OP_RESOLVE) ?
+		msg->hdr.length : be16toh(msg->hdr.length);
+	if (len < ACM_MSG_HDR_LENGTH || len > sizeof(*msg))
+		return EINVAL;
+
+	len -= ACM_MSG_HDR_LENGTH;
+	if (len) {
+		ret = recv(sock, (char *) msg->data, len, MSG_WAITALL);
+		if (ret != len)
+			return ENOTCONN;
+	}
+	return 0;
+}
+
+/*
+ * Read one response, dropping acm_lock while blocked. A broken stream
+ * fails every pending request.
+ */
+static void ucma_ib_read_resp(void)
+{
+	struct acm_request *req, *next;
+	struct acm_msg msg;
+	int err;
+
+	acm_reading = 1;
+	pthread_mutex_unlock(&acm_lock);
+	err = ucma_ib_recv_msg(&msg);
+	pthread_mutex_lock(&acm_lock);
+	acm_reading = 0;
+
+	if (err && sock >= 0) {
+		shutdown(sock, SHUT_RDWR);
+		close(sock);
+		sock = -1;
+	}
+
+	list_for_each_safe(&acm_pending, req, next, entry) {
+		if (!err && req->tid != msg.hdr.tid)
+			continue;
+
+		list_del(&req->entry);
+		if (!err)
+			memcpy(req->msg, &msg, sizeof(msg));
+		req->err = err;
+		req->done = 1;
+		if (!err)
+			break;
+	}
+	pthread_cond_broadcast(&acm_cond);
+}
+
+/* Send @msg and wait for the response, which overwrites it */
+static int ucma_ib_query(struct acm_msg *msg)
+{
+	struct acm_request req = {};
+	int ret;
+
+	pthread_mutex_lock(&acm_lock);
+	req.tid = msg->hdr.tid = ++acm_tid;
+	req.msg = msg;
+	list_add_tail(&acm_pending, &req.entry);
+
+	ret = send(sock, (char *) msg, msg->hdr.length, MSG_NOSIGNAL);
+	if (ret != msg->hdr.length) {
+		list_del(&req.entry);
+		pthread_mutex_unlock(&acm_lock);
+		return -1;
+	}
+
+	while (!req.done) {
+		if (acm_reading)
+			pthread_cond_wait(&acm_cond, &acm_lock);
+		else
+			ucma_ib_read_resp();
+	}
+	pthread_mutex_unlock(&acm_lock);
+
+	return req.err ? -1 : 0;
+}
+
 static int ucma_ib_set_addr(struct rdma_addrinfo *ib_rai,
 			    struct rdma_addrinfo *rai)
 {
@@ -424,16 +532,8 @@ void ucma_ib_resolve(struct rdma_addrinfo **rai,
 		msg.hdr.length += ACM_MSG_EP_LENGTH;
 	}
 
-	pthread_mutex_lock(&acm_lock);
-	ret = send(sock, (char *) &msg, msg.hdr.length, 0);
-	if (ret != msg.hdr.length) {
-		pthread_mutex_unlock(&acm_lock);
-		return;
-	}
-
-	ret = recv(sock, (char *) &msg, sizeof msg, 0);
-	pthread_mutex_unlock(&acm_lock);
-	if (ret < ACM_MSG_HDR_LENGTH || ret != msg.hdr.length || msg.hdr.status)
+	ret = ucma_ib_query(&msg);
+	if (ret || msg.hdr.status)
 		return;
 
 	ucma_ib_save_resp(*rai, &msg);
@@ -41,6 +41,7 @@
 #define __MEMORY_H__
 
 #include <pthread.h>
+#include <util/ring.h>
 
 struct bnxt_re_queue {
 	void *va;
@@ -94,7 +95,7 @@ static inline void iowrite32(__u32 *dst, __le32 *src)
 /* Basic queue operation */
 static inline uint32_t bnxt_re_is_que_full(struct bnxt_re_queue *que)
 {
-	return (((que->diff + que->tail) & (que->depth - 1)) == que->head);
+	return ring_mask_free(que->tail, que->head, que->depth) < que->diff;
 }
 
 static inline uint32_t bnxt_re_is_que_empty(struct bnxt_re_queue *que)
@@ -104,7 +105,7 @@ static inline uint32_t bnxt_re_is_que_empty(struct bnxt_re_queue *que)
 
 static inline uint32_t bnxt_re_incr(uint32_t val, uint32_t max)
 {
-	return (++val & (max - 1));
+	return ring_mask_advance(val, 1, max);
 }
 
 static inline void bnxt_re_incr_tail(struct bnxt_re_queue *que)
@@ -1180,30 +1180,30 @@ int bnxt_re_post_send(struct ibv_qp *ibvqp, struct ibv_send_wr *wr,
 	struct bnxt_re_wrid *wrid;
 	struct bnxt_re_psns *psns;
 	void *sqe;
-	int ret = 0, bytes = 0;
+	int ret = 0, bytes = 0, nreq = 0;
 	uint8_t is_inline = false;
 
 	pthread_spin_lock(&sq->qlock);
 	while (wr) {
 		if ((qp->qpst != IBV_QPS_RTS) && (qp->qpst != IBV_QPS_SQD)) {
 			*bad = wr;
-			pthread_spin_unlock(&sq->qlock);
-			return EINVAL;
+			ret = EINVAL;
+			break;
 		}
 
 		if ((qp->qptyp == IBV_QPT_UD) &&
 		    (wr->opcode != IBV_WR_SEND &&
 		     wr->opcode != IBV_WR_SEND_WITH_IMM)) {
 			*bad = wr;
-			pthread_spin_unlock(&sq->qlock);
-			return EINVAL;
+			ret = EINVAL;
+			break;
 		}
 
 		if (bnxt_re_is_que_full(sq) ||
 		    wr->num_sge > qp->cap.max_ssge) {
 			*bad = wr;
-			pthread_spin_unlock(&sq->qlock);
-			return ENOMEM;
+			ret = ENOMEM;
+			break;
 		}
 
 		sqe = (void *)(sq->va + (sq->tail * sq->stride));
@@ -1261,14 +1261,16 @@ int bnxt_re_post_send(struct ibv_qp *ibvqp, struct ibv_send_wr *wr,
 		bnxt_re_fill_psns(qp, psns, wr->opcode, bytes);
 		bnxt_re_incr_tail(sq);
 		qp->wqe_cnt++;
+		nreq++;
 		wr = wr->next;
-		bnxt_re_ring_sq_db(qp);
 		if (qp->wqe_cnt == BNXT_RE_UD_QP_HW_STALL && qp->qptyp ==
 		    IBV_QPT_UD) {
 			/* Move RTS to RTS since it is time. */
 			struct ibv_qp_attr attr;
 			int attr_mask;
 
+			bnxt_re_ring_sq_db(qp);
+			nreq = 0;
 			attr_mask = IBV_QP_STATE;
 			attr.qp_state = IBV_QPS_RTS;
 			bnxt_re_modify_qp(&qp->ibvqp, &attr, attr_mask);
@@ -1276,6 +1278,9 @@ int bnxt_re_post_send(struct ibv_qp *ibvqp, struct ibv_send_wr *wr,
 		}
 	}
 
+	/* The doorbell carries the tail, so one covers the whole list */
+	if (nreq)
+		bnxt_re_ring_sq_db(qp);
 	pthread_spin_unlock(&sq->qlock);
 	return ret;
 }
@@ -1320,40 +1325,42 @@ int bnxt_re_post_recv(struct ibv_qp *ibvqp, struct ibv_recv_wr *wr,
 	struct bnxt_re_qp *qp = to_bnxt_re_qp(ibvqp);
 	struct bnxt_re_queue *rq = qp->rqq;
 	void *rqe;
-	int ret;
+	int ret = 0, nreq = 0;
 
 	pthread_spin_lock(&rq->qlock);
 	while (wr) {
 		/* check QP state, abort if it is ERR or RST */
 		if (qp->qpst == IBV_QPS_RESET || qp->qpst == IBV_QPS_ERR) {
 			*bad = wr;
-			pthread_spin_unlock(&rq->qlock);
-			return EINVAL;
+			ret = EINVAL;
+			break;
 		}
 
 		if (bnxt_re_is_que_full(rq) ||
 		    wr->num_sge > qp->cap.max_rsge) {
-			pthread_spin_unlock(&rq->qlock);
 			*bad = wr;
-			return ENOMEM;
+			ret = ENOMEM;
+			break;
 		}
 
 		rqe = (void *)(rq->va + (rq->tail * rq->stride));
 		memset(rqe, 0, bnxt_re_get_rqe_sz());
-		ret = bnxt_re_build_rqe(qp, wr, rqe);
-		if (ret < 0) {
-			pthread_spin_unlock(&rq->qlock);
+		if (bnxt_re_build_rqe(qp, wr, rqe) < 0) {
 			*bad = wr;
-			return ENOMEM;
+			ret = ENOMEM;
+			break;
 		}
 
 		bnxt_re_incr_tail(rq);
+		nreq++;
 		wr = wr->next;
-		bnxt_re_ring_rq_db(qp);
 	}
+
+	if (nreq)
+		bnxt_re_ring_rq_db(qp);
 	pthread_spin_unlock(&rq->qlock);
 
-	return 0;
+	return ret;
 }
 
 struct ibv_srq *bnxt_re_create_srq(struct ibv_pd *ibvpd,
@@ -33,6 +33,7 @@
 #include <stdio.h>
 #include <string.h>
 #include <malloc.h>
+#include <util/ring.h>
 #include "hns_roce_u_db.h"
 #include "hns_roce_u_hw_v1.h"
 #include "hns_roce_u.h"
@@ -110,7 +111,7 @@ static void hns_roce_update_cq_cons_index(struct hns_roce_context *ctx,
 		       cq->cqn);
 	roce_set_field(cq_db.u32_4, CQ_DB_U32_4_CONS_IDX_M,
 		       CQ_DB_U32_4_CONS_IDX_S,
-		       cq->cons_index & ((cq->cq_depth << 1) - 1));
+		       ring_pow2_wrap(cq->cons_index, cq->cq_depth));
 
 	hns_roce_write64((uint32_t *)&cq_db, ctx, ROCEE_DB_OTHERS_L_0_REG);
 }
@@ -203,24 +204,42 @@ static void *get_send_wqe(struct hns_roce_qp *qp, int n)
 	return (void *)(qp->buf.buf + qp->sq.offset + (n << qp->sq.wqe_shift));
 }
 
-static int hns_roce_wq_overflow(struct hns_roce_wq *wq, int nreq,
-				struct hns_roce_cq *cq)
+/*
+ * Number of WQEs that can be posted from wq->head on. wq->tail is moved by
+ * the poller, so it is only read under the CQ lock once the queue looks
+ * full.
+ */
+static unsigned int hns_roce_wq_free(struct hns_roce_wq *wq,
+				     struct hns_roce_cq *cq)
 {
 	unsigned int cur;
 
-	cur = wq->head - wq->tail;
-	if (cur + nreq < wq->max_post)
-		return 0;
+	cur = ring_pow2_count(wq->head, wq->tail, wq->wqe_cnt);
+	if (cur < wq->max_post)
+		return wq->max_post - cur;
 
 	/* While the num of wqe exceeds cap of the device, cq will be locked */
 	pthread_spin_lock(&cq->lock);
-	cur = wq->head - wq->tail;
+	cur = ring_pow2_count(wq->head, wq->tail, wq->wqe_cnt);
 	pthread_spin_unlock(&cq->lock);
 
+	return cur < wq->max_post ? wq->max_post - cur : 0;
+}
+
+/* @room is what the post call reserved so far, refreshed once it runs out */
+static int hns_roce_wq_overflow(struct hns_roce_wq *wq, unsigned int nreq,
+				unsigned int *room, struct hns_roce_cq *cq)
+{
+	if (nreq < *room)
+		return 0;
+
+	*room = hns_roce_wq_free(wq, cq);
+	if (nreq < *room)
+		return 0;
+
 	printf("wq:(head = %d, tail = %d, max_post = %d), nreq = 0x%x\n",
 		wq->head, wq->tail, wq->max_post, nreq);
-
-	return cur + nreq >= wq->max_post;
+	return 1;
 }
 
 static struct hns_roce_qp *hns_roce_find_qp(struct hns_roce_context *ctx,
@@ -307,11 +326,11 @@ static int hns_roce_v1_poll_one(struct hns_roce_cq *cq,
 				    (wq->wqe_cnt - 1);
 		}
 		/* write the wr_id of wq into the wc */
-		wc->wr_id = wq->wrid[wq->tail & (wq->wqe_cnt - 1)];
+		wc->wr_id = wq->wrid[ring_pow2_slot(wq->tail, wq->wqe_cnt)];
 		++wq->tail;
 	} else {
 		wq = &(*cur_qp)->rq;
-		wc->wr_id = wq->wrid[wq->tail & (wq->wqe_cnt - 1)];
+		wc->wr_id = wq->wrid[ring_pow2_slot(wq->tail, wq->wqe_cnt)];
 		++wq->tail;
 	}
 
@@ -410,8 +429,8 @@ static int hns_roce_u_v1_poll_cq(struct ibv_cq *ibvcq, int ne,
 
 	if (npolled) {
 		if (dev->hw_version == HNS_ROCE_HW_VER1) {
-			*cq->set_ci_db = (unsigned short)(cq->cons_index &
-					 ((cq->cq_depth << 1) - 1));
+			*cq->set_ci_db = (unsigned short)
+				ring_pow2_wrap(cq->cons_index, cq->cq_depth);
 			mmio_ordered_writes_hack();
 		}
 
@@ -437,7 +456,7 @@ static int hns_roce_u_v1_arm_cq(struct ibv_cq *ibvcq, int solicited)
 	struct hns_roce_cq_db cq_db;
 	struct hns_roce_cq *cq = to_hr_cq(ibvcq);
 
-	ci  = cq->cons_index & ((cq->cq_depth << 1) - 1);
+	ci  = ring_pow2_wrap(cq->cons_index, cq->cq_depth);
 	solicited_flag = solicited ? HNS_ROCE_CQ_DB_REQ_SOL :
 				     HNS_ROCE_CQ_DB_REQ_NEXT;
 
@@ -462,7 +481,7 @@ static int hns_roce_u_v1_arm_cq(struct ibv_cq *ibvcq, int solicited)
 static int hns_roce_u_v1_post_send(struct ibv_qp *ibvqp, struct ibv_send_wr *wr,
 				   struct ibv_send_wr **bad_wr)
 {
-	unsigned int ind;
+	unsigned int ind, room = 0;
 	void *wqe;
 	int nreq;
 	int ps_opcode, i;
@@ -478,7 +497,7 @@ static int hns_roce_u_v1_post_send(struct ibv_qp *ibvqp, struct ibv_send_wr *wr,
 	ind = qp->sq.head;
 
 	for (nreq = 0; wr; ++nreq, wr = wr->next) {
-		if (hns_roce_wq_overflow(&qp->sq, nreq,
+		if (hns_roce_wq_overflow(&qp->sq, nreq, &room,
 					 to_hr_cq(qp->ibv_qp.send_cq))) {
 			ret = -1;
 			*bad_wr = wr;
@@ -492,10 +511,11 @@ static int hns_roce_u_v1_post_send(struct ibv_qp *ibvqp, struct ibv_send_wr *wr,
 			goto out;
 		}
 
-		ctrl = wqe = get_send_wqe(qp, ind & (qp->sq.wqe_cnt - 1));
+		ctrl = wqe = get_send_wqe(qp, ring_pow2_slot(ind,
+							     qp->sq.wqe_cnt));
 		memset(ctrl, 0, sizeof(struct hns_roce_wqe_ctrl_seg));
 
-		qp->sq.wrid[ind & (qp->sq.wqe_cnt - 1)] = wr->wr_id;
+		qp->sq.wrid[ring_pow2_slot(ind, qp->sq.wqe_cnt)] = wr->wr_id;
 		for (i = 0; i < wr->num_sge; i++)
 			ctrl->msg_length += wr->sg_list[i].length;
 
@@ -588,7 +608,7 @@ out:
 
 		hns_roce_update_sq_head(ctx, qp->ibv_qp.qp_num,
 				qp->port_num - 1, qp->sl,
-				qp->sq.head & ((qp->sq.wqe_cnt << 1) - 1));
+				ring_pow2_wrap(qp->sq.head, qp->sq.wqe_cnt));
 	}
 
 	pthread_spin_unlock(&qp->sq.lock);
@@ -745,6 +765,7 @@ static int hns_roce_u_v1_post_recv(struct ibv_qp *ibvqp, struct ibv_recv_wr *wr,
 	int ret = 0;
 	int nreq;
 	int ind;
+	unsigned int room = 0;
 	struct ibv_sge *sg;
 	struct hns_roce_rc_rq_wqe *rq_wqe;
 	struct hns_roce_qp *qp = to_hr_qp(ibvqp);
@@ -753,10 +774,10 @@ static int hns_roce_u_v1_post_recv(struct ibv_qp *ibvqp, struct ibv_recv_wr *wr,
 	pthread_spin_lock(&qp->rq.lock);
 
 	/* check that state is OK to post receive */
-	ind = qp->rq.head & (qp->rq.wqe_cnt - 1);
+	ind = ring_pow2_slot(qp->rq.head, qp->rq.wqe_cnt);
 
 	for (nreq = 0; wr; ++nreq, wr = wr->next) {
-		if (hns_roce_wq_overflow(&qp->rq, nreq,
+		if (hns_roce_wq_overflow(&qp->rq, nreq, &room,
 					 to_hr_cq(qp->ibv_qp.recv_cq))) {
 			ret = -1;
 			*bad_wr = wr;
@@ -812,7 +833,7 @@ static int hns_roce_u_v1_post_recv(struct ibv_qp *ibvqp, struct ibv_recv_wr *wr,
 
 		qp->rq.wrid[ind] = wr->wr_id;
 
-		ind = (ind + 1) & (qp->rq.wqe_cnt - 1);
+		ind = ring_mask_advance(ind, 1, qp->rq.wqe_cnt);
 	}
 
 out:
@@ -820,7 +841,7 @@ out:
 		qp->rq.head += nreq;
 
 		hns_roce_update_rq_head(ctx, qp->ibv_qp.qp_num,
-				    qp->rq.head & ((qp->rq.wqe_cnt << 1) - 1));
+				    ring_pow2_wrap(qp->rq.head, qp->rq.wqe_cnt));
 	}
 
 	pthread_spin_unlock(&qp->rq.lock);
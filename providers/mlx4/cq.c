@@ -41,6 +41,7 @@
 
 #include <util/compiler.h>
 #include <util/mmio.h>
+#include <ccan/minmax.h>
 #include <infiniband/opcode.h>
 
 #include "mlx4.h"
@@ -51,6 +52,10 @@ enum {
 	CQ_POLL_ERR				= -2
 };
 
+enum {
+	MLX4_CQ_POLL_BATCH			= 16,
+};
+
 static struct mlx4_cqe *get_cqe(struct mlx4_cq *cq, int entry)
 {
 	return cq->buf.buf + entry * cq->cqe_size;
@@ -65,11 +70,6 @@ static void *get_sw_cqe(struct mlx4_cq *cq, int n)
 		!!(n & (cq->ibv_cq.cqe + 1))) ? NULL : cqe;
 }
 
-static struct mlx4_cqe *next_cqe_sw(struct mlx4_cq *cq)
-{
-	return get_sw_cqe(cq, cq->cons_index);
-}
-
 static enum ibv_wc_status mlx4_handle_error_cqe(struct mlx4_err_cqe *cqe)
 {
 	if (cqe->syndrome == MLX4_CQE_SYNDROME_LOCAL_QP_OP_ERR)
@@ -154,17 +154,25 @@ static inline void handle_good_req(struct ibv_wc *wc, struct mlx4_cqe *cqe)
 	}
 }
 
-static inline int mlx4_get_next_cqe(struct mlx4_cq *cq,
-				    struct mlx4_cqe **pcqe)
-				    ALWAYS_INLINE;
-static inline int mlx4_get_next_cqe(struct mlx4_cq *cq,
-				    struct mlx4_cqe **pcqe)
+/*
+ * Count the software owned CQEs from cons_index on, up to @max. The caller
+ * issues a single read barrier for all of them before taking them with
+ * mlx4_take_cqe(), instead of one barrier per CQE.
+ */
+static inline int mlx4_scan_sw_cqes(struct mlx4_cq *cq, int max)
 {
-	struct mlx4_cqe *cqe;
+	int n;
+
+	for (n = 0; n < max; n++)
+		if (!get_sw_cqe(cq, cq->cons_index + n))
+			break;
 
-	cqe = next_cqe_sw(cq);
-	if (!cqe)
-		return CQ_EMPTY;
+	return n;
+}
+
+static inline struct mlx4_cqe *mlx4_take_cqe(struct mlx4_cq *cq)
+{
+	struct mlx4_cqe *cqe = get_cqe(cq, cq->cons_index & cq->ibv_cq.cqe);
 
 	if (cq->cqe_size == 64)
 		++cqe;
@@ -173,15 +181,7 @@ static inline int mlx4_get_next_cqe(struct mlx4_cq *cq,
 
 	VALGRIND_MAKE_MEM_DEFINED(cqe, sizeof *cqe);
 
-	/*
-	 * Make sure we read CQ entry contents after we've checked the
-	 * ownership bit.
-	 */
-	udma_from_device_barrier();
-
-	*pcqe = cqe;
-
-	return CQ_OK;
+	return cqe;
 }
 
 static inline int mlx4_parse_cqe(struct mlx4_cq *cq,
@@ -334,53 +334,72 @@ static inline int mlx4_parse_lazy_cqe(struct mlx4_cq *cq,
 	return mlx4_parse_cqe(cq, cqe, &cq->cur_qp, NULL, 1);
 }
 
-static inline int mlx4_poll_one(struct mlx4_cq *cq,
-			 struct mlx4_qp **cur_qp,
-			 struct ibv_wc *wc)
-			 ALWAYS_INLINE;
-static inline int mlx4_poll_one(struct mlx4_cq *cq,
-			 struct mlx4_qp **cur_qp,
-			 struct ibv_wc *wc)
-{
-	struct mlx4_cqe *cqe;
-	int err;
-
-	err = mlx4_get_next_cqe(cq, &cqe);
-	if (err == CQ_EMPTY)
-		return err;
-
-	return mlx4_parse_cqe(cq, cqe, cur_qp, wc, 0);
-}
-
-int mlx4_poll_cq(struct ibv_cq *ibcq, int ne, struct ibv_wc *wc)
+static inline int poll_cq(struct ibv_cq *ibcq, int ne, struct ibv_wc *wc,
+			  int lock)
+			  ALWAYS_INLINE;
+static inline int poll_cq(struct ibv_cq *ibcq, int ne, struct ibv_wc *wc,
+			  int lock)
 {
 	struct mlx4_cq *cq = to_mcq(ibcq);
 	struct mlx4_qp *qp = NULL;
-	int npolled;
+	struct mlx4_cqe *cqe;
+	int npolled = 0;
+	int batch, i;
 	int err = CQ_OK;
 
-	pthread_spin_lock(&cq->lock);
+	if (lock)
+		pthread_spin_lock(&cq->lock);
 
-	for (npolled = 0; npolled < ne; ++npolled) {
-		err = mlx4_poll_one(cq, &qp, wc + npolled);
-		if (err != CQ_OK)
+	while (npolled < ne) {
+		batch = mlx4_scan_sw_cqes(cq, min_t(int, ne - npolled,
+							 MLX4_CQ_POLL_BATCH));
+		if (!batch)
 			break;
+
+		/*
+		 * Make sure we read CQ entry contents after we've checked the
+		 * ownership bits.
+		 */
+		udma_from_device_barrier();
+
+		for (i = 0; i != batch; i++) {
+			cqe = mlx4_take_cqe(cq);
+			if (i + 1 != batch)
+				__builtin_prefetch(get_cqe(cq, cq->cons_index &
+							   cq->ibv_cq.cqe));
+
+			err = mlx4_parse_cqe(cq, cqe, &qp, wc + npolled, 0);
+			if (unlikely(err != CQ_OK))
+				goto out;
+			++npolled;
+		}
 	}
 
+out:
 	if (npolled || err == CQ_POLL_ERR)
 		mlx4_update_cons_index(cq);
 
-	pthread_spin_unlock(&cq->lock);
+	if (lock)
+		pthread_spin_unlock(&cq->lock);
 
 	return err == CQ_POLL_ERR ? err : npolled;
 }
 
+int mlx4_poll_cq(struct ibv_cq *ibcq, int ne, struct ibv_wc *wc)
+{
+	if (to_mcq(ibcq)->flags & MLX4_CQ_FLAGS_SINGLE_THREADED)
+		return poll_cq(ibcq, ne, wc, 0);
+
+	return poll_cq(ibcq, ne, wc, 1);
+}
+
 static inline void _mlx4_end_poll(struct ibv_cq_ex *ibcq, int lock)
 				  ALWAYS_INLINE;
 static inline void _mlx4_end_poll(struct ibv_cq_ex *ibcq, int lock)
 {
 	struct mlx4_cq *cq = to_mcq(ibv_cq_ex_to_cq(ibcq));
 
+	cq->poll_ready = 0;
 	mlx4_update_cons_index(cq);
 
 	if (lock)
@@ -407,13 +426,21 @@ static inline int _mlx4_start_poll(struct ibv_cq_ex *ibcq,
 
 	cq->cur_qp = NULL;
 
-	err = mlx4_get_next_cqe(cq, &cqe);
-	if (err == CQ_EMPTY) {
+	cq->poll_ready = mlx4_scan_sw_cqes(cq, MLX4_CQ_POLL_BATCH);
+	if (!cq->poll_ready) {
 		if (lock)
 			pthread_spin_unlock(&cq->lock);
 		return ENOENT;
 	}
 
+	/*
+	 * Make sure we read CQ entry contents after we've checked the
+	 * ownership bits.
+	 */
+	udma_from_device_barrier();
+
+	--cq->poll_ready;
+	cqe = mlx4_take_cqe(cq);
 	err = mlx4_parse_lazy_cqe(cq, cqe);
 	if (lock && err)
 		pthread_spin_unlock(&cq->lock);
@@ -425,12 +452,17 @@ static int mlx4_next_poll(struct ibv_cq_ex *ibcq)
 {
 	struct mlx4_cq *cq = to_mcq(ibv_cq_ex_to_cq(ibcq));
 	struct mlx4_cqe *cqe;
-	int err;
 
-	err = mlx4_get_next_cqe(cq, &cqe);
-	if (err == CQ_EMPTY)
-		return ENOENT;
+	if (!cq->poll_ready) {
+		cq->poll_ready = mlx4_scan_sw_cqes(cq, MLX4_CQ_POLL_BATCH);
+		if (!cq->poll_ready)
+			return ENOENT;
+
+		udma_from_device_barrier();
+	}
 
+	--cq->poll_ready;
+	cqe = mlx4_take_cqe(cq);
 	return mlx4_parse_lazy_cqe(cq, cqe);
 }
 
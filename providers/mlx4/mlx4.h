@@ -168,6 +168,8 @@ struct mlx4_cq {
 	struct mlx4_qp			*cur_qp;
 	struct mlx4_cqe			*cqe;
 	uint32_t			flags;
+	/* CQEs already checked to be software owned in this poll */
+	int				poll_ready;
 };
 
 struct mlx4_srq {
@@ -42,164 +42,164 @@
 #include "mlx5.h"
 #include "bitmap.h"
 
-static int mlx5_bitmap_init(struct mlx5_bitmap *bitmap, uint32_t num,
-			    uint32_t mask)
+/*
+ * Hugepage arena. Queue buffers are carved out of shared hugetlb segments
+ * by a buddy allocator, so many small CQs and QPs share one hugepage
+ * instead of each taking its own. Segments are MLX5_HUGE_ARENA_SIZE or the
+ * next power of two that fits the buffer, are placed on the context's NUMA
+ * node, and are released once every buffer in them is freed. Setting
+ * MLX5_HUGE_PAGE_1G uses 1GiB pages and arenas, if the system has them.
+ */
+#define MLX5_HUGE_MIN_SHIFT	12
+#define MLX5_HUGE_ARENA_SIZE	MLX5_SHM_LENGTH
+#define MLX5_HUGE_1G_SIZE	(1UL << 30)
+
+#ifndef SHM_HUGE_SHIFT
+#define SHM_HUGE_SHIFT		26
+#endif
+#ifndef SHM_HUGE_1GB
+#define SHM_HUGE_1GB		(30 << SHM_HUGE_SHIFT)
+#endif
+
+static int mlx5_buddy_init(struct mlx5_buddy *buddy, int max_order)
 {
-	bitmap->last = 0;
-	bitmap->top  = 0;
-	bitmap->max  = num;
-	bitmap->avail = num;
-	bitmap->mask = mask;
-	bitmap->avail = bitmap->max;
-	bitmap->table = calloc(BITS_TO_LONGS(bitmap->max), sizeof(uint32_t));
-	if (!bitmap->table)
-		return -ENOMEM;
+	int i;
+
+	buddy->max_order = max_order;
+	buddy->bits = calloc(max_order + 1, sizeof(*buddy->bits));
+	buddy->num_free = calloc(max_order + 1, sizeof(*buddy->num_free));
+	if (!buddy->bits || !buddy->num_free)
+		goto err;
+
+	for (i = 0; i <= max_order; i++) {
+		buddy->bits[i] = calloc(BITS_TO_LONGS(1UL << (max_order - i)),
+					sizeof(long));
+		if (!buddy->bits[i])
+			goto err;
+	}
 
+	mlx5_set_bit(0, buddy->bits[max_order]);
+	buddy->num_free[max_order] = 1;
 	return 0;
+
+err:
+	if (buddy->bits)
+		for (i = 0; i <= max_order; i++)
+			free(buddy->bits[i]);
+	free(buddy->bits);
+	free(buddy->num_free);
+	return ENOMEM;
 }
 
-static void bitmap_free_range(struct mlx5_bitmap *bitmap, uint32_t obj,
-			      int cnt)
+static void mlx5_buddy_cleanup(struct mlx5_buddy *buddy)
 {
 	int i;
 
-	obj &= bitmap->max - 1;
-
-	for (i = 0; i < cnt; i++)
-		mlx5_clear_bit(obj + i, bitmap->table);
-	bitmap->last = min(bitmap->last, obj);
-	bitmap->top = (bitmap->top + bitmap->max) & bitmap->mask;
-	bitmap->avail += cnt;
+	for (i = 0; i <= buddy->max_order; i++)
+		free(buddy->bits[i]);
+	free(buddy->bits);
+	free(buddy->num_free);
 }
 
-static int bitmap_empty(struct mlx5_bitmap *bitmap)
+static int mlx5_buddy_empty(struct mlx5_buddy *buddy)
 {
-	return (bitmap->avail == bitmap->max) ? 1 : 0;
+	return buddy->num_free[buddy->max_order] == 1;
 }
 
-static int bitmap_avail(struct mlx5_bitmap *bitmap)
+/* Returns the first block of a free run of 1 << order blocks, or -1 */
+static int mlx5_buddy_alloc(struct mlx5_buddy *buddy, int order)
 {
-	return bitmap->avail;
-}
+	unsigned long *bits;
+	uint32_t seg, i;
+	int o;
 
-static void mlx5_bitmap_cleanup(struct mlx5_bitmap *bitmap)
-{
-	if (bitmap->table)
-		free(bitmap->table);
-}
+	for (o = order; o <= buddy->max_order; o++)
+		if (buddy->num_free[o])
+			goto found;
 
-static void free_huge_mem(struct mlx5_hugetlb_mem *hmem)
-{
-	mlx5_bitmap_cleanup(&hmem->bitmap);
-	if (shmdt(hmem->shmaddr) == -1)
-		mlx5_dbg(stderr, MLX5_DBG_CONTIG, "%s\n", strerror(errno));
-	shmctl(hmem->shmid, IPC_RMID, NULL);
-	free(hmem);
-}
+	return -1;
 
-static int mlx5_bitmap_alloc(struct mlx5_bitmap *bitmap)
-{
-	uint32_t obj;
-	int ret;
+found:
+	bits = buddy->bits[o];
+	for (i = 0; !bits[i]; i++)
+		;
+	seg = i * BITS_PER_LONG + __builtin_ctzl(bits[i]);
 
-	obj = mlx5_find_first_zero_bit(bitmap->table, bitmap->max);
-	if (obj < bitmap->max) {
-		mlx5_set_bit(obj, bitmap->table);
-		bitmap->last = (obj + 1);
-		if (bitmap->last == bitmap->max)
-			bitmap->last = 0;
-		obj |= bitmap->top;
-		ret = obj;
-	} else
-		ret = -1;
+	mlx5_clear_bit(seg, bits);
+	--buddy->num_free[o];
 
-	if (ret != -1)
-		--bitmap->avail;
+	while (o > order) {
+		--o;
+		seg <<= 1;
+		mlx5_set_bit(seg ^ 1, buddy->bits[o]);
+		++buddy->num_free[o];
+	}
 
-	return ret;
+	return seg << order;
 }
 
-static uint32_t find_aligned_range(unsigned long *bitmap,
-				   uint32_t start, uint32_t nbits,
-				   int len, int alignment)
+static void mlx5_buddy_free(struct mlx5_buddy *buddy, uint32_t seg, int order)
 {
-	uint32_t end, i;
-
-again:
-	start = align(start, alignment);
-
-	while ((start < nbits) && mlx5_test_bit(start, bitmap))
-		start += alignment;
-
-	if (start >= nbits)
-		return -1;
-
-	end = start + len;
-	if (end > nbits)
-		return -1;
-
-	for (i = start + 1; i < end; i++) {
-		if (mlx5_test_bit(i, bitmap)) {
-			start = i + 1;
-			goto again;
-		}
+	seg >>= order;
+
+	while (order < buddy->max_order &&
+	       mlx5_test_bit(seg ^ 1, buddy->bits[order])) {
+		mlx5_clear_bit(seg ^ 1, buddy->bits[order]);
+		--buddy->num_free[order];
+		seg >>= 1;
+		++order;
 	}
 
-	return start;
+	mlx5_set_bit(seg, buddy->bits[order]);
+	++buddy->num_free[order];
 }
 
-static int bitmap_alloc_range(struct mlx5_bitmap *bitmap, int cnt,
-			      int align)
+static int huge_order(size_t size)
 {
-	uint32_t obj;
-	int ret, i;
+	int order = 0;
 
-	if (cnt == 1 && align == 1)
-		return mlx5_bitmap_alloc(bitmap);
+	while ((1UL << (order + MLX5_HUGE_MIN_SHIFT)) < size)
+		order++;
 
-	if (cnt > bitmap->max)
-		return -1;
-
-	obj = find_aligned_range(bitmap->table, bitmap->last,
-				 bitmap->max, cnt, align);
-	if (obj >= bitmap->max) {
-		bitmap->top = (bitmap->top + bitmap->max) & bitmap->mask;
-		obj = find_aligned_range(bitmap->table, 0, bitmap->max,
-					 cnt, align);
-	}
-
-	if (obj < bitmap->max) {
-		for (i = 0; i < cnt; i++)
-			mlx5_set_bit(obj + i, bitmap->table);
-		if (obj == bitmap->last) {
-			bitmap->last = (obj + cnt);
-			if (bitmap->last >= bitmap->max)
-				bitmap->last = 0;
-		}
-		obj |= bitmap->top;
-		ret = obj;
-	} else
-		ret = -1;
-
-	if (ret != -1)
-		bitmap->avail -= cnt;
+	return order;
+}
 
-	return obj;
+static void free_huge_mem(struct mlx5_hugetlb_mem *hmem)
+{
+	mlx5_buddy_cleanup(&hmem->buddy);
+	if (shmdt(hmem->shmaddr) == -1)
+		mlx5_dbg(stderr, MLX5_DBG_CONTIG, "%s\n", strerror(errno));
+	free(hmem);
 }
 
-static struct mlx5_hugetlb_mem *alloc_huge_mem(size_t size)
+static struct mlx5_hugetlb_mem *alloc_huge_mem(struct mlx5_context *mctx,
+					       int order)
 {
 	struct mlx5_hugetlb_mem *hmem;
+	size_t arena = MLX5_HUGE_ARENA_SIZE;
+	int flags = SHM_HUGETLB | SHM_R | SHM_W;
 	size_t shm_len;
 
 	hmem = malloc(sizeof(*hmem));
 	if (!hmem)
 		return NULL;
 
-	shm_len = align(size, MLX5_SHM_LENGTH);
-	hmem->shmid = shmget(IPC_PRIVATE, shm_len, SHM_HUGETLB | SHM_R | SHM_W);
+	if (getenv("MLX5_HUGE_PAGE_1G")) {
+		arena = MLX5_HUGE_1G_SIZE;
+		flags |= SHM_HUGE_1GB;
+	}
+
+again:
+	shm_len = max_t(size_t, arena, 1UL << (order + MLX5_HUGE_MIN_SHIFT));
+	hmem->shmid = shmget(IPC_PRIVATE, shm_len, flags);
 	if (hmem->shmid == -1) {
 		mlx5_dbg(stderr, MLX5_DBG_CONTIG, "%s\n", strerror(errno));
+		if (flags & SHM_HUGE_1GB) {
+			/* No 1GiB pages reserved, use the default size */
+			arena = MLX5_HUGE_ARENA_SIZE;
+			flags &= ~SHM_HUGE_1GB;
+			goto again;
+		}
 		goto out_free;
 	}
 
@@ -209,22 +209,26 @@ static struct mlx5_hugetlb_mem *alloc_huge_mem(size_t size)
 		goto out_rmid;
 	}
 
-	if (mlx5_bitmap_init(&hmem->bitmap, shm_len / MLX5_Q_CHUNK_SIZE,
-			     shm_len / MLX5_Q_CHUNK_SIZE - 1)) {
-		mlx5_dbg(stderr, MLX5_DBG_CONTIG, "%s\n", strerror(errno));
-		goto out_shmdt;
-	}
-
 	/*
 	 * Marked to be destroyed when process detaches from shmget segment
 	 */
 	shmctl(hmem->shmid, IPC_RMID, NULL);
 
+	if (mlx5_buddy_init(&hmem->buddy, huge_order(shm_len))) {
+		mlx5_dbg(stderr, MLX5_DBG_CONTIG, "%s\n", strerror(ENOMEM));
+		goto out_shmdt;
+	}
+
+	/* Nothing has touched the segment yet, so this places all of it */
+	hmem->numa_node = ibv_get_numa_node(&mctx->ibv_ctx);
+	verbs_numa_bind(&mctx->ibv_ctx, hmem->shmaddr, shm_len);
+
 	return hmem;
 
 out_shmdt:
 	if (shmdt(hmem->shmaddr) == -1)
 		mlx5_dbg(stderr, MLX5_DBG_CONTIG, "%s\n", strerror(errno));
+	goto out_free;
 
 out_rmid:
 	shmctl(hmem->shmid, IPC_RMID, NULL);
@@ -237,51 +241,40 @@ out_free:
 static int alloc_huge_buf(struct mlx5_context *mctx, struct mlx5_buf *buf,
 			  size_t size, int page_size)
 {
-	int found = 0;
-	int nchunk;
 	struct mlx5_hugetlb_mem *hmem;
+	int node = ibv_get_numa_node(&mctx->ibv_ctx);
+	int order;
 	int ret;
 
-	buf->length = align(size, MLX5_Q_CHUNK_SIZE);
-	nchunk = buf->length / MLX5_Q_CHUNK_SIZE;
+	/* Blocks of order n are aligned to their size inside the segment */
+	order = huge_order(max_t(size_t, size, page_size));
+	buf->length = 1UL << (order + MLX5_HUGE_MIN_SHIFT);
 
 	mlx5_spin_lock(&mctx->hugetlb_lock);
 	list_for_each(&mctx->hugetlb_list, hmem, entry) {
-		if (bitmap_avail(&hmem->bitmap)) {
-			buf->base = bitmap_alloc_range(&hmem->bitmap, nchunk, 1);
-			if (buf->base != -1) {
-				buf->hmem = hmem;
-				found = 1;
-				break;
-			}
-		}
+		if (hmem->numa_node != node ||
+		    order > hmem->buddy.max_order)
+			continue;
+
+		buf->base = mlx5_buddy_alloc(&hmem->buddy, order);
+		if (buf->base != -1)
+			goto found;
 	}
 	mlx5_spin_unlock(&mctx->hugetlb_lock);
 
-	if (!found) {
-		hmem = alloc_huge_mem(buf->length);
-		if (!hmem)
-			return -1;
-
-		buf->base = bitmap_alloc_range(&hmem->bitmap, nchunk, 1);
-		if (buf->base == -1) {
-			free_huge_mem(hmem);
-			/* TBD: remove after proven stability */
-			fprintf(stderr, "BUG: huge allocation\n");
-			return -1;
-		}
+	hmem = alloc_huge_mem(mctx, order);
+	if (!hmem)
+		return -1;
 
-		buf->hmem = hmem;
+	buf->base = mlx5_buddy_alloc(&hmem->buddy, order);
 
-		mlx5_spin_lock(&mctx->hugetlb_lock);
-		if (bitmap_avail(&hmem->bitmap))
-			list_add(&mctx->hugetlb_list, &hmem->entry);
-		else
-			list_add_tail(&mctx->hugetlb_list, &hmem->entry);
-		mlx5_spin_unlock(&mctx->hugetlb_lock);
-	}
+	mlx5_spin_lock(&mctx->hugetlb_lock);
+	list_add(&mctx->hugetlb_list, &hmem->entry);
+found:
+	mlx5_spin_unlock(&mctx->hugetlb_lock);
 
-	buf->buf = hmem->shmaddr + buf->base * MLX5_Q_CHUNK_SIZE;
+	buf->hmem = hmem;
+	buf->buf = hmem->shmaddr + ((size_t)buf->base << MLX5_HUGE_MIN_SHIFT);
 
 	ret = ibv_dontfork_range(buf->buf, buf->length);
 	if (ret) {
@@ -294,8 +287,8 @@ static int alloc_huge_buf(struct mlx5_context *mctx, struct mlx5_buf *buf,
 
 out_fork:
 	mlx5_spin_lock(&mctx->hugetlb_lock);
-	bitmap_free_range(&hmem->bitmap, buf->base, nchunk);
-	if (bitmap_empty(&hmem->bitmap)) {
+	mlx5_buddy_free(&hmem->buddy, buf->base, order);
+	if (mlx5_buddy_empty(&hmem->buddy)) {
 		list_del(&hmem->entry);
 		mlx5_spin_unlock(&mctx->hugetlb_lock);
 		free_huge_mem(hmem);
@@ -307,15 +300,14 @@ out_fork:
 
 static void free_huge_buf(struct mlx5_context *ctx, struct mlx5_buf *buf)
 {
-	int nchunk;
+	struct mlx5_hugetlb_mem *hmem = buf->hmem;
 
-	nchunk = buf->length / MLX5_Q_CHUNK_SIZE;
 	mlx5_spin_lock(&ctx->hugetlb_lock);
-	bitmap_free_range(&buf->hmem->bitmap, buf->base, nchunk);
-	if (bitmap_empty(&buf->hmem->bitmap)) {
-		list_del(&buf->hmem->entry);
+	mlx5_buddy_free(&hmem->buddy, buf->base, huge_order(buf->length));
+	if (mlx5_buddy_empty(&hmem->buddy)) {
+		list_del(&hmem->entry);
 		mlx5_spin_unlock(&ctx->hugetlb_lock);
-		free_huge_mem(buf->hmem);
+		free_huge_mem(hmem);
 	} else
 		mlx5_spin_unlock(&ctx->hugetlb_lock);
 }
@@ -395,8 +387,11 @@ int mlx5_alloc_prefered_buf(struct mlx5_context *mctx,
 	if (type == MLX5_ALLOC_TYPE_EXTERNAL)
 		return mlx5_alloc_buf_extern(mctx, buf, size);
 
-	return mlx5_alloc_buf(buf, size, page_size);
+	ret = mlx5_alloc_buf(buf, size, page_size);
+	if (!ret)
+		verbs_numa_bind(&mctx->ibv_ctx, buf->buf, buf->length);
 
+	return ret;
 }
 
 int mlx5_free_actual_buf(struct mlx5_context *ctx, struct mlx5_buf *buf)
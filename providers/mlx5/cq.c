@@ -61,8 +61,6 @@ enum {
 int mlx5_stall_num_loop = 60;
 int mlx5_stall_cq_poll_min = 60;
 int mlx5_stall_cq_poll_max = 100000;
-int mlx5_stall_cq_inc_step = 100;
-int mlx5_stall_cq_dec_step = 10;
 
 static inline uint8_t get_cqe_l3_hdr_type(struct mlx5_cqe64 *cqe)
 {
@@ -141,11 +139,35 @@ static inline void handle_good_req(struct ibv_wc *wc, struct mlx5_cqe64 *cqe, st
 	}
 }
 
+/*
+ * A striding RQ CQE reports how many strides the packet used. The WQE is
+ * done, and the RQ tail moves on, once all of its strides are used.
+ * Returns true for the CQE that completed the WQE.
+ */
+static inline int mlx5_rwq_consume_strides(struct mlx5_rwq *rwq,
+					   uint32_t byte_cnt)
+{
+	rwq->consumed_strides += (byte_cnt >> MLX5_MPRQ_STRIDES_SHIFT) &
+				 MLX5_MPRQ_STRIDES_MASK;
+	if (rwq->consumed_strides < rwq->num_strides)
+		return 0;
+
+	rwq->consumed_strides = 0;
+	++rwq->rq.tail;
+	return 1;
+}
+
+static inline uint32_t mlx5_stride_byte_len(uint32_t byte_cnt)
+{
+	return byte_cnt & MLX5_MPRQ_FILLER ? 0 : byte_cnt & MLX5_MPRQ_LEN_MASK;
+}
+
 static inline int handle_responder_lazy(struct mlx5_cq *cq, struct mlx5_cqe64 *cqe,
 					struct mlx5_resource *cur_rsc, struct mlx5_srq *srq)
 {
 	uint16_t	wqe_ctr;
 	struct mlx5_wq *wq;
+	struct mlx5_rwq *rwq;
 	struct mlx5_qp *qp = rsc_to_mqp(cur_rsc);
 	int err = IBV_WC_SUCCESS;
 
@@ -159,6 +181,13 @@ static inline int handle_responder_lazy(struct mlx5_cq *cq, struct mlx5_cqe64 *c
 		else if (cqe->op_own & MLX5_INLINE_SCATTER_64)
 			err = mlx5_copy_to_recv_srq(srq, wqe_ctr, cqe - 1,
 						    be32toh(cqe->byte_cnt));
+	} else if (unlikely(cur_rsc->type == MLX5_RSC_TYPE_RWQ &&
+			    rsc_to_mrwq(cur_rsc)->striding)) {
+		rwq = rsc_to_mrwq(cur_rsc);
+		cq->ibv_cq.wr_id = rwq->rq.wrid[rwq->rq.tail & (rwq->rq.wqe_cnt - 1)];
+		cq->flags |= MLX5_CQ_FLAGS_STRIDING;
+		if (mlx5_rwq_consume_strides(rwq, be32toh(cqe->byte_cnt)))
+			cq->flags |= MLX5_CQ_FLAGS_STRIDE_LAST;
 	} else {
 		if (likely(cur_rsc->type == MLX5_RSC_TYPE_QP)) {
 			wq = &qp->rq;
@@ -196,6 +225,7 @@ static inline int handle_responder(struct ibv_wc *wc, struct mlx5_cqe64 *cqe,
 {
 	uint16_t	wqe_ctr;
 	struct mlx5_wq *wq;
+	struct mlx5_rwq *rwq;
 	struct mlx5_qp *qp = rsc_to_mqp(cur_rsc);
 	uint8_t g;
 	int err = 0;
@@ -211,6 +241,12 @@ static inline int handle_responder(struct ibv_wc *wc, struct mlx5_cqe64 *cqe,
 		else if (cqe->op_own & MLX5_INLINE_SCATTER_64)
 			err = mlx5_copy_to_recv_srq(srq, wqe_ctr, cqe - 1,
 						    wc->byte_len);
+	} else if (unlikely(cur_rsc->type == MLX5_RSC_TYPE_RWQ &&
+			    rsc_to_mrwq(cur_rsc)->striding)) {
+		rwq = rsc_to_mrwq(cur_rsc);
+		wc->wr_id = rwq->rq.wrid[rwq->rq.tail & (rwq->rq.wqe_cnt - 1)];
+		wc->byte_len = mlx5_stride_byte_len(wc->byte_len);
+		mlx5_rwq_consume_strides(rwq, be32toh(cqe->byte_cnt));
 	} else {
 		if (likely(cur_rsc->type == MLX5_RSC_TYPE_QP)) {
 			wq = &qp->rq;
@@ -347,6 +383,50 @@ static void mlx5_get_cycles(uint64_t *cycles)
 }
 #endif
 
+/*
+ * Adaptive stall governor. Each CQ keeps an EWMA of the fraction of polls
+ * that found the CQ empty, in 1/MLX5_STALL_EWMA_ONE units with a weight of
+ * 1/8 per sample. The stall before the next poll grows with the square of
+ * that ratio, from mlx5_stall_cq_poll_min cycles for a CQ that always has
+ * completions up to mlx5_stall_cq_poll_max cycles for one that is always
+ * empty, so a busy CQ is polled almost back to back while a spinning poller
+ * on an idle CQ backs off. A poll that filled the whole array is not
+ * followed by a stall at all, there is a backlog to drain.
+ */
+#define MLX5_STALL_EWMA_SHIFT	16
+#define MLX5_STALL_EWMA_ONE	(1 << MLX5_STALL_EWMA_SHIFT)
+#define MLX5_STALL_EWMA_WEIGHT	3
+
+static inline void mlx5_stall_adapt(struct mlx5_cq *cq, int empty, int drained)
+{
+	uint64_t range, ratio;
+
+	cq->stall_empty_ewma += ((empty ? MLX5_STALL_EWMA_ONE : 0) -
+				 cq->stall_empty_ewma) >> MLX5_STALL_EWMA_WEIGHT;
+
+	ratio = cq->stall_empty_ewma;
+	range = mlx5_stall_cq_poll_max > mlx5_stall_cq_poll_min ?
+		mlx5_stall_cq_poll_max - mlx5_stall_cq_poll_min : 0;
+	cq->stall_cycles = mlx5_stall_cq_poll_min +
+		((range * ratio * ratio) >> (2 * MLX5_STALL_EWMA_SHIFT));
+
+	if (empty || drained)
+		mlx5_get_cycles(&cq->stall_last_count);
+	else
+		cq->stall_last_count = 0;
+}
+
+static inline void mlx5_stall_wait(struct mlx5_cq *cq, int adaptive)
+{
+	if (adaptive) {
+		if (cq->stall_last_count)
+			mlx5_stall_cycles_poll_cq(cq->stall_last_count + cq->stall_cycles);
+	} else if (cq->stall_next_poll) {
+		cq->stall_next_poll = 0;
+		mlx5_stall_poll_cq();
+	}
+}
+
 static inline struct mlx5_qp *get_req_context(struct mlx5_context *mctx,
 					      struct mlx5_resource **cur_rsc,
 					      uint32_t rsn, int cqe_ver)
@@ -543,7 +623,9 @@ static inline int mlx5_parse_cqe(struct mlx5_cq *cq,
 	qpn = be32toh(cqe64->sop_drop_qpn) & 0xffffff;
 	if (lazy) {
 		cq->cqe64 = cqe64;
-		cq->flags &= (~MLX5_CQ_FLAGS_RX_CSUM_VALID);
+		cq->flags &= ~(MLX5_CQ_FLAGS_RX_CSUM_VALID |
+			       MLX5_CQ_FLAGS_STRIDING |
+			       MLX5_CQ_FLAGS_STRIDE_LAST);
 	} else {
 		wc->wc_flags = 0;
 		wc->qp_num = qpn;
@@ -681,6 +763,7 @@ static inline int mlx5_parse_cqe(struct mlx5_cq *cq,
 				switch ((*cur_rsc)->type) {
 				case MLX5_RSC_TYPE_RWQ:
 					wq = &(rsc_to_mrwq(*cur_rsc)->rq);
+					rsc_to_mrwq(*cur_rsc)->consumed_strides = 0;
 					break;
 				default:
 					wq = &(rsc_to_mqp(*cur_rsc)->rq);
@@ -711,76 +794,123 @@ static inline int mlx5_parse_lazy_cqe(struct mlx5_cq *cq,
 	return mlx5_parse_cqe(cq, cqe64, cqe, &cq->cur_rsc, &cq->cur_srq, NULL, cqe_ver, 1);
 }
 
-static inline int mlx5_poll_one(struct mlx5_cq *cq,
-				struct mlx5_resource **cur_rsc,
-				struct mlx5_srq **cur_srq,
-				struct ibv_wc *wc, int cqe_ver)
-				ALWAYS_INLINE;
-static inline int mlx5_poll_one(struct mlx5_cq *cq,
-				struct mlx5_resource **cur_rsc,
-				struct mlx5_srq **cur_srq,
-				struct ibv_wc *wc, int cqe_ver)
-{
-	struct mlx5_cqe64 *cqe64;
-	void *cqe;
-	int err;
+/*
+ * Count the software owned CQEs from cons_index on, up to @max and never
+ * past the end of the ring so the expected owner bit stays the same. The
+ * op_own bytes are cqe_sz apart, so they are gathered four at a time into
+ * a word and the owner bit and opcode of all four are checked at once.
+ * Only ownership is read here, the caller issues the read barrier before
+ * looking at the CQE contents.
+ */
+static inline int mlx5_scan_sw_cqes(struct mlx5_cq *cq, int max)
+				    ALWAYS_INLINE;
+static inline int mlx5_scan_sw_cqes(struct mlx5_cq *cq, int max)
+{
+	uint32_t mask = cq->ibv_cq.cqe;
+	uint32_t idx = cq->cons_index & mask;
+	uint32_t own = cq->cons_index & (mask + 1) ? 0x01010101 : 0;
+	int stride = cq->cqe_sz;
+	uint8_t *op_own;
+	uint32_t word, bad;
+	int n = 0;
+
+	max = min_t(int, max, mask + 1 - idx);
+	op_own = (uint8_t *)get_cqe(cq, idx) + stride - 1;
+
+	for (; n + 4 <= max; n += 4, op_own += 4 * stride) {
+		word = op_own[0] | op_own[stride] << 8 |
+		       op_own[2 * stride] << 16 |
+		       (uint32_t)op_own[3 * stride] << 24;
+
+		/* Owner bit differs, or the opcode nibble is MLX5_CQE_INVALID */
+		bad = (word ^ own) & 0x01010101;
+		word = (~word >> 4) & 0x0f0f0f0f;
+		bad |= (word - 0x01010101) & ~word & 0x80808080;
+		if (bad)
+			break;
+	}
 
-	err = mlx5_get_next_cqe(cq, &cqe64, &cqe);
-	if (err == CQ_EMPTY)
-		return err;
+	for (; n < max; n++, op_own += stride) {
+		if ((*op_own >> 4) == MLX5_CQE_INVALID ||
+		    ((*op_own & MLX5_CQE_OWNER_MASK) ^ !!own))
+			break;
+	}
 
-	return mlx5_parse_cqe(cq, cqe64, cqe, cur_rsc, cur_srq, wc, cqe_ver, 0);
+	return n;
 }
 
 static inline int poll_cq(struct ibv_cq *ibcq, int ne,
-		      struct ibv_wc *wc, int cqe_ver)
-		      ALWAYS_INLINE;
+			  struct ibv_wc *wc, int cqe_ver, int lock)
+			  ALWAYS_INLINE;
 static inline int poll_cq(struct ibv_cq *ibcq, int ne,
-		      struct ibv_wc *wc, int cqe_ver)
+			  struct ibv_wc *wc, int cqe_ver, int lock)
 {
 	struct mlx5_cq *cq = to_mcq(ibcq);
 	struct mlx5_resource *rsc = NULL;
 	struct mlx5_srq *srq = NULL;
-	int npolled;
+	struct mlx5_cqe64 *cqe64;
+	void *cqe;
+	int npolled = 0;
+	int batch, i;
 	int err = CQ_OK;
 
-	if (cq->stall_enable) {
-		if (cq->stall_adaptive_enable) {
-			if (cq->stall_last_count)
-				mlx5_stall_cycles_poll_cq(cq->stall_last_count + cq->stall_cycles);
-		} else if (cq->stall_next_poll) {
-			cq->stall_next_poll = 0;
-			mlx5_stall_poll_cq();
-		}
-	}
+	if (cq->stall_enable)
+		mlx5_stall_wait(cq, cq->stall_adaptive_enable);
 
-	mlx5_spin_lock(&cq->lock);
+	if (lock)
+		mlx5_spin_lock(&cq->lock);
 
-	for (npolled = 0; npolled < ne; ++npolled) {
-		err = mlx5_poll_one(cq, &rsc, &srq, wc + npolled, cqe_ver);
-		if (err != CQ_OK)
+	while (npolled < ne) {
+		batch = mlx5_scan_sw_cqes(cq, ne - npolled);
+		if (!batch) {
+			err = CQ_EMPTY;
 			break;
+		}
+
+		/*
+		 * Make sure we read CQ entry contents after we've checked the
+		 * ownership bits.
+		 */
+		udma_from_device_barrier();
+
+		for (i = 0; i != batch; i++) {
+			cqe = get_cqe(cq, cq->cons_index & cq->ibv_cq.cqe);
+			cqe64 = (cq->cqe_sz == 64) ? cqe : cqe + 64;
+			if (i + 1 != batch)
+				__builtin_prefetch(cqe + cq->cqe_sz);
+
+			++cq->cons_index;
+			VALGRIND_MAKE_MEM_DEFINED(cqe64, sizeof *cqe64);
+
+#ifdef MLX5_DEBUG
+			{
+				struct mlx5_context *mctx = to_mctx(cq->ibv_cq.context);
+
+				if (mlx5_debug_mask & MLX5_DBG_CQ_CQE) {
+					FILE *fp = mctx->dbg_fp;
+
+					mlx5_dbg(fp, MLX5_DBG_CQ_CQE, "dump cqe for cqn 0x%x:\n", cq->cqn);
+					dump_cqe(fp, cqe64);
+				}
+			}
+#endif
+			err = mlx5_parse_cqe(cq, cqe64, cqe, &rsc, &srq,
+					     wc + npolled, cqe_ver, 0);
+			if (unlikely(err != CQ_OK))
+				goto out;
+			++npolled;
+		}
 	}
 
+out:
 	update_cons_index(cq);
 
-	mlx5_spin_unlock(&cq->lock);
+	if (lock)
+		mlx5_spin_unlock(&cq->lock);
 
 	if (cq->stall_enable) {
 		if (cq->stall_adaptive_enable) {
-			if (npolled == 0) {
-				cq->stall_cycles = max(cq->stall_cycles-mlx5_stall_cq_dec_step,
-						       mlx5_stall_cq_poll_min);
-				mlx5_get_cycles(&cq->stall_last_count);
-			} else if (npolled < ne) {
-				cq->stall_cycles = min(cq->stall_cycles+mlx5_stall_cq_inc_step,
-						       mlx5_stall_cq_poll_max);
-				mlx5_get_cycles(&cq->stall_last_count);
-			} else {
-				cq->stall_cycles = max(cq->stall_cycles-mlx5_stall_cq_dec_step,
-						       mlx5_stall_cq_poll_min);
-				cq->stall_last_count = 0;
-			}
+			mlx5_stall_adapt(cq, npolled == 0, npolled < ne);
 		} else if (err == CQ_EMPTY) {
 			cq->stall_next_poll = 1;
 		}
@@ -810,19 +940,8 @@ static inline void _mlx5_end_poll(struct ibv_cq_ex *ibcq,
 
 	if (stall) {
 		if (stall == POLLING_MODE_STALL_ADAPTIVE) {
-			if (!(cq->flags & MLX5_CQ_FLAGS_FOUND_CQES)) {
-				cq->stall_cycles = max(cq->stall_cycles - mlx5_stall_cq_dec_step,
-						       mlx5_stall_cq_poll_min);
-				mlx5_get_cycles(&cq->stall_last_count);
-			} else if (cq->flags & MLX5_CQ_FLAGS_EMPTY_DURING_POLL) {
-				cq->stall_cycles = min(cq->stall_cycles + mlx5_stall_cq_inc_step,
-						       mlx5_stall_cq_poll_max);
-				mlx5_get_cycles(&cq->stall_last_count);
-			} else {
-				cq->stall_cycles = max(cq->stall_cycles - mlx5_stall_cq_dec_step,
-						       mlx5_stall_cq_poll_min);
-				cq->stall_last_count = 0;
-			}
+			mlx5_stall_adapt(cq, !(cq->flags & MLX5_CQ_FLAGS_FOUND_CQES),
+					 cq->flags & MLX5_CQ_FLAGS_EMPTY_DURING_POLL);
 		} else if (!(cq->flags & MLX5_CQ_FLAGS_FOUND_CQES)) {
 			cq->stall_next_poll = 1;
 		}
@@ -845,15 +964,8 @@ static inline int mlx5_start_poll(struct ibv_cq_ex *ibcq, struct ibv_poll_cq_att
 	if (unlikely(attr->comp_mask))
 		return EINVAL;
 
-	if (stall) {
-		if (stall == POLLING_MODE_STALL_ADAPTIVE) {
-			if (cq->stall_last_count)
-				mlx5_stall_cycles_poll_cq(cq->stall_last_count + cq->stall_cycles);
-		} else if (cq->stall_next_poll) {
-			cq->stall_next_poll = 0;
-			mlx5_stall_poll_cq();
-		}
-	}
+	if (stall)
+		mlx5_stall_wait(cq, stall == POLLING_MODE_STALL_ADAPTIVE);
 
 	if (lock)
 		mlx5_spin_lock(&cq->lock);
@@ -867,13 +979,10 @@ static inline int mlx5_start_poll(struct ibv_cq_ex *ibcq, struct ibv_poll_cq_att
 			mlx5_spin_unlock(&cq->lock);
 
 		if (stall) {
-			if (stall == POLLING_MODE_STALL_ADAPTIVE) {
-				cq->stall_cycles = max(cq->stall_cycles - mlx5_stall_cq_dec_step,
-						mlx5_stall_cq_poll_min);
-				mlx5_get_cycles(&cq->stall_last_count);
-			} else {
+			if (stall == POLLING_MODE_STALL_ADAPTIVE)
+				mlx5_stall_adapt(cq, 1, 1);
+			else
 				cq->stall_next_poll = 1;
-			}
 		}
 
 		return ENOENT;
@@ -887,11 +996,8 @@ static inline int mlx5_start_poll(struct ibv_cq_ex *ibcq, struct ibv_poll_cq_att
 		mlx5_spin_unlock(&cq->lock);
 
 	if (stall && err) {
-		if (stall == POLLING_MODE_STALL_ADAPTIVE) {
-			cq->stall_cycles = max(cq->stall_cycles - mlx5_stall_cq_dec_step,
-						mlx5_stall_cq_poll_min);
+		if (stall == POLLING_MODE_STALL_ADAPTIVE)
 			cq->stall_last_count = 0;
-		}
 
 		cq->flags &= ~(MLX5_CQ_FLAGS_FOUND_CQES);
 	}
@@ -1044,14 +1150,21 @@ static inline void mlx5_end_poll_lock(struct ibv_cq_ex *ibcq)
 	_mlx5_end_poll(ibcq, 1, 0);
 }
 
+/* CQs created with IBV_CREATE_CQ_ATTR_SINGLE_THREADED are polled lockless */
 int mlx5_poll_cq(struct ibv_cq *ibcq, int ne, struct ibv_wc *wc)
 {
-	return poll_cq(ibcq, ne, wc, 0);
+	if (to_mcq(ibcq)->flags & MLX5_CQ_FLAGS_SINGLE_THREADED)
+		return poll_cq(ibcq, ne, wc, 0, 0);
+
+	return poll_cq(ibcq, ne, wc, 0, 1);
 }
 
 int mlx5_poll_cq_v1(struct ibv_cq *ibcq, int ne, struct ibv_wc *wc)
 {
-	return poll_cq(ibcq, ne, wc, 1);
+	if (to_mcq(ibcq)->flags & MLX5_CQ_FLAGS_SINGLE_THREADED)
+		return poll_cq(ibcq, ne, wc, 1, 0);
+
+	return poll_cq(ibcq, ne, wc, 1, 1);
 }
 
 static inline enum ibv_wc_opcode mlx5_cq_read_wc_opcode(struct ibv_cq_ex *ibcq)
@@ -1130,6 +1243,9 @@ static inline uint32_t mlx5_cq_read_wc_byte_len(struct ibv_cq_ex *ibcq)
 {
 	struct mlx5_cq *cq = to_mcq(ibv_cq_ex_to_cq(ibcq));
 
+	if (unlikely(cq->flags & MLX5_CQ_FLAGS_STRIDING))
+		return mlx5_stride_byte_len(be32toh(cq->cqe64->byte_cnt));
+
 	return be32toh(cq->cqe64->byte_cnt);
 }
 
@@ -1245,7 +1361,7 @@ static const struct op
 	[SINGLE_THREADED | STALL | ADAPTIVE] =  POLL_FN_ENTRY(_v0, , _stall, _adaptive),
 };
 
-void mlx5_cq_fill_pfns(struct mlx5_cq *cq, const struct ibv_cq_init_attr_ex *cq_attr)
+void mlx5_cq_set_poll_ops(struct mlx5_cq *cq)
 {
 	struct mlx5_context *mctx = to_mctx(ibv_cq_ex_to_cq(&cq->ibv_cq)->context);
 	const struct op *poll_ops = &ops[((cq->stall_enable && cq->stall_adaptive_enable) ? ADAPTIVE : 0) |
@@ -1257,6 +1373,11 @@ void mlx5_cq_fill_pfns(struct mlx5_cq *cq, const struct ibv_cq_init_attr_ex *cq_
 	cq->ibv_cq.start_poll = poll_ops->start_poll;
 	cq->ibv_cq.next_poll = poll_ops->next_poll;
 	cq->ibv_cq.end_poll = poll_ops->end_poll;
+}
+
+void mlx5_cq_fill_pfns(struct mlx5_cq *cq, const struct ibv_cq_init_attr_ex *cq_attr)
+{
+	mlx5_cq_set_poll_ops(cq);
 
 	cq->ibv_cq.read_opcode = mlx5_cq_read_wc_opcode;
 	cq->ibv_cq.read_vendor_err = mlx5_cq_read_wc_vendor_err;
@@ -1283,6 +1404,28 @@ void mlx5_cq_fill_pfns(struct mlx5_cq *cq, const struct ibv_cq_init_attr_ex *cq_
 		cq->ibv_cq.read_flow_tag = mlx5_cq_read_flow_tag;
 }
 
+int mlx5dv_wc_read_stride(struct ibv_cq_ex *ibcq,
+			  struct mlx5dv_wc_stride *stride)
+{
+	struct mlx5_cq *cq = to_mcq(ibv_cq_ex_to_cq(ibcq));
+	uint32_t byte_cnt;
+
+	if (!(cq->flags & MLX5_CQ_FLAGS_STRIDING))
+		return EINVAL;
+
+	byte_cnt = be32toh(cq->cqe64->byte_cnt);
+	stride->index = be16toh(cq->cqe64->wqe_counter);
+	stride->num = (byte_cnt >> MLX5_MPRQ_STRIDES_SHIFT) &
+		      MLX5_MPRQ_STRIDES_MASK;
+	stride->flags = 0;
+	if (byte_cnt & MLX5_MPRQ_FILLER)
+		stride->flags |= MLX5DV_WC_STRIDE_FILLER;
+	if (cq->flags & MLX5_CQ_FLAGS_STRIDE_LAST)
+		stride->flags |= MLX5DV_WC_STRIDE_LAST;
+
+	return 0;
+}
+
 int mlx5_arm_cq(struct ibv_cq *ibvcq, int solicited)
 {
 	struct mlx5_cq *cq = to_mcq(ibvcq);
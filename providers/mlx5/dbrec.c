@@ -38,14 +38,29 @@
 
 #include "mlx5.h"
 
+/*
+ * Pages with a free record sit on db_avail, so allocation takes the first
+ * one. Every page is also hashed by its address, so freeing a record finds
+ * its page without walking a list. Records are cache line sized slots
+ * tracked by a bitmap per page.
+ */
 struct mlx5_db_page {
-	struct mlx5_db_page	       *prev, *next;
+	struct list_node		avail_entry;
+	struct list_node		hash_entry;
 	struct mlx5_buf			buf;
 	int				num_db;
 	int				use_cnt;
 	unsigned long			free[0];
 };
 
+static inline struct list_head *db_bucket(struct mlx5_context *context,
+					  uintptr_t addr)
+{
+	uintptr_t ps = to_mdev(context->ibv_ctx.device)->page_size;
+
+	return &context->db_hash[(addr / ps) & (MLX5_DB_HASH_SIZE - 1)];
+}
+
 static struct mlx5_db_page *__add_page(struct mlx5_context *context)
 {
 	struct mlx5_db_page *page;
@@ -64,8 +79,12 @@ static struct mlx5_db_page *__add_page(struct mlx5_context *context)
 
 	if (mlx5_is_extern_alloc(context))
 		ret = mlx5_alloc_buf_extern(context, &page->buf, ps);
-	else
+	else {
 		ret = mlx5_alloc_buf(&page->buf, ps, ps);
+		if (!ret)
+			verbs_numa_bind(&context->ibv_ctx, page->buf.buf,
+					page->buf.length);
+	}
 	if (ret) {
 		free(page);
 		return NULL;
@@ -76,11 +95,9 @@ static struct mlx5_db_page *__add_page(struct mlx5_context *context)
 	for (i = 0; i < nlong; ++i)
 		page->free[i] = ~0;
 
-	page->prev = NULL;
-	page->next = context->db_list;
-	context->db_list = page;
-	if (page->next)
-		page->next->prev = page;
+	list_add(&context->db_avail, &page->avail_entry);
+	list_add(db_bucket(context, (uintptr_t)page->buf.buf),
+		 &page->hash_entry);
 
 	return page;
 }
@@ -93,16 +110,15 @@ __be32 *mlx5_alloc_dbrec(struct mlx5_context *context)
 
 	pthread_mutex_lock(&context->db_list_mutex);
 
-	for (page = context->db_list; page; page = page->next)
-		if (page->use_cnt < page->num_db)
-			goto found;
-
-	page = __add_page(context);
-	if (!page)
-		goto out;
+	page = list_top(&context->db_avail, struct mlx5_db_page, avail_entry);
+	if (!page) {
+		page = __add_page(context);
+		if (!page)
+			goto out;
+	}
 
-found:
-	++page->use_cnt;
+	if (++page->use_cnt == page->num_db)
+		list_del(&page->avail_entry);
 
 	for (i = 0; !page->free[i]; ++i)
 		/* nothing */;
@@ -122,27 +138,27 @@ void mlx5_free_db(struct mlx5_context *context, __be32 *db)
 {
 	struct mlx5_db_page *page;
 	uintptr_t ps = to_mdev(context->ibv_ctx.device)->page_size;
+	uintptr_t addr = (uintptr_t) db & ~(ps - 1);
+	struct list_head *bucket = db_bucket(context, addr);
 	int i;
 
 	pthread_mutex_lock(&context->db_list_mutex);
 
-	for (page = context->db_list; page; page = page->next)
-		if (((uintptr_t) db & ~(ps - 1)) == (uintptr_t) page->buf.buf)
-			break;
-
-	if (!page)
-		goto out;
+	list_for_each(bucket, page, hash_entry)
+		if (addr == (uintptr_t) page->buf.buf)
+			goto found;
+	goto out;
 
+found:
 	i = ((void *) db - page->buf.buf) / context->cache_line_size;
 	page->free[i / (8 * sizeof(long))] |= 1UL << (i % (8 * sizeof(long)));
 
-	if (!--page->use_cnt) {
-		if (page->prev)
-			page->prev->next = page->next;
-		else
-			context->db_list = page->next;
-		if (page->next)
-			page->next->prev = page->prev;
+	if (page->use_cnt-- == page->num_db)
+		list_add(&context->db_avail, &page->avail_entry);
+
+	if (!page->use_cnt) {
+		list_del(&page->avail_entry);
+		list_del(&page->hash_entry);
 
 		if (page->buf.type == MLX5_ALLOC_TYPE_EXTERNAL)
 			mlx5_free_buf_extern(context, &page->buf);
@@ -221,7 +221,13 @@ struct mlx5_drv_create_wq {
 	__u32		user_index;
 	__u32		flags;
 	__u32		comp_mask;
-	__u32		reserved;
+	__u32		single_stride_log_num_of_bytes;
+	__u32		single_wqe_log_num_of_strides;
+	__u32		two_byte_shift_en;
+};
+
+enum mlx5_create_wq_comp_mask {
+	MLX5_CREATE_WQ_STRIDING_RQ	= 1 << 0,
 };
 
 struct mlx5_create_wq {
@@ -280,6 +286,11 @@ struct mlx5_packet_pacing_caps {
 	__u32  reserved;
 };
 
+struct mlx5_sw_parsing_caps {
+	__u32 sw_parsing_offloads;
+	__u32 supported_qpts;
+};
+
 enum mlx5_mpw_caps {
 	MLX5_MPW_OBSOLETE	= 1 << 0, /* Obsoleted, don't use */
 	MLX5_ALLOW_MPW		= 1 << 1,
@@ -296,6 +307,9 @@ struct mlx5_query_device_ex_resp {
 	struct mlx5_packet_pacing_caps	packet_pacing_caps;
 	__u32				support_multi_pkt_send_wqe;
 	__u32				reserved;
+	struct mlx5_sw_parsing_caps	sw_parsing_caps;
+	struct mlx5dv_striding_rq_caps	striding_rq_caps;
+	__u32				reserved1;
 };
 
 struct mlx5_create_action_xfrm {
@@ -128,41 +128,43 @@ static int read_number_from_line(const char *line, int *value)
 	*value = atoi(ptr);
 	return 0;
 }
-/**
- * The function looks for the first free user-index in all the
- * user-index tables. If all are used, returns -1, otherwise
- * a valid user-index.
- * In case the reference count of the table is zero, it means the
- * table is not in use and wasn't allocated yet, therefore the
- * mlx5_store_uidx allocates the table, and increment the reference
- * count on the table.
+/*
+ * User indexes are handed out from a stack of released indexes, or else by
+ * bumping uidx_next, so storing and clearing are O(1). The last index is
+ * kept unused as before.
  */
 static int32_t get_free_uidx(struct mlx5_context *ctx)
 {
-	int32_t tind;
-	int32_t i;
-
-	for (tind = 0; tind < MLX5_UIDX_TABLE_SIZE; tind++) {
-		if (ctx->uidx_table[tind].refcnt < MLX5_UIDX_TABLE_MASK)
-			break;
-	}
+	if (ctx->uidx_free_cnt)
+		return ctx->uidx_free[--ctx->uidx_free_cnt];
 
-	if (tind == MLX5_UIDX_TABLE_SIZE)
+	if (ctx->uidx_next >= MLX5_UIDX_TABLE_SIZE * (MLX5_UIDX_TABLE_MASK + 1) - 1)
 		return -1;
 
-	if (!ctx->uidx_table[tind].refcnt)
-		return tind << MLX5_UIDX_TABLE_SHIFT;
+	return ctx->uidx_next++;
+}
 
-	for (i = 0; i < MLX5_UIDX_TABLE_MASK + 1; i++) {
-		if (!ctx->uidx_table[tind].table[i])
-			break;
+static int put_free_uidx(struct mlx5_context *ctx, uint32_t uidx)
+{
+	uint32_t *free_list;
+	uint32_t max;
+
+	if (ctx->uidx_free_cnt == ctx->uidx_free_max) {
+		max = ctx->uidx_free_max ? ctx->uidx_free_max * 2 : 64;
+		free_list = realloc(ctx->uidx_free, max * sizeof(*free_list));
+		if (!free_list)
+			return -1;
+		ctx->uidx_free = free_list;
+		ctx->uidx_free_max = max;
 	}
 
-	return (tind << MLX5_UIDX_TABLE_SHIFT) | i;
+	ctx->uidx_free[ctx->uidx_free_cnt++] = uidx;
+	return 0;
 }
 
 int32_t mlx5_store_uidx(struct mlx5_context *ctx, void *rsc)
 {
+	struct mlx5_resource **table;
 	int32_t tind;
 	int32_t ret = -1;
 	int32_t uidx;
@@ -173,16 +175,22 @@ int32_t mlx5_store_uidx(struct mlx5_context *ctx, void *rsc)
 		goto out;
 
 	tind = uidx >> MLX5_UIDX_TABLE_SHIFT;
-
-	if (!ctx->uidx_table[tind].refcnt) {
-		ctx->uidx_table[tind].table = calloc(MLX5_UIDX_TABLE_MASK + 1,
-						     sizeof(struct mlx5_resource *));
-		if (!ctx->uidx_table[tind].table)
+	table = atomic_load_explicit(&ctx->uidx_table[tind].table,
+				     memory_order_relaxed);
+
+	if (!table) {
+		table = verbs_numa_zalloc(&ctx->ibv_ctx,
+					  (MLX5_UIDX_TABLE_MASK + 1) *
+					  sizeof(struct mlx5_resource *));
+		if (!table) {
+			put_free_uidx(ctx, uidx);
 			goto out;
+		}
+		atomic_store_explicit(&ctx->uidx_table[tind].table, table,
+				      memory_order_release);
 	}
 
-	++ctx->uidx_table[tind].refcnt;
-	ctx->uidx_table[tind].table[uidx & MLX5_UIDX_TABLE_MASK] = rsc;
+	table[uidx & MLX5_UIDX_TABLE_MASK] = rsc;
 	ret = uidx;
 
 out:
@@ -193,17 +201,29 @@ out:
 void mlx5_clear_uidx(struct mlx5_context *ctx, uint32_t uidx)
 {
 	int tind = uidx >> MLX5_UIDX_TABLE_SHIFT;
+	struct mlx5_resource **table;
 
 	pthread_mutex_lock(&ctx->uidx_table_mutex);
 
-	if (!--ctx->uidx_table[tind].refcnt)
-		free(ctx->uidx_table[tind].table);
-	else
-		ctx->uidx_table[tind].table[uidx & MLX5_UIDX_TABLE_MASK] = NULL;
+	table = atomic_load_explicit(&ctx->uidx_table[tind].table,
+				     memory_order_relaxed);
+	table[uidx & MLX5_UIDX_TABLE_MASK] = NULL;
+
+	/* Without room on the free stack the index is leaked, not reused */
+	put_free_uidx(ctx, uidx);
 
 	pthread_mutex_unlock(&ctx->uidx_table_mutex);
 }
 
+static void mlx5_free_uidx_tables(struct mlx5_context *ctx)
+{
+	int i;
+
+	for (i = 0; i < MLX5_UIDX_TABLE_SIZE; i++)
+		free(atomic_load(&ctx->uidx_table[i].table));
+	free(ctx->uidx_free);
+}
+
 static int mlx5_is_sandy_bridge(int *num_cores)
 {
 	char line[128];
@@ -382,9 +402,14 @@ static void mlx5_read_env(struct ibv_device *ibdev, struct mlx5_context *ctx)
 		/* autodetect if we need to do cq polling */
 		ctx->stall_enable = mlx5_enable_sandy_bridge_fix(ibdev);
 
+	/*
+	 * The adaptive governor is used unless a fixed number of stall loops
+	 * is asked for.
+	 */
 	env_value = getenv("MLX5_STALL_NUM_LOOP");
 	if (env_value)
 		mlx5_stall_num_loop = atoi(env_value);
+	ctx->stall_adaptive_enable = !env_value || mlx5_stall_num_loop < 0;
 
 	env_value = getenv("MLX5_STALL_CQ_POLL_MIN");
 	if (env_value)
@@ -394,22 +419,7 @@ static void mlx5_read_env(struct ibv_device *ibdev, struct mlx5_context *ctx)
 	if (env_value)
 		mlx5_stall_cq_poll_max = atoi(env_value);
 
-	env_value = getenv("MLX5_STALL_CQ_INC_STEP");
-	if (env_value)
-		mlx5_stall_cq_inc_step = atoi(env_value);
-
-	env_value = getenv("MLX5_STALL_CQ_DEC_STEP");
-	if (env_value)
-		mlx5_stall_cq_dec_step = atoi(env_value);
-
-	ctx->stall_adaptive_enable = 0;
-	ctx->stall_cycles = 0;
-
-	if (mlx5_stall_num_loop < 0) {
-		ctx->stall_adaptive_enable = 1;
-		ctx->stall_cycles = mlx5_stall_cq_poll_min;
-	}
-
+	ctx->stall_cycles = mlx5_stall_cq_poll_min;
 }
 
 static int get_total_uuars(int page_size)
@@ -633,6 +643,11 @@ int mlx5dv_query_device(struct ibv_context *ctx_in,
 	if (attrs_out->comp_mask & MLX5DV_CONTEXT_MASK_XFRM_FLAGS)
 		attrs_out->xfrm_flags = mctx->xfrm_flags;
 
+	if (attrs_out->comp_mask & MLX5DV_CONTEXT_MASK_STRIDING_RQ) {
+		attrs_out->striding_rq_caps = mctx->striding_rq_caps;
+		comp_mask_out |= MLX5DV_CONTEXT_MASK_STRIDING_RQ;
+	}
+
 	attrs_out->comp_mask = comp_mask_out;
 
 	return 0;
@@ -901,10 +916,12 @@ static int mlx5_init_context(struct verbs_device *vdev,
 	for (i = 0; i < MLX5_QP_TABLE_SIZE; ++i)
 		context->qp_table[i].refcnt = 0;
 
-	for (i = 0; i < MLX5_QP_TABLE_SIZE; ++i)
-		context->uidx_table[i].refcnt = 0;
+	for (i = 0; i < MLX5_UIDX_TABLE_SIZE; ++i)
+		atomic_init(&context->uidx_table[i].table, NULL);
 
-	context->db_list = NULL;
+	list_head_init(&context->db_avail);
+	for (i = 0; i < MLX5_DB_HASH_SIZE; ++i)
+		list_head_init(&context->db_hash[i]);
 
 	pthread_mutex_init(&context->db_list_mutex, NULL);
 
@@ -973,6 +990,7 @@ static int mlx5_init_context(struct verbs_device *vdev,
 	verbs_set_ctx_op(v_ctx, create_action_xfrm, mlx5_create_action_xfrm);
 	verbs_set_ctx_op(v_ctx, destroy_action_xfrm, ibv_cmd_destroy_action_xfrm);
 	verbs_set_ctx_op(v_ctx, modify_action_xfrm, mlx5_modify_action_xfrm);
+	verbs_set_ctx_op(v_ctx, init_qp_ex, mlx5_init_qp_ex);
 
 	memset(&device_attr, 0, sizeof(device_attr));
 	if (!mlx5_query_device_ex(ctx, NULL, &device_attr,
@@ -1011,6 +1029,7 @@ static void mlx5_cleanup_context(struct verbs_device *device,
 	int i;
 
 	free(context->bfs);
+	mlx5_free_uidx_tables(context);
 	for (i = 0; i < MLX5_MAX_UARS; ++i) {
 		if (context->uar[i])
 			munmap(context->uar[i], page_size);
@@ -127,6 +127,10 @@ enum {
 	MLX5_SRQ_TABLE_SIZE		= 1 << (24 - MLX5_SRQ_TABLE_SHIFT),
 };
 
+enum {
+	MLX5_DB_HASH_SIZE		= 64,
+};
+
 enum {
 	MLX5_BF_OFFSET	= 0x800
 };
@@ -192,6 +196,14 @@ enum {
 	MLX5_FLOW_TAG_MASK	= 0x000fffff,
 };
 
+/* byte_cnt of a striding RQ CQE */
+enum {
+	MLX5_MPRQ_FILLER	= 1U << 31,
+	MLX5_MPRQ_STRIDES_SHIFT	= 16,
+	MLX5_MPRQ_STRIDES_MASK	= 0x7fff,
+	MLX5_MPRQ_LEN_MASK	= 0xffff,
+};
+
 struct mlx5_resource {
 	enum mlx5_rsc_type	type;
 	uint32_t		rsn;
@@ -233,14 +245,23 @@ struct mlx5_context {
 	}				srq_table[MLX5_SRQ_TABLE_SIZE];
 	pthread_mutex_t			srq_table_mutex;
 
+	/*
+	 * Tables are published once and kept until the context is freed, so
+	 * mlx5_find_uidx() needs no lock. The mutex serializes writers.
+	 */
 	struct {
-		struct mlx5_resource  **table;
-		int                     refcnt;
+		_Atomic(struct mlx5_resource **) table;
 	}				uidx_table[MLX5_UIDX_TABLE_SIZE];
+	uint32_t		       *uidx_free;
+	uint32_t			uidx_free_cnt;
+	uint32_t			uidx_free_max;
+	uint32_t			uidx_next;
 	pthread_mutex_t                 uidx_table_mutex;
 
 	void			       *uar[MLX5_MAX_UARS];
-	struct mlx5_db_page	       *db_list;
+	/* Doorbell pages with a free record, and all of them by address */
+	struct list_head		db_avail;
+	struct list_head		db_hash[MLX5_DB_HASH_SIZE];
 	pthread_mutex_t			db_list_mutex;
 	int				cache_line_size;
 	int				max_sq_desc_sz;
@@ -271,23 +292,22 @@ struct mlx5_context {
 	uint32_t			uar_size;
 	uint64_t			vendor_cap_flags; /* Use enum mlx5_vendor_cap_flags */
 	struct mlx5dv_cqe_comp_caps	cqe_comp_caps;
+	struct mlx5dv_striding_rq_caps	striding_rq_caps;
 	struct mlx5dv_ctx_allocators	extern_alloc;
 	uint16_t			xfrm_flags;
 };
 
-struct mlx5_bitmap {
-	uint32_t		last;
-	uint32_t		top;
-	uint32_t		max;
-	uint32_t		avail;
-	uint32_t		mask;
-	unsigned long	       *table;
+struct mlx5_buddy {
+	int			max_order;
+	uint32_t	       *num_free;
+	unsigned long	      **bits;
 };
 
 struct mlx5_hugetlb_mem {
 	int			shmid;
 	void		       *shmaddr;
-	struct mlx5_bitmap	bitmap;
+	int			numa_node;
+	struct mlx5_buddy	buddy;
 	struct list_node	entry;
 };
 
@@ -316,6 +336,8 @@ enum {
 	MLX5_CQ_FLAGS_EXTENDED = 1 << 3,
 	MLX5_CQ_FLAGS_SINGLE_THREADED = 1 << 4,
 	MLX5_CQ_FLAGS_DV_OWNED = 1 << 5,
+	MLX5_CQ_FLAGS_STRIDING = 1 << 6,
+	MLX5_CQ_FLAGS_STRIDE_LAST = 1 << 7,
 };
 
 struct mlx5_cq {
@@ -339,6 +361,7 @@ struct mlx5_cq {
 	uint64_t			stall_last_count;
 	int				stall_adaptive_enable;
 	int				stall_cycles;
+	int				stall_empty_ewma;
 	struct mlx5_resource		*cur_rsc;
 	struct mlx5_srq			*cur_srq;
 	struct mlx5_cqe64		*cqe64;
@@ -430,6 +453,22 @@ struct mlx5_qp {
 	uint16_t			max_tso_header;
 	int                             rss_qp;
 	uint32_t			flags; /* Use enum mlx5_qp_flags */
+
+	/* Work request builder state, valid from wr_start to wr_complete */
+	struct mlx5_wqe_ctrl_seg	*cur_ctrl;
+	void				*cur_data;
+	void				*cur_xrc;
+	void				*cur_dgram;
+	int				cur_size;
+	int				cur_num_sge;
+	bool				cur_atomic;
+	bool				cur_inl;
+	int				nreq;
+	int				inl_wqe;
+	int				wr_err;
+	unsigned int			start_post;
+	struct mlx5_wqe_ctrl_seg	*last_ctrl;
+	int				last_size;
 };
 
 struct mlx5_ah {
@@ -448,6 +487,9 @@ struct mlx5_rwq {
 	void	*pbuff;
 	__be32	*recv_db;
 	int wq_sig;
+	int striding;
+	uint32_t num_strides;
+	uint32_t consumed_strides;
 };
 
 static inline int mlx5_ilog2(int n)
@@ -467,8 +509,6 @@ static inline int mlx5_ilog2(int n)
 extern int mlx5_stall_num_loop;
 extern int mlx5_stall_cq_poll_min;
 extern int mlx5_stall_cq_poll_max;
-extern int mlx5_stall_cq_inc_step;
-extern int mlx5_stall_cq_dec_step;
 extern int mlx5_single_threaded;
 
 static inline unsigned DIV_ROUND_UP(unsigned n, unsigned d)
@@ -613,6 +653,7 @@ struct ibv_cq *mlx5_create_cq(struct ibv_context *context, int cqe,
 struct ibv_cq_ex *mlx5_create_cq_ex(struct ibv_context *context,
 				    struct ibv_cq_init_attr_ex *cq_attr);
 void mlx5_cq_fill_pfns(struct mlx5_cq *cq, const struct ibv_cq_init_attr_ex *cq_attr);
+void mlx5_cq_set_poll_ops(struct mlx5_cq *cq);
 int mlx5_alloc_cq_buf(struct mlx5_context *mctx, struct mlx5_cq *cq,
 		      struct mlx5_buf *buf, int nent, int cqe_sz);
 int mlx5_free_cq_buf(struct mlx5_context *ctx, struct mlx5_buf *buf);
@@ -648,6 +689,7 @@ int mlx5_modify_qp(struct ibv_qp *qp, struct ibv_qp_attr *attr,
 int mlx5_destroy_qp(struct ibv_qp *qp);
 void mlx5_init_qp_indices(struct mlx5_qp *qp);
 void mlx5_init_rwq_indices(struct mlx5_rwq *rwq);
+int mlx5_init_qp_ex(struct ibv_qp *ibqp, struct ibv_qp_ex *qpx);
 int mlx5_post_send(struct ibv_qp *ibqp, struct ibv_send_wr *wr,
 			  struct ibv_send_wr **bad_wr);
 int mlx5_post_recv(struct ibv_qp *ibqp, struct ibv_recv_wr *wr,
@@ -701,9 +743,12 @@ int mlx5_modify_action_xfrm(struct _ibv_action_xfrm *action,
 static inline void *mlx5_find_uidx(struct mlx5_context *ctx, uint32_t uidx)
 {
 	int tind = uidx >> MLX5_UIDX_TABLE_SHIFT;
+	struct mlx5_resource **table;
 
-	if (likely(ctx->uidx_table[tind].refcnt))
-		return ctx->uidx_table[tind].table[uidx & MLX5_UIDX_TABLE_MASK];
+	table = atomic_load_explicit(&ctx->uidx_table[tind].table,
+				     memory_order_acquire);
+	if (likely(table))
+		return table[uidx & MLX5_UIDX_TABLE_MASK];
 
 	return NULL;
 }
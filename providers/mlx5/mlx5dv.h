@@ -59,7 +59,8 @@ enum {
 enum mlx5dv_context_comp_mask {
 	MLX5DV_CONTEXT_MASK_CQE_COMPRESION	= 1 << 0,
 	MLX5DV_CONTEXT_MASK_XFRM_FLAGS		= 1 << 1,
-	MLX5DV_CONTEXT_MASK_RESERVED		= 1 << 2,
+	MLX5DV_CONTEXT_MASK_STRIDING_RQ		= 1 << 2,
+	MLX5DV_CONTEXT_MASK_RESERVED		= 1 << 3,
 };
 
 struct mlx5dv_cqe_comp_caps {
@@ -67,6 +68,14 @@ struct mlx5dv_cqe_comp_caps {
 	uint32_t supported_format; /* enum mlx5dv_cqe_comp_res_format */
 };
 
+struct mlx5dv_striding_rq_caps {
+	uint32_t min_single_stride_log_num_of_bytes;
+	uint32_t max_single_stride_log_num_of_bytes;
+	uint32_t min_single_wqe_log_num_of_strides;
+	uint32_t max_single_wqe_log_num_of_strides;
+	uint32_t supported_qpts; /* Use enum ibv_qp_type bits */
+};
+
 enum {
 	MLX5DV_CONTEXT_XFRM_FLAGS_ESP_AES_GCM_REQ_METADATA = 1U << 0,
 	MLX5DV_CONTEXT_XFRM_FLAGS_ESP_AES_GCM_RX = 1U << 1,
@@ -83,6 +92,7 @@ struct mlx5dv_context {
 	uint64_t	comp_mask;
 	struct mlx5dv_cqe_comp_caps	cqe_comp_caps;
 	uint32_t	xfrm_flags;
+	struct mlx5dv_striding_rq_caps	striding_rq_caps;
 };
 
 enum mlx5dv_context_flags {
@@ -109,6 +119,73 @@ struct ibv_cq_ex *mlx5dv_create_cq(struct ibv_context *context,
 				   struct ibv_cq_init_attr_ex *cq_attr,
 				   struct mlx5dv_cq_init_attr *mlx5_cq_attr);
 
+enum mlx5dv_wq_init_attr_mask {
+	MLX5DV_WQ_INIT_ATTR_MASK_STRIDING_RQ	= 1 << 0,
+	MLX5DV_WQ_INIT_ATTR_MASK_RESERVED	= 1 << 1,
+};
+
+struct mlx5dv_striding_rq_init_attr {
+	uint32_t	single_stride_log_num_of_bytes;
+	uint32_t	single_wqe_log_num_of_strides;
+	uint8_t		two_byte_shift_en;
+};
+
+struct mlx5dv_wq_init_attr {
+	uint64_t				comp_mask; /* Use enum mlx5dv_wq_init_attr_mask */
+	struct mlx5dv_striding_rq_init_attr	striding_rq_attrs;
+};
+
+/*
+ * A striding receive WQ has one buffer per WQE that is carved into
+ * 1 << single_wqe_log_num_of_strides strides, each packet is written to the
+ * next free stride(s) of the current WQE.
+ */
+struct ibv_wq *mlx5dv_create_wq(struct ibv_context *context,
+				struct ibv_wq_init_attr *wq_init_attr,
+				struct mlx5dv_wq_init_attr *mlx5_wq_attr);
+
+enum mlx5dv_wc_stride_flags {
+	/* No packet, the strides left in the WQE were skipped */
+	MLX5DV_WC_STRIDE_FILLER		= 1 << 0,
+	/* The WQE is consumed and may be posted again */
+	MLX5DV_WC_STRIDE_LAST		= 1 << 1,
+};
+
+struct mlx5dv_wc_stride {
+	uint16_t	index; /* First stride the packet was written to */
+	uint16_t	num; /* Strides consumed by this completion */
+	uint32_t	flags; /* Use enum mlx5dv_wc_stride_flags */
+};
+
+/*
+ * Read the stride information of the current completion of an extended CQ,
+ * between ibv_start_poll() and ibv_end_poll(). Returns EINVAL if the
+ * completion is not for a striding receive WQ.
+ */
+int mlx5dv_wc_read_stride(struct ibv_cq_ex *cq, struct mlx5dv_wc_stride *stride);
+
+enum mlx5dv_cq_stall_mode {
+	MLX5DV_CQ_STALL_NONE		= 0,
+	MLX5DV_CQ_STALL_FIXED		= 1,
+	MLX5DV_CQ_STALL_ADAPTIVE	= 2,
+};
+
+enum mlx5dv_cq_attr_mask {
+	MLX5DV_CQ_ATTR_MASK_STALL_MODE	= 1 << 0,
+	MLX5DV_CQ_ATTR_MASK_RESERVED	= 1 << 1,
+};
+
+struct mlx5dv_cq_attr {
+	uint64_t comp_mask; /* Use enum mlx5dv_cq_attr_mask */
+	uint32_t stall_mode; /* Use enum mlx5dv_cq_stall_mode */
+};
+
+/*
+ * Change the polling behaviour of a CQ. Must not be called while another
+ * thread polls the CQ.
+ */
+int mlx5dv_modify_cq(struct ibv_cq *cq, struct mlx5dv_cq_attr *attr);
+
 enum mlx5dv_action_xfrm_attr_esp_aes_gcm_mask {
 	MLX5DV_ACTION_XFRM_ATTR_ESP_AES_GCM_MASK_XFRM_FLAGS	= 1 << 0,
 	MLX5DV_ACTION_XFRM_ATTR_ESP_AES_GCM_MASK_RESERVED	= 1 << 1,
@@ -160,6 +160,7 @@ void mlx5_init_rwq_indices(struct mlx5_rwq *rwq)
 {
 	rwq->rq.head	 = 0;
 	rwq->rq.tail	 = 0;
+	rwq->consumed_strides = 0;
 }
 
 void mlx5_init_qp_indices(struct mlx5_qp *qp)
@@ -661,10 +662,53 @@ static inline int mlx5_post_send_underlay(struct mlx5_qp *qp, struct ibv_send_wr
 	return 0;
 }
 
+static inline void post_send_db(struct mlx5_qp *qp, struct mlx5_bf *bf,
+				int nreq, int inl, int size, void *ctrl)
+{
+	struct mlx5_context *ctx;
+
+	/*
+	 * Make sure that descriptors are written before
+	 * updating doorbell record and ringing the doorbell
+	 */
+	udma_to_device_barrier();
+	qp->db[MLX5_SND_DBR] = htobe32(qp->sq.cur_post & 0xffff);
+
+	/* Make sure that the doorbell write happens before the memcpy
+	 * to WC memory below */
+	ctx = to_mctx(qp->ibv_qp->context);
+	if (bf->need_lock)
+		mmio_wc_spinlock(&bf->lock.lock);
+	else
+		mmio_wc_start();
+
+	if (!ctx->shut_up_bf && nreq == 1 && bf->uuarn &&
+	    (inl || ctx->prefer_bf) && size > 1 &&
+	    size <= bf->buf_size / 16)
+		mlx5_bf_copy(bf->reg + bf->offset, (uint64_t *)ctrl,
+			     align(size * 16, 64), qp);
+	else
+		mmio_write64_be(bf->reg + bf->offset, *(__be64 *)ctrl);
+
+	/*
+	 * use mmio_flush_writes() to ensure write combining buffers are flushed out
+	 * of the running CPU. This must be carried inside the spinlock.
+	 * Otherwise, there is a potential race. In the race, CPU A
+	 * writes doorbell 1, which is waiting in the WC buffer. CPU B
+	 * writes doorbell 2, and it's write is flushed earlier. Since
+	 * the mmio_flush_writes is CPU local, this will result in the HCA seeing
+	 * doorbell 2, followed by doorbell 1.
+	 * Flush before toggling bf_offset to be latency oriented.
+	 */
+	mmio_flush_writes();
+	bf->offset ^= bf->buf_size;
+	if (bf->need_lock)
+		mlx5_spin_unlock(&bf->lock);
+}
+
 static inline int _mlx5_post_send(struct ibv_qp *ibqp, struct ibv_send_wr *wr,
 				  struct ibv_send_wr **bad_wr)
 {
-	struct mlx5_context *ctx;
 	struct mlx5_qp *qp = to_mqp(ibqp);
 	void *seg;
 	struct mlx5_wqe_eth_seg *eseg;
@@ -980,44 +1024,7 @@ out:
 	if (likely(nreq)) {
 		qp->sq.head += nreq;
 		qp->fm_cache = next_fence;
-
-		/*
-		 * Make sure that descriptors are written before
-		 * updating doorbell record and ringing the doorbell
-		 */
-		udma_to_device_barrier();
-		qp->db[MLX5_SND_DBR] = htobe32(qp->sq.cur_post & 0xffff);
-
-		/* Make sure that the doorbell write happens before the memcpy
-		 * to WC memory below */
-		ctx = to_mctx(ibqp->context);
-		if (bf->need_lock)
-			mmio_wc_spinlock(&bf->lock.lock);
-		else
-			mmio_wc_start();
-
-		if (!ctx->shut_up_bf && nreq == 1 && bf->uuarn &&
-		    (inl || ctx->prefer_bf) && size > 1 &&
-		    size <= bf->buf_size / 16)
-			mlx5_bf_copy(bf->reg + bf->offset, (uint64_t *)ctrl,
-				     align(size * 16, 64), qp);
-		else
-			mmio_write64_be(bf->reg + bf->offset, *(__be64 *)ctrl);
-
-		/*
-		 * use mmio_flush_writes() to ensure write combining buffers are flushed out
-		 * of the running CPU. This must be carried inside the spinlock.
-		 * Otherwise, there is a potential race. In the race, CPU A
-		 * writes doorbell 1, which is waiting in the WC buffer. CPU B
-		 * writes doorbell 2, and it's write is flushed earlier. Since
-		 * the mmio_flush_writes is CPU local, this will result in the HCA seeing
-		 * doorbell 2, followed by doorbell 1.
-		 * Flush before toggling bf_offset to be latency oriented.
-		 */
-		mmio_flush_writes();
-		bf->offset ^= bf->buf_size;
-		if (bf->need_lock)
-			mlx5_spin_unlock(&bf->lock);
+		post_send_db(qp, bf, nreq, inl, size, ctrl);
 	}
 
 	mlx5_spin_unlock(&qp->sq.lock);
@@ -1046,6 +1053,454 @@ int mlx5_post_send(struct ibv_qp *ibqp, struct ibv_send_wr *wr,
 	return _mlx5_post_send(ibqp, wr, bad_wr);
 }
 
+/*
+ * Work request builder. Each opcode call closes the previous WQE and opens
+ * a new one in the SQ, the setters append segments to it in place, and
+ * wr_complete rings the doorbell once for the whole batch. Errors are
+ * latched in wr_err and returned by wr_complete, which then rolls the SQ
+ * back to where wr_start found it.
+ */
+static void mlx5_wr_finalize(struct mlx5_qp *mqp)
+{
+	struct mlx5_wqe_ctrl_seg *ctrl = mqp->cur_ctrl;
+
+	ctrl->qpn_ds = htobe32(mqp->cur_size | (mqp->ibv_qp->qp_num << 8));
+	if (unlikely(mqp->wq_sig))
+		ctrl->signature = wq_sig(ctrl);
+
+#ifdef MLX5_DEBUG
+	if (mlx5_debug_mask & MLX5_DBG_QP_SEND)
+		dump_wqe(to_mctx(mqp->ibv_qp->context)->dbg_fp,
+			 mqp->sq.cur_post & (mqp->sq.wqe_cnt - 1),
+			 mqp->cur_size, mqp);
+#endif
+
+	mqp->sq.cur_post += DIV_ROUND_UP(mqp->cur_size * 16, MLX5_SEND_WQE_BB);
+	mqp->last_ctrl = ctrl;
+	mqp->last_size = mqp->cur_size;
+	mqp->nreq++;
+	mqp->cur_ctrl = NULL;
+}
+
+static void mlx5_wr_start(struct ibv_qp_ex *qpx)
+{
+	struct mlx5_qp *mqp = to_mqp(qpx->qp);
+
+	mlx5_spin_lock(&mqp->sq.lock);
+
+	mqp->cur_ctrl = NULL;
+	mqp->nreq = 0;
+	mqp->inl_wqe = 0;
+	mqp->wr_err = 0;
+	mqp->start_post = mqp->sq.cur_post;
+}
+
+static int mlx5_wr_complete(struct ibv_qp_ex *qpx)
+{
+	struct mlx5_qp *mqp = to_mqp(qpx->qp);
+	int err;
+
+	if (mqp->cur_ctrl && !mqp->wr_err)
+		mlx5_wr_finalize(mqp);
+
+	err = mqp->wr_err;
+	if (unlikely(err)) {
+		mqp->sq.cur_post = mqp->start_post;
+		goto out;
+	}
+
+	if (likely(mqp->nreq)) {
+		mqp->sq.head += mqp->nreq;
+		mqp->fm_cache = 0;
+		post_send_db(mqp, mqp->bf, mqp->nreq, mqp->inl_wqe,
+			     mqp->last_size, mqp->last_ctrl);
+	}
+
+out:
+	mlx5_spin_unlock(&mqp->sq.lock);
+	return err;
+}
+
+static void mlx5_wr_abort(struct ibv_qp_ex *qpx)
+{
+	struct mlx5_qp *mqp = to_mqp(qpx->qp);
+
+	mqp->sq.cur_post = mqp->start_post;
+	mlx5_spin_unlock(&mqp->sq.lock);
+}
+
+/* Open a WQE for @ib_op and return where the opcode specific segment goes */
+static void *mlx5_wr_common(struct ibv_qp_ex *qpx, enum ibv_wr_opcode ib_op,
+			    __be32 imm)
+{
+	struct mlx5_qp *mqp = to_mqp(qpx->qp);
+	struct mlx5_wqe_ctrl_seg *ctrl;
+	uint8_t fence;
+	unsigned int idx;
+	void *seg;
+
+	if (unlikely(mqp->wr_err))
+		return NULL;
+
+	if (mqp->cur_ctrl)
+		mlx5_wr_finalize(mqp);
+
+	if (unlikely(mlx5_wq_overflow(&mqp->sq, mqp->nreq,
+				      to_mcq(mqp->ibv_qp->send_cq)))) {
+		mqp->wr_err = ENOMEM;
+		return NULL;
+	}
+
+	if (qpx->wr_flags & IBV_SEND_FENCE)
+		fence = MLX5_WQE_CTRL_FENCE;
+	else
+		fence = mqp->nreq ? 0 : mqp->fm_cache;
+
+	idx = mqp->sq.cur_post & (mqp->sq.wqe_cnt - 1);
+	ctrl = seg = mlx5_get_send_wqe(mqp, idx);
+	*(uint32_t *)(seg + 8) = 0;
+	ctrl->imm = imm;
+	ctrl->fm_ce_se = mqp->sq_signal_bits | fence |
+		(qpx->wr_flags & IBV_SEND_SIGNALED ?
+		 MLX5_WQE_CTRL_CQ_UPDATE : 0) |
+		(qpx->wr_flags & IBV_SEND_SOLICITED ?
+		 MLX5_WQE_CTRL_SOLICITED : 0);
+	ctrl->opmod_idx_opcode = htobe32(((mqp->sq.cur_post & 0xffff) << 8) |
+					 mlx5_ib_opcode[ib_op]);
+
+	mqp->sq.wrid[idx] = qpx->wr_id;
+	mqp->sq.wqe_head[idx] = mqp->sq.head + mqp->nreq;
+
+	seg += sizeof(*ctrl);
+	mqp->cur_size = sizeof(*ctrl) / 16;
+	mqp->cur_ctrl = ctrl;
+	mqp->cur_xrc = NULL;
+	mqp->cur_dgram = NULL;
+	mqp->cur_num_sge = 0;
+	mqp->cur_atomic = false;
+	mqp->cur_inl = false;
+
+	if (mqp->ibv_qp->qp_type == IBV_QPT_XRC_SEND) {
+		mqp->cur_xrc = seg;
+		seg += sizeof(struct mlx5_wqe_xrc_seg);
+		mqp->cur_size += sizeof(struct mlx5_wqe_xrc_seg) / 16;
+	}
+
+	mqp->cur_data = seg;
+	return seg;
+}
+
+static void mlx5_wr_send_common(struct ibv_qp_ex *qpx,
+				enum ibv_wr_opcode ib_op, __be32 imm)
+{
+	struct mlx5_qp *mqp = to_mqp(qpx->qp);
+	void *seg;
+
+	seg = mlx5_wr_common(qpx, ib_op, imm);
+	if (!seg || mqp->ibv_qp->qp_type != IBV_QPT_UD)
+		return;
+
+	mqp->cur_dgram = seg;
+	seg += sizeof(struct mlx5_wqe_datagram_seg);
+	mqp->cur_size += sizeof(struct mlx5_wqe_datagram_seg) / 16;
+	if (unlikely(seg == mqp->sq.qend))
+		seg = mlx5_get_send_wqe(mqp, 0);
+	mqp->cur_data = seg;
+}
+
+static void mlx5_wr_send(struct ibv_qp_ex *qpx)
+{
+	mlx5_wr_send_common(qpx, IBV_WR_SEND, 0);
+}
+
+static void mlx5_wr_send_imm(struct ibv_qp_ex *qpx, __be32 imm_data)
+{
+	mlx5_wr_send_common(qpx, IBV_WR_SEND_WITH_IMM, imm_data);
+}
+
+static void mlx5_wr_rdma_common(struct ibv_qp_ex *qpx, enum ibv_wr_opcode ib_op,
+				uint32_t rkey, uint64_t remote_addr,
+				__be32 imm)
+{
+	struct mlx5_qp *mqp = to_mqp(qpx->qp);
+	void *seg;
+
+	if (unlikely(mqp->ibv_qp->qp_type == IBV_QPT_UD ||
+		     (mqp->ibv_qp->qp_type == IBV_QPT_UC &&
+		      ib_op == IBV_WR_RDMA_READ))) {
+		if (!mqp->wr_err)
+			mqp->wr_err = EINVAL;
+		return;
+	}
+
+	seg = mlx5_wr_common(qpx, ib_op, imm);
+	if (!seg)
+		return;
+
+	set_raddr_seg(seg, remote_addr, rkey);
+	mqp->cur_data = seg + sizeof(struct mlx5_wqe_raddr_seg);
+	mqp->cur_size += sizeof(struct mlx5_wqe_raddr_seg) / 16;
+}
+
+static void mlx5_wr_rdma_write(struct ibv_qp_ex *qpx, uint32_t rkey,
+			       uint64_t remote_addr)
+{
+	mlx5_wr_rdma_common(qpx, IBV_WR_RDMA_WRITE, rkey, remote_addr, 0);
+}
+
+static void mlx5_wr_rdma_write_imm(struct ibv_qp_ex *qpx, uint32_t rkey,
+				   uint64_t remote_addr, __be32 imm_data)
+{
+	mlx5_wr_rdma_common(qpx, IBV_WR_RDMA_WRITE_WITH_IMM, rkey, remote_addr,
+			    imm_data);
+}
+
+static void mlx5_wr_rdma_read(struct ibv_qp_ex *qpx, uint32_t rkey,
+			      uint64_t remote_addr)
+{
+	mlx5_wr_rdma_common(qpx, IBV_WR_RDMA_READ, rkey, remote_addr, 0);
+}
+
+static void mlx5_wr_atomic_common(struct ibv_qp_ex *qpx,
+				  enum ibv_wr_opcode ib_op, uint32_t rkey,
+				  uint64_t remote_addr, uint64_t compare_add,
+				  uint64_t swap)
+{
+	struct mlx5_qp *mqp = to_mqp(qpx->qp);
+	void *seg;
+
+	if (unlikely(!mqp->atomics_enabled ||
+		     (mqp->ibv_qp->qp_type != IBV_QPT_RC &&
+		      mqp->ibv_qp->qp_type != IBV_QPT_XRC_SEND))) {
+		if (!mqp->wr_err)
+			mqp->wr_err = mqp->atomics_enabled ? EINVAL : ENOSYS;
+		return;
+	}
+
+	seg = mlx5_wr_common(qpx, ib_op, 0);
+	if (!seg)
+		return;
+
+	set_raddr_seg(seg, remote_addr, rkey);
+	seg += sizeof(struct mlx5_wqe_raddr_seg);
+	set_atomic_seg(seg, ib_op, swap, compare_add);
+	seg += sizeof(struct mlx5_wqe_atomic_seg);
+
+	mqp->cur_data = seg;
+	mqp->cur_size += (sizeof(struct mlx5_wqe_raddr_seg) +
+			  sizeof(struct mlx5_wqe_atomic_seg)) / 16;
+	mqp->cur_atomic = true;
+}
+
+static void mlx5_wr_atomic_cmp_swp(struct ibv_qp_ex *qpx, uint32_t rkey,
+				   uint64_t remote_addr, uint64_t compare,
+				   uint64_t swap)
+{
+	mlx5_wr_atomic_common(qpx, IBV_WR_ATOMIC_CMP_AND_SWP, rkey,
+			      remote_addr, compare, swap);
+}
+
+static void mlx5_wr_atomic_fetch_add(struct ibv_qp_ex *qpx, uint32_t rkey,
+				     uint64_t remote_addr, uint64_t add)
+{
+	mlx5_wr_atomic_common(qpx, IBV_WR_ATOMIC_FETCH_AND_ADD, rkey,
+			      remote_addr, add, 0);
+}
+
+/* Setters may only follow an opcode call */
+static inline struct mlx5_qp *mlx5_wr_cur(struct ibv_qp_ex *qpx)
+{
+	struct mlx5_qp *mqp = to_mqp(qpx->qp);
+
+	if (unlikely(mqp->wr_err))
+		return NULL;
+
+	if (unlikely(!mqp->cur_ctrl)) {
+		mqp->wr_err = EINVAL;
+		return NULL;
+	}
+
+	return mqp;
+}
+
+static void mlx5_wr_set_ud_addr(struct ibv_qp_ex *qpx, struct ibv_ah *ah,
+				uint32_t remote_qpn, uint32_t remote_qkey)
+{
+	struct mlx5_qp *mqp = mlx5_wr_cur(qpx);
+	struct mlx5_wqe_datagram_seg *dseg;
+
+	if (!mqp)
+		return;
+
+	if (unlikely(!mqp->cur_dgram)) {
+		mqp->wr_err = EINVAL;
+		return;
+	}
+
+	dseg = mqp->cur_dgram;
+	memcpy(&dseg->av, &to_mah(ah)->av, sizeof(dseg->av));
+	dseg->av.dqp_dct = htobe32(remote_qpn | MLX5_EXTENDED_UD_AV);
+	dseg->av.key.qkey.qkey = htobe32(remote_qkey);
+}
+
+static void mlx5_wr_set_xrc_srqn(struct ibv_qp_ex *qpx, uint32_t remote_srqn)
+{
+	struct mlx5_qp *mqp = mlx5_wr_cur(qpx);
+	struct mlx5_wqe_xrc_seg *xrc;
+
+	if (!mqp)
+		return;
+
+	if (unlikely(!mqp->cur_xrc)) {
+		mqp->wr_err = EINVAL;
+		return;
+	}
+
+	xrc = mqp->cur_xrc;
+	xrc->xrc_srqn = htobe32(remote_srqn);
+}
+
+static inline void mlx5_wr_add_sge(struct mlx5_qp *mqp, uint32_t lkey,
+				   uint64_t addr, uint32_t length)
+{
+	struct mlx5_wqe_data_seg *dpseg = mqp->cur_data;
+
+	/* Zero length SGEs are skipped, as in post_send */
+	if (unlikely(!length))
+		return;
+
+	if (unlikely(dpseg == mqp->sq.qend))
+		dpseg = mlx5_get_send_wqe(mqp, 0);
+
+	dpseg->byte_count = htobe32(mqp->cur_atomic ? MLX5_ATOMIC_SIZE :
+						     length);
+	dpseg->lkey = htobe32(lkey);
+	dpseg->addr = htobe64(addr);
+
+	mqp->cur_data = dpseg + 1;
+	mqp->cur_size += sizeof(*dpseg) / 16;
+}
+
+static void mlx5_wr_set_sge(struct ibv_qp_ex *qpx, uint32_t lkey,
+			    uint64_t addr, uint32_t length)
+{
+	struct mlx5_qp *mqp = mlx5_wr_cur(qpx);
+
+	if (!mqp)
+		return;
+
+	if (unlikely(mqp->cur_inl || mqp->cur_num_sge + 1 > mqp->sq.max_gs)) {
+		mqp->wr_err = mqp->cur_inl ? EINVAL : ENOMEM;
+		return;
+	}
+
+	mqp->cur_num_sge++;
+	mlx5_wr_add_sge(mqp, lkey, addr, length);
+}
+
+static void mlx5_wr_set_sge_list(struct ibv_qp_ex *qpx, size_t num_sge,
+				 const struct ibv_sge *sg_list)
+{
+	struct mlx5_qp *mqp = mlx5_wr_cur(qpx);
+	size_t i;
+
+	if (!mqp)
+		return;
+
+	if (unlikely(mqp->cur_inl ||
+		     mqp->cur_num_sge + num_sge > mqp->sq.max_gs)) {
+		mqp->wr_err = mqp->cur_inl ? EINVAL : ENOMEM;
+		return;
+	}
+
+	mqp->cur_num_sge += num_sge;
+	for (i = 0; i != num_sge; i++)
+		mlx5_wr_add_sge(mqp, sg_list[i].lkey, sg_list[i].addr,
+				sg_list[i].length);
+}
+
+static void mlx5_wr_set_inline_data(struct ibv_qp_ex *qpx, void *addr,
+				    size_t length)
+{
+	struct mlx5_qp *mqp = mlx5_wr_cur(qpx);
+	struct mlx5_wqe_inline_seg *seg;
+	void *wqe;
+	size_t copy;
+
+	if (!mqp)
+		return;
+
+	if (unlikely(mqp->cur_inl || mqp->cur_num_sge || mqp->cur_atomic)) {
+		mqp->wr_err = EINVAL;
+		return;
+	}
+
+	if (unlikely(length > mqp->max_inline_data)) {
+		mqp->wr_err = ENOMEM;
+		return;
+	}
+
+	mqp->cur_inl = true;
+	if (unlikely(!length))
+		return;
+
+	seg = mqp->cur_data;
+	if (unlikely((void *)seg == mqp->sq.qend))
+		seg = mlx5_get_send_wqe(mqp, 0);
+	wqe = seg + 1;
+	if (unlikely(wqe + length > mqp->sq.qend)) {
+		copy = mqp->sq.qend - wqe;
+		memcpy(wqe, addr, copy);
+		addr += copy;
+		length -= copy;
+		wqe = mlx5_get_send_wqe(mqp, 0);
+		memcpy(wqe, addr, length);
+		length += copy;
+	} else {
+		memcpy(wqe, addr, length);
+	}
+
+	seg->byte_count = htobe32(length | MLX5_INLINE_SEG);
+	mqp->cur_size += align(length + sizeof(seg->byte_count), 16) / 16;
+	mqp->inl_wqe = 1;
+}
+
+int mlx5_init_qp_ex(struct ibv_qp *ibqp, struct ibv_qp_ex *qpx)
+{
+	struct mlx5_qp *mqp = to_mqp(ibqp);
+
+	switch (ibqp->qp_type) {
+	case IBV_QPT_RC:
+	case IBV_QPT_UC:
+	case IBV_QPT_XRC_SEND:
+		break;
+	case IBV_QPT_UD:
+		if (mqp->flags & MLX5_QP_FLAGS_USE_UNDERLAY)
+			return EOPNOTSUPP;
+		break;
+	default:
+		return EOPNOTSUPP;
+	}
+
+	qpx->wr_start = mlx5_wr_start;
+	qpx->wr_complete = mlx5_wr_complete;
+	qpx->wr_abort = mlx5_wr_abort;
+	qpx->wr_send = mlx5_wr_send;
+	qpx->wr_send_imm = mlx5_wr_send_imm;
+	qpx->wr_rdma_write = mlx5_wr_rdma_write;
+	qpx->wr_rdma_write_imm = mlx5_wr_rdma_write_imm;
+	qpx->wr_rdma_read = mlx5_wr_rdma_read;
+	qpx->wr_atomic_cmp_swp = mlx5_wr_atomic_cmp_swp;
+	qpx->wr_atomic_fetch_add = mlx5_wr_atomic_fetch_add;
+	qpx->wr_set_ud_addr = mlx5_wr_set_ud_addr;
+	qpx->wr_set_xrc_srqn = mlx5_wr_set_xrc_srqn;
+	qpx->wr_set_sge = mlx5_wr_set_sge;
+	qpx->wr_set_sge_list = mlx5_wr_set_sge_list;
+	qpx->wr_set_inline_data = mlx5_wr_set_inline_data;
+
+	return 0;
+}
+
 int mlx5_bind_mw(struct ibv_qp *qp, struct ibv_mw *mw,
 		 struct ibv_mw_bind *mw_bind)
 {
@@ -1153,6 +1608,12 @@ int mlx5_post_wq_recv(struct ibv_wq *ibwq, struct ibv_recv_wr *wr,
 			++scat;
 		}
 
+		/* Striding WQEs start with an unused next segment */
+		if (rwq->striding) {
+			memset(scat, 0, sizeof(struct mlx5_wqe_srq_next_seg));
+			++scat;
+		}
+
 		for (i = 0, j = 0; i < wr->num_sge; ++i) {
 			if (unlikely(!wr->sg_list[i].length))
 				continue;
@@ -1300,8 +1761,10 @@ int mlx5_store_qp(struct mlx5_context *ctx, uint32_t qpn, struct mlx5_qp *qp)
 	int tind = qpn >> MLX5_QP_TABLE_SHIFT;
 
 	if (!ctx->qp_table[tind].refcnt) {
-		ctx->qp_table[tind].table = calloc(MLX5_QP_TABLE_MASK + 1,
-						   sizeof(struct mlx5_qp *));
+		ctx->qp_table[tind].table =
+			verbs_numa_zalloc(&ctx->ibv_ctx,
+					  (MLX5_QP_TABLE_MASK + 1) *
+					  sizeof(struct mlx5_qp *));
 		if (!ctx->qp_table[tind].table)
 			return -1;
 	}
@@ -187,6 +187,7 @@ int mlx5_alloc_srq_buf(struct ibv_context *context, struct mlx5_srq *srq)
 		return -1;
 	}
 
+	verbs_numa_bind(context, srq->buf.buf, srq->buf.length);
 	memset(srq->buf.buf, 0, buf_size);
 
 	/*
@@ -221,8 +222,10 @@ int mlx5_store_srq(struct mlx5_context *ctx, uint32_t srqn,
 	int tind = srqn >> MLX5_SRQ_TABLE_SHIFT;
 
 	if (!ctx->srq_table[tind].refcnt) {
-		ctx->srq_table[tind].table = calloc(MLX5_QP_TABLE_MASK + 1,
-						   sizeof(struct mlx5_qp *));
+		ctx->srq_table[tind].table =
+			verbs_numa_zalloc(&ctx->ibv_ctx,
+					  (MLX5_QP_TABLE_MASK + 1) *
+					  sizeof(struct mlx5_qp *));
 		if (!ctx->srq_table[tind].table)
 			return -1;
 	}
@@ -529,6 +529,43 @@ struct ibv_cq_ex *mlx5dv_create_cq(struct ibv_context *context,
 	return cq;
 }
 
+int mlx5dv_modify_cq(struct ibv_cq *ibcq, struct mlx5dv_cq_attr *attr)
+{
+	struct mlx5_cq *cq = to_mcq(ibcq);
+
+	if (attr->comp_mask & ~(MLX5DV_CQ_ATTR_MASK_RESERVED - 1))
+		return EINVAL;
+
+	if (attr->comp_mask & MLX5DV_CQ_ATTR_MASK_STALL_MODE) {
+		switch (attr->stall_mode) {
+		case MLX5DV_CQ_STALL_NONE:
+			cq->stall_enable = 0;
+			cq->stall_adaptive_enable = 0;
+			break;
+		case MLX5DV_CQ_STALL_FIXED:
+			cq->stall_enable = 1;
+			cq->stall_adaptive_enable = 0;
+			break;
+		case MLX5DV_CQ_STALL_ADAPTIVE:
+			cq->stall_enable = 1;
+			cq->stall_adaptive_enable = 1;
+			break;
+		default:
+			return EINVAL;
+		}
+
+		cq->stall_next_poll = 0;
+		cq->stall_last_count = 0;
+		cq->stall_empty_ewma = 0;
+		cq->stall_cycles = mlx5_stall_cq_poll_min;
+
+		if (cq->flags & MLX5_CQ_FLAGS_EXTENDED)
+			mlx5_cq_set_poll_ops(cq);
+	}
+
+	return 0;
+}
+
 struct ibv_action_xfrm *mlx5dv_create_action_xfrm_esp_aes_gcm(struct ibv_context *ctx,
 							      const struct ibv_action_xfrm_attr_esp_aes_gcm *attr,
 							      struct mlx5dv_action_xfrm_attr_esp_aes_gcm *mlx5_attr)
@@ -977,6 +1014,9 @@ static int mlx5_calc_rwq_size(struct mlx5_context *ctx,
 	if (rwq->wq_sig)
 		wqe_size += sizeof(struct mlx5_rwqe_sig);
 
+	if (rwq->striding)
+		wqe_size += sizeof(struct mlx5_wqe_srq_next_seg);
+
 	if (wqe_size <= 0 || wqe_size > ctx->max_rq_desc_sz)
 		return -EINVAL;
 
@@ -987,7 +1027,8 @@ static int mlx5_calc_rwq_size(struct mlx5_context *ctx,
 	rwq->rq.wqe_shift = mlx5_ilog2(wqe_size);
 	rwq->rq.max_post = 1 << mlx5_ilog2(wq_size / wqe_size);
 	scat_spc = wqe_size -
-		((rwq->wq_sig) ? sizeof(struct mlx5_rwqe_sig) : 0);
+		((rwq->wq_sig) ? sizeof(struct mlx5_rwqe_sig) : 0) -
+		((rwq->striding) ? sizeof(struct mlx5_wqe_srq_next_seg) : 0);
 	rwq->rq.max_gs = scat_spc / sizeof(struct mlx5_wqe_data_seg);
 	return wq_size;
 }
@@ -2042,6 +2083,7 @@ int mlx5_query_device_ex(struct ibv_context *context,
 		mctx->vendor_cap_flags |= MLX5_VENDOR_CAP_FLAGS_ENHANCED_MPW;
 
 	mctx->cqe_comp_caps = resp.cqe_comp_caps;
+	mctx->striding_rq_caps = resp.striding_rq_caps;
 
 	major     = (raw_fw_ver >> 32) & 0xffff;
 	minor     = (raw_fw_ver >> 16) & 0xffff;
@@ -2104,8 +2146,9 @@ static int mlx5_alloc_rwq_buf(struct ibv_context *context,
 	return 0;
 }
 
-struct ibv_wq *mlx5_create_wq(struct ibv_context *context,
-			      struct ibv_wq_init_attr *attr)
+static struct ibv_wq *create_wq(struct ibv_context *context,
+				struct ibv_wq_init_attr *attr,
+				struct mlx5dv_wq_init_attr *mlx5wq_attr)
 {
 	struct mlx5_create_wq		cmd;
 	struct mlx5_create_wq_resp		resp;
@@ -2119,6 +2162,12 @@ struct ibv_wq *mlx5_create_wq(struct ibv_context *context,
 	if (attr->wq_type != IBV_WQT_RQ)
 		return NULL;
 
+	if (mlx5wq_attr &&
+	    (mlx5wq_attr->comp_mask & ~(MLX5DV_WQ_INIT_ATTR_MASK_RESERVED - 1))) {
+		errno = EINVAL;
+		return NULL;
+	}
+
 	memset(&cmd, 0, sizeof(cmd));
 	memset(&resp, 0, sizeof(resp));
 
@@ -2126,7 +2175,28 @@ struct ibv_wq *mlx5_create_wq(struct ibv_context *context,
 	if (!rwq)
 		return NULL;
 
-	rwq->wq_sig = rwq_sig_enabled(context);
+	if (mlx5wq_attr &&
+	    (mlx5wq_attr->comp_mask & MLX5DV_WQ_INIT_ATTR_MASK_STRIDING_RQ)) {
+		struct mlx5dv_striding_rq_init_attr *stride_attr =
+			&mlx5wq_attr->striding_rq_attrs;
+
+		if (stride_attr->single_wqe_log_num_of_strides >= 16) {
+			errno = EINVAL;
+			goto err;
+		}
+
+		rwq->striding = 1;
+		rwq->num_strides = 1U << stride_attr->single_wqe_log_num_of_strides;
+		cmd.drv.comp_mask |= MLX5_CREATE_WQ_STRIDING_RQ;
+		cmd.drv.single_stride_log_num_of_bytes =
+			stride_attr->single_stride_log_num_of_bytes;
+		cmd.drv.single_wqe_log_num_of_strides =
+			stride_attr->single_wqe_log_num_of_strides;
+		cmd.drv.two_byte_shift_en = stride_attr->two_byte_shift_en;
+	}
+
+	/* The signature segment is not supported by striding WQEs */
+	rwq->wq_sig = !rwq->striding && rwq_sig_enabled(context);
 	if (rwq->wq_sig)
 		cmd.drv.flags = MLX5_RWQ_FLAG_SIGNATURE;
 
@@ -2189,6 +2259,19 @@ err:
 	return NULL;
 }
 
+struct ibv_wq *mlx5_create_wq(struct ibv_context *context,
+			      struct ibv_wq_init_attr *attr)
+{
+	return create_wq(context, attr, NULL);
+}
+
+struct ibv_wq *mlx5dv_create_wq(struct ibv_context *context,
+				struct ibv_wq_init_attr *attr,
+				struct mlx5dv_wq_init_attr *mlx5_wq_attr)
+{
+	return create_wq(context, attr, mlx5_wq_attr);
+}
+
 int mlx5_modify_wq(struct ibv_wq *wq, struct ibv_wq_attr *attr)
 {
 	struct mlx5_modify_wq	cmd = {};
@@ -63,6 +63,24 @@ static const struct verbs_match_ent hca_table[] = {
 	{},
 };
 
+/*
+ * With RXE_SINGLE_THREADED=1 the application promises that no queue is
+ * used by more than one thread at a time, and the queue locks are skipped.
+ */
+static int rxe_single_threaded;
+
+static inline void rxe_spin_lock(pthread_spinlock_t *lock)
+{
+	if (!rxe_single_threaded)
+		pthread_spin_lock(lock);
+}
+
+static inline void rxe_spin_unlock(pthread_spinlock_t *lock)
+{
+	if (!rxe_single_threaded)
+		pthread_spin_unlock(lock);
+}
+
 static int rxe_query_device(struct ibv_context *context,
 			    struct ibv_device_attr *attr)
 {
@@ -201,12 +219,12 @@ static int rxe_resize_cq(struct ibv_cq *ibcq, int cqe)
 	struct rxe_resize_cq_resp resp;
 	int ret;
 
-	pthread_spin_lock(&cq->lock);
+	rxe_spin_lock(&cq->lock);
 
 	ret = ibv_cmd_resize_cq(ibcq, cqe, &cmd, sizeof cmd,
 				&resp.ibv_resp, sizeof resp);
 	if (ret) {
-		pthread_spin_unlock(&cq->lock);
+		rxe_spin_unlock(&cq->lock);
 		return ret;
 	}
 
@@ -217,7 +235,7 @@ static int rxe_resize_cq(struct ibv_cq *ibcq, int cqe)
 			 ibcq->context->cmd_fd, resp.mi.offset);
 
 	ret = errno;
-	pthread_spin_unlock(&cq->lock);
+	rxe_spin_unlock(&cq->lock);
 
 	if ((void *)cq->queue == MAP_FAILED) {
 		cq->queue = NULL;
@@ -250,23 +268,26 @@ static int rxe_poll_cq(struct ibv_cq *ibcq, int ne, struct ibv_wc *wc)
 {
 	struct rxe_cq *cq = to_rcq(ibcq);
 	struct rxe_queue *q;
+	unsigned int cons;
 	int npolled;
-	uint8_t *src;
+	int i;
 
-	pthread_spin_lock(&cq->lock);
+	rxe_spin_lock(&cq->lock);
 	q = cq->queue;
 
-	for (npolled = 0; npolled < ne; ++npolled, ++wc) {
-		if (queue_empty(q))
-			break;
+	cons = load_consumer(q);
+	npolled = queue_count(q, cons);
+	if (npolled > ne)
+		npolled = ne;
 
-		atomic_thread_fence(memory_order_acquire);
-		src = consumer_addr(q);
-		memcpy(wc, src, sizeof(*wc));
-		advance_consumer(q);
-	}
+	for (i = 0; i < npolled; i++)
+		memcpy(&wc[i], addr_from_index(q, cons + i), sizeof(*wc));
+
+	/* One consumer index update hands all the entries back */
+	if (npolled)
+		store_consumer(q, cons + npolled);
 
-	pthread_spin_unlock(&cq->lock);
+	rxe_spin_unlock(&cq->lock);
 	return npolled;
 }
 
@@ -318,7 +339,7 @@ static int rxe_modify_srq(struct ibv_srq *ibsrq,
 	mi.size = 0;
 
 	if (attr_mask & IBV_SRQ_MAX_WR)
-		pthread_spin_lock(&srq->rq.lock);
+		rxe_spin_lock(&srq->rq.lock);
 
 	cmd.mmap_info_addr = (__u64)(uintptr_t) & mi;
 	rc = ibv_cmd_modify_srq(ibsrq, attr, attr_mask,
@@ -344,7 +365,7 @@ static int rxe_modify_srq(struct ibv_srq *ibsrq,
 
 out:
 	if (attr_mask & IBV_SRQ_MAX_WR)
-		pthread_spin_unlock(&srq->rq.lock);
+		rxe_spin_unlock(&srq->rq.lock);
 	return rc;
 }
 
@@ -371,7 +392,8 @@ static int rxe_destroy_srq(struct ibv_srq *ibvsrq)
 	return ret;
 }
 
-static int rxe_post_one_recv(struct rxe_wq *rq, struct ibv_recv_wr *recv_wr)
+static int rxe_post_one_recv(struct rxe_wq *rq, struct ibv_recv_wr *recv_wr,
+			     unsigned int prod)
 {
 	int i;
 	struct rxe_recv_wqe *wqe;
@@ -379,17 +401,12 @@ static int rxe_post_one_recv(struct rxe_wq *rq, struct ibv_recv_wr *recv_wr)
 	int length = 0;
 	int rc = 0;
 
-	if (queue_full(q)) {
-		rc  = -ENOMEM;
-		goto out;
-	}
-
 	if (recv_wr->num_sge > rq->max_sge) {
 		rc = -EINVAL;
 		goto out;
 	}
 
-	wqe = (struct rxe_recv_wqe *)producer_addr(q);
+	wqe = (struct rxe_recv_wqe *)addr_from_index(q, prod);
 
 	wqe->wr_id = recv_wr->wr_id;
 	wqe->num_sge = recv_wr->num_sge;
@@ -407,32 +424,57 @@ static int rxe_post_one_recv(struct rxe_wq *rq, struct ibv_recv_wr *recv_wr)
 	wqe->dma.num_sge = wqe->num_sge;
 	wqe->dma.sge_offset = 0;
 
-	advance_producer(q);
-
 out:
 	return rc;
 }
 
-static int rxe_post_srq_recv(struct ibv_srq *ibvsrq,
-			     struct ibv_recv_wr *recv_wr,
-			     struct ibv_recv_wr **bad_recv_wr)
+/*
+ * Post a list of receive WRs and publish the new producer index once.
+ * Must hold the rq lock.
+ */
+static int rxe_post_recv_list(struct rxe_wq *rq, struct ibv_recv_wr *recv_wr,
+			      struct ibv_recv_wr **bad_wr)
 {
-	struct rxe_srq *srq = to_rsrq(ibvsrq);
+	struct rxe_queue *q = rq->queue;
+	unsigned int prod = load_producer(q);
+	unsigned int avail = queue_free(q, prod);
+	unsigned int nreq = 0;
 	int rc = 0;
 
-	pthread_spin_lock(&srq->rq.lock);
+	for (; recv_wr; recv_wr = recv_wr->next, nreq++) {
+		if (nreq == avail) {
+			rc = -ENOMEM;
+			*bad_wr = recv_wr;
+			break;
+		}
 
-	while (recv_wr) {
-		rc = rxe_post_one_recv(&srq->rq, recv_wr);
+		rc = rxe_post_one_recv(rq, recv_wr, prod + nreq);
 		if (rc) {
-			*bad_recv_wr = recv_wr;
+			*bad_wr = recv_wr;
 			break;
 		}
-
-		recv_wr = recv_wr->next;
 	}
 
-	pthread_spin_unlock(&srq->rq.lock);
+	if (nreq)
+		store_producer(q, prod + nreq);
+
+	return rc;
+}
+
+static int rxe_post_srq_recv(struct ibv_srq *ibvsrq,
+			     struct ibv_recv_wr *recv_wr,
+			     struct ibv_recv_wr **bad_recv_wr)
+{
+	struct rxe_srq *srq = to_rsrq(ibvsrq);
+	int rc;
+
+	rxe_spin_lock(&srq->rq.lock);
+	rc = rxe_post_recv_list(&srq->rq, recv_wr, bad_recv_wr);
+	rxe_spin_unlock(&srq->rq.lock);
+
+	/* A loopback send may be waiting for a receive buffer */
+	if (to_rctx(ibvsrq->context)->loopback)
+		rxe_loop_kick();
 
 	return rc;
 }
@@ -636,7 +678,7 @@ static int init_send_wqe(struct rxe_qp *qp, struct rxe_wq *sq,
 }
 
 static int post_one_send(struct rxe_qp *qp, struct rxe_wq *sq,
-			 struct ibv_send_wr *ibwr)
+			 struct ibv_send_wr *ibwr, unsigned int prod)
 {
 	int err;
 	struct rxe_send_wqe *wqe;
@@ -652,18 +694,9 @@ static int post_one_send(struct rxe_qp *qp, struct rxe_wq *sq,
 		return err;
 	}
 
-	wqe = (struct rxe_send_wqe *)producer_addr(sq->queue);
-
-	err = init_send_wqe(qp, sq, ibwr, length, wqe);
-	if (err)
-		return err;
-
-	if (queue_full(sq->queue))
-		return -ENOMEM;
+	wqe = (struct rxe_send_wqe *)addr_from_index(sq->queue, prod);
 
-	advance_producer(sq->queue);
-
-	return 0;
+	return init_send_wqe(qp, sq, ibwr, length, wqe);
 }
 
 /* send a null post send as a doorbell */
@@ -697,6 +730,8 @@ static int rxe_post_send(struct ibv_qp *ibqp,
 	int err;
 	struct rxe_qp *qp = to_rqp(ibqp);
 	struct rxe_wq *sq = &qp->sq;
+	unsigned int prod, avail;
+	unsigned int nreq = 0;
 
 	if (!bad_wr)
 		return EINVAL;
@@ -706,19 +741,38 @@ static int rxe_post_send(struct ibv_qp *ibqp,
 	if (!sq || !wr_list || !sq->queue)
 	 	return EINVAL;
 
-	pthread_spin_lock(&sq->lock);
+	rxe_spin_lock(&sq->lock);
 
-	while (wr_list) {
-		rc = post_one_send(qp, sq, wr_list);
-		if (rc) {
+	prod = load_producer(sq->queue);
+	avail = queue_free(sq->queue, prod);
+
+	for (; wr_list; wr_list = wr_list->next, nreq++) {
+		if (nreq == avail) {
+			rc = -ENOMEM;
 			*bad_wr = wr_list;
 			break;
 		}
 
-		wr_list = wr_list->next;
+		rc = post_one_send(qp, sq, wr_list, prod + nreq);
+		if (rc) {
+			*bad_wr = wr_list;
+			break;
+		}
 	}
 
-	pthread_spin_unlock(&sq->lock);
+	/* The whole list is made visible to the kernel at once */
+	if (nreq)
+		store_producer(sq->queue, prod + nreq);
+
+	rxe_spin_unlock(&sq->lock);
+
+	if (!nreq)
+		return rc;
+
+	if (to_rctx(ibqp->context)->loopback) {
+		rxe_loop_kick();
+		return rc;
+	}
 
 	err =  post_send_db(ibqp);
 	return err ? err : rc;
@@ -740,19 +794,13 @@ static int rxe_post_recv(struct ibv_qp *ibqp,
 	if (!rq || !recv_wr || !rq->queue)
 		return EINVAL;
 
-	pthread_spin_lock(&rq->lock);
-
-	while (recv_wr) {
-		rc = rxe_post_one_recv(rq, recv_wr);
-		if (rc) {
-			*bad_wr = recv_wr;
-			break;
-		}
-
-		recv_wr = recv_wr->next;
-	}
+	rxe_spin_lock(&rq->lock);
+	rc = rxe_post_recv_list(rq, recv_wr, bad_wr);
+	rxe_spin_unlock(&rq->lock);
 
-	pthread_spin_unlock(&rq->lock);
+	/* A loopback send may be waiting for a receive buffer */
+	if (to_rctx(ibqp->context)->loopback)
+		rxe_loop_kick();
 
 	return rc;
 }
@@ -864,6 +912,7 @@ static struct ibv_context *rxe_alloc_context(struct ibv_device *ibdev,
 	struct rxe_context *context;
 	struct ibv_get_context cmd;
 	struct ibv_get_context_resp resp;
+	char *env;
 
 	context = malloc(sizeof *context);
 	if (!context)
@@ -872,6 +921,18 @@ static struct ibv_context *rxe_alloc_context(struct ibv_device *ibdev,
 	memset(context, 0, sizeof *context);
 	context->ibv_ctx.cmd_fd = cmd_fd;
 
+	env = getenv("RXE_SINGLE_THREADED");
+	if (env)
+		rxe_single_threaded = !strcmp(env, "1");
+
+	if (to_rdev(ibdev)->loopback) {
+		context->loopback = true;
+		context->ibv_ctx.ops = rxe_ctx_ops;
+		if (rxe_loop_init_context(context))
+			goto out;
+		return &context->ibv_ctx;
+	}
+
 	if (ibv_cmd_get_context(&context->ibv_ctx, &cmd,
 				sizeof cmd, &resp, sizeof resp))
 		goto out;
@@ -889,6 +950,8 @@ static void rxe_free_context(struct ibv_context *ibctx)
 {
 	struct rxe_context *context = to_rctx(ibctx);
 
+	if (context->loopback)
+		rxe_loop_uninit_context(context);
 	free(context);
 }
 
@@ -899,6 +962,9 @@ static void rxe_uninit_device(struct verbs_device *verbs_device)
 	free(dev);
 }
 
+/* Loopback devices get LIDs in the order they are found */
+static uint16_t rxe_loop_lids;
+
 static struct verbs_device *rxe_device_alloc(struct verbs_sysfs_dev *sysfs_dev)
 {
 	struct rxe_device *dev;
@@ -907,6 +973,9 @@ static struct verbs_device *rxe_device_alloc(struct verbs_sysfs_dev *sysfs_dev)
 		return NULL;
 
 	dev->abi_version = sysfs_dev->abi_ver;
+	dev->loopback = sysfs_dev->loopback;
+	if (dev->loopback)
+		dev->lid = ++rxe_loop_lids;
 
 	return &dev->ibv_dev;
 }
@@ -51,10 +51,14 @@ enum rdma_network_type {
 struct rxe_device {
 	struct verbs_device	ibv_dev;
 	int	abi_version;
+	/* Implemented in user space by rxe_loop.c */
+	bool	loopback;
+	uint16_t	lid;
 };
 
 struct rxe_context {
 	struct ibv_context	ibv_ctx;
+	bool			loopback;
 };
 
 struct rxe_cq {
@@ -128,4 +132,9 @@ static inline struct rxe_ah *to_rah(struct ibv_ah *ibah)
 	return to_rxxx(ah, ah);
 }
 
+/* rxe_loop.c */
+int rxe_loop_init_context(struct rxe_context *context);
+void rxe_loop_uninit_context(struct rxe_context *context);
+void rxe_loop_kick(void);
+
 #endif /* RXE_H */
@@ -0,0 +1,1339 @@
+/* GPLv2 or OpenIB.org BSD (MIT) See COPYING file */
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <sys/uio.h>
+
+#include <ccan/container_of.h>
+#include <ccan/list.h>
+#include <ccan/minmax.h>
+
+#include "rxe_queue.h"
+#include "rxe.h"
+
+/*
+ * Loopback rxe devices are named in RDMAV_LOOPBACK_DEVICES and have no
+ * kernel driver behind them. The data path in rxe.c is used unchanged:
+ * WQEs and CQEs go through the same rxe_queue rings, but the rings live
+ * in ordinary memory and a library thread stands in for the kernel as the
+ * consumer of the SQs, RQs and SRQs and the producer of the CQs.
+ *
+ * All loopback devices in a process share one fabric and QPs find each
+ * other by QP number alone; address handles and path attributes are
+ * accepted and ignored. An RC message waits for a receive WQE as long as
+ * it takes, as if rnr_retry were 7, while UC and UD messages are dropped.
+ * Completion channels, multicast, memory windows, resizing and sharing
+ * with other processes are not supported.
+ */
+#define LOOP_FIRST_QPN		16
+#define LOOP_MAX_QP		4096
+#define LOOP_MAX_MR		4096
+#define LOOP_MAX_CQ		4096
+#define LOOP_MAX_PD		4096
+#define LOOP_MAX_AH		4096
+#define LOOP_MAX_WR		16384
+#define LOOP_MAX_SGE		32
+#define LOOP_MAX_INLINE		400
+#define LOOP_MAX_CQE		65535
+#define LOOP_MAX_RD_ATOMIC	128
+#define LOOP_MAX_MSG		(1U << 31)
+#define LOOP_MTU		4096
+#define LOOP_UD_GRH		40
+
+/* WQEs executed from one SQ before moving on to the next QP */
+#define LOOP_BUDGET		64
+/* Passes without progress before the thread waits for a doorbell */
+#define LOOP_SPIN		1024
+/* How long the thread sleeps while a QP waits for a CQ to drain */
+#define LOOP_STALL_NS		100000
+
+enum {
+	LOOP_DONE,
+	LOOP_STALL,
+};
+
+struct loop_mr {
+	struct ibv_mr		ibv_mr;
+	struct ibv_pd		*pd;
+	uint64_t		addr;
+	uint64_t		length;
+	uint32_t		key;
+	int			access;
+};
+
+struct loop_cq {
+	struct rxe_cq		rcq;
+	unsigned int		users;
+};
+
+struct loop_srq {
+	struct rxe_srq		rsrq;
+	struct ibv_srq_attr	attr;
+	unsigned int		users;
+};
+
+struct loop_qp {
+	struct rxe_qp		rqp;
+	struct list_node	entry;
+	struct ibv_pd		*pd;
+	struct loop_cq		*scq;
+	struct loop_cq		*rcq;
+	struct loop_srq		*srq;
+	enum ibv_qp_type	type;
+	uint32_t		qpn;
+	uint16_t		lid;
+	bool			sq_sig_all;
+	/* Only changed with the fabric lock held */
+	struct ibv_qp_attr	attr;
+};
+
+static struct {
+	/* Protects the tables and the QP list, held for a whole pass */
+	pthread_mutex_t		lock;
+	struct list_head	qps;
+	struct loop_qp		*qp_table[LOOP_MAX_QP];
+	struct loop_mr		*mr_table[LOOP_MAX_MR];
+	uint32_t		next_qpn;
+	unsigned int		next_mr;
+	uint8_t			mr_gen;
+	bool			stalled;
+	bool			stop;
+
+	pthread_mutex_t		users_lock;
+	unsigned int		users;
+	pthread_t		thread;
+
+	_Atomic(unsigned int)	doorbell;
+	atomic_bool		sleeping;
+	pthread_mutex_t		wait_lock;
+	pthread_cond_t		wait_cond;
+} fabric = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.qps = LIST_HEAD_INIT(fabric.qps),
+	.next_qpn = LOOP_FIRST_QPN,
+	.users_lock = PTHREAD_MUTEX_INITIALIZER,
+	.wait_lock = PTHREAD_MUTEX_INITIALIZER,
+	.wait_cond = PTHREAD_COND_INITIALIZER,
+};
+
+static inline struct loop_qp *to_lqp(struct ibv_qp *ibqp)
+{
+	return container_of(to_rqp(ibqp), struct loop_qp, rqp);
+}
+
+static inline struct loop_cq *to_lcq(struct ibv_cq *ibcq)
+{
+	return container_of(to_rcq(ibcq), struct loop_cq, rcq);
+}
+
+static inline struct loop_srq *to_lsrq(struct ibv_srq *ibsrq)
+{
+	return container_of(to_rsrq(ibsrq), struct loop_srq, rsrq);
+}
+
+static inline struct loop_mr *to_lmr(struct ibv_mr *ibmr)
+{
+	return container_of(ibmr, struct loop_mr, ibv_mr);
+}
+
+static unsigned int loop_roundup_pow2(unsigned int n)
+{
+	return n <= 1 ? 1 : 1U << (32 - __builtin_clz(n - 1));
+}
+
+/* Lay out a ring the way the kernel does for the real device */
+static struct rxe_queue *loop_alloc_queue(struct ibv_context *context,
+					  unsigned int num_elem,
+					  size_t elem_size)
+{
+	unsigned int log2_elem_size = 0;
+	struct rxe_queue *q;
+
+	while ((1UL << log2_elem_size) < elem_size)
+		log2_elem_size++;
+
+	q = verbs_numa_zalloc(context,
+			      sizeof(*q) + ((size_t)num_elem << log2_elem_size));
+	if (!q)
+		return NULL;
+
+	q->log2_elem_size = log2_elem_size;
+	q->index_mask = num_elem - 1;
+	return q;
+}
+
+void rxe_loop_kick(void)
+{
+	atomic_fetch_add(&fabric.doorbell, 1);
+
+	if (atomic_load(&fabric.sleeping)) {
+		pthread_mutex_lock(&fabric.wait_lock);
+		pthread_cond_signal(&fabric.wait_cond);
+		pthread_mutex_unlock(&fabric.wait_lock);
+	}
+}
+
+/*
+ * Everything below up to loop_thread() runs on the library thread with
+ * the fabric lock held. It is the only consumer of the work queues and
+ * the only producer of the CQs, so the rings need no locking.
+ */
+static bool loop_cq_room(struct loop_cq *cq, unsigned int n)
+{
+	struct rxe_queue *q = cq->rcq.queue;
+
+	return queue_free(q, load_producer(q)) >= n;
+}
+
+static void loop_cq_push(struct loop_cq *cq, const struct ibv_wc *wc)
+{
+	struct rxe_queue *q = cq->rcq.queue;
+	unsigned int prod = load_producer(q);
+
+	memcpy(addr_from_index(q, prod), wc, sizeof(*wc));
+	store_producer(q, prod + 1);
+}
+
+static struct loop_mr *loop_find_mr(uint32_t key)
+{
+	struct loop_mr *mr = fabric.mr_table[(key >> 8) % LOOP_MAX_MR];
+
+	return mr && mr->key == key ? mr : NULL;
+}
+
+/* Check that @key covers [addr, addr + length) with @access in @pd */
+static void *loop_map(struct ibv_pd *pd, uint32_t key, uint64_t addr,
+		      uint64_t length, int access)
+{
+	struct loop_mr *mr = loop_find_mr(key);
+
+	if (!mr || mr->pd != pd || (mr->access & access) != access ||
+	    addr < mr->addr || length > mr->length ||
+	    addr - mr->addr > mr->length - length)
+		return NULL;
+
+	return (void *)(uintptr_t)addr;
+}
+
+/* Returns the number of bytes described by @sge, or -1 for a bad key */
+static int64_t loop_sge_iov(struct ibv_pd *pd, const struct rxe_sge *sge,
+			    unsigned int num_sge, int access, struct iovec *iov)
+{
+	int64_t total = 0;
+	unsigned int i;
+
+	for (i = 0; i < num_sge; i++) {
+		iov[i].iov_len = sge[i].length;
+		iov[i].iov_base = NULL;
+		if (!sge[i].length)
+			continue;
+
+		iov[i].iov_base = loop_map(pd, sge[i].lkey, sge[i].addr,
+					   sge[i].length, access);
+		if (!iov[i].iov_base)
+			return -1;
+		total += sge[i].length;
+	}
+
+	return total;
+}
+
+/* The caller checked that both sides hold @len bytes, @dst after @skip */
+static void loop_copy(const struct iovec *dst, size_t skip,
+		      const struct iovec *src, size_t len)
+{
+	size_t doff = skip;
+	size_t soff = 0;
+	size_t n;
+
+	while (len) {
+		while (doff >= dst->iov_len) {
+			doff -= dst->iov_len;
+			dst++;
+		}
+		while (soff >= src->iov_len) {
+			soff -= src->iov_len;
+			src++;
+		}
+
+		n = min_t(size_t, dst->iov_len - doff, src->iov_len - soff);
+		if (n > len)
+			n = len;
+		memcpy((uint8_t *)dst->iov_base + doff,
+		       (uint8_t *)src->iov_base + soff, n);
+		doff += n;
+		soff += n;
+		len -= n;
+	}
+}
+
+static int64_t loop_gather(struct loop_qp *qp, struct rxe_send_wqe *wqe,
+			   struct iovec *iov)
+{
+	if (wqe->wr.send_flags & IBV_SEND_INLINE) {
+		iov->iov_base = wqe->dma.inline_data;
+		iov->iov_len = wqe->dma.length;
+		return wqe->dma.length;
+	}
+
+	return loop_sge_iov(qp->pd, wqe->dma.sge, wqe->dma.num_sge, 0, iov);
+}
+
+static bool loop_remote(struct loop_qp *dst, uint32_t rkey, uint64_t addr,
+			uint64_t length, int access, struct iovec *iov)
+{
+	if (!(dst->attr.qp_access_flags & access))
+		return false;
+
+	iov->iov_len = length;
+	iov->iov_base = NULL;
+	if (!length)
+		return true;
+
+	iov->iov_base = loop_map(dst->pd, rkey, addr, length, access);
+	return iov->iov_base != NULL;
+}
+
+static void loop_qp_error(struct loop_qp *qp)
+{
+	qp->attr.qp_state = IBV_QPS_ERR;
+}
+
+static enum ibv_wc_opcode loop_wc_opcode(uint32_t opcode)
+{
+	switch (opcode) {
+	case IBV_WR_RDMA_WRITE:
+	case IBV_WR_RDMA_WRITE_WITH_IMM:
+		return IBV_WC_RDMA_WRITE;
+	case IBV_WR_RDMA_READ:
+		return IBV_WC_RDMA_READ;
+	case IBV_WR_ATOMIC_CMP_AND_SWP:
+		return IBV_WC_COMP_SWAP;
+	case IBV_WR_ATOMIC_FETCH_AND_ADD:
+		return IBV_WC_FETCH_ADD;
+	default:
+		return IBV_WC_SEND;
+	}
+}
+
+static bool loop_valid_opcode(enum ibv_qp_type type, uint32_t opcode)
+{
+	switch (opcode) {
+	case IBV_WR_SEND:
+	case IBV_WR_SEND_WITH_IMM:
+		return true;
+	case IBV_WR_RDMA_WRITE:
+	case IBV_WR_RDMA_WRITE_WITH_IMM:
+		return type != IBV_QPT_UD;
+	case IBV_WR_RDMA_READ:
+	case IBV_WR_ATOMIC_CMP_AND_SWP:
+	case IBV_WR_ATOMIC_FETCH_AND_ADD:
+		return type == IBV_QPT_RC;
+	default:
+		return false;
+	}
+}
+
+/* NULL if the message would not reach anybody */
+static struct loop_qp *loop_find_dest(struct loop_qp *qp,
+				      struct rxe_send_wqe *wqe)
+{
+	struct loop_qp *dst;
+	uint32_t qpn, qkey;
+
+	qpn = qp->type == IBV_QPT_UD ? wqe->wr.wr.ud.remote_qpn :
+				       qp->attr.dest_qp_num;
+	if (qpn >= LOOP_MAX_QP)
+		return NULL;
+
+	dst = fabric.qp_table[qpn];
+	if (!dst || dst->type != qp->type ||
+	    dst->attr.qp_state < IBV_QPS_RTR ||
+	    dst->attr.qp_state == IBV_QPS_ERR)
+		return NULL;
+
+	if (qp->type != IBV_QPT_UD)
+		return dst->attr.dest_qp_num == qp->qpn ? dst : NULL;
+
+	/* The high bit selects the QP's own Q_Key */
+	qkey = wqe->wr.wr.ud.remote_qkey;
+	if (qkey & 0x80000000)
+		qkey = qp->attr.qkey;
+	return dst->attr.qkey == qkey ? dst : NULL;
+}
+
+/*
+ * Consume a receive WQE of @dst for a SEND, or for the immediate of an
+ * RDMA WRITE whose payload goes to @remote instead.
+ */
+static int loop_recv(struct loop_qp *qp, struct loop_qp *dst,
+		     struct rxe_send_wqe *wqe, const struct iovec *src,
+		     size_t len, const struct iovec *remote,
+		     enum ibv_wc_status *status)
+{
+	struct rxe_wq *rq = dst->srq ? &dst->srq->rsrq.rq : &dst->rqp.rq;
+	size_t skip = dst->type == IBV_QPT_UD ? LOOP_UD_GRH : 0;
+	struct rxe_queue *q = rq->queue;
+	unsigned int cons = load_consumer(q);
+	struct iovec iov[LOOP_MAX_SGE];
+	struct rxe_recv_wqe *rwqe;
+	struct ibv_wc wc = {};
+	int64_t room;
+
+	if (!queue_count(q, cons)) {
+		if (qp->type == IBV_QPT_RC)
+			return LOOP_STALL;
+		return LOOP_DONE;
+	}
+
+	if (!loop_cq_room(dst->rcq, dst->rcq == qp->scq ? 2 : 1))
+		return LOOP_STALL;
+
+	rwqe = addr_from_index(q, cons);
+
+	wc.wr_id = rwqe->wr_id;
+	wc.qp_num = dst->qpn;
+	wc.src_qp = qp->qpn;
+	wc.slid = qp->lid;
+	if (wqe->wr.opcode != IBV_WR_SEND) {
+		wc.wc_flags = IBV_WC_WITH_IMM;
+		wc.imm_data = wqe->wr.ex.imm_data;
+	}
+
+	if (remote) {
+		wc.opcode = IBV_WC_RECV_RDMA_WITH_IMM;
+		wc.byte_len = len;
+		loop_copy(remote, 0, src, len);
+	} else {
+		wc.opcode = IBV_WC_RECV;
+		wc.byte_len = skip + len;
+		room = loop_sge_iov(dst->pd, rwqe->dma.sge, rwqe->dma.num_sge,
+				    IBV_ACCESS_LOCAL_WRITE, iov);
+		if (room < 0) {
+			wc.status = IBV_WC_LOC_PROT_ERR;
+			*status = IBV_WC_REM_OP_ERR;
+		} else if (room < skip + len) {
+			wc.status = IBV_WC_LOC_LEN_ERR;
+			*status = IBV_WC_REM_INV_REQ_ERR;
+		} else {
+			loop_copy(iov, skip, src, len);
+		}
+	}
+
+	store_consumer(q, cons + 1);
+	loop_cq_push(dst->rcq, &wc);
+	if (wc.status != IBV_WC_SUCCESS)
+		loop_qp_error(dst);
+
+	/* A UD sender never learns what happened to the datagram */
+	if (qp->type == IBV_QPT_UD)
+		*status = IBV_WC_SUCCESS;
+
+	return LOOP_DONE;
+}
+
+static uint64_t loop_atomic(void *addr, struct rxe_send_wr *wr)
+{
+	uint64_t *p = addr;
+	uint64_t orig;
+
+	if (wr->opcode == IBV_WR_ATOMIC_FETCH_AND_ADD)
+		return __atomic_fetch_add(p, wr->wr.atomic.compare_add,
+					  __ATOMIC_SEQ_CST);
+
+	orig = wr->wr.atomic.compare_add;
+	__atomic_compare_exchange_n(p, &orig, wr->wr.atomic.swap, false,
+				    __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+	return orig;
+}
+
+static int loop_execute(struct loop_qp *qp, struct rxe_send_wqe *wqe)
+{
+	enum ibv_wc_status status = IBV_WC_SUCCESS;
+	struct rxe_send_wr *wr = &wqe->wr;
+	struct iovec local[LOOP_MAX_SGE];
+	struct iovec remote, result;
+	struct ibv_wc wc = {};
+	struct loop_qp *dst;
+	uint64_t orig;
+	int ret = LOOP_DONE;
+	int64_t len;
+
+	if (!loop_cq_room(qp->scq, 1))
+		return LOOP_STALL;
+
+	wc.wr_id = wr->wr_id;
+	wc.qp_num = qp->qpn;
+	wc.opcode = loop_wc_opcode(wr->opcode);
+
+	if (!loop_valid_opcode(qp->type, wr->opcode)) {
+		status = IBV_WC_LOC_QP_OP_ERR;
+		goto complete;
+	}
+
+	if (wr->opcode == IBV_WR_RDMA_READ ||
+	    wr->opcode == IBV_WR_ATOMIC_CMP_AND_SWP ||
+	    wr->opcode == IBV_WR_ATOMIC_FETCH_AND_ADD)
+		len = loop_sge_iov(qp->pd, wqe->dma.sge, wqe->dma.num_sge,
+				   IBV_ACCESS_LOCAL_WRITE, local);
+	else
+		len = loop_gather(qp, wqe, local);
+
+	if (len < 0) {
+		status = IBV_WC_LOC_PROT_ERR;
+		goto complete;
+	}
+
+	if (len > LOOP_MAX_MSG ||
+	    (qp->type == IBV_QPT_UD && len > LOOP_MTU)) {
+		status = IBV_WC_LOC_LEN_ERR;
+		goto complete;
+	}
+
+	dst = loop_find_dest(qp, wqe);
+	if (!dst) {
+		if (qp->type == IBV_QPT_RC)
+			status = IBV_WC_RETRY_EXC_ERR;
+		goto complete;
+	}
+
+	switch (wr->opcode) {
+	case IBV_WR_SEND:
+	case IBV_WR_SEND_WITH_IMM:
+		ret = loop_recv(qp, dst, wqe, local, len, NULL, &status);
+		break;
+
+	case IBV_WR_RDMA_WRITE:
+	case IBV_WR_RDMA_WRITE_WITH_IMM:
+		if (!loop_remote(dst, wr->wr.rdma.rkey, wr->wr.rdma.remote_addr,
+				 len, IBV_ACCESS_REMOTE_WRITE, &remote)) {
+			status = IBV_WC_REM_ACCESS_ERR;
+			break;
+		}
+
+		if (wr->opcode == IBV_WR_RDMA_WRITE)
+			loop_copy(&remote, 0, local, len);
+		else
+			ret = loop_recv(qp, dst, wqe, local, len, &remote,
+					&status);
+		break;
+
+	case IBV_WR_RDMA_READ:
+		if (!loop_remote(dst, wr->wr.rdma.rkey, wr->wr.rdma.remote_addr,
+				 len, IBV_ACCESS_REMOTE_READ, &remote)) {
+			status = IBV_WC_REM_ACCESS_ERR;
+			break;
+		}
+
+		loop_copy(local, 0, &remote, len);
+		wc.byte_len = len;
+		break;
+
+	case IBV_WR_ATOMIC_CMP_AND_SWP:
+	case IBV_WR_ATOMIC_FETCH_AND_ADD:
+		if (len < (int64_t) sizeof(orig)) {
+			status = IBV_WC_LOC_LEN_ERR;
+			break;
+		}
+
+		if (wr->wr.atomic.remote_addr & (sizeof(orig) - 1)) {
+			status = IBV_WC_REM_INV_REQ_ERR;
+			break;
+		}
+
+		if (!loop_remote(dst, wr->wr.atomic.rkey,
+				 wr->wr.atomic.remote_addr, sizeof(orig),
+				 IBV_ACCESS_REMOTE_ATOMIC, &remote)) {
+			status = IBV_WC_REM_ACCESS_ERR;
+			break;
+		}
+
+		orig = loop_atomic(remote.iov_base, wr);
+		result.iov_base = &orig;
+		result.iov_len = sizeof(orig);
+		loop_copy(local, 0, &result, sizeof(orig));
+		wc.byte_len = sizeof(orig);
+		break;
+	}
+
+	if (ret == LOOP_STALL)
+		return LOOP_STALL;
+
+complete:
+	if (status != IBV_WC_SUCCESS || qp->sq_sig_all ||
+	    (wr->send_flags & IBV_SEND_SIGNALED)) {
+		wc.status = status;
+		loop_cq_push(qp->scq, &wc);
+	}
+
+	if (status != IBV_WC_SUCCESS)
+		loop_qp_error(qp);
+
+	return LOOP_DONE;
+}
+
+/* Complete what is left on a work queue of a QP in the error state */
+static bool loop_flush(struct loop_qp *qp, struct rxe_queue *q,
+		       struct loop_cq *cq, bool send)
+{
+	struct ibv_wc wc = {
+		.status = IBV_WC_WR_FLUSH_ERR,
+		.qp_num = qp->qpn,
+	};
+	struct rxe_queue *cq_q = cq->rcq.queue;
+	unsigned int cons = load_consumer(q);
+	unsigned int n = queue_count(q, cons);
+	unsigned int i;
+	void *wqe;
+
+	if (n > queue_free(cq_q, load_producer(cq_q))) {
+		n = queue_free(cq_q, load_producer(cq_q));
+		fabric.stalled = true;
+	}
+
+	for (i = 0; i < n; i++) {
+		wqe = addr_from_index(q, cons + i);
+		if (send) {
+			wc.wr_id = ((struct rxe_send_wqe *)wqe)->wr.wr_id;
+			wc.opcode = loop_wc_opcode(
+				((struct rxe_send_wqe *)wqe)->wr.opcode);
+		} else {
+			wc.wr_id = ((struct rxe_recv_wqe *)wqe)->wr_id;
+			wc.opcode = IBV_WC_RECV;
+		}
+		loop_cq_push(cq, &wc);
+	}
+
+	if (n)
+		store_consumer(q, cons + n);
+
+	return n;
+}
+
+static bool loop_process_qp(struct loop_qp *qp)
+{
+	struct rxe_queue *q = qp->rqp.sq.queue;
+	unsigned int cons, n, i;
+	bool progress;
+
+	if (qp->attr.qp_state == IBV_QPS_ERR) {
+		progress = loop_flush(qp, q, qp->scq, true);
+		if (!qp->srq)
+			progress |= loop_flush(qp, qp->rqp.rq.queue, qp->rcq,
+					       false);
+		return progress;
+	}
+
+	if (qp->attr.qp_state != IBV_QPS_RTS)
+		return false;
+
+	cons = load_consumer(q);
+	n = min_t(unsigned int, queue_count(q, cons), LOOP_BUDGET);
+
+	for (i = 0; i < n; i++) {
+		if (loop_execute(qp, addr_from_index(q, cons + i)) ==
+		    LOOP_STALL) {
+			fabric.stalled = true;
+			break;
+		}
+
+		/* The rest is flushed on the next pass */
+		if (qp->attr.qp_state == IBV_QPS_ERR) {
+			i++;
+			break;
+		}
+	}
+
+	if (i)
+		store_consumer(q, cons + i);
+
+	return i;
+}
+
+static void loop_sleep(unsigned int seq, bool stalled)
+{
+	struct timespec ts;
+
+	pthread_mutex_lock(&fabric.wait_lock);
+	atomic_store(&fabric.sleeping, true);
+
+	if (atomic_load(&fabric.doorbell) == seq) {
+		if (stalled) {
+			clock_gettime(CLOCK_REALTIME, &ts);
+			ts.tv_nsec += LOOP_STALL_NS;
+			if (ts.tv_nsec >= 1000000000) {
+				ts.tv_sec++;
+				ts.tv_nsec -= 1000000000;
+			}
+			pthread_cond_timedwait(&fabric.wait_cond,
+					       &fabric.wait_lock, &ts);
+		} else {
+			pthread_cond_wait(&fabric.wait_cond, &fabric.wait_lock);
+		}
+	}
+
+	atomic_store(&fabric.sleeping, false);
+	pthread_mutex_unlock(&fabric.wait_lock);
+}
+
+static void *loop_thread(void *arg)
+{
+	unsigned int idle = 0;
+	unsigned int seq;
+	bool progress, stalled;
+	struct loop_qp *qp;
+
+	for (;;) {
+		seq = atomic_load(&fabric.doorbell);
+
+		pthread_mutex_lock(&fabric.lock);
+		if (fabric.stop) {
+			pthread_mutex_unlock(&fabric.lock);
+			break;
+		}
+
+		progress = false;
+		fabric.stalled = false;
+		list_for_each(&fabric.qps, qp, entry)
+			progress |= loop_process_qp(qp);
+		stalled = fabric.stalled;
+		pthread_mutex_unlock(&fabric.lock);
+
+		if (progress) {
+			idle = 0;
+			continue;
+		}
+
+		/* Let the application run if it shares the CPU with us */
+		if (++idle < LOOP_SPIN) {
+			sched_yield();
+			continue;
+		}
+
+		idle = 0;
+		loop_sleep(seq, stalled);
+	}
+
+	return NULL;
+}
+
+static int loop_query_device(struct ibv_context *context,
+			     struct ibv_device_attr *attr)
+{
+	memset(attr, 0, sizeof(*attr));
+
+	snprintf(attr->fw_ver, sizeof(attr->fw_ver), "0.0.0");
+	attr->max_mr_size = UINT64_MAX;
+	attr->page_size_cap = 0xfffff000;
+	attr->vendor_id = 0xffffff;
+	attr->max_qp = LOOP_MAX_QP - LOOP_FIRST_QPN;
+	attr->max_qp_wr = LOOP_MAX_WR;
+	attr->device_cap_flags = IBV_DEVICE_RC_RNR_NAK_GEN;
+	attr->max_sge = LOOP_MAX_SGE;
+	attr->max_sge_rd = LOOP_MAX_SGE;
+	attr->max_cq = LOOP_MAX_CQ;
+	attr->max_cqe = LOOP_MAX_CQE;
+	attr->max_mr = LOOP_MAX_MR;
+	attr->max_pd = LOOP_MAX_PD;
+	attr->max_qp_rd_atom = LOOP_MAX_RD_ATOMIC;
+	attr->max_qp_init_rd_atom = LOOP_MAX_RD_ATOMIC;
+	attr->max_res_rd_atom = LOOP_MAX_RD_ATOMIC * LOOP_MAX_QP;
+	attr->atomic_cap = IBV_ATOMIC_HCA;
+	attr->max_ah = LOOP_MAX_AH;
+	attr->max_srq = LOOP_MAX_QP;
+	attr->max_srq_wr = LOOP_MAX_WR;
+	attr->max_srq_sge = LOOP_MAX_SGE;
+	attr->max_pkeys = 1;
+	attr->local_ca_ack_delay = 15;
+	attr->phys_port_cnt = 1;
+
+	return 0;
+}
+
+static int loop_query_port(struct ibv_context *context, uint8_t port,
+			   struct ibv_port_attr *attr)
+{
+	if (port != 1)
+		return EINVAL;
+
+	memset(attr, 0, sizeof(*attr));
+
+	attr->state = IBV_PORT_ACTIVE;
+	attr->max_mtu = IBV_MTU_4096;
+	attr->active_mtu = IBV_MTU_4096;
+	attr->max_msg_sz = LOOP_MAX_MSG;
+	attr->pkey_tbl_len = 1;
+	attr->lid = to_rdev(context->device)->lid;
+	attr->max_vl_num = 1;
+	attr->active_width = 1;		/* 1X */
+	attr->active_speed = 1;		/* 2.5 Gbps */
+	attr->phys_state = 5;		/* LinkUp */
+	attr->link_layer = IBV_LINK_LAYER_INFINIBAND;
+
+	return 0;
+}
+
+static struct ibv_pd *loop_alloc_pd(struct ibv_context *context)
+{
+	struct ibv_pd *pd;
+
+	pd = calloc(1, sizeof(*pd));
+	if (!pd)
+		return NULL;
+
+	pd->context = context;
+	return pd;
+}
+
+static int loop_dealloc_pd(struct ibv_pd *pd)
+{
+	free(pd);
+	return 0;
+}
+
+static struct ibv_mr *loop_reg_mr(struct ibv_pd *pd, void *addr,
+				  size_t length, int access)
+{
+	struct loop_mr *mr;
+	unsigned int i, idx = 0;
+
+	/* Remote writes and atomics need local write access as well */
+	if ((access & (IBV_ACCESS_REMOTE_WRITE | IBV_ACCESS_REMOTE_ATOMIC)) &&
+	    !(access & IBV_ACCESS_LOCAL_WRITE)) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	mr = calloc(1, sizeof(*mr));
+	if (!mr)
+		return NULL;
+
+	mr->pd = pd;
+	mr->addr = (uintptr_t)addr;
+	mr->length = length;
+	mr->access = access;
+
+	pthread_mutex_lock(&fabric.lock);
+	for (i = 0; i < LOOP_MAX_MR; i++) {
+		idx = (fabric.next_mr + i) % LOOP_MAX_MR;
+		if (!fabric.mr_table[idx])
+			break;
+	}
+
+	if (i == LOOP_MAX_MR) {
+		pthread_mutex_unlock(&fabric.lock);
+		free(mr);
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	/* The low byte catches keys of MRs that were deregistered */
+	mr->key = idx << 8 | fabric.mr_gen++;
+	fabric.mr_table[idx] = mr;
+	fabric.next_mr = idx + 1;
+	pthread_mutex_unlock(&fabric.lock);
+
+	mr->ibv_mr.context = pd->context;
+	mr->ibv_mr.pd = pd;
+	mr->ibv_mr.addr = addr;
+	mr->ibv_mr.length = length;
+	mr->ibv_mr.handle = idx;
+	mr->ibv_mr.lkey = mr->key;
+	mr->ibv_mr.rkey = mr->key;
+
+	return &mr->ibv_mr;
+}
+
+static int loop_dereg_mr(struct ibv_mr *ibmr)
+{
+	struct loop_mr *mr = to_lmr(ibmr);
+
+	pthread_mutex_lock(&fabric.lock);
+	fabric.mr_table[(mr->key >> 8) % LOOP_MAX_MR] = NULL;
+	pthread_mutex_unlock(&fabric.lock);
+
+	free(mr);
+	return 0;
+}
+
+static struct ibv_cq *loop_create_cq(struct ibv_context *context, int cqe,
+				     struct ibv_comp_channel *channel,
+				     int comp_vector)
+{
+	struct loop_cq *cq;
+	unsigned int num;
+
+	if (channel) {
+		errno = EOPNOTSUPP;
+		return NULL;
+	}
+
+	if (cqe < 1 || cqe > LOOP_MAX_CQE) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	cq = calloc(1, sizeof(*cq));
+	if (!cq)
+		return NULL;
+
+	num = loop_roundup_pow2(cqe + 1);
+	cq->rcq.queue = loop_alloc_queue(context, num, sizeof(struct ibv_wc));
+	if (!cq->rcq.queue) {
+		free(cq);
+		return NULL;
+	}
+
+	pthread_spin_init(&cq->rcq.lock, PTHREAD_PROCESS_PRIVATE);
+	cq->rcq.ibv_cq.context = context;
+	cq->rcq.ibv_cq.cqe = num - 1;
+
+	return &cq->rcq.ibv_cq;
+}
+
+static int loop_req_notify_cq(struct ibv_cq *ibcq, int solicited_only)
+{
+	return EOPNOTSUPP;
+}
+
+static int loop_resize_cq(struct ibv_cq *ibcq, int cqe)
+{
+	return EOPNOTSUPP;
+}
+
+static int loop_destroy_cq(struct ibv_cq *ibcq)
+{
+	struct loop_cq *cq = to_lcq(ibcq);
+
+	pthread_mutex_lock(&fabric.lock);
+	if (cq->users) {
+		pthread_mutex_unlock(&fabric.lock);
+		return EBUSY;
+	}
+	pthread_mutex_unlock(&fabric.lock);
+
+	pthread_spin_destroy(&cq->rcq.lock);
+	free(cq->rcq.queue);
+	free(cq);
+	return 0;
+}
+
+static struct ibv_srq *loop_create_srq(struct ibv_pd *pd,
+				       struct ibv_srq_init_attr *attr)
+{
+	struct loop_srq *srq;
+	unsigned int num;
+
+	if (attr->attr.max_wr < 1 || attr->attr.max_wr > LOOP_MAX_WR ||
+	    attr->attr.max_sge > LOOP_MAX_SGE) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	srq = calloc(1, sizeof(*srq));
+	if (!srq)
+		return NULL;
+
+	num = loop_roundup_pow2(attr->attr.max_wr + 1);
+	srq->rsrq.rq.queue = loop_alloc_queue(pd->context, num,
+		sizeof(struct rxe_recv_wqe) +
+		attr->attr.max_sge * sizeof(struct rxe_sge));
+	if (!srq->rsrq.rq.queue) {
+		free(srq);
+		return NULL;
+	}
+
+	srq->rsrq.rq.max_sge = attr->attr.max_sge;
+	pthread_spin_init(&srq->rsrq.rq.lock, PTHREAD_PROCESS_PRIVATE);
+
+	attr->attr.max_wr = num - 1;
+	srq->attr = attr->attr;
+	srq->rsrq.ibv_srq.context = pd->context;
+
+	return &srq->rsrq.ibv_srq;
+}
+
+static int loop_modify_srq(struct ibv_srq *ibsrq, struct ibv_srq_attr *attr,
+			   int attr_mask)
+{
+	struct loop_srq *srq = to_lsrq(ibsrq);
+
+	if (attr_mask & IBV_SRQ_MAX_WR)
+		return EOPNOTSUPP;
+
+	/* Accepted, but no limit event is ever generated */
+	if (attr_mask & IBV_SRQ_LIMIT) {
+		if (attr->srq_limit > srq->attr.max_wr)
+			return EINVAL;
+		srq->attr.srq_limit = attr->srq_limit;
+	}
+
+	return 0;
+}
+
+static int loop_query_srq(struct ibv_srq *ibsrq, struct ibv_srq_attr *attr)
+{
+	*attr = to_lsrq(ibsrq)->attr;
+	return 0;
+}
+
+static int loop_destroy_srq(struct ibv_srq *ibsrq)
+{
+	struct loop_srq *srq = to_lsrq(ibsrq);
+
+	pthread_mutex_lock(&fabric.lock);
+	if (srq->users) {
+		pthread_mutex_unlock(&fabric.lock);
+		return EBUSY;
+	}
+	pthread_mutex_unlock(&fabric.lock);
+
+	pthread_spin_destroy(&srq->rsrq.rq.lock);
+	free(srq->rsrq.rq.queue);
+	free(srq);
+	return 0;
+}
+
+/* Called with the fabric lock held, 0 when every QP number is taken */
+static uint32_t loop_alloc_qpn(void)
+{
+	uint32_t qpn;
+	unsigned int i;
+
+	for (i = LOOP_FIRST_QPN; i < LOOP_MAX_QP; i++) {
+		qpn = fabric.next_qpn++;
+		if (fabric.next_qpn == LOOP_MAX_QP)
+			fabric.next_qpn = LOOP_FIRST_QPN;
+		if (!fabric.qp_table[qpn])
+			return qpn;
+	}
+
+	return 0;
+}
+
+static struct ibv_qp *loop_create_qp(struct ibv_pd *pd,
+				     struct ibv_qp_init_attr *attr)
+{
+	struct ibv_qp_cap *cap = &attr->cap;
+	struct loop_qp *qp;
+	unsigned int num;
+	size_t size;
+	uint32_t qpn;
+
+	if ((attr->qp_type != IBV_QPT_RC && attr->qp_type != IBV_QPT_UC &&
+	     attr->qp_type != IBV_QPT_UD) ||
+	    !attr->send_cq || !attr->recv_cq ||
+	    cap->max_send_wr > LOOP_MAX_WR || cap->max_recv_wr > LOOP_MAX_WR ||
+	    cap->max_send_sge > LOOP_MAX_SGE ||
+	    cap->max_recv_sge > LOOP_MAX_SGE ||
+	    cap->max_inline_data > LOOP_MAX_INLINE) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	qp = calloc(1, sizeof(*qp));
+	if (!qp)
+		return NULL;
+
+	num = loop_roundup_pow2(cap->max_send_wr + 1);
+	size = max_t(size_t, cap->max_send_sge * sizeof(struct rxe_sge),
+		     cap->max_inline_data);
+	qp->rqp.sq.queue = loop_alloc_queue(pd->context, num,
+					    sizeof(struct rxe_send_wqe) + size);
+	if (!qp->rqp.sq.queue)
+		goto err;
+
+	cap->max_send_wr = num - 1;
+	qp->rqp.sq.max_sge = cap->max_send_sge;
+	qp->rqp.sq.max_inline = cap->max_inline_data;
+	pthread_spin_init(&qp->rqp.sq.lock, PTHREAD_PROCESS_PRIVATE);
+
+	if (!attr->srq) {
+		num = loop_roundup_pow2(cap->max_recv_wr + 1);
+		qp->rqp.rq.queue = loop_alloc_queue(pd->context, num,
+			sizeof(struct rxe_recv_wqe) +
+			cap->max_recv_sge * sizeof(struct rxe_sge));
+		if (!qp->rqp.rq.queue)
+			goto err;
+
+		cap->max_recv_wr = num - 1;
+		qp->rqp.rq.max_sge = cap->max_recv_sge;
+		pthread_spin_init(&qp->rqp.rq.lock, PTHREAD_PROCESS_PRIVATE);
+	}
+
+	qp->pd = pd;
+	qp->scq = to_lcq(attr->send_cq);
+	qp->rcq = to_lcq(attr->recv_cq);
+	qp->srq = attr->srq ? to_lsrq(attr->srq) : NULL;
+	qp->type = attr->qp_type;
+	qp->lid = to_rdev(pd->context->device)->lid;
+	qp->sq_sig_all = attr->sq_sig_all;
+	qp->attr.qp_state = IBV_QPS_RESET;
+	qp->attr.cap = *cap;
+	qp->attr.port_num = 1;
+
+	pthread_mutex_lock(&fabric.lock);
+	qpn = loop_alloc_qpn();
+	if (!qpn) {
+		pthread_mutex_unlock(&fabric.lock);
+		errno = ENOMEM;
+		goto err;
+	}
+
+	qp->qpn = qpn;
+	fabric.qp_table[qpn] = qp;
+	list_add_tail(&fabric.qps, &qp->entry);
+	qp->scq->users++;
+	qp->rcq->users++;
+	if (qp->srq)
+		qp->srq->users++;
+	pthread_mutex_unlock(&fabric.lock);
+
+	qp->rqp.ibv_qp.context = pd->context;
+	qp->rqp.ibv_qp.qp_num = qpn;
+	qp->rqp.ibv_qp.handle = qpn;
+
+	return &qp->rqp.ibv_qp;
+
+err:
+	free(qp->rqp.sq.queue);
+	free(qp->rqp.rq.queue);
+	free(qp);
+	return NULL;
+}
+
+static bool loop_valid_transition(enum ibv_qp_state cur,
+				  enum ibv_qp_state next)
+{
+	switch (next) {
+	case IBV_QPS_RESET:
+	case IBV_QPS_ERR:
+		return true;
+	case IBV_QPS_INIT:
+		return cur == IBV_QPS_RESET || cur == IBV_QPS_INIT;
+	case IBV_QPS_RTR:
+		return cur == IBV_QPS_INIT;
+	case IBV_QPS_RTS:
+		return cur == IBV_QPS_RTR || cur == IBV_QPS_RTS;
+	default:
+		return false;
+	}
+}
+
+static void loop_reset_queue(struct rxe_queue *q)
+{
+	if (!q)
+		return;
+
+	atomic_store(&q->producer_index, 0);
+	atomic_store(&q->consumer_index, 0);
+}
+
+static int loop_modify_qp(struct ibv_qp *ibqp, struct ibv_qp_attr *attr,
+			  int attr_mask)
+{
+	struct loop_qp *qp = to_lqp(ibqp);
+	struct ibv_qp_attr *cur = &qp->attr;
+	int ret = 0;
+
+	if ((attr_mask & IBV_QP_CAP) ||
+	    ((attr_mask & IBV_QP_PORT) && attr->port_num != 1))
+		return EINVAL;
+
+	pthread_mutex_lock(&fabric.lock);
+
+	if ((attr_mask & IBV_QP_STATE) &&
+	    !loop_valid_transition(cur->qp_state, attr->qp_state)) {
+		ret = EINVAL;
+		goto out;
+	}
+
+	if (attr_mask & IBV_QP_ACCESS_FLAGS)
+		cur->qp_access_flags = attr->qp_access_flags;
+	if (attr_mask & IBV_QP_PKEY_INDEX)
+		cur->pkey_index = attr->pkey_index;
+	if (attr_mask & IBV_QP_QKEY)
+		cur->qkey = attr->qkey;
+	if (attr_mask & IBV_QP_AV)
+		cur->ah_attr = attr->ah_attr;
+	if (attr_mask & IBV_QP_PATH_MTU)
+		cur->path_mtu = attr->path_mtu;
+	if (attr_mask & IBV_QP_TIMEOUT)
+		cur->timeout = attr->timeout;
+	if (attr_mask & IBV_QP_RETRY_CNT)
+		cur->retry_cnt = attr->retry_cnt;
+	if (attr_mask & IBV_QP_RNR_RETRY)
+		cur->rnr_retry = attr->rnr_retry;
+	if (attr_mask & IBV_QP_RQ_PSN)
+		cur->rq_psn = attr->rq_psn;
+	if (attr_mask & IBV_QP_MAX_QP_RD_ATOMIC)
+		cur->max_rd_atomic = attr->max_rd_atomic;
+	if (attr_mask & IBV_QP_MIN_RNR_TIMER)
+		cur->min_rnr_timer = attr->min_rnr_timer;
+	if (attr_mask & IBV_QP_SQ_PSN)
+		cur->sq_psn = attr->sq_psn;
+	if (attr_mask & IBV_QP_MAX_DEST_RD_ATOMIC)
+		cur->max_dest_rd_atomic = attr->max_dest_rd_atomic;
+	if (attr_mask & IBV_QP_DEST_QPN)
+		cur->dest_qp_num = attr->dest_qp_num;
+
+	if (attr_mask & IBV_QP_STATE) {
+		if (attr->qp_state == IBV_QPS_RESET) {
+			loop_reset_queue(qp->rqp.sq.queue);
+			loop_reset_queue(qp->rqp.rq.queue);
+			qp->rqp.ssn = 0;
+		}
+		cur->qp_state = attr->qp_state;
+	}
+
+out:
+	pthread_mutex_unlock(&fabric.lock);
+
+	/* Moving to RTS or to the error state may have made work runnable */
+	if (!ret && (attr_mask & IBV_QP_STATE))
+		rxe_loop_kick();
+
+	return ret;
+}
+
+static int loop_query_qp(struct ibv_qp *ibqp, struct ibv_qp_attr *attr,
+			 int attr_mask, struct ibv_qp_init_attr *init_attr)
+{
+	struct loop_qp *qp = to_lqp(ibqp);
+
+	pthread_mutex_lock(&fabric.lock);
+	*attr = qp->attr;
+	pthread_mutex_unlock(&fabric.lock);
+
+	memset(init_attr, 0, sizeof(*init_attr));
+	init_attr->qp_context = ibqp->qp_context;
+	init_attr->send_cq = ibqp->send_cq;
+	init_attr->recv_cq = ibqp->recv_cq;
+	init_attr->srq = ibqp->srq;
+	init_attr->cap = attr->cap;
+	init_attr->qp_type = qp->type;
+	init_attr->sq_sig_all = qp->sq_sig_all;
+
+	return 0;
+}
+
+static int loop_destroy_qp(struct ibv_qp *ibqp)
+{
+	struct loop_qp *qp = to_lqp(ibqp);
+
+	pthread_mutex_lock(&fabric.lock);
+	list_del(&qp->entry);
+	fabric.qp_table[qp->qpn] = NULL;
+	qp->scq->users--;
+	qp->rcq->users--;
+	if (qp->srq)
+		qp->srq->users--;
+	pthread_mutex_unlock(&fabric.lock);
+
+	pthread_spin_destroy(&qp->rqp.sq.lock);
+	if (qp->rqp.rq.queue)
+		pthread_spin_destroy(&qp->rqp.rq.lock);
+	free(qp->rqp.sq.queue);
+	free(qp->rqp.rq.queue);
+	free(qp);
+	return 0;
+}
+
+static struct ibv_ah *loop_create_ah(struct ibv_pd *pd,
+				     struct ibv_ah_attr *attr)
+{
+	struct rxe_ah *ah;
+
+	if (attr->port_num != 1) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	ah = calloc(1, sizeof(*ah));
+	if (!ah)
+		return NULL;
+
+	/* Datagrams are routed by QP number, the AV is only kept for show */
+	ah->av.port_num = attr->port_num;
+	memcpy(&ah->av.grh, &attr->grh, sizeof(attr->grh));
+	ah->ibv_ah.context = pd->context;
+
+	return &ah->ibv_ah;
+}
+
+static int loop_destroy_ah(struct ibv_ah *ibah)
+{
+	free(to_rah(ibah));
+	return 0;
+}
+
+static int loop_mcast(struct ibv_qp *qp, const union ibv_gid *gid,
+		      uint16_t lid)
+{
+	return EOPNOTSUPP;
+}
+
+int rxe_loop_init_context(struct rxe_context *context)
+{
+	struct ibv_context *ibctx = &context->ibv_ctx;
+	int ret = 0;
+
+	ibctx->async_fd = -1;
+	ibctx->num_comp_vectors = 1;
+
+	/* The data path ops from rxe.c stay, they only touch the rings */
+	ibctx->ops.query_device = loop_query_device;
+	ibctx->ops.query_port = loop_query_port;
+	ibctx->ops.alloc_pd = loop_alloc_pd;
+	ibctx->ops.dealloc_pd = loop_dealloc_pd;
+	ibctx->ops.reg_mr = loop_reg_mr;
+	ibctx->ops.dereg_mr = loop_dereg_mr;
+	ibctx->ops.create_cq = loop_create_cq;
+	ibctx->ops.req_notify_cq = loop_req_notify_cq;
+	ibctx->ops.resize_cq = loop_resize_cq;
+	ibctx->ops.destroy_cq = loop_destroy_cq;
+	ibctx->ops.create_srq = loop_create_srq;
+	ibctx->ops.modify_srq = loop_modify_srq;
+	ibctx->ops.query_srq = loop_query_srq;
+	ibctx->ops.destroy_srq = loop_destroy_srq;
+	ibctx->ops.create_qp = loop_create_qp;
+	ibctx->ops.query_qp = loop_query_qp;
+	ibctx->ops.modify_qp = loop_modify_qp;
+	ibctx->ops.destroy_qp = loop_destroy_qp;
+	ibctx->ops.create_ah = loop_create_ah;
+	ibctx->ops.destroy_ah = loop_destroy_ah;
+	ibctx->ops.attach_mcast = loop_mcast;
+	ibctx->ops.detach_mcast = loop_mcast;
+
+	pthread_mutex_lock(&fabric.users_lock);
+	if (!fabric.users) {
+		fabric.stop = false;
+		ret = pthread_create(&fabric.thread, NULL, loop_thread, NULL);
+	}
+	if (!ret)
+		fabric.users++;
+	pthread_mutex_unlock(&fabric.users_lock);
+
+	return ret;
+}
+
+void rxe_loop_uninit_context(struct rxe_context *context)
+{
+	pthread_mutex_lock(&fabric.users_lock);
+	if (!--fabric.users) {
+		pthread_mutex_lock(&fabric.lock);
+		fabric.stop = true;
+		pthread_mutex_unlock(&fabric.lock);
+
+		rxe_loop_kick();
+		pthread_join(fabric.thread, NULL);
+	}
+	pthread_mutex_unlock(&fabric.users_lock);
+}
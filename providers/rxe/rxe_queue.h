@@ -114,6 +114,51 @@ static inline void *consumer_addr(struct rxe_queue *q)
 			  << q->log2_elem_size);
 }
 
+/*
+ * Batched access: the owner of an index loads it once, works on a local
+ * copy and publishes it once all elements were written or read, so the
+ * other side sees one index update per batch.
+ */
+static inline unsigned int load_producer(struct rxe_queue *q)
+{
+	/* Must hold producer_index lock */
+	return atomic_load_explicit(&q->producer_index, memory_order_relaxed);
+}
+
+static inline unsigned int load_consumer(struct rxe_queue *q)
+{
+	/* Must hold consumer_index lock */
+	return atomic_load_explicit(&q->consumer_index, memory_order_relaxed);
+}
+
+/* Number of elements that can be produced from @prod on */
+static inline unsigned int queue_free(struct rxe_queue *q, unsigned int prod)
+{
+	return (atomic_load_explicit(&q->consumer_index, memory_order_acquire) -
+		prod - 1) & q->index_mask;
+}
+
+/* Number of elements that can be consumed from @cons on */
+static inline unsigned int queue_count(struct rxe_queue *q, unsigned int cons)
+{
+	return (atomic_load_explicit(&q->producer_index, memory_order_acquire) -
+		cons) & q->index_mask;
+}
+
+static inline void store_producer(struct rxe_queue *q, unsigned int prod)
+{
+	/* Must hold producer_index lock */
+	atomic_store_explicit(&q->producer_index, prod & q->index_mask,
+			      memory_order_release);
+}
+
+static inline void store_consumer(struct rxe_queue *q, unsigned int cons)
+{
+	/* Must hold consumer_index lock */
+	atomic_store_explicit(&q->consumer_index, cons & q->index_mask,
+			      memory_order_release);
+}
+
 static inline void *addr_from_index(struct rxe_queue *q, unsigned int index)
 {
 	return q->data + ((index & q->index_mask)
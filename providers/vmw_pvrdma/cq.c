@@ -78,38 +78,12 @@ static struct pvrdma_cqe *get_cqe(struct pvrdma_cq *cq, int entry)
 
 static int pvrdma_poll_one(struct pvrdma_cq *cq,
 			   struct pvrdma_qp **cur_qp,
-			   struct ibv_wc *wc)
+			   struct ibv_wc *wc, unsigned int head)
 {
 	struct pvrdma_context *ctx = to_vctx(cq->ibv_cq.context);
-	int has_data;
-	unsigned int head;
-	int tried = 0;
 	struct pvrdma_cqe *cqe;
 
-retry:
-	has_data = pvrdma_idx_ring_has_data(&cq->ring_state->rx,
-					    cq->cqe_cnt, &head);
-	if (has_data == 0) {
-		unsigned int val;
-
-		if (tried)
-			return CQ_EMPTY;
-
-		/* Pass down POLL to give physical HCA a chance to poll. */
-		val = cq->cqn | PVRDMA_UAR_CQ_POLL;
-		pvrdma_write_uar_cq(ctx->uar, val);
-
-		tried = 1;
-		goto retry;
-	} else if (has_data == -1) {
-		return CQ_POLL_ERR;
-	}
-
-	cqe = get_cqe(cq, head);
-	if (!cqe)
-		return CQ_EMPTY;
-
-	udma_from_device_barrier();
+	cqe = get_cqe(cq, ring_pow2_slot(head, cq->cqe_cnt));
 
 	if (ctx->qp_tbl[cqe->qp & 0xFFFF])
 		*cur_qp = (struct pvrdma_qp *)ctx->qp_tbl[cqe->qp & 0xFFFF];
@@ -130,16 +104,19 @@ retry:
 	wc->dlid_path_bits = cqe->dlid_path_bits;
 	wc->vendor_err = 0;
 
-	/* Update shared ring state. */
-	pvrdma_idx_ring_inc(&(cq->ring_state->rx.cons_head), cq->cqe_cnt);
-
 	return CQ_OK;
 }
 
+/*
+ * Read the producer index once, return up to @num_entries of the CQEs it
+ * covers and update the shared consumer index once for all of them.
+ */
 int pvrdma_poll_cq(struct ibv_cq *ibcq, int num_entries, struct ibv_wc *wc)
 {
+	struct pvrdma_context *ctx = to_vctx(ibcq->context);
 	struct pvrdma_cq *cq = to_vcq(ibcq);
 	struct pvrdma_qp *qp;
+	unsigned int head, tail, avail;
 	int npolled = 0;
 
 	if (num_entries < 1 || wc == NULL)
@@ -147,11 +124,34 @@ int pvrdma_poll_cq(struct ibv_cq *ibcq, int num_entries, struct ibv_wc *wc)
 
 	pthread_spin_lock(&cq->lock);
 
-	for (npolled = 0; npolled < num_entries; ++npolled) {
-		if (pvrdma_poll_one(cq, &qp, wc + npolled) != CQ_OK)
+	head = cq->ring_state->rx.cons_head;
+	tail = ring_load(&cq->ring_state->rx.prod_tail);
+	if (!ring_pow2_valid(head, cq->cqe_cnt) ||
+	    !ring_pow2_valid(tail, cq->cqe_cnt))
+		goto out;
+
+	avail = ring_pow2_count(tail, head, cq->cqe_cnt);
+	if (!avail) {
+		/* Pass down POLL to give physical HCA a chance to poll. */
+		pvrdma_write_uar_cq(ctx->uar, cq->cqn | PVRDMA_UAR_CQ_POLL);
+
+		tail = ring_load(&cq->ring_state->rx.prod_tail);
+		if (!ring_pow2_valid(tail, cq->cqe_cnt))
+			goto out;
+		avail = ring_pow2_count(tail, head, cq->cqe_cnt);
+	}
+
+	for (npolled = 0; npolled < num_entries && npolled < avail;
+	     ++npolled) {
+		if (pvrdma_poll_one(cq, &qp, wc + npolled, head) != CQ_OK)
 			break;
+		head = ring_pow2_advance(head, 1, cq->cqe_cnt);
 	}
 
+	/* Update shared ring state. */
+	if (npolled)
+		ring_release(&cq->ring_state->rx.cons_head, head);
+out:
 	pthread_spin_unlock(&cq->lock);
 
 	return npolled;
@@ -49,6 +49,7 @@
 
 #include <stdint.h>
 #include <linux/types.h>
+#include <util/ring.h>
 
 #define PVRDMA_INVALID_IDX	-1	/* Invalid index. */
 
@@ -70,8 +71,7 @@ struct pvrdma_ring_state {
 
 static inline int pvrdma_idx_valid(uint32_t idx, uint32_t max_elems)
 {
-	/* Generates fewer instructions than a less-than. */
-	return (idx & ~((max_elems << 1) - 1)) == 0;
+	return ring_pow2_valid(idx, max_elems);
 }
 
 static inline int32_t pvrdma_idx(uint32_t *var, uint32_t max_elems)
@@ -79,16 +79,13 @@ static inline int32_t pvrdma_idx(uint32_t *var, uint32_t max_elems)
 	const uint32_t idx = *var;
 
 	if (pvrdma_idx_valid(idx, max_elems))
-		return idx & (max_elems - 1);
+		return ring_pow2_slot(idx, max_elems);
 	return PVRDMA_INVALID_IDX;
 }
 
 static inline void pvrdma_idx_ring_inc(uint32_t *var, uint32_t max_elems)
 {
-	uint32_t idx = (*var) + 1;		/* Increment. */
-
-	idx &= (max_elems << 1) - 1;		/* Modulo size, flip gen. */
-	*var = idx;
+	*var = ring_pow2_advance(*var, 1, max_elems);
 }
 
 static inline int32_t pvrdma_idx_ring_has_space(const struct pvrdma_ring *r,
@@ -100,8 +97,8 @@ static inline int32_t pvrdma_idx_ring_has_space(const struct pvrdma_ring *r,
 
 	if (pvrdma_idx_valid(tail, max_elems) &&
 	    pvrdma_idx_valid(head, max_elems)) {
-		*out_tail = tail & (max_elems - 1);
-		return tail != (head ^ max_elems);
+		*out_tail = ring_pow2_slot(tail, max_elems);
+		return ring_pow2_free(tail, head, max_elems) != 0;
 	}
 	return PVRDMA_INVALID_IDX;
 }
@@ -115,8 +112,8 @@ static inline int32_t pvrdma_idx_ring_has_data(const struct pvrdma_ring *r,
 
 	if (pvrdma_idx_valid(tail, max_elems) &&
 	    pvrdma_idx_valid(head, max_elems)) {
-		*out_head = head & (max_elems - 1);
-		return tail != head;
+		*out_head = ring_pow2_slot(head, max_elems);
+		return ring_pow2_count(tail, head, max_elems) != 0;
 	}
 	return PVRDMA_INVALID_IDX;
 }
@@ -311,7 +311,7 @@ int pvrdma_post_send(struct ibv_qp *ibqp, struct ibv_send_wr *wr,
 {
 	struct pvrdma_context *ctx = to_vctx(ibqp->context);
 	struct pvrdma_qp *qp = to_vqp(ibqp);
-	int ind;
+	unsigned int ind, head, tail;
 	int nreq = 0;
 	struct pvrdma_sq_wqe_hdr *wqe_hdr;
 	struct ibv_sge *sge;
@@ -328,21 +328,24 @@ int pvrdma_post_send(struct ibv_qp *ibqp, struct ibv_send_wr *wr,
 	}
 
 	pthread_spin_lock(&qp->sq.lock);
-	ind = pvrdma_idx(&(qp->sq.ring_state->prod_tail), qp->sq.wqe_cnt);
-	if (ind < 0) {
-		pthread_spin_unlock(&qp->sq.lock);
+	tail = qp->sq.ring_state->prod_tail;
+	head = ring_load(&qp->sq.ring_state->cons_head);
+	if (!ring_pow2_valid(tail, qp->sq.wqe_cnt) ||
+	    !ring_pow2_valid(head, qp->sq.wqe_cnt)) {
 		ret = EINVAL;
+		*bad_wr = wr;
 		goto out;
 	}
 
 	for (nreq = 0; wr; ++nreq, wr = wr->next) {
-		unsigned int tail;
-
-		if (pvrdma_idx_ring_has_space(qp->sq.ring_state,
-					      qp->sq.wqe_cnt, &tail) <= 0) {
-			ret = ENOMEM;
-			*bad_wr = wr;
-			goto out;
+		/* The device may have consumed more since head was read */
+		if (!ring_pow2_free(tail, head, qp->sq.wqe_cnt)) {
+			head = ring_load(&qp->sq.ring_state->cons_head);
+			if (!ring_pow2_free(tail, head, qp->sq.wqe_cnt)) {
+				ret = ENOMEM;
+				*bad_wr = wr;
+				goto out;
+			}
 		}
 
 		if (wr->num_sge > qp->sq.max_gs) {
@@ -351,6 +354,7 @@ int pvrdma_post_send(struct ibv_qp *ibqp, struct ibv_send_wr *wr,
 			goto out;
 		}
 
+		ind = ring_pow2_slot(tail, qp->sq.wqe_cnt);
 		wqe_hdr = (struct pvrdma_sq_wqe_hdr *)get_sq_wqe(qp, ind);
 		wqe_hdr->wr_id = wr->wr_id;
 		wqe_hdr->num_sge = wr->num_sge;
@@ -404,18 +408,14 @@ int pvrdma_post_send(struct ibv_qp *ibqp, struct ibv_send_wr *wr,
 			sge++;
 		}
 
-		udma_to_device_barrier();
-		pvrdma_idx_ring_inc(&(qp->sq.ring_state->prod_tail),
-				    qp->sq.wqe_cnt);
-
 		qp->sq.wrid[ind] = wr->wr_id;
-		++ind;
-		if (ind >= qp->sq.wqe_cnt)
-			ind = 0;
+		tail = ring_pow2_advance(tail, 1, qp->sq.wqe_cnt);
 	}
 
 out:
 	if (nreq) {
+		/* One producer update and doorbell for the whole list */
+		ring_commit(&qp->sq.ring_state->prod_tail, tail);
 		udma_to_device_barrier();
 		pvrdma_write_uar_qp(ctx->uar,
 				    PVRDMA_UAR_QP_SEND | ibqp->qp_num);
@@ -433,8 +433,8 @@ int pvrdma_post_recv(struct ibv_qp *ibqp, struct ibv_recv_wr *wr,
 	struct pvrdma_qp *qp = to_vqp(ibqp);
 	struct pvrdma_rq_wqe_hdr *wqe_hdr;
 	struct ibv_sge *sge;
-	int nreq;
-	int ind;
+	int nreq = 0;
+	unsigned int ind, head, tail;
 	int i;
 	int ret = 0;
 
@@ -451,22 +451,23 @@ int pvrdma_post_recv(struct ibv_qp *ibqp, struct ibv_recv_wr *wr,
 	}
 
 	pthread_spin_lock(&qp->rq.lock);
-
-	ind = pvrdma_idx(&(qp->rq.ring_state->prod_tail), qp->rq.wqe_cnt);
-	if (ind < 0) {
-		pthread_spin_unlock(&qp->rq.lock);
+	tail = qp->rq.ring_state->prod_tail;
+	head = ring_load(&qp->rq.ring_state->cons_head);
+	if (!ring_pow2_valid(tail, qp->rq.wqe_cnt) ||
+	    !ring_pow2_valid(head, qp->rq.wqe_cnt)) {
+		ret = EINVAL;
 		*bad_wr = wr;
-		return EINVAL;
+		goto out;
 	}
 
 	for (nreq = 0; wr; ++nreq, wr = wr->next) {
-		unsigned int tail;
-
-		if (pvrdma_idx_ring_has_space(qp->rq.ring_state,
-					      qp->rq.wqe_cnt, &tail) <= 0) {
-			ret = ENOMEM;
-			*bad_wr = wr;
-			goto out;
+		if (!ring_pow2_free(tail, head, qp->rq.wqe_cnt)) {
+			head = ring_load(&qp->rq.ring_state->cons_head);
+			if (!ring_pow2_free(tail, head, qp->rq.wqe_cnt)) {
+				ret = ENOMEM;
+				*bad_wr = wr;
+				goto out;
+			}
 		}
 
 		if (wr->num_sge > qp->rq.max_gs) {
@@ -476,6 +477,7 @@ int pvrdma_post_recv(struct ibv_qp *ibqp, struct ibv_recv_wr *wr,
 		}
 
 		/* Fetch wqe */
+		ind = ring_pow2_slot(tail, qp->rq.wqe_cnt);
 		wqe_hdr = (struct pvrdma_rq_wqe_hdr *)get_rq_wqe(qp, ind);
 		wqe_hdr->wr_id = wr->wr_id;
 		wqe_hdr->num_sge = wr->num_sge;
@@ -488,17 +490,17 @@ int pvrdma_post_recv(struct ibv_qp *ibqp, struct ibv_recv_wr *wr,
 			sge++;
 		}
 
-		pvrdma_idx_ring_inc(&qp->rq.ring_state->prod_tail,
-				    qp->rq.wqe_cnt);
-
 		qp->rq.wrid[ind] = wr->wr_id;
-		ind = (ind + 1) & (qp->rq.wqe_cnt - 1);
+		tail = ring_pow2_advance(tail, 1, qp->rq.wqe_cnt);
 	}
 
 out:
-	if (nreq)
+	if (nreq) {
+		ring_commit(&qp->rq.ring_state->prod_tail, tail);
+		udma_to_device_barrier();
 		pvrdma_write_uar_qp(ctx->uar,
 				    PVRDMA_UAR_QP_RECV | ibqp->qp_num);
+	}
 
 	pthread_spin_unlock(&qp->rq.lock);
 	return ret;
@@ -0,0 +1,118 @@
+/* GPLv2 or OpenIB.org BSD (MIT) See COPYING file */
+#ifndef UTIL_RING_H
+#define UTIL_RING_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <util/udma_barrier.h>
+
+/*
+ * Index arithmetic for single producer, single consumer rings of a power
+ * of two @size elements, where the producer and the consumer each own one
+ * index and only read the other one.
+ *
+ * Wrapped rings (ring_pow2_*) keep both indices in [0, 2 * size). The
+ * extra bit tells a full ring from an empty one, so every element can be
+ * used. This is the format devices that share their indices with the
+ * driver use, and free running counters that are masked when published
+ * also fit it.
+ *
+ * Masked rings (ring_mask_*) keep both indices in [0, size), and leave one
+ * element unused to tell full from empty.
+ *
+ * The operations take an index value and a count, so a batch is handled
+ * by loading the other side's index once, working on a local copy of our
+ * own, and storing it once:
+ *
+ *	prod = *ring_prod;
+ *	n = min(ring_pow2_free(prod, ring_load(ring_cons), size), wanted);
+ *	for (i = 0; i != n; i++)
+ *		write element ring_pow2_slot(ring_pow2_advance(prod, i, size),
+ *					     size);
+ *	ring_commit(ring_prod, ring_pow2_advance(prod, n, size));
+ *
+ * and the consumer does the same with ring_pow2_count() and ring_release().
+ * Counts passed to the advance helpers must not exceed @size.
+ */
+
+static inline uint32_t ring_load(const uint32_t *idx)
+{
+	uint32_t val = *(const volatile uint32_t *)idx;
+
+	/* Nothing covered by the index may be read before the index */
+	udma_from_device_barrier();
+	return val;
+}
+
+/* Publish a producer index after the elements it covers were written */
+static inline void ring_commit(uint32_t *idx, uint32_t val)
+{
+	udma_to_device_barrier();
+	*(volatile uint32_t *)idx = val;
+}
+
+/*
+ * Publish a consumer index after the elements it frees were read. This is
+ * the read barrier, since the reads have to complete before the store.
+ */
+static inline void ring_release(uint32_t *idx, uint32_t val)
+{
+	udma_from_device_barrier();
+	*(volatile uint32_t *)idx = val;
+}
+
+/* Wrapped rings */
+static inline bool ring_pow2_valid(uint32_t idx, uint32_t size)
+{
+	return (idx & ~(2 * size - 1)) == 0;
+}
+
+/* Fold a free running counter into a wrapped index */
+static inline uint32_t ring_pow2_wrap(uint32_t idx, uint32_t size)
+{
+	return idx & (2 * size - 1);
+}
+
+static inline uint32_t ring_pow2_slot(uint32_t idx, uint32_t size)
+{
+	return idx & (size - 1);
+}
+
+static inline uint32_t ring_pow2_advance(uint32_t idx, uint32_t n,
+					 uint32_t size)
+{
+	return (idx + n) & (2 * size - 1);
+}
+
+static inline uint32_t ring_pow2_count(uint32_t prod, uint32_t cons,
+				       uint32_t size)
+{
+	return (prod - cons) & (2 * size - 1);
+}
+
+static inline uint32_t ring_pow2_free(uint32_t prod, uint32_t cons,
+				      uint32_t size)
+{
+	return size - ring_pow2_count(prod, cons, size);
+}
+
+/* Masked rings */
+static inline uint32_t ring_mask_advance(uint32_t idx, uint32_t n,
+					 uint32_t size)
+{
+	return (idx + n) & (size - 1);
+}
+
+static inline uint32_t ring_mask_count(uint32_t prod, uint32_t cons,
+				       uint32_t size)
+{
+	return (prod - cons) & (size - 1);
+}
+
+static inline uint32_t ring_mask_free(uint32_t prod, uint32_t cons,
+				      uint32_t size)
+{
+	return (cons - prod - 1) & (size - 1);
+}
+
+#endif